@@ -0,0 +1,161 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <x86intrin.h>
+
+#include <fmt/core.h>
+#include <glog/logging.h>
+
+#include "utils/numa.hpp"
+
+namespace saqlib::bench {
+/**
+ * @brief Keep `value` alive: the compiler must assume it is read, so the work producing it
+ * cannot be dropped
+ */
+template <typename T>
+inline void do_not_optimize(const T &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+/**
+ * @brief Make the compiler assume the pointed-to memory changed, so loads are not hoisted
+ * out of the timing loop
+ */
+inline void clobber_memory() { asm volatile("" : : : "memory"); }
+
+struct BenchConfig {
+    int cpu = 0;             // pin the benchmark thread to this CPU, -1 to leave it free
+    double warmup_ms = 20;   // run before measuring, to fault in pages and settle the clock
+    double sample_ms = 10;   // target duration of one sample
+    size_t num_samples = 15; // the median sample is reported
+};
+
+struct BenchResult {
+    std::string name;
+    std::string params; // "key=value,..." of the input
+    size_t reps = 0;    // calls per sample
+    double ns_per_op = 0;
+    double ns_per_op_min = 0;
+    double cycles_per_op = 0; // TSC (reference) cycles
+    double ops_per_s = 0;
+    double gb_per_s = 0; // bytes_per_op of input streamed per second
+};
+
+/**
+ * @brief Minimal micro-benchmark harness
+ *
+ * A kernel runs `reps` times per sample, with `reps` grown until a sample takes
+ * `sample_ms`. After a warmup, `num_samples` samples are timed with steady_clock and rdtsc
+ * and the median one is reported. Cycles are TSC cycles, which tick at a constant reference
+ * rate rather than the core clock.
+ */
+class Bench {
+    BenchConfig cfg_;
+    std::vector<BenchResult> results_;
+    bool pinned_ = false;
+
+    static double now_ns() {
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+  public:
+    explicit Bench(const BenchConfig &cfg) : cfg_(cfg) {
+        if (cfg_.cpu >= 0) {
+            pinned_ = utils::pin_thread({cfg_.cpu});
+            LOG_IF(WARNING, !pinned_) << "Cannot pin the benchmark thread to cpu " << cfg_.cpu;
+        }
+    }
+
+    /**
+     * @brief Time `func`, which does `ops_per_call` operations touching `bytes_per_op` bytes each
+     */
+    template <typename Func>
+    const BenchResult &run(const std::string &name, const std::string &params, double bytes_per_op,
+                           size_t ops_per_call, Func &&func) {
+        auto sample = [&](size_t reps, uint64_t &cycles) {
+            clobber_memory();
+            const double t0 = now_ns();
+            const uint64_t c0 = __rdtsc();
+            for (size_t r = 0; r < reps; ++r) {
+                func();
+                clobber_memory();
+            }
+            cycles = __rdtsc() - c0;
+            return now_ns() - t0;
+        };
+
+        uint64_t cycles;
+        size_t reps = 1;
+        const double warmup_end = now_ns() + cfg_.warmup_ms * 1e6;
+        for (;;) {
+            const double ns = sample(reps, cycles);
+            if (ns >= cfg_.sample_ms * 1e6 && now_ns() >= warmup_end) {
+                break;
+            }
+            if (ns < cfg_.sample_ms * 1e6) {
+                reps = std::max(reps + 1, size_t(reps * std::min(10.0, cfg_.sample_ms * 1e6 / std::max(ns, 1.0))));
+            }
+        }
+
+        std::vector<std::pair<double, uint64_t>> samples(cfg_.num_samples);
+        for (auto &s : samples) {
+            s.first = sample(reps, cycles);
+            s.second = cycles;
+        }
+        std::sort(samples.begin(), samples.end());
+        const auto &median = samples[samples.size() / 2];
+        const double ops = double(reps) * ops_per_call;
+
+        BenchResult res;
+        res.name = name;
+        res.params = params;
+        res.reps = reps;
+        res.ns_per_op = median.first / ops;
+        res.ns_per_op_min = samples.front().first / ops;
+        res.cycles_per_op = median.second / ops;
+        res.ops_per_s = 1e9 / res.ns_per_op;
+        res.gb_per_s = bytes_per_op / res.ns_per_op;
+        results_.push_back(res);
+        return results_.back();
+    }
+
+    const std::vector<BenchResult> &results() const { return results_; }
+
+    static std::string header() {
+        return fmt::format("{:<28} {:<22} {:>12} {:>12} {:>10} {:>14} {:>9}", "kernel", "params", "ns/op",
+                           "min ns/op", "cycles/op", "ops/s", "GB/s");
+    }
+
+    static std::string toString(const BenchResult &r) {
+        return fmt::format("{:<28} {:<22} {:>12.2f} {:>12.2f} {:>10.1f} {:>14.4g} {:>9.2f}", r.name, r.params,
+                           r.ns_per_op, r.ns_per_op_min, r.cycles_per_op, r.ops_per_s, r.gb_per_s);
+    }
+
+    /**
+     * @brief Write the results as a JSON document, for comparing runs across commits
+     */
+    void write_json(const std::string &filename) const {
+        std::ofstream out(filename);
+        CHECK(out.is_open()) << "Cannot open " << filename;
+        out << fmt::format("{{\n  \"cpu\": {},\n  \"pinned\": {},\n  \"num_samples\": {},\n  \"results\": [",
+                           cfg_.cpu, pinned_ ? "true" : "false", cfg_.num_samples);
+        for (size_t i = 0; i < results_.size(); ++i) {
+            const auto &r = results_[i];
+            out << fmt::format("{}\n    {{\"name\": \"{}\", \"params\": \"{}\", \"reps\": {}, \"ns_per_op\": {:.4f}, "
+                               "\"ns_per_op_min\": {:.4f}, \"cycles_per_op\": {:.3f}, \"ops_per_s\": {:.6g}, "
+                               "\"gb_per_s\": {:.4f}}}",
+                               i ? "," : "", r.name, r.params, r.reps, r.ns_per_op, r.ns_per_op_min,
+                               r.cycles_per_op, r.ops_per_s, r.gb_per_s);
+        }
+        out << "\n  ]\n}\n";
+    }
+};
+} // namespace saqlib::bench
@@ -0,0 +1,209 @@
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fmt/core.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "bench.hpp"
+#include "defines.hpp"
+#include "quantization/caq/caq_encoder.hpp"
+#include "quantization/cluster_data.hpp"
+#include "quantization/config.h"
+#include "quantization/fastscan/fastscan.hpp"
+#include "quantization/fastscan/fastscan_highacc.hpp"
+#include "utils/code_helper.hpp"
+#include "utils/memory.hpp"
+#include "utils/pool.hpp"
+#include "utils/space.hpp"
+
+using namespace saqlib;
+
+DEFINE_string(dims, "128,768,1536", "comma separated dimensions, multiples of 64");
+DEFINE_string(filter, "", "only run the kernels whose name contains this string");
+DEFINE_string(json, "", "also write the results to this JSON file");
+DEFINE_int32(cpu, 0, "pin the benchmark thread to this CPU, -1 to leave it free");
+DEFINE_double(sample_ms, 10, "target duration of one timed sample");
+DEFINE_int32(num_samples, 15, "timed samples per kernel, the median is reported");
+
+namespace {
+constexpr size_t kMaxIpBits = 16;      // CodeHelper<b> for b = 1..16
+constexpr size_t kQueryBits = 8;       // bits per dimension of the quantized query of warmup_ip_x0_q
+constexpr size_t kPoolInserts = 1024;  // candidates inserted into one ResultPool per call
+
+std::mt19937 gen(7);
+
+template <typename T>
+memory::UniqueArray<T> random_bytes(size_t count) {
+    auto arr = memory::make_unique_array<T>(count, 64);
+    std::uniform_int_distribution<uint32_t> dist(0, 255);
+    auto *bytes = reinterpret_cast<uint8_t *>(arr.get());
+    for (size_t i = 0; i < count * sizeof(T); ++i) {
+        bytes[i] = dist(gen);
+    }
+    return arr;
+}
+
+FloatVec random_vec(size_t dim) {
+    std::normal_distribution<float> dist(0, 1);
+    FloatVec v(dim);
+    for (auto &x : v) {
+        x = dist(gen);
+    }
+    return v;
+}
+
+bool selected(const std::string &name) { return FLAGS_filter.empty() || name.find(FLAGS_filter) != std::string::npos; }
+
+void report(const bench::BenchResult &r) { std::cout << bench::Bench::toString(r) << std::endl; }
+
+void bench_fastscan(bench::Bench &b, size_t dim) {
+    const size_t lut_len = dim / 4 * 16; // 16 entries per 4 dimensions
+    const FloatVec query = random_vec(dim);
+    const std::string params = fmt::format("D={}", dim);
+
+    if (selected("pack_lut")) {
+        auto lut = memory::make_unique_array<float>(lut_len, 64);
+        report(b.run("pack_lut", params, (dim + lut_len) * sizeof(float), 1, [&] {
+            fastscan::pack_lut(dim, query.data(), lut.get());
+            bench::do_not_optimize(lut[lut_len - 1]);
+        }));
+    }
+
+    auto lut_u16 = random_bytes<uint16_t>(lut_len);
+    auto hc_lut = memory::make_unique_array<uint8_t>(lut_len * 2, 64);
+    if (selected("transfer_lut_hacc")) {
+        report(b.run("transfer_lut_hacc", params, lut_len * 2 * 2, 1, [&] {
+            fastscan::transfer_lut_hacc(lut_u16.get(), dim, hc_lut.get());
+            bench::do_not_optimize(hc_lut[0]);
+        }));
+    }
+
+    if (selected("accumulate_hacc")) {
+        fastscan::transfer_lut_hacc(lut_u16.get(), dim, hc_lut.get());
+        // one block of KFastScanSize short codes, 1 bit per dimension
+        const size_t code_bytes = dim * KFastScanSize / 8;
+        auto codes = random_bytes<uint8_t>(code_bytes);
+        __m512i res[2];
+        // one op is a block, so GB/s counts the codes and the table read for it
+        report(b.run("accumulate_hacc", fmt::format("{},block={}", params, KFastScanSize), code_bytes + lut_len * 2, 1,
+                     [&] {
+                         fastscan::accumulate_hacc(codes.get(), hc_lut.get(), res, dim);
+                         bench::do_not_optimize(res[0]);
+                         bench::do_not_optimize(res[1]);
+                     }));
+    }
+}
+
+template <size_t kBits>
+void bench_compute_ip(bench::Bench &b, size_t dim, const FloatVec &query) {
+    const size_t code_bytes = dim * kBits / 8;
+    auto code = random_bytes<uint8_t>(code_bytes);
+    report(b.run(fmt::format("CodeHelper<{}>::compute_ip", kBits), fmt::format("D={}", dim),
+                 code_bytes + dim * sizeof(float), 1, [&] {
+                     float ip = utils::CodeHelper<kBits>::compute_ip(query.data(), code.get(), dim);
+                     bench::do_not_optimize(ip);
+                 }));
+}
+
+template <size_t... kBits>
+void bench_compute_ips(bench::Bench &b, size_t dim, std::index_sequence<kBits...>) {
+    const FloatVec query = random_vec(dim);
+    (bench_compute_ip<kBits + 1>(b, dim, query), ...);
+}
+
+void bench_short_code(bench::Bench &b, size_t dim) {
+    const std::string params = fmt::format("D={}", dim);
+    auto data = random_bytes<uint64_t>(dim / 64);
+    if (selected("warmup_ip_x0_q")) {
+        auto query_bin = random_bytes<uint64_t>(dim / 64 * kQueryBits);
+        report(b.run("warmup_ip_x0_q", fmt::format("{},qB={}", params, kQueryBits), dim / 8 * (1 + kQueryBits), 1,
+                     [&] {
+                         float ip = utils::warmup_ip_x0_q(data.get(), query_bin.get(), 0.01f, -1.0f, dim, kQueryBits);
+                         bench::do_not_optimize(ip);
+                     }));
+    }
+    if (selected("mask_ip_x0_q")) {
+        const FloatVec query = random_vec(dim);
+        report(b.run("mask_ip_x0_q", params, dim / 8 + dim * sizeof(float), 1, [&] {
+            float ip = utils::mask_ip_x0_q(query.data(), data.get(), dim);
+            bench::do_not_optimize(ip);
+        }));
+    }
+}
+
+void bench_encoder(bench::Bench &b, size_t dim) {
+    QuantSingleConfig cfg;
+    const FloatVec vec = random_vec(dim);
+    for (size_t bits = 1; bits <= KMaxQuantizeBits; ++bits) {
+        CAQEncoder encoder(dim, bits, cfg);
+        CaqCode caq;
+        report(b.run("CAQEncoder::encode_and_fac", fmt::format("D={},bits={}", dim, bits), dim * sizeof(float), 1,
+                     [&] {
+                         encoder.encode_and_fac(vec, caq);
+                         bench::do_not_optimize(caq.fac_rescale);
+                     }));
+    }
+}
+
+void bench_result_pool(bench::Bench &b) {
+    std::uniform_real_distribution<float> dist(0, 1);
+    std::vector<float> dists(kPoolInserts);
+    for (auto &d : dists) {
+        d = dist(gen);
+    }
+    for (size_t k : {10, 100, 1000}) {
+        // a fresh pool per call, so the first k inserts of every call fill it
+        report(b.run("ResultPool::insert", fmt::format("k={},n={}", k, kPoolInserts), sizeof(PID) + sizeof(float),
+                     kPoolInserts, [&] {
+                         utils::ResultPool pool(k);
+                         for (size_t i = 0; i < kPoolInserts; ++i) {
+                             pool.insert(i, dists[i]);
+                         }
+                         bench::do_not_optimize(pool.distk());
+                     }));
+    }
+}
+} // namespace
+
+int main(int argc, char *argv[]) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+    std::vector<size_t> dims;
+    std::stringstream ss(FLAGS_dims);
+    for (std::string d; std::getline(ss, d, ',');) {
+        dims.push_back(std::stoul(d));
+        CHECK(dims.back() && dims.back() % 64 == 0) << "Dimensions must be positive multiples of 64: " << d;
+    }
+
+    bench::BenchConfig cfg;
+    cfg.cpu = FLAGS_cpu;
+    cfg.sample_ms = FLAGS_sample_ms;
+    cfg.num_samples = FLAGS_num_samples;
+    bench::Bench b(cfg);
+
+    std::cout << bench::Bench::header() << std::endl;
+    for (size_t dim : dims) {
+        bench_fastscan(b, dim);
+        if (selected("compute_ip")) {
+            bench_compute_ips(b, dim, std::make_index_sequence<kMaxIpBits>{});
+        }
+        bench_short_code(b, dim);
+        if (selected("encode_and_fac")) {
+            bench_encoder(b, dim);
+        }
+    }
+    if (selected("ResultPool")) {
+        bench_result_pool(b);
+    }
+
+    if (!FLAGS_json.empty()) {
+        b.write_json(FLAGS_json);
+        std::cout << "results written to " << FLAGS_json << std::endl;
+    }
+    return 0;
+}
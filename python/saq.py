@@ -0,0 +1,175 @@
+"""ctypes binding of libsaq (saqlib/capi/saq_c.h).
+
+Arrays are handed to the library in place when they are C-contiguous float32 (uint32 for
+cluster ids), and converted once otherwise. Results are written straight into numpy arrays.
+ctypes releases the GIL for the duration of every call, so searches from several Python
+threads run in parallel.
+
+    import numpy as np, saq
+    index = saq.Index.build(data, centroids, cluster_ids, avg_bits=4)
+    ids, dists = index.search(queries, topk=10, nprobe=64)
+"""
+import ctypes
+import os
+
+import numpy as np
+
+METRIC_L2 = 0
+METRIC_IP = 1
+_ABI_VERSION = 1
+
+
+class _BuildParams(ctypes.Structure):
+    _fields_ = [
+        ("avg_bits", ctypes.c_float),
+        ("enable_segmentation", ctypes.c_int),
+        ("native_pca", ctypes.c_int),
+        ("num_threads", ctypes.c_int),
+    ]
+
+
+class _SearchParams(ctypes.Structure):
+    _fields_ = [
+        ("topk", ctypes.c_size_t),
+        ("nprobe", ctypes.c_size_t),
+        ("metric", ctypes.c_int),
+        ("vars_bound_m", ctypes.c_float),
+    ]
+
+
+def _load_library():
+    path = os.environ.get("SAQ_LIBRARY")
+    if not path:
+        path = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "bin", "libsaq.so")
+    lib = ctypes.CDLL(path)
+    c_float_p = ctypes.POINTER(ctypes.c_float)
+    c_uint32_p = ctypes.POINTER(ctypes.c_uint32)
+    index_p = ctypes.c_void_p
+    signatures = {
+        "saq_abi_version": (ctypes.c_int, []),
+        "saq_last_error": (ctypes.c_char_p, []),
+        "saq_build_params_init": (None, [ctypes.POINTER(_BuildParams)]),
+        "saq_search_params_init": (None, [ctypes.POINTER(_SearchParams)]),
+        "saq_build": (ctypes.c_int, [c_float_p, ctypes.c_size_t, ctypes.c_size_t, c_float_p, ctypes.c_size_t,
+                                     c_uint32_p, ctypes.POINTER(_BuildParams), ctypes.POINTER(index_p)]),
+        "saq_load": (ctypes.c_int, [ctypes.c_char_p, ctypes.POINTER(index_p)]),
+        "saq_save": (ctypes.c_int, [index_p, ctypes.c_char_p]),
+        "saq_free": (None, [index_p]),
+        "saq_size": (ctypes.c_size_t, [index_p]),
+        "saq_dim": (ctypes.c_size_t, [index_p]),
+        "saq_num_clusters": (ctypes.c_size_t, [index_p]),
+        "saq_set_num_threads": (ctypes.c_int, [index_p, ctypes.c_int]),
+        "saq_search": (ctypes.c_int, [index_p, c_float_p, ctypes.POINTER(_SearchParams), c_uint32_p, c_float_p]),
+        "saq_search_batch": (ctypes.c_int, [index_p, c_float_p, ctypes.c_size_t, ctypes.POINTER(_SearchParams),
+                                            c_uint32_p, c_float_p]),
+    }
+    for name, (restype, argtypes) in signatures.items():
+        fn = getattr(lib, name)
+        fn.restype = restype
+        fn.argtypes = argtypes
+    if lib.saq_abi_version() != _ABI_VERSION:
+        raise RuntimeError(f"{path} implements ABI {lib.saq_abi_version()}, this binding needs {_ABI_VERSION}")
+    return lib
+
+
+_lib = _load_library()
+
+
+def _check(ret):
+    if ret != 0:
+        raise RuntimeError(f"saq error {ret}: {_lib.saq_last_error().decode()}")
+
+
+def _matrix(a, dtype, name):
+    """a as a C-contiguous 2-d array of dtype, without a copy when it already is one"""
+    a = np.ascontiguousarray(a, dtype=dtype)
+    if a.ndim != 2:
+        raise ValueError(f"{name} must be 2-d, got shape {a.shape}")
+    return a
+
+
+def _ptr(a, ctype):
+    return a.ctypes.data_as(ctypes.POINTER(ctype))
+
+
+class Index:
+    def __init__(self, handle):
+        self._handle = ctypes.c_void_p(handle)
+
+    def __del__(self):
+        if getattr(self, "_handle", None):
+            _lib.saq_free(self._handle)
+            self._handle = None
+
+    @classmethod
+    def build(cls, data, centroids, cluster_ids, avg_bits=4.0, enable_segmentation=True, native_pca=False,
+              num_threads=0):
+        """Index of the rows of data, clustered by the caller (e.g. faiss k-means)"""
+        data = _matrix(data, np.float32, "data")
+        centroids = _matrix(centroids, np.float32, "centroids")
+        cluster_ids = np.ascontiguousarray(cluster_ids, dtype=np.uint32).reshape(-1)
+        if centroids.shape[1] != data.shape[1] or cluster_ids.shape[0] != data.shape[0]:
+            raise ValueError("data, centroids and cluster_ids do not match")
+        params = _BuildParams()
+        _lib.saq_build_params_init(ctypes.byref(params))
+        params.avg_bits = avg_bits
+        params.enable_segmentation = int(enable_segmentation)
+        params.native_pca = int(native_pca)
+        params.num_threads = num_threads
+        handle = ctypes.c_void_p()
+        _check(_lib.saq_build(_ptr(data, ctypes.c_float), data.shape[0], data.shape[1],
+                              _ptr(centroids, ctypes.c_float), centroids.shape[0],
+                              _ptr(cluster_ids, ctypes.c_uint32), ctypes.byref(params), ctypes.byref(handle)))
+        return cls(handle.value)
+
+    @classmethod
+    def load(cls, filename):
+        handle = ctypes.c_void_p()
+        _check(_lib.saq_load(os.fsencode(filename), ctypes.byref(handle)))
+        return cls(handle.value)
+
+    def save(self, filename):
+        _check(_lib.saq_save(self._handle, os.fsencode(filename)))
+
+    def __len__(self):
+        return _lib.saq_size(self._handle)
+
+    @property
+    def dim(self):
+        return _lib.saq_dim(self._handle)
+
+    @property
+    def num_clusters(self):
+        return _lib.saq_num_clusters(self._handle)
+
+    def set_num_threads(self, num_threads):
+        """Threads of a batched search, 0 for all cores"""
+        _check(_lib.saq_set_num_threads(self._handle, num_threads))
+
+    def search(self, queries, topk=10, nprobe=64, metric=METRIC_L2, vars_bound_m=None, out=None):
+        """(ids, distances) of the topk neighbours of each row of queries, as (nq, topk) arrays
+
+        out: optional (ids, distances) arrays to write into, uint32 and float32 of shape (nq, topk)
+        """
+        queries = _matrix(queries, np.float32, "queries")
+        if queries.shape[1] != self.dim:
+            raise ValueError(f"queries have {queries.shape[1]} dimensions, the index {self.dim}")
+        params = _SearchParams()
+        _lib.saq_search_params_init(ctypes.byref(params))
+        params.topk = topk
+        params.nprobe = nprobe
+        params.metric = metric
+        if vars_bound_m is not None:
+            params.vars_bound_m = vars_bound_m
+        nq = queries.shape[0]
+        if out is None:
+            ids = np.empty((nq, topk), dtype=np.uint32)
+            distances = np.empty((nq, topk), dtype=np.float32)
+        else:
+            ids, distances = out
+            for a, dtype in ((ids, np.uint32), (distances, np.float32)):
+                if a.dtype != dtype or a.shape != (nq, topk) or not a.flags.c_contiguous:
+                    raise ValueError(f"out arrays must be C-contiguous {dtype.__name__} of shape {(nq, topk)}")
+        _check(_lib.saq_search_batch(self._handle, _ptr(queries, ctypes.c_float), nq, ctypes.byref(params),
+                                     _ptr(ids, ctypes.c_uint32), _ptr(distances, ctypes.c_float)))
+        return ids, distances
@@ -0,0 +1,103 @@
+#pragma once
+
+/*
+ * C interface of libsaq, for bindings from other languages.
+ *
+ * Every buffer belongs to the caller: matrices are row major float32 and are read in place
+ * during the call, results are written into caller-provided arrays. No call keeps a pointer
+ * to a caller buffer or calls back into the caller, so bindings may release their interpreter
+ * lock around any call. Functions returning int return SAQ_OK or an error code, with a
+ * message for the calling thread in saq_last_error(). Arguments are checked up front.
+ * saq_load() checks the header and the checksums of the file, and saq_save() opens the output
+ * first, returning SAQ_ERR_IO on failure. A write that fails after that, e.g. on a full disk,
+ * still aborts the process, as in the command line tools.
+ *
+ * Searches on one index may run concurrently from several threads. saq_save() may run
+ * alongside them; saq_free() and saq_set_num_threads() may not.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#define SAQ_API __declspec(dllexport)
+#else
+#define SAQ_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SAQ_ABI_VERSION 1
+
+enum {
+    SAQ_OK = 0,
+    SAQ_ERR_INVALID_ARGUMENT = 1,
+    SAQ_ERR_IO = 2,
+    SAQ_ERR_INTERNAL = 3,
+};
+
+enum {
+    SAQ_METRIC_L2 = 0, /* squared euclidean distance, smallest first */
+    SAQ_METRIC_IP = 1, /* inner product, largest first */
+};
+
+typedef struct saq_index saq_index;
+
+typedef struct saq_build_params {
+    float avg_bits;          /* average bits per dimension, e.g. 0.5 to 8 */
+    int enable_segmentation; /* 0 quantizes all dimensions alike (CAQ) */
+    int native_pca;          /* build a PCA of the data and store it in the index */
+    int num_threads;         /* 0 for all cores */
+} saq_build_params;
+
+typedef struct saq_search_params {
+    size_t topk;
+    size_t nprobe;      /* clusters probed per query */
+    int metric;         /* SAQ_METRIC_* */
+    float vars_bound_m; /* pruning bound of the variance stage, in standard deviations */
+} saq_search_params;
+
+/* Version of the interface implemented by the library, SAQ_ABI_VERSION of its header */
+SAQ_API int saq_abi_version(void);
+
+/* Message of the last error of the calling thread, "" if none */
+SAQ_API const char *saq_last_error(void);
+
+SAQ_API void saq_build_params_init(saq_build_params *params);
+SAQ_API void saq_search_params_init(saq_search_params *params);
+
+/*
+ * Build an index of the `n` rows of `data` (n x dim), clustered by the caller: `centroids`
+ * (num_clusters x dim) and the cluster of each row in `cluster_ids`.
+ */
+SAQ_API int saq_build(const float *data, size_t n, size_t dim, const float *centroids, size_t num_clusters,
+                      const uint32_t *cluster_ids, const saq_build_params *params, saq_index **index);
+
+SAQ_API int saq_load(const char *filename, saq_index **index);
+SAQ_API int saq_save(const saq_index *index, const char *filename);
+SAQ_API void saq_free(saq_index *index);
+
+SAQ_API size_t saq_size(const saq_index *index);
+SAQ_API size_t saq_dim(const saq_index *index);
+SAQ_API size_t saq_num_clusters(const saq_index *index);
+
+/* Threads of saq_search_batch(), 0 for all cores. Default 1 */
+SAQ_API int saq_set_num_threads(saq_index *index, int num_threads);
+
+/*
+ * The `topk` nearest neighbours of `query` (dim floats): ids into `ids` and estimated
+ * distances into `distances` (may be NULL), closest first. Slots without a candidate get
+ * the id UINT32_MAX and the largest distance of the metric.
+ */
+SAQ_API int saq_search(saq_index *index, const float *query, const saq_search_params *params, uint32_t *ids,
+                       float *distances);
+
+/* saq_search() of the `num_queries` rows of `queries`, `topk` results per row */
+SAQ_API int saq_search_batch(saq_index *index, const float *queries, size_t num_queries,
+                             const saq_search_params *params, uint32_t *ids, float *distances);
+
+#ifdef __cplusplus
+}
+#endif
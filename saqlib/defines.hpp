@@ -1,6 +1,7 @@
 #pragma once
 #define EIGEN_DONT_PARALLELIZE
 
+#include <limits>
 #include <stdint.h>
 
 #include "third/Eigen/Dense"
@@ -16,6 +17,7 @@ constexpr size_t KFastScanSize = 32;
 constexpr size_t kDimPaddingSize = 64;
 
 using PID = uint32_t;
+constexpr PID kInvalidPID = std::numeric_limits<PID>::max(); // id of the result slots without a candidate
 
 template <typename T>
 using RowVector = Eigen::RowVector<T, Eigen::Dynamic>;
@@ -41,6 +43,15 @@ enum class DistType {
     IP,    // inner product
 };
 
+/**
+ * @brief Storage precision of the per-vector factors (|o|, <c, o_a>, rescale, error)
+ */
+enum class FactorType : uint8_t {
+    Fp32 = 0, // float
+    Fp16 = 1, // IEEE half, refused before quantization for data whose factors may exceed 65504
+    Bf16 = 2, // bfloat16, float range with 8 bits of mantissa
+};
+
 struct Candidate {
     PID id;
     float distance;
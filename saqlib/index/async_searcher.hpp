@@ -0,0 +1,255 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fmt/core.h>
+#include <glog/logging.h>
+
+#include "defines.hpp"
+#include "index/ivf.hpp"
+#include "quantization/config.h"
+#include "utils/BS_thread_pool.hpp"
+
+namespace saqlib {
+struct AsyncSearcherConfig {
+    size_t topk = 10;
+    size_t nprobe = 64;
+    SearcherConfig searcher_cfg;
+    size_t max_batch = 32;     // queries per batch
+    size_t max_delay_us = 200; // longest wait of a query for its batch to fill
+    size_t num_threads = 0;    // workers running the batches, 0 for all cores
+};
+
+/**
+ * @brief Batch sizes and queue depths seen by an AsyncSearcher
+ */
+struct AsyncSearcherStats {
+    size_t num_queries = 0;
+    size_t num_batches = 0;
+    std::vector<size_t> batch_sizes;  // number of batches of each size
+    std::vector<size_t> queue_depths; // queries waiting when a batch was cut, in power of two buckets
+
+    std::string toString() const {
+        std::string str = fmt::format("{} queries in {} batches, {:.2f} per batch\n  batch sizes:", num_queries,
+                                      num_batches, num_batches ? double(num_queries) / num_batches : 0.0);
+        for (size_t size = 1; size < batch_sizes.size(); ++size) {
+            if (batch_sizes[size]) {
+                str += fmt::format(" {}: {}", size, batch_sizes[size]);
+            }
+        }
+        str += "\n  queue depths:";
+        for (size_t b = 0; b < queue_depths.size(); ++b) {
+            if (queue_depths[b]) {
+                str += b ? fmt::format(" [{}, {}): {}", size_t(1) << (b - 1), size_t(1) << b, queue_depths[b])
+                         : fmt::format(" 0: {}", queue_depths[b]);
+            }
+        }
+        return str + "\n";
+    }
+};
+
+/**
+ * @brief Front end of an IVF taking queries one by one and searching them in micro-batches
+ *
+ * A dispatcher thread cuts a batch when `max_batch` queries wait, or when the oldest one has
+ * waited `max_delay_us`, and only while a worker is free: under load the queries queue up
+ * meanwhile and the batches grow to `max_batch`, trading at most the delay plus one batch of
+ * latency for the cluster reuse of IVF::search_batch(). Each batch runs on one worker.
+ */
+template <DistType kDistType = DistType::Any>
+class AsyncSearcher {
+  public:
+    using Callback = std::function<void(std::vector<PID> &&)>;
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Request {
+        FloatVec query;
+        std::promise<std::vector<PID>> promise;
+        Callback callback; // replaces the promise if set
+        Clock::time_point arrival;
+    };
+
+    IVF &ivf_;
+    const AsyncSearcherConfig cfg_;
+    BS::thread_pool<> pool_;
+
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::deque<Request> queue_;
+    size_t busy_ = 0; // batches running
+    bool stop_ = false;
+    AsyncSearcherStats stats_;
+    std::thread dispatcher_;
+
+    void dispatch() {
+        std::unique_lock<std::mutex> lock(mtx_);
+        while (true) {
+            cv_.wait(lock, [&] { return stop_ || (!queue_.empty() && busy_ < pool_.get_thread_count()); });
+            if (queue_.empty()) {
+                return; // stopped and drained
+            }
+            const auto deadline = queue_.front().arrival + std::chrono::microseconds(cfg_.max_delay_us);
+            if (!stop_ && queue_.size() < cfg_.max_batch) {
+                cv_.wait_until(lock, deadline, [&] { return stop_ || queue_.size() >= cfg_.max_batch; });
+            }
+
+            const size_t depth = queue_.size();
+            const size_t size = std::min(depth, cfg_.max_batch);
+            auto batch = std::make_shared<std::vector<Request>>(); // pool tasks must be copyable
+            batch->reserve(size);
+            for (size_t i = 0; i < size; ++i) {
+                batch->push_back(std::move(queue_.front()));
+                queue_.pop_front();
+            }
+            stats_.num_queries += size;
+            stats_.num_batches += 1;
+            stats_.batch_sizes[size] += 1;
+            const size_t bucket = 64 - __builtin_clzll(depth);
+            stats_.queue_depths.resize(std::max(stats_.queue_depths.size(), bucket + 1), 0);
+            stats_.queue_depths[bucket] += 1;
+            busy_ += 1;
+
+            lock.unlock();
+            pool_.detach_task([this, batch] { run(*batch); });
+            lock.lock();
+        }
+    }
+
+    void run(std::vector<Request> &batch) {
+        // the worker is released however the batch ends, or wait() would never return
+        struct Release {
+            AsyncSearcher *self;
+            ~Release() {
+                {
+                    std::lock_guard<std::mutex> lock(self->mtx_);
+                    self->busy_ -= 1;
+                }
+                self->cv_.notify_all();
+            }
+        } release{this};
+
+        const size_t topk = cfg_.topk;
+        std::vector<PID> results(batch.size() * topk);
+        try {
+            FloatRowMat queries(batch.size(), batch.front().query.cols());
+            for (size_t i = 0; i < batch.size(); ++i) {
+                queries.row(i) = batch[i].query;
+            }
+            ivf_.search_batch<kDistType>(queries, topk, cfg_.nprobe, cfg_.searcher_cfg, results.data());
+        } catch (const std::exception &e) {
+            for (auto &request : batch) {
+                if (request.callback) {
+                    LOG(ERROR) << "AsyncSearcher batch failed: " << e.what();
+                } else {
+                    request.promise.set_exception(std::current_exception());
+                }
+            }
+            return;
+        }
+        for (size_t i = 0; i < batch.size(); ++i) {
+            std::vector<PID> ids(results.begin() + i * topk, results.begin() + (i + 1) * topk);
+            if (!batch[i].callback) {
+                batch[i].promise.set_value(std::move(ids));
+                continue;
+            }
+            try {
+                batch[i].callback(std::move(ids)); // a throwing callback does not cost the others their results
+            } catch (const std::exception &e) {
+                LOG(ERROR) << "AsyncSearcher callback threw: " << e.what();
+            }
+        }
+    }
+
+    void push(Request request) {
+        CHECK_EQ(size_t(request.query.cols()), ivf_.num_dim()) << "Query dimension mismatch";
+        request.arrival = Clock::now();
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            CHECK(!stop_) << "AsyncSearcher is stopped";
+            queue_.push_back(std::move(request));
+        }
+        cv_.notify_all();
+    }
+
+  public:
+    AsyncSearcher(IVF &ivf, const AsyncSearcherConfig &cfg) : ivf_(ivf), cfg_(cfg), pool_(cfg.num_threads) {
+        CHECK_GT(cfg_.max_batch, 0u);
+        stats_.batch_sizes.assign(cfg_.max_batch + 1, 0);
+        dispatcher_ = std::thread([this] { dispatch(); });
+    }
+
+    AsyncSearcher(const AsyncSearcher &) = delete;
+    AsyncSearcher &operator=(const AsyncSearcher &) = delete;
+
+    /**
+     * @brief Search the queries still queued, then stop
+     */
+    ~AsyncSearcher() {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        dispatcher_.join();
+        pool_.wait();
+    }
+
+    /**
+     * @brief Queue a query, its `topk` ids are delivered through the future
+     */
+    std::future<std::vector<PID>> submit(const FloatVec &query) {
+        Request request;
+        request.query = query;
+        auto future = request.promise.get_future();
+        push(std::move(request));
+        return future;
+    }
+
+    /**
+     * @brief Queue a query, `callback` gets its `topk` ids on the worker thread of its batch.
+     * Exceptions thrown by `callback` are logged and dropped.
+     */
+    void submit(const FloatVec &query, Callback callback) {
+        Request request;
+        request.query = query;
+        request.callback = std::move(callback);
+        push(std::move(request));
+    }
+
+    /**
+     * @brief Block until every query submitted so far has been answered
+     */
+    void wait() {
+        std::unique_lock<std::mutex> lock(mtx_);
+        cv_.wait(lock, [&] { return queue_.empty() && busy_ == 0; });
+    }
+
+    /**
+     * @brief Queries waiting for a batch
+     */
+    size_t queue_depth() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return queue_.size();
+    }
+
+    AsyncSearcherStats stats() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return stats_;
+    }
+};
+} // namespace saqlib
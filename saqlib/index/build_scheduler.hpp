@@ -0,0 +1,118 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <numeric>
+#include <vector>
+
+#include "glog/logging.h"
+#include <fmt/core.h>
+
+#include "defines.hpp"
+#include "utils/BS_thread_pool.hpp"
+#include "utils/StopW.hpp"
+#include "utils/tools.hpp"
+
+namespace saqlib {
+/**
+ * @brief Size-aware scheduler for parallel cluster quantization
+ *
+ * Turns clusters into tasks of block ranges (KFastScanSize vectors per block). Clusters
+ * larger than `max_task_blocks` are split into near-equal ranges so a few giant k-means
+ * clusters cannot serialize the tail of the build. Tasks are issued largest-first.
+ */
+class BuildScheduler {
+  public:
+    struct Task {
+        PID cid;          // cluster id
+        size_t blk_begin; // first block of the range
+        size_t blk_end;   // one past the last block of the range
+        size_t num_vec;   // vectors in the range, used as cost
+    };
+
+  private:
+    std::vector<Task> tasks_;
+    size_t num_split_clusters_ = 0;
+    size_t max_task_blocks_ = 0;
+
+    // stats of the last run()
+    std::vector<double> busy_us_;
+    double wall_us_ = 0;
+
+  public:
+    /**
+     * @param cluster_sizes Number of vectors in each cluster
+     * @param num_threads Number of worker threads
+     * @param max_task_blocks Max blocks per task. 0 picks 1/8 of the per-thread share.
+     */
+    explicit BuildScheduler(const std::vector<size_t> &cluster_sizes, size_t num_threads, size_t max_task_blocks = 0) {
+        size_t total_blocks = 0;
+        for (auto sz : cluster_sizes) {
+            total_blocks += utils::div_rd_up(sz, KFastScanSize);
+        }
+        max_task_blocks_ = max_task_blocks ? max_task_blocks
+                                           : std::max<size_t>(4, total_blocks / (std::max<size_t>(num_threads, 1) * 8));
+
+        for (size_t cid = 0; cid < cluster_sizes.size(); ++cid) {
+            const size_t num_vec = cluster_sizes[cid];
+            const size_t num_blocks = utils::div_rd_up(num_vec, KFastScanSize);
+            if (num_blocks == 0) {
+                continue;
+            }
+            const size_t num_ranges = utils::div_rd_up(num_blocks, max_task_blocks_);
+            num_split_clusters_ += num_ranges > 1;
+            for (size_t r = 0; r < num_ranges; ++r) {
+                size_t blk_begin = num_blocks * r / num_ranges;
+                size_t blk_end = num_blocks * (r + 1) / num_ranges;
+                size_t n = std::min(blk_end * KFastScanSize, num_vec) - blk_begin * KFastScanSize;
+                tasks_.push_back({(PID)cid, blk_begin, blk_end, n});
+            }
+        }
+        std::stable_sort(tasks_.begin(), tasks_.end(),
+                         [](const Task &a, const Task &b) { return a.num_vec > b.num_vec; });
+    }
+
+    const auto &tasks() const { return tasks_; }
+    size_t num_split_clusters() const { return num_split_clusters_; }
+
+    /**
+     * @brief Run `func(const Task &)` for every task on `pool` and wait for completion
+     *
+     * Busy time is recorded per worker for report().
+     */
+    template <typename Pool, typename Func>
+    void run(Pool &pool, Func &&func) {
+        busy_us_.assign(pool.get_thread_count(), 0);
+        utils::StopW wall;
+        for (const auto &task : tasks_) {
+            pool.detach_task([&, task]() {
+                utils::StopW stopw;
+                func(task);
+                auto idx = BS::this_thread::get_index();
+                // each worker only touches its own slot
+                busy_us_[idx.value_or(0)] += stopw.getElapsedTimeMicro();
+            });
+        }
+        pool.wait();
+        wall_us_ = wall.getElapsedTimeMicro();
+    }
+
+    /**
+     * @brief Log the task split and per-thread utilisation of the last run()
+     */
+    void report() const {
+        LOG(INFO) << fmt::format("Build scheduler: {} tasks, {} clusters split (max {} blocks per task)",
+                                 tasks_.size(), num_split_clusters_, max_task_blocks_);
+        if (busy_us_.empty() || wall_us_ <= 0) {
+            return;
+        }
+        std::vector<double> util(busy_us_.size());
+        std::transform(busy_us_.begin(), busy_us_.end(), util.begin(),
+                       [this](double b) { return 100.0 * b / wall_us_; });
+        auto [min_it, max_it] = std::minmax_element(util.begin(), util.end());
+        double avg = std::accumulate(util.begin(), util.end(), 0.0) / util.size();
+        LOG(INFO) << fmt::format("Thread utilisation over {:.3f} S: avg {:.1f}% min {:.1f}% max {:.1f}%",
+                                 wall_us_ / 1e6, avg, *min_it, *max_it);
+    }
+};
+} // namespace saqlib
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fmt/core.h>
+#include <glog/logging.h>
+
+#include "defines.hpp"
+#include "index/index_file.hpp"
+#include "quantization/cluster_data.hpp"
+#include "quantization/config.h"
+
+namespace saqlib {
+/**
+ * @brief Clusters of an index file loaded on first use, with LRU eviction
+ *
+ * get() returns the cluster as a shared_ptr that pins it: it stays valid while the caller
+ * holds it, even if it is evicted meanwhile, so the memory in use can exceed the capacity by
+ * the clusters being scanned. Concurrent misses of one cluster read it once, the other
+ * callers wait for it. The cache is split into shards with one lock each.
+ */
+class ClusterCache {
+  public:
+    using ClusterPtr = std::shared_ptr<const SaqCluData>;
+
+  private:
+    static constexpr size_t kNumShards = 16;
+
+    struct Entry {
+        std::shared_future<ClusterPtr> cluster;
+        size_t bytes;
+        std::list<PID>::iterator lru;
+    };
+
+    struct Shard {
+        std::mutex mtx;
+        std::list<PID> lru; // most recently used first
+        std::unordered_map<PID, Entry> entries;
+        size_t bytes = 0;
+    };
+
+    IndexFileReader file_;
+    const std::vector<std::pair<size_t, size_t>> quant_plan_;
+    const QuantizeConfig cfg_;
+    const std::vector<size_t> cluster_sizes_;
+    size_t shard_capacity_; // bytes per shard
+    Shard shards_[kNumShards];
+    std::atomic<size_t> hits_{0};
+    std::atomic<size_t> misses_{0};
+
+  public:
+    /**
+     * @param quant_plan, cfg plan and configuration the clusters were quantized with, `cfg.storage`
+     * sets their in-memory layout
+     * @param cluster_sizes number of vectors of each cluster
+     * @param capacity_bytes memory for cached clusters, at least one cluster per shard is kept
+     */
+    ClusterCache(const char *filename, std::vector<std::pair<size_t, size_t>> quant_plan, const QuantizeConfig &cfg,
+                 std::vector<size_t> cluster_sizes, size_t capacity_bytes)
+        : file_(filename), quant_plan_(std::move(quant_plan)), cfg_(cfg), cluster_sizes_(std::move(cluster_sizes)),
+          shard_capacity_(capacity_bytes / kNumShards) {}
+
+    ClusterCache(const ClusterCache &) = delete;
+    ClusterCache &operator=(const ClusterCache &) = delete;
+
+    size_t capacity_bytes() const { return shard_capacity_ * kNumShards; }
+    const std::vector<size_t> &cluster_sizes() const { return cluster_sizes_; }
+    size_t hits() const { return hits_.load(std::memory_order_relaxed); }
+    size_t misses() const { return misses_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Bytes of the clusters in the cache
+     */
+    size_t bytes() {
+        size_t total = 0;
+        for (auto &shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            total += shard.bytes;
+        }
+        return total;
+    }
+
+    /**
+     * @brief Cluster `cid`, read from the file if it is not cached
+     * @param hit optional, set to whether the cluster was cached
+     */
+    ClusterPtr get(PID cid, bool *hit = nullptr) {
+        CHECK_LT(cid, cluster_sizes_.size()) << "Bad cluster id";
+        auto &shard = shards_[cid % kNumShards];
+        std::promise<ClusterPtr> loading;
+        std::shared_future<ClusterPtr> cluster;
+        bool found = false;
+        {
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            auto it = shard.entries.find(cid);
+            found = it != shard.entries.end();
+            if (found) {
+                shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru);
+                cluster = it->second.cluster;
+            } else {
+                cluster = loading.get_future().share();
+                const auto *entry = file_.find(IndexSection::Cluster, cid);
+                CHECK(entry) << "Missing section of cluster " << cid;
+                const size_t bytes = entry->bytes;
+                shard.lru.push_front(cid);
+                shard.entries.emplace(cid, Entry{cluster, bytes, shard.lru.begin()});
+                shard.bytes += bytes;
+                while (shard.bytes > shard_capacity_ && shard.lru.size() > 1) {
+                    auto victim = shard.entries.find(shard.lru.back());
+                    shard.bytes -= victim->second.bytes;
+                    shard.entries.erase(victim);
+                    shard.lru.pop_back();
+                }
+            }
+        }
+        (found ? hits_ : misses_).fetch_add(1, std::memory_order_relaxed);
+        if (hit) {
+            *hit = found;
+        }
+        if (!found) {
+            loading.set_value(load(cid));
+        }
+        return cluster.get();
+    }
+
+    std::string toString() {
+        const size_t total = hits() + misses();
+        return fmt::format("cluster cache {:.1f} of {:.1f} MiB, {} hits, {} misses ({:.1f}% hit rate)",
+                           bytes() / 1048576.0, capacity_bytes() / 1048576.0, hits(), misses(),
+                           total ? 100.0 * hits() / total : 0.0);
+    }
+
+  private:
+    ClusterPtr load(PID cid) const {
+        auto cluster = std::make_shared<SaqCluData>(cluster_sizes_[cid], quant_plan_, cfg_.use_compact_layout,
+                                                    cfg_.storage.interleaved_layout, nullptr, false, cfg_.factor_type);
+        auto buf = file_.read(IndexSection::Cluster, cid);
+        MemoryIStream is(buf);
+        cluster->load(is);
+        return cluster;
+    }
+};
+} // namespace saqlib
@@ -0,0 +1,333 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <istream>
+#include <map>
+#include <ostream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include <fmt/core.h>
+#include <glog/logging.h>
+
+#include "utils/crc32c.hpp"
+#include "utils/tools.hpp"
+
+namespace saqlib {
+/**
+ * @brief Sections of an index file in format v2
+ */
+enum class IndexSection : uint32_t {
+    Centroids = 1,    // IVF centroids
+    QuantData = 2,    // quantization config, plan and rotators (SaqData)
+    ClusterSizes = 3, // number of vectors of every cluster
+    Cluster = 4,      // data of one cluster, index is the cluster id
+    ExternalIds = 5,  // optional 64-bit external id of every vector
+    Pca = 6,          // optional PCA applied to raw queries
+    Shards = 7,       // shard table of a ShardedIVF manifest
+};
+
+struct IndexFileHeader {
+    uint64_t magic = 0;
+    uint32_t version = 0;
+    uint32_t flags = 0;
+    uint64_t num_data = 0;
+    uint64_t num_dim = 0;
+    uint64_t num_cen = 0;
+    uint64_t num_sections = 0;
+    uint32_t crc = 0; // CRC32C of this header (with crc = 0) followed by the directory
+    uint32_t reserved = 0;
+};
+
+struct IndexSectionEntry {
+    uint32_t type;   // IndexSection
+    uint32_t crc;    // CRC32C of the payload
+    uint64_t index;  // e.g. the cluster id
+    uint64_t offset; // from the start of the file, multiple of kIndexFileAlign
+    uint64_t bytes;
+};
+
+constexpr size_t kIndexFileAlign = 4096;
+constexpr uint64_t kIndexFileMagic = 0x3158444e49514153;    // "SAQINDX1", an IVF index
+constexpr uint64_t kManifestFileMagic = 0x3144524853514153; // "SAQSHRD1", a ShardedIVF manifest
+constexpr uint32_t kIndexFileVersion = 2;                   // first version with sections
+
+/**
+ * @brief Read-only std::istream over a memory buffer, so sections parse without a copy
+ */
+class MemoryIStream : public std::istream {
+    struct Buf : std::streambuf {
+        Buf(const char *data, size_t bytes) {
+            auto *p = const_cast<char *>(data);
+            setg(p, p, p + bytes);
+        }
+    } buf_;
+
+  public:
+    MemoryIStream(const char *data, size_t bytes) : std::istream(nullptr), buf_(data, bytes) { rdbuf(&buf_); }
+    explicit MemoryIStream(const std::vector<char> &data) : MemoryIStream(data.data(), data.size()) {}
+};
+
+/**
+ * @brief Output buffer of one section: passes the payload on to the file, keeping its
+ * CRC32C and size. Writes larger than the buffer go straight through.
+ */
+class SectionStreamBuf : public std::streambuf {
+    std::streambuf *out_;
+    std::vector<char> buf_;
+    uint32_t crc_ = 0;
+    size_t bytes_ = 0;
+
+  public:
+    explicit SectionStreamBuf(std::streambuf *out, size_t buf_bytes = 1 << 16) : out_(out), buf_(buf_bytes) {
+        setp(buf_.data(), buf_.data() + buf_.size());
+    }
+
+    uint32_t crc() const { return crc_; }
+    size_t bytes() const { return bytes_; }
+
+  protected:
+    int_type overflow(int_type ch) override {
+        if (!flush()) {
+            return traits_type::eof();
+        }
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    std::streamsize xsputn(const char *s, std::streamsize n) override {
+        if (n < epptr() - pptr()) {
+            std::memcpy(pptr(), s, n);
+            pbump(static_cast<int>(n));
+            return n;
+        }
+        return flush() && put(s, n) ? n : 0;
+    }
+
+    int sync() override { return flush() ? 0 : -1; }
+
+  private:
+    bool put(const char *data, size_t n) {
+        crc_ = utils::crc32c(data, n, crc_);
+        bytes_ += n;
+        return out_->sputn(data, n) == static_cast<std::streamsize>(n);
+    }
+
+    bool flush() {
+        const size_t n = pptr() - pbase();
+        setp(buf_.data(), buf_.data() + buf_.size());
+        return put(buf_.data(), n);
+    }
+};
+
+/**
+ * @brief Write an index file in format v2
+ *
+ * Layout: header and section directory in the first page(s), then the payload of every
+ * section starting on a kIndexFileAlign boundary. The directory is written last, so room
+ * for `max_sections` entries is reserved up front. Payloads are streamed to the file.
+ */
+class IndexFileWriter {
+    std::ofstream out_;
+    IndexFileHeader header_;
+    std::vector<IndexSectionEntry> dir_;
+    size_t max_sections_;
+    size_t pos_;
+
+  public:
+    IndexFileWriter(const char *filename, const IndexFileHeader &header, size_t max_sections)
+        : out_(filename, std::ios::binary), header_(header), max_sections_(max_sections),
+          pos_(utils::rd_up_to_multiple_of(sizeof(IndexFileHeader) + max_sections * sizeof(IndexSectionEntry),
+                                           kIndexFileAlign)) {
+        CHECK(out_.is_open()) << "Cannot open " << filename;
+        dir_.reserve(max_sections);
+    }
+
+    /**
+     * @brief Append a section whose payload is written by `write(std::ostream &)`, which
+     * must not seek
+     */
+    template <typename F>
+    void add(IndexSection type, uint64_t index, F &&write) {
+        CHECK_LT(dir_.size(), max_sections_) << "Too many sections";
+        out_.seekp(pos_);
+        SectionStreamBuf buf(out_.rdbuf());
+        std::ostream os(&buf);
+        write(os);
+        CHECK(os.flush()) << fmt::format("Failed to write section (type {}, index {})",
+                                         static_cast<uint32_t>(type), index);
+        dir_.push_back({static_cast<uint32_t>(type), buf.crc(), index, pos_, buf.bytes()});
+        pos_ = utils::rd_up_to_multiple_of(pos_ + buf.bytes(), kIndexFileAlign);
+    }
+
+    void finish() {
+        // pad the last payload to a full page
+        out_.seekp(0, std::ios::end);
+        const size_t end = out_.tellp();
+        const std::vector<char> zeros(pos_ - end, 0);
+        out_.write(zeros.data(), zeros.size());
+
+        header_.num_sections = dir_.size();
+        header_.crc = 0;
+        header_.crc = utils::crc32c(dir_.data(), dir_.size() * sizeof(IndexSectionEntry),
+                                    utils::crc32c(&header_, sizeof(header_)));
+        out_.seekp(0);
+        out_.write(reinterpret_cast<const char *>(&header_), sizeof(header_));
+        out_.write(reinterpret_cast<const char *>(dir_.data()), dir_.size() * sizeof(IndexSectionEntry));
+        out_.close();
+        CHECK(!out_.fail()) << "Failed to write index file";
+    }
+};
+
+/**
+ * @brief Random access to the sections of an index file in format v2
+ *
+ * The header and the directory are checked when the file is opened, so a damaged or foreign
+ * file fails there with the reason instead of sizing buffers from garbage. read() uses pread,
+ * so sections can be read from several threads at once.
+ */
+class IndexFileReader {
+    int fd_ = -1;
+    uint64_t file_bytes_ = 0;
+    IndexFileHeader header_;
+    std::vector<IndexSectionEntry> dir_;
+    std::map<std::pair<uint32_t, uint64_t>, size_t> lookup_;
+
+  public:
+    explicit IndexFileReader(const char *filename) {
+        const auto error = open_file(filename);
+        CHECK(error.empty()) << filename << ": " << error;
+    }
+
+    /**
+     * @brief Why `filename` cannot be opened by IndexFileReader, empty if it can
+     *
+     * Checks the header and the directory without failing. The payloads are checked by verify().
+     */
+    static std::string check(const char *filename) {
+        IndexFileReader reader;
+        return reader.open_file(filename);
+    }
+
+    IndexFileReader(const IndexFileReader &) = delete;
+    IndexFileReader &operator=(const IndexFileReader &) = delete;
+
+    ~IndexFileReader() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    const IndexFileHeader &header() const { return header_; }
+    const std::vector<IndexSectionEntry> &sections() const { return dir_; }
+
+    /**
+     * @brief Directory entry of a section, nullptr if the file has none
+     */
+    const IndexSectionEntry *find(IndexSection type, uint64_t index = 0) const {
+        auto it = lookup_.find({static_cast<uint32_t>(type), index});
+        return it == lookup_.end() ? nullptr : &dir_[it->second];
+    }
+
+    /**
+     * @brief Read the payload of a section and check its CRC
+     */
+    std::vector<char> read(const IndexSectionEntry &entry) const {
+        std::vector<char> buf(entry.bytes);
+        read_at(buf.data(), buf.size(), entry.offset);
+        CHECK_EQ(utils::crc32c(buf.data(), buf.size()), entry.crc)
+            << fmt::format("Corrupted section (type {}, index {})", entry.type, entry.index);
+        return buf;
+    }
+
+    std::vector<char> read(IndexSection type, uint64_t index = 0) const {
+        const auto *entry = find(type, index);
+        CHECK(entry) << fmt::format("Missing section (type {}, index {})", static_cast<uint32_t>(type), index);
+        return read(*entry);
+    }
+
+    /**
+     * @brief Check the CRC of every section without failing
+     * @return number of corrupted sections
+     */
+    size_t verify() const {
+        size_t bad = 0;
+        for (const auto &entry : dir_) {
+            std::vector<char> buf(entry.bytes);
+            read_at(buf.data(), buf.size(), entry.offset);
+            if (utils::crc32c(buf.data(), buf.size()) != entry.crc) {
+                LOG(ERROR) << fmt::format("Corrupted section (type {}, index {})", entry.type, entry.index);
+                ++bad;
+            }
+        }
+        return bad;
+    }
+
+  private:
+    IndexFileReader() = default;
+
+    std::string open_file(const char *filename) {
+        fd_ = open(filename, O_RDONLY);
+        struct stat st;
+        if (fd_ < 0 || fstat(fd_, &st) != 0) {
+            return fmt::format("cannot open: {}", std::strerror(errno));
+        }
+        file_bytes_ = st.st_size;
+        if (file_bytes_ < sizeof(header_)) {
+            return "truncated header";
+        }
+        read_at(&header_, sizeof(header_), 0);
+        if (header_.magic != kIndexFileMagic && header_.magic != kManifestFileMagic) {
+            return fmt::format("not an index file (magic {:#x})", header_.magic);
+        }
+        if (header_.version != kIndexFileVersion) {
+            return fmt::format("format version {} has no sections, or is not known to this library",
+                               header_.version);
+        }
+        if (header_.num_sections > (file_bytes_ - sizeof(header_)) / sizeof(IndexSectionEntry)) {
+            return fmt::format("directory of {} sections beyond the end of the file", header_.num_sections);
+        }
+        dir_.resize(header_.num_sections);
+        read_at(dir_.data(), dir_.size() * sizeof(IndexSectionEntry), sizeof(header_));
+
+        auto hdr = header_;
+        hdr.crc = 0;
+        uint32_t crc = utils::crc32c(dir_.data(), dir_.size() * sizeof(IndexSectionEntry),
+                                     utils::crc32c(&hdr, sizeof(hdr)));
+        if (crc != header_.crc) {
+            return "corrupted header";
+        }
+        for (size_t i = 0; i < dir_.size(); ++i) {
+            const auto &entry = dir_[i];
+            if (entry.offset > file_bytes_ || entry.bytes > file_bytes_ - entry.offset) {
+                return fmt::format("section (type {}, index {}) beyond the end of the file", entry.type,
+                                   entry.index);
+            }
+            lookup_[{entry.type, entry.index}] = i;
+        }
+        return {};
+    }
+
+    void read_at(void *dst, size_t bytes, size_t offset) const {
+        auto *p = static_cast<char *>(dst);
+        while (bytes) {
+            ssize_t n = pread(fd_, p, bytes, offset);
+            CHECK_GT(n, 0) << fmt::format("Index file truncated or unreadable at offset {}: {}", offset,
+                                          n < 0 ? std::strerror(errno) : "EOF");
+            p += n;
+            offset += n;
+            bytes -= n;
+        }
+    }
+};
+} // namespace saqlib
@@ -1,8 +1,10 @@
 #pragma once
 
+#include <algorithm>
 #include <cstring>
 #include <fstream>
 #include <functional>
+#include <stdexcept>
 #include <stdint.h>
 #include <vector>
 
@@ -28,13 +30,29 @@ class Initializer
     virtual void set_centroids(FloatRowMat c) = 0;
     virtual void centroids_distances(const FloatVec &, size_t, DistType dist_type, std::vector<Candidate> &)
         const = 0;
-    virtual void load(std::ifstream &, const char *) = 0;
-    virtual void save(std::ofstream &, const char *) const = 0;
+
+    /**
+     * @brief centroids_distances() of every row of `queries`, `nprobe` candidates each
+     */
+    virtual void centroids_distances_batch(const Eigen::Ref<const FloatRowMat> &queries, size_t nprobe,
+                                           DistType dist_type, std::vector<std::vector<Candidate>> &candidates) const
+    {
+        candidates.resize(queries.rows());
+        for (size_t i = 0; i < candidates.size(); ++i) {
+            candidates[i].resize(nprobe);
+            centroids_distances(queries.row(i), nprobe, dist_type, candidates[i]);
+        }
+    }
+
+    virtual void load(std::istream &, const char *) = 0;
+    virtual void save(std::ostream &, const char *) const = 0;
+    virtual size_t memory_bytes() const = 0;
 };
 
 class FlatInitializer : public Initializer
 {
     FloatRowMat centroids_;
+    FloatVec centroid_norms_; // squared, for centroids_distances_batch()
 
   public:
     explicit FlatInitializer(size_t num_dim, size_t num_cluster)
@@ -47,8 +65,13 @@ class FlatInitializer : public Initializer
     void set_centroids(FloatRowMat c) override
     {
         centroids_ = std::move(c);
+        centroid_norms_ = centroids_.rowwise().squaredNorm().transpose();
     }
 
+    const FloatRowMat &centroids() const { return centroids_; }
+
+    size_t memory_bytes() const override { return (centroids_.size() + centroid_norms_.size()) * sizeof(float); }
+
     void centroids_distances(
         const FloatVec &query, size_t nprobe, DistType dist_type, std::vector<Candidate> &candidates) const override
     {
@@ -75,7 +98,39 @@ class FlatInitializer : public Initializer
         std::copy(centroid_dist.begin(), centroid_dist.begin() + nprobe, candidates.begin());
     }
 
-    void save(std::ofstream &output, const char *) const override
+    /**
+     * @brief Distances of a batch of queries to all centroids as one GEMM, L2 from the
+     * precomputed centroid norms
+     */
+    void centroids_distances_batch(const Eigen::Ref<const FloatRowMat> &queries, size_t nprobe,
+                                   DistType dist_type, std::vector<std::vector<Candidate>> &candidates) const override
+    {
+        if (dist_type != DistType::L2Sqr && dist_type != DistType::IP) {
+            throw std::invalid_argument(
+                fmt::format("Unsupported distance type: {}", static_cast<int>(dist_type)));
+        }
+        const FloatRowMat ips = queries * centroids_.transpose();
+        candidates.resize(queries.rows());
+        std::vector<Candidate> centroid_dist(this->num_cluster_);
+        for (size_t q = 0; q < size_t(queries.rows()); ++q) {
+            const float query_norm = queries.row(q).squaredNorm();
+            for (PID i = 0; i < num_cluster_; ++i) {
+                centroid_dist[i].id = i;
+                centroid_dist[i].distance =
+                    dist_type == DistType::IP ? ips(q, i) : query_norm + centroid_norms_[i] - 2 * ips(q, i);
+            }
+            if (dist_type == DistType::IP) {
+                std::partial_sort(centroid_dist.begin(), centroid_dist.begin() + nprobe,
+                                  centroid_dist.end(), std::greater<>());
+            } else {
+                std::partial_sort(centroid_dist.begin(), centroid_dist.begin() + nprobe,
+                                  centroid_dist.end());
+            }
+            candidates[q].assign(centroid_dist.begin(), centroid_dist.begin() + nprobe);
+        }
+    }
+
+    void save(std::ostream &output, const char *) const override
     {
         CHECK_EQ(centroids_.size(), num_dim_ * num_cluster_) << "Centroids not set";
         output.write(
@@ -83,7 +138,7 @@ class FlatInitializer : public Initializer
             static_cast<long>(sizeof(float) * num_dim_ * num_cluster_));
     }
 
-    void load(std::ifstream &input, const char *) override
+    void load(std::istream &input, const char *) override
     {
         if (centroids_.size() < 1) {
             centroids_.resize(num_cluster_, num_dim_);
@@ -91,6 +146,7 @@ class FlatInitializer : public Initializer
         input.read(
             reinterpret_cast<char *>(centroids_.data()),
             static_cast<long>(sizeof(float) * num_dim_ * num_cluster_));
+        centroid_norms_ = centroids_.rowwise().squaredNorm().transpose();
     }
 };
 } // namespace saqlib
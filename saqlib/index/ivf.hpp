@@ -1,32 +1,55 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
 #include <fstream>
+#include <future>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <numeric>
+#include <tuple>
+#include <unordered_map>
 #include <vector>
 
 #include "glog/logging.h"
 #include <fmt/core.h>
 
 #include "defines.hpp"
+#include "index/build_scheduler.hpp"
+#include "index/cluster_cache.hpp"
+#include "index/index_file.hpp"
 #include "index/initializer.hpp"
+#include "index/memory_report.hpp"
+#include "index/tiered_store.hpp"
+#include "index/vector_store.hpp"
 #include "quantization/cluster_data.hpp"
 #include "quantization/config.h"
 #include "quantization/saq_data.hpp"
 #include "quantization/saq_quantizer.hpp"
 #include "quantization/saq_searcher.hpp"
 #include "utils/BS_thread_pool.hpp"
+#include "utils/IO.hpp"
 #include "utils/StopW.hpp"
+#include "utils/numa.hpp"
 #include "utils/pool.hpp"
+#include "utils/rotator.hpp"
+#include "utils/stage_profiler.hpp"
 
 namespace saqlib
 {
 class IVF
 {
   public:
+    static constexpr uint64_t kIndexMagic = kIndexFileMagic;  // older files start with num_data
+    static constexpr uint32_t kIndexVersion = kIndexFileVersion; // 2: sectioned file, see index_file.hpp
+    static constexpr uint32_t kFlagExternalIds = 1;
+
     QuantMetrics quant_metrics_; // Quantization metrics
   protected:
     size_t num_data_; // num of data points
@@ -34,12 +57,64 @@ class IVF
     size_t num_cen_;  // num of centroids
     QuantizeConfig cfg_;
     std::unique_ptr<Initializer> initer_ = nullptr;
-    std::vector<SaqCluData> parallel_clusters_; // cluster data for SAQ
-    std::unique_ptr<SaqData> saq_data_;
+    utils::NumaTopology topo_; // nodes to place the clusters on, the host topology if left empty
+    std::vector<std::unique_ptr<memory::HugePageArena>> arenas_; // optional storage of the clusters, one per node
+    std::vector<SaqCluData> parallel_clusters_;                  // cluster data for SAQ
+    std::vector<std::vector<SaqCluData>> replicas_;              // NumaMode::Replicate, copies for nodes 1..n-1
+    std::vector<int> cluster_node_;                              // NumaMode::Partition, node of each cluster
+    std::shared_ptr<SaqData> saq_data_; // may be shared with other indexes, see set_saq_data()
+    utils::PCARotatorPtr pca_ = nullptr; // optional PCA applied to raw queries
+    std::vector<uint64_t> external_ids_; // optional external id of each vector
     //  ======= Presistence data above  =======
     std::unique_ptr<SaqDataMaker> saq_data_maker_;
+    std::vector<std::unique_ptr<BS::thread_pool<>>> node_pools_; // NumaMode::Partition, workers pinned to each node
+    std::unique_ptr<TieredLongStore> tiered_;                     // StorageConfig::tiered, long data in the index file
+    std::unique_ptr<ClusterCache> lazy_;                          // StorageConfig::lazy, clusters read on first probe
+
+    bool partial_ = false; // loaded with a subset of the clusters
 
     void allocate_clusters(const std::vector<size_t> &);
+    void load_sections(const char *, StorageConfig, const std::vector<PID> *, size_t);
+    void finalize_placement();
+
+    template <DistType kDistType>
+    void search_tiered(const Eigen::RowVectorXf &, const std::vector<Candidate> &, const SearcherConfig &,
+                       utils::ResultPool &, QueryRuntimeMetrics *);
+
+    bool numa_enabled() const { return cfg_.storage.numa != NumaMode::None && topo_.num_nodes() > 1; }
+
+    /**
+     * @brief Clusters to be read by the calling thread
+     */
+    const std::vector<SaqCluData> &local_clusters() const
+    {
+        if (replicas_.empty()) {
+            return parallel_clusters_;
+        }
+        int node = topo_.current_node();
+        return node == 0 ? parallel_clusters_ : replicas_[node - 1];
+    }
+
+    /**
+     * @brief Ids of `pool` into `results`, `capacity()` of them, and their distances if
+     * `distances` is set. Empty slots get kInvalidPID and the largest distance of the ordering
+     */
+    static void copy_pool(utils::ResultPool &pool, bool greater, PID *results, float *distances)
+    {
+        const float empty = greater ? std::numeric_limits<float>::lowest() : std::numeric_limits<float>::max();
+        pool.copy_results(results);
+        for (size_t j = 0; distances && j < pool.capacity(); ++j) {
+            distances[j] = j < pool.size() ? pool.get(j).second : empty;
+        }
+    }
+
+    static void copy_pools(std::vector<utils::ResultPool> &pools, bool greater, PID *results, float *distances)
+    {
+        for (size_t i = 0; i < pools.size(); ++i) {
+            const size_t topk = pools[i].capacity();
+            copy_pool(pools[i], greater, results + i * topk, distances ? distances + i * topk : nullptr);
+        }
+    }
 
     void prepare_initer(const FloatRowMat *centroids)
     {
@@ -59,16 +134,28 @@ class IVF
     void free_memory()
     {
         initer_.reset();
+        pca_.reset();
+        external_ids_.clear();
+        partial_ = false;
+        node_pools_.clear();
+        tiered_.reset();
+        lazy_.reset();
         parallel_clusters_.clear();
+        replicas_.clear();
+        cluster_node_.clear();
+        arenas_.clear();
         saq_data_maker_.reset();
     }
 
   public:
     explicit IVF() = default;
     explicit IVF(size_t n, size_t num_dim, size_t k, QuantizeConfig cfg)
-        : num_data_(n), num_dim_(num_dim), num_cen_(k), cfg_(std::move(cfg)),
-          saq_data_maker_(std::make_unique<SaqDataMaker>(cfg_, num_dim))
+        : num_data_(n), num_dim_(num_dim), num_cen_(k), cfg_(std::move(cfg))
     {
+        if (cfg_.planner.avg_cluster_size <= 0 && num_cen_) {
+            cfg_.planner.avg_cluster_size = float(num_data_) / num_cen_;
+        }
+        saq_data_maker_ = std::make_unique<SaqDataMaker>(cfg_, num_dim);
     }
     IVF(const IVF &) = delete;
 
@@ -76,22 +163,149 @@ class IVF
 
     auto num_data() const { return num_data_; }
     auto num_dim() const { return num_dim_; }
+    auto num_clusters() const { return num_cen_; }
     auto &get_config() const { return cfg_; }
     auto get_initer() const { return initer_.get(); }
     const SaqData *get_saq_data() const { return saq_data_.get(); }
     auto &get_pclusters() const { return parallel_clusters_; }
+    ClusterCache *get_cluster_cache() const { return lazy_.get(); }
+    const utils::PCARotator *get_pca() const { return pca_.get(); }
+
+    /**
+     * @brief Attach a PCA transform to the index
+     *
+     * The index is expected to be constructed on PCA-transformed data. The transform is
+     * saved with the index and applied to raw queries in search()/estimate().
+     */
+    void set_pca(utils::PCARotatorPtr pca)
+    {
+        CHECK(!pca || pca->D == num_dim_) << "PCA dimension mismatch";
+        pca_ = std::move(pca);
+    }
+
+    /**
+     * @brief Place the clusters on the nodes of `topo` instead of the ones of the host, e.g. to
+     * run a NUMA placement on a single node. Takes effect at the next construct() or load()
+     */
+    void set_topology(utils::NumaTopology topo) { topo_ = std::move(topo); }
+
+    /**
+     * @brief Attach 64-bit external ids, one per vector in the order passed to construct().
+     * They are saved with the index, search() keeps returning internal ids.
+     */
+    void set_external_ids(std::vector<uint64_t> ids)
+    {
+        CHECK(ids.empty() || ids.size() == num_data_) << "External ids size mismatch";
+        external_ids_ = std::move(ids);
+    }
+
+    bool has_external_ids() const { return !external_ids_.empty(); }
+
+    /**
+     * @brief Map internal ids (e.g. search results) to external ids
+     */
+    void to_external_ids(const PID *ids, size_t num, uint64_t *out) const
+    {
+        CHECK(has_external_ids()) << "No external ids attached";
+        for (size_t i = 0; i < num; ++i) {
+            out[i] = ids[i] < num_data_ ? external_ids_[ids[i]] : std::numeric_limits<uint64_t>::max();
+        }
+    }
 
     void construct(const FloatRowMat &data, const FloatRowMat &centroids, const PID *cluster_ids,
                    int num_threads = 64, bool use_1_centroid = false);
 
+    /**
+     * @brief Construct from the ids of the rows of `data` in each cluster. The ids are stored as
+     * they are, so an index may hold any subset of the rows, e.g. one shard of them.
+     */
+    void construct(const FloatRowMat &data, const FloatRowMat &centroids, const std::vector<std::vector<PID>> &id_lists,
+                   int num_threads = 64, bool use_1_centroid = false);
+
+    /**
+     * @brief Construct from a stream of the base set instead of the loaded matrix
+     *
+     * Blocks are quantized as soon as the stream has passed all their vectors, so besides the
+     * two chunks of the stream only the rows of unfinished blocks are held, at most 31 per
+     * cluster. Takes an extra pass for the variance (if not set) or the mean (`use_1_centroid`).
+     * The chunks are transformed by the PCA of set_pca(), if any, so the stream may read the raw
+     * file. The result is the same as construct() on the whole (transformed) matrix.
+     */
+    void construct(utils::VectorStream &stream, const FloatRowMat &centroids, const PID *cluster_ids,
+                   int num_threads = 64, bool use_1_centroid = false);
+
     void save(const char *) const;
 
-    void load(const char *);
+    /**
+     * @brief Load an index saved by save()
+     * @param storage in-memory storage of the clusters. It is not stored in the file.
+     * @param clusters load only these clusters, the others are kept empty. nullptr loads
+     * all. Needs a file of version 2.
+     * @param num_threads threads reading clusters of a version 2 file, 0 for all cores
+     */
+    void load(const char *, StorageConfig storage = {}, const std::vector<PID> *clusters = nullptr,
+              size_t num_threads = 0);
 
-    template <DistType kDistType = DistType::Any>
+    /**
+     * @brief Check the header and the checksums of all sections of an index file, without failing
+     * @return false if the file is damaged, is not an IVF index or has no checksums
+     */
+    static bool verify(const char *filename);
+
+    /**
+     * @brief Memory held by the index: per section, per segment of the quantization plan, and
+     * the distribution of the cluster sizes
+     */
+    MemoryReport memory_report() const;
+
+    /**
+     * @tparam Profiler utils::CycleProfiler adds the cycles and survivors of each stage of
+     * the query to `profile` (tiered indexes: routing only). The default compiles them out
+     * @param distances nullptr, or the `topk` estimated distances of `results`, see search_batch()
+     */
+    template <DistType kDistType = DistType::Any, typename Profiler = utils::NoProfiler>
     void search(const Eigen::RowVectorXf &__restrict__ ori_query,
                 size_t topk, size_t nprobe, SearcherConfig searcher_cfg,
-                PID *__restrict__ results, QueryRuntimeMetrics *runtime_metrics = nullptr);
+                PID *__restrict__ results, QueryRuntimeMetrics *runtime_metrics = nullptr,
+                utils::SearchProfile *profile = nullptr, float *distances = nullptr);
+
+    /**
+     * @brief search() of every row of `queries`, `topk` results each into `results`
+     *
+     * The queries are routed together by one GEMM with the centroids, then the probed clusters
+     * are scanned rank by rank: the queries probing a cluster as their r-th nearest scan it back
+     * to back, and each query keeps the nearest-first order of search(), so the results are the
+     * same. Lazy, tiered and NUMA-partitioned indexes scan query by query.
+     * @param distances nullptr, or `topk` estimated distances per query. Slots without a
+     * candidate get kInvalidPID with the largest distance of the ordering
+     * @param runtime_metrics nullptr, or one per query
+     */
+    template <DistType kDistType = DistType::Any>
+    void search_batch(const Eigen::Ref<const FloatRowMat> &queries, size_t topk, size_t nprobe,
+                      SearcherConfig searcher_cfg, PID *__restrict__ results, float *distances = nullptr,
+                      QueryRuntimeMetrics *runtime_metrics = nullptr);
+
+    /**
+     * @brief search() with an exact re-ranking: fetches `topk * rerank_factor` candidates, then
+     * keeps the `topk` closest by their distances to the vectors of `store`
+     *
+     * `store` holds the vectors in the space of `ori_query`, e.g. it is the base file. The exact
+     * distances go to `distances`; the time of the re-ranking to `runtime_metrics->rerank_ns`.
+     */
+    template <DistType kDistType = DistType::Any>
+    void search_rerank(const Eigen::RowVectorXf &__restrict__ ori_query, size_t topk, size_t nprobe,
+                       SearcherConfig searcher_cfg, const VectorStore &store, float rerank_factor,
+                       PID *__restrict__ results, float *__restrict__ distances,
+                       QueryRuntimeMetrics *runtime_metrics = nullptr);
+
+    /**
+     * @brief Scan the clusters of `centroid_dist` into `KNNs`, for a query already mapped by
+     * transform_query(). search() without the probing of the centroids.
+     */
+    template <DistType kDistType = DistType::Any, typename Profiler = utils::NoProfiler>
+    void search_probed(const Eigen::RowVectorXf &query, const std::vector<Candidate> &centroid_dist,
+                       const SearcherConfig &searcher_cfg, utils::ResultPool &KNNs,
+                       QueryRuntimeMetrics *runtime_metrics = nullptr, utils::SearchProfile *profile = nullptr);
 
     template <DistType kDistType = DistType::Any>
     void estimate(const Eigen::RowVectorXf &__restrict__ ori_query,
@@ -106,6 +320,39 @@ class IVF
         saq_data_maker_->set_variance(std::move(vars));
     }
 
+    /**
+     * @brief Quantize with the plan and rotators of `data` instead of making them in construct(),
+     * so that indexes built separately (e.g. shards) encode vectors the same way
+     */
+    void set_saq_data(std::shared_ptr<SaqData> data)
+    {
+        CHECK_EQ(data->num_dim, num_dim_) << "Quantization data dimension mismatch";
+        saq_data_ = std::move(data);
+        saq_data_maker_.reset();
+        const auto storage = cfg_.storage;
+        cfg_ = saq_data_->cfg;
+        cfg_.storage = storage;
+    }
+
+    /**
+     * @brief Map a raw query into the index space
+     *
+     * Returns `ori_query` untouched when no PCA is attached or it is disabled in
+     * `searcher_cfg`. For IP the mean is not subtracted: <q, o> only differs from
+     * <qP^T, (o - mean)P^T> by a per-query constant, so the ranking is preserved.
+     * The mapped query lives in a buffer of the calling thread, valid until its next call.
+     */
+    const Eigen::RowVectorXf &transform_query(const Eigen::RowVectorXf &ori_query,
+                                              const SearcherConfig &searcher_cfg) const
+    {
+        if (!pca_ || !searcher_cfg.apply_pca) {
+            return ori_query;
+        }
+        thread_local Eigen::RowVectorXf buf; // allocated once per searching thread
+        pca_->transform(ori_query, buf, searcher_cfg.dist_type != DistType::IP);
+        return buf;
+    }
+
     void printQPlan(const SaqData *data)
     {
         LOG(INFO) << "Dynamic bits allocation plan:";
@@ -129,32 +376,43 @@ class IVF
  */
 inline void IVF::construct(const FloatRowMat &data, const FloatRowMat &centroids, const PID *cluster_ids,
                            int num_threads, bool use_1_centroid)
+{
+    std::vector<std::vector<PID>> id_lists(num_cen_);
+    for (size_t i = 0; i < num_data_; ++i) {
+        PID cid = cluster_ids[i];
+        CHECK_LT(cid, num_cen_) << "Bad cluster id\n";
+        id_lists[cid].push_back((PID)i);
+    }
+    construct(data, centroids, id_lists, num_threads, use_1_centroid);
+}
+
+inline void IVF::construct(const FloatRowMat &data, const FloatRowMat &centroids,
+                           const std::vector<std::vector<PID>> &id_lists, int num_threads, bool use_1_centroid)
 {
     LOG(INFO) << "Start IVF construction...\n";
+    CHECK(!cfg_.storage.tiered) << "Tiered storage reads the long codes from an index file, load() the saved index with it";
+    CHECK_EQ(id_lists.size(), num_cen_) << "One id list per centroid is needed";
 
     // 1. prepare initializer
     prepare_initer(&centroids);
 
-    // 2. prepare SAQ data
-    {
+    // 2. prepare SAQ data, unless set_saq_data() gave it
+    if (saq_data_maker_) {
         if (!saq_data_maker_->is_variance_set()) {
             // If variance is not set, compute it from data
             saq_data_maker_->compute_variance(data);
         }
         saq_data_ = saq_data_maker_->return_data();
-        printQPlan(saq_data_.get());
     }
+    printQPlan(saq_data_.get());
 
     // 3. prepare clusters
-    std::vector<std::vector<PID>> id_lists(num_cen_);
+    std::vector<size_t> counts(num_cen_, 0);
     {
-        std::vector<size_t> counts(num_cen_, 0);
-        for (size_t i = 0; i < num_data_; ++i) {
-            PID cid = cluster_ids[i];
-            CHECK_LE(cid, num_cen_) << "Bad cluster id\n";
-            id_lists[cid].push_back((PID)i);
-            counts[cid] += 1;
+        for (size_t cid = 0; cid < num_cen_; ++cid) {
+            counts[cid] = id_lists[cid].size();
         }
+        CHECK_EQ(std::accumulate(counts.begin(), counts.end(), size_t(0)), num_data_) << "Id lists do not match num_data";
         allocate_clusters(counts);
     }
 
@@ -168,75 +426,435 @@ inline void IVF::construct(const FloatRowMat &data, const FloatRowMat &centroids
         SAQuantizer saq_quantizer_(saq_data_.get());
         BS::thread_pool pool(num_threads);
         utils::StopW stopw;
-        /* Quantize each cluster */
-        for (size_t i = 0; i < num_cen_; ++i) {
-            pool.detach_task([&, this, i]() {
+        if (cfg_.factor_type == FactorType::Fp16) {
+            std::vector<double> bounds(num_cen_, 0);
+            pool.detach_loop(size_t(0), num_cen_, [&](size_t i) {
                 const FloatVec &cur_centroid = use_1_centroid ? tot_avg_centroid : centroids.row(i);
-                auto &clu = parallel_clusters_[i];
-
-                saq_quantizer_.quantize_cluster(data, cur_centroid, id_lists[i], clu);
+                for (auto id : id_lists[i]) {
+                    bounds[i] = std::max(bounds[i], saq_quantizer_.factor_bound(&data(id, 0), cur_centroid));
+                }
             });
+            pool.wait();
+            utils::check_factor_range(cfg_.factor_type, *std::max_element(bounds.begin(), bounds.end()));
         }
+        /* Store ids and centroids of each cluster */
+        pool.detach_loop(size_t(0), num_cen_, [&](size_t i) {
+            const FloatVec &cur_centroid = use_1_centroid ? tot_avg_centroid : centroids.row(i);
+            saq_quantizer_.prepare_cluster(cur_centroid, id_lists[i], parallel_clusters_[i]);
+        });
         pool.wait();
+
+        /* Quantize block ranges of clusters, largest first */
+        quant_metrics_ = QuantMetrics();
+        std::mutex metrics_mtx;
+        BuildScheduler scheduler(counts, pool.get_thread_count());
+        scheduler.run(pool, [&](const BuildScheduler::Task &task) {
+            QuantMetrics metrics;
+            saq_quantizer_.quantize_blocks(data, parallel_clusters_[task.cid], task.blk_begin, task.blk_end, &metrics);
+            std::lock_guard<std::mutex> lock(metrics_mtx);
+            quant_metrics_.norm_ip_o_oa.merge(metrics.norm_ip_o_oa);
+        });
         auto tm_ms = stopw.getElapsedTimeMicro() / 1000.0;
         LOG(INFO) << "Quantization done. tm: " << tm_ms / 1e3 << " S";
+        scheduler.report();
     }
+    finalize_placement();
+}
+
+inline void IVF::construct(utils::VectorStream &stream, const FloatRowMat &centroids, const PID *cluster_ids,
+                           int num_threads, bool use_1_centroid)
+{
+    LOG(INFO) << "Start IVF construction from a stream...\n";
+    CHECK(!cfg_.storage.tiered) << "Tiered storage reads the long codes from an index file, load() the saved index with it";
+    CHECK_EQ(stream.rows(), num_data_) << "Stream rows do not match num_data";
+    CHECK_EQ(stream.padded_cols(), num_dim_) << "Stream dimension mismatch";
+
+    std::vector<std::vector<PID>> id_lists(num_cen_);
+    for (size_t i = 0; i < num_data_; ++i) {
+        PID cid = cluster_ids[i];
+        CHECK_LT(cid, num_cen_) << "Bad cluster id\n";
+        id_lists[cid].push_back((PID)i);
+    }
+    auto for_each_chunk = [&](auto &&fn) {
+        stream.reset();
+        size_t first;
+        while (auto *chunk = stream.next(&first)) {
+            if (pca_) {
+                pca_->transform_inplace(*chunk);
+            }
+            fn(*chunk, first);
+        }
+    };
+
+    // 1. prepare initializer
+    prepare_initer(&centroids);
+
+    // 2. prepare SAQ data, with a pass for the mean and variance if needed
+    const bool need_variance = saq_data_maker_ && !saq_data_maker_->is_variance_set();
+    FloatVec tot_avg_centroid;
+    if (need_variance || use_1_centroid) {
+        // moments shifted by the first row for numerical stability
+        Eigen::RowVectorXd shift, sum, sq_sum;
+        for_each_chunk([&](const FloatRowMat &chunk, size_t) {
+            if (shift.size() == 0) {
+                shift = chunk.row(0).cast<double>();
+                sum = sq_sum = Eigen::RowVectorXd::Zero(chunk.cols());
+            }
+            for (Eigen::Index r = 0; r < chunk.rows(); ++r) {
+                Eigen::RowVectorXd d = chunk.row(r).cast<double>() - shift;
+                sum += d;
+                sq_sum += d.cwiseProduct(d);
+            }
+        });
+        const Eigen::RowVectorXd mean_shifted = sum / double(num_data_);
+        tot_avg_centroid = (shift + mean_shifted).cast<float>();
+        if (need_variance) {
+            FloatVec vars = (sq_sum / double(num_data_) - mean_shifted.cwiseProduct(mean_shifted)).cast<float>();
+            saq_data_maker_->set_variance(std::move(vars));
+        }
+    }
+    if (saq_data_maker_) {
+        saq_data_ = saq_data_maker_->return_data();
+    }
+    printQPlan(saq_data_.get());
+
+    // 3. prepare clusters
+    std::vector<size_t> counts(num_cen_, 0);
+    for (size_t cid = 0; cid < num_cen_; ++cid) {
+        counts[cid] = id_lists[cid].size();
+    }
+    allocate_clusters(counts);
+
+    // 4. quantize the blocks completed by each chunk
+    {
+        SAQuantizer saq_quantizer_(saq_data_.get());
+        BS::thread_pool pool(num_threads);
+        utils::StopW stopw;
+        if (cfg_.factor_type == FactorType::Fp16) {
+            // one more pass, so that factors out of the fp16 range fail before any cluster is quantized
+            double bound = 0;
+            for_each_chunk([&](const FloatRowMat &chunk, size_t first) {
+                for (Eigen::Index r = 0; r < chunk.rows(); ++r) {
+                    const PID cid = cluster_ids[first + r];
+                    const FloatVec &cur_centroid = use_1_centroid ? tot_avg_centroid : centroids.row(cid);
+                    bound = std::max(bound, saq_quantizer_.factor_bound(&chunk(r, 0), cur_centroid));
+                }
+            });
+            utils::check_factor_range(cfg_.factor_type, bound);
+        }
+        pool.detach_loop(size_t(0), num_cen_, [&](size_t i) {
+            const FloatVec &cur_centroid = use_1_centroid ? tot_avg_centroid : centroids.row(i);
+            saq_quantizer_.prepare_cluster(cur_centroid, id_lists[i], parallel_clusters_[i]);
+        });
+        pool.wait();
+
+        // ids in a cluster are ascending, so its blocks complete in order and a block is complete
+        // once the stream has passed its last id
+        auto last_id = [&](PID cid, size_t blk) {
+            return id_lists[cid][std::min((blk + 1) * KFastScanSize, id_lists[cid].size()) - 1];
+        };
+        struct BlockRange {
+            PID cid;
+            size_t blk_begin;
+            size_t blk_end;
+        };
+        constexpr size_t kTaskBlocks = 8;
+        std::vector<size_t> next_blk(num_cen_, 0); // first block not quantized
+        std::unordered_map<PID, FloatVec> carry;   // rows of unfinished blocks from earlier chunks
+        size_t max_carry = 0;
+        quant_metrics_ = QuantMetrics();
+        std::mutex metrics_mtx;
+        for_each_chunk([&](const FloatRowMat &chunk, size_t first) {
+            const size_t end = first + chunk.rows();
+            std::vector<BlockRange> tasks;
+            for (PID cid = 0; cid < num_cen_; ++cid) {
+                const size_t num_blocks = utils::div_rd_up(counts[cid], KFastScanSize);
+                size_t blk = next_blk[cid];
+                while (blk < num_blocks && last_id(cid, blk) < end) {
+                    ++blk;
+                }
+                for (size_t b = next_blk[cid]; b < blk; b += kTaskBlocks) {
+                    tasks.push_back({cid, b, std::min(b + kTaskBlocks, blk)});
+                }
+                next_blk[cid] = blk;
+            }
+
+            auto row = [&](PID id) -> const float * {
+                return id >= first ? &chunk(id - first, 0) : carry.find(id)->second.data();
+            };
+            pool.detach_loop(size_t(0), tasks.size(), [&](size_t t) {
+                const auto &task = tasks[t];
+                QuantMetrics metrics;
+                saq_quantizer_.quantize_blocks_from(row, parallel_clusters_[task.cid], task.blk_begin, task.blk_end,
+                                                    &metrics);
+                std::lock_guard<std::mutex> lock(metrics_mtx);
+                quant_metrics_.norm_ip_o_oa.merge(metrics.norm_ip_o_oa);
+            });
+            pool.wait();
+
+            // drop the carried rows of the quantized blocks, carry the rows of the unfinished ones
+            for (const auto &task : tasks) {
+                const auto &ids = id_lists[task.cid];
+                const size_t vec_end = std::min(task.blk_end * KFastScanSize, ids.size());
+                for (size_t v = task.blk_begin * KFastScanSize; v < vec_end && ids[v] < first; ++v) {
+                    carry.erase(ids[v]);
+                }
+            }
+            for (size_t id = first; id < end; ++id) {
+                const PID cid = cluster_ids[id];
+                const size_t v = next_blk[cid] * KFastScanSize;
+                if (v < counts[cid] && id >= id_lists[cid][v]) {
+                    carry.emplace(PID(id), chunk.row(id - first));
+                }
+            }
+            max_carry = std::max(max_carry, carry.size());
+        });
+        CHECK(carry.empty()) << "Stream ended before all blocks were complete";
+        auto tm_ms = stopw.getElapsedTimeMicro() / 1000.0;
+        LOG(INFO) << "Quantization done. tm: " << tm_ms / 1e3 << " S, at most " << max_carry
+                  << " rows held across chunks";
+    }
+    finalize_placement();
 }
 
 inline void IVF::allocate_clusters(const std::vector<size_t> &cluster_sizes)
 {
     // init clusters
+    node_pools_.clear();
     parallel_clusters_.clear();
+    replicas_.clear();
+    cluster_node_.clear();
+    arenas_.clear();
+    if (topo_.num_nodes() == 0) {
+        topo_ = utils::NumaTopology::host();
+    }
+    const auto &storage = cfg_.storage;
+    const bool numa = numa_enabled();
+    const size_t num_nodes = numa ? topo_.num_nodes() : 1;
+    CHECK(!(storage.tiered && numa)) << "Tiered storage does not support NUMA placement";
+    if (storage.huge_page || numa) {
+        for (size_t n = 0; n < num_nodes; ++n) {
+            arenas_.push_back(std::make_unique<memory::HugePageArena>(storage.huge_page, storage.prefault, 1ul << 30,
+                                                                      numa ? topo_.node_ids[n] : -1));
+        }
+    }
+    auto arena = [&](size_t node) { return arenas_.empty() ? nullptr : arenas_[node].get(); };
+
+    if (numa && storage.numa == NumaMode::Partition) {
+        // largest clusters first, each to the node holding the fewest vectors so far
+        std::vector<size_t> order(num_cen_);
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(),
+                         [&](size_t a, size_t b) { return cluster_sizes[a] > cluster_sizes[b]; });
+        std::vector<size_t> node_load(num_nodes, 0);
+        cluster_node_.resize(num_cen_);
+        for (auto cid : order) {
+            auto node = std::min_element(node_load.begin(), node_load.end()) - node_load.begin();
+            cluster_node_[cid] = node;
+            node_load[node] += cluster_sizes[cid];
+        }
+    }
+
     parallel_clusters_.reserve(num_cen_);
     for (size_t i = 0; i < num_cen_; ++i) {
-        parallel_clusters_.emplace_back(cluster_sizes[i], saq_data_->quant_plan, cfg_.use_compact_layout);
+        parallel_clusters_.emplace_back(cluster_sizes[i], saq_data_->quant_plan, cfg_.use_compact_layout,
+                                        storage.interleaved_layout, arena(cluster_node_.empty() ? 0 : cluster_node_[i]),
+                                        storage.tiered, cfg_.factor_type);
+    }
+    if (numa && storage.numa == NumaMode::Replicate) {
+        replicas_.resize(num_nodes - 1);
+        for (size_t n = 1; n < num_nodes; ++n) {
+            auto &replica = replicas_[n - 1];
+            replica.reserve(num_cen_);
+            for (size_t i = 0; i < num_cen_; ++i) {
+                replica.emplace_back(cluster_sizes[i], saq_data_->quant_plan, cfg_.use_compact_layout,
+                                     storage.interleaved_layout, arena(n), false, cfg_.factor_type);
+            }
+        }
     }
     LOG(INFO) << "Initializing done... num_points: " << num_data_;
 }
 
+/**
+ * @brief Fill the replicas or start the node workers once the clusters hold their data,
+ * then release the unused tail of the arenas
+ */
+inline void IVF::finalize_placement()
+{
+    size_t id_bytes = 0;
+    for (const auto &pclu : parallel_clusters_) {
+        id_bytes += pclu.id_bytes();
+    }
+    LOG(INFO) << fmt::format("Packed ids: {:.2f} MiB, {:.2f} bits per vector", id_bytes / 1048576.0,
+                             num_data_ ? 8.0 * id_bytes / num_data_ : 0.0);
+    if (!replicas_.empty()) {
+        utils::StopW stopw;
+        for (size_t n = 0; n < replicas_.size(); ++n) {
+            // copy with threads of the target node, so the copy reads remote and writes local memory
+            BS::thread_pool pool(topo_.node_cpus[n + 1].size(), utils::AffinityInit::node(topo_, n + 1));
+            pool.detach_loop(size_t(0), num_cen_, [&](size_t i) { replicas_[n][i].copy_from(parallel_clusters_[i]); });
+            pool.wait();
+        }
+        LOG(INFO) << "Replicated clusters to " << replicas_.size() << " more NUMA nodes. tm: "
+                  << stopw.getElapsedTimeMicro() / 1e6 << " S";
+    }
+    if (!cluster_node_.empty()) {
+        node_pools_.clear();
+        for (size_t n = 0; n < topo_.num_nodes(); ++n) {
+            node_pools_.push_back(std::make_unique<BS::thread_pool<>>(topo_.node_cpus[n].size(),
+                                                                    utils::AffinityInit::node(topo_, n)));
+        }
+        LOG(INFO) << "Partitioned clusters over " << topo_.num_nodes() << " NUMA nodes";
+    }
+    for (size_t n = 0; n < arenas_.size(); ++n) {
+        arenas_[n]->shrink_to_fit();
+        LOG(INFO) << "Cluster storage arena " << n << ": " << arenas_[n]->toString();
+    }
+}
+
+inline MemoryReport IVF::memory_report() const
+{
+    MemoryReport report;
+    report.num_data = num_data_;
+    if (saq_data_) {
+        for (const auto &[num_dim, num_bits] : saq_data_->quant_plan) {
+            report.segments.push_back({num_dim, num_bits, {}});
+        }
+    }
+    size_t id_bytes = 0;
+    for (const auto &pclu : parallel_clusters_) {
+        for (size_t i = 0; i < pclu.num_segments_; ++i) {
+            report.segments[i].memory.merge(pclu.segment_memory(i));
+        }
+        id_bytes += pclu.id_bytes();
+        report.cluster_sizes.push_back(pclu.num_vec_);
+    }
+    if (lazy_) {
+        report.cluster_sizes = lazy_->cluster_sizes();
+    }
+    for (auto size : report.cluster_sizes) {
+        report.padding_vectors += utils::rd_up_to_multiple_of(size, KFastScanSize) - size;
+    }
+
+    SegmentMemory clusters;
+    for (const auto &seg : report.segments) {
+        clusters.merge(seg.memory);
+    }
+    auto add = [&](std::string name, size_t bytes, size_t padding = 0) {
+        if (bytes) {
+            report.sections.push_back({std::move(name), bytes, padding});
+        }
+    };
+    add("short factors", clusters.short_factors, clusters.short_factors_padding);
+    add("short codes", clusters.short_codes, clusters.short_codes_padding);
+    add("long codes", clusters.long_codes, clusters.long_codes_padding);
+    add("long factors", clusters.long_factors);
+    add("ids", id_bytes);
+    add("cluster centroids", clusters.centroid);
+    add(fmt::format("NUMA replicas ({})", replicas_.size()), replicas_.size() * (clusters.total() + id_bytes),
+        replicas_.size() * (clusters.short_factors_padding + clusters.short_codes_padding + clusters.long_codes_padding));
+    if (lazy_) {
+        add("lazy cluster cache", lazy_->bytes());
+    }
+    if (tiered_) {
+        add("tier block cache", tiered_->cache().bytes());
+    }
+    for (const auto &arena : arenas_) {
+        const auto stats = arena->stats();
+        add("arena slack", stats.mapped_bytes - stats.used_bytes, stats.mapped_bytes - stats.used_bytes);
+    }
+
+    add("centroids", initer_ ? initer_->memory_bytes() : 0);
+    if (saq_data_) {
+        size_t rotator_bytes = 0;
+        for (const auto &bd : saq_data_->base_datas) {
+            rotator_bytes += bd.rotator ? bd.rotator->size() * bd.rotator->size() * sizeof(float) : 0;
+        }
+        add("rotators", rotator_bytes);
+        add("variance", saq_data_->data_variance.size() * sizeof(float));
+    }
+    if (pca_) {
+        add("pca", (pca_->P.size() + pca_->mean.size()) * sizeof(float));
+    }
+    add("external ids", external_ids_.size() * sizeof(uint64_t));
+    return report;
+}
+
 inline void IVF::save(const char *filename) const
 {
+    CHECK(!lazy_) << "Cannot save an index loaded with lazy clusters";
     if (parallel_clusters_.empty()) {
         LOG(ERROR) << "IVF not constructed\n";
         return;
     }
+    CHECK(!partial_) << "Cannot save an index loaded with a subset of the clusters";
+    CHECK(!tiered_) << "Cannot save an index loaded with tiered storage";
 
-    std::ofstream output(filename, std::ios::binary);
-
-    /* Save meta data */
-    output.write((char *)&num_data_, sizeof(size_t));
-    output.write((char *)&num_dim_, sizeof(size_t));
-    output.write((char *)&num_cen_, sizeof(size_t));
-
-    this->initer_->save(output, filename);
+    IndexFileHeader header;
+    header.magic = kIndexMagic;
+    header.version = kIndexVersion;
+    header.flags = has_external_ids() ? kFlagExternalIds : 0;
+    header.num_data = num_data_;
+    header.num_dim = num_dim_;
+    header.num_cen = num_cen_;
+    IndexFileWriter writer(filename, header, num_cen_ + 5);
 
-    saq_data_->save(output);
+    writer.add(IndexSection::Centroids, 0, [&](std::ostream &os) { initer_->save(os, filename); });
+    writer.add(IndexSection::QuantData, 0, [&](std::ostream &os) { saq_data_->save(os); });
 
     /* Save number of vectors of each cluster */
-    std::vector<size_t> cluster_sizes;
-    cluster_sizes.reserve(num_cen_);
-    for (const auto &cur_cluster : parallel_clusters_) {
-        cluster_sizes.push_back(cur_cluster.num_vec_);
-    }
-    output.write((char *)cluster_sizes.data(), sizeof(size_t) * num_cen_);
+    writer.add(IndexSection::ClusterSizes, 0, [&](std::ostream &os) {
+        for (const auto &cur_cluster : parallel_clusters_) {
+            size_t size = cur_cluster.num_vec_;
+            os.write((char *)&size, sizeof(size_t));
+        }
+    });
 
-    for (const auto &pclu : parallel_clusters_) {
-        pclu.save(output);
+    for (size_t cid = 0; cid < num_cen_; ++cid) {
+        writer.add(IndexSection::Cluster, cid, [&](std::ostream &os) { parallel_clusters_[cid].save(os); });
     }
 
-    output.close();
+    if (has_external_ids()) {
+        writer.add(IndexSection::ExternalIds, 0, [&](std::ostream &os) {
+            os.write((char *)external_ids_.data(), sizeof(uint64_t) * num_data_);
+        });
+    }
+    if (pca_) {
+        writer.add(IndexSection::Pca, 0, [&](std::ostream &os) { pca_->save(os); });
+    }
+    writer.finish();
 }
 
-inline void IVF::load(const char *filename)
+inline void IVF::load(const char *filename, StorageConfig storage, const std::vector<PID> *clusters,
+                      size_t num_threads)
 {
     free_memory();
     LOG(INFO) << "Loading IVF...\n";
     std::ifstream input(filename, std::ios::binary);
-    assert(input.is_open());
+    CHECK(input.is_open()) << "Cannot open " << filename;
 
-    /* Load meta data */
+    /* Load header and meta data. Files without header store raw ids */
     LOG(INFO) << "\tLoading meta data...\n";
-    input.read((char *)&this->num_data_, sizeof(size_t));
+    uint64_t magic = 0;
+    uint32_t version = 0;
+    uint32_t flags = 0;
+    input.read((char *)&magic, sizeof(uint64_t));
+    if (magic == kIndexMagic) {
+        input.read((char *)&version, sizeof(uint32_t));
+        input.read((char *)&flags, sizeof(uint32_t));
+        CHECK_LE(version, kIndexVersion) << "Index file is newer than this library";
+        if (version >= 2) {
+            input.close();
+            load_sections(filename, storage, clusters, num_threads);
+            return;
+        }
+        input.read((char *)&this->num_data_, sizeof(size_t));
+    } else {
+        this->num_data_ = magic;
+    }
+    CHECK(clusters == nullptr) << "Loading a subset of the clusters needs an index file of version 2";
+    CHECK(!storage.tiered) << "Tiered storage needs an index file of version 2";
+    CHECK(!storage.lazy) << "Lazy clusters need an index file of version 2";
     input.read((char *)&this->num_dim_, sizeof(size_t));
     input.read((char *)&this->num_cen_, sizeof(size_t));
 
@@ -244,25 +862,157 @@ inline void IVF::load(const char *filename)
     this->initer_->load(input, filename);
 
     saq_data_ = std::make_unique<SaqData>();
-    saq_data_->load(input);
+    saq_data_->load(input, true);
+    cfg_ = saq_data_->cfg;
+    cfg_.storage = storage;
 
     /* Load number of vectors of each cluster */
     std::vector<size_t> cluster_sizes(num_cen_, 0);
     input.read((char *)cluster_sizes.data(), sizeof(size_t) * num_cen_);
     DCHECK_EQ(num_data_,
-              std::accumulate(cluster_sizes.begin(), cluster_sizes.end(), 0));
+              std::accumulate(cluster_sizes.begin(), cluster_sizes.end(), size_t(0)));
 
     allocate_clusters(cluster_sizes);
-    for (size_t i = 0; i < num_cen_; ++i) {
-        for (auto &pclu : parallel_clusters_) {
-            pclu.load(input);
-        }
+    for (auto &pclu : parallel_clusters_) {
+        pclu.load(input, version >= 1);
+    }
+    finalize_placement();
+
+    if (flags & kFlagExternalIds) {
+        external_ids_.resize(num_data_);
+        input.read((char *)external_ids_.data(), sizeof(uint64_t) * num_data_);
+    }
+
+    char pca_flags = 0;
+    if (input.peek() != std::ifstream::traits_type::eof()) {
+        input.read(&pca_flags, sizeof(char));
+    }
+    if (pca_flags) {
+        LOG(INFO) << "\tLoading PCA...\n";
+        pca_ = std::make_unique<utils::PCARotator>();
+        pca_->load(input);
+        CHECK_EQ(pca_->D, num_dim_) << "PCA dimension mismatch";
     }
 
     input.close();
     LOG(INFO) << "Index loaded\n";
 }
 
+inline void IVF::load_sections(const char *filename, StorageConfig storage, const std::vector<PID> *clusters,
+                               size_t num_threads)
+{
+    utils::StopW stopw;
+    IndexFileReader file(filename);
+    num_data_ = file.header().num_data;
+    num_dim_ = file.header().num_dim;
+    num_cen_ = file.header().num_cen;
+
+    {
+        auto buf = file.read(IndexSection::Centroids);
+        MemoryIStream is(buf);
+        prepare_initer(nullptr);
+        initer_->load(is, filename);
+    }
+    {
+        auto buf = file.read(IndexSection::QuantData);
+        MemoryIStream is(buf);
+        saq_data_ = std::make_unique<SaqData>();
+        saq_data_->load(is);
+        cfg_ = saq_data_->cfg;
+        cfg_.storage = storage;
+    }
+
+    auto sizes_buf = file.read(IndexSection::ClusterSizes);
+    CHECK_EQ(sizes_buf.size(), sizeof(size_t) * num_cen_);
+    std::vector<size_t> cluster_sizes(num_cen_);
+    std::memcpy(cluster_sizes.data(), sizes_buf.data(), sizes_buf.size());
+    DCHECK_EQ(num_data_, std::accumulate(cluster_sizes.begin(), cluster_sizes.end(), size_t(0)));
+
+    if (storage.lazy) {
+        CHECK(!clusters && !storage.tiered && !storage.huge_page && storage.numa == NumaMode::None)
+            << "Lazy clusters cannot be combined with a subset of the clusters, tiered, huge page or NUMA storage";
+        lazy_ = std::make_unique<ClusterCache>(filename, saq_data_->quant_plan, cfg_, std::move(cluster_sizes),
+                                               storage.lazy_cache_mb << 20);
+    }
+
+    /* Clusters left out keep zero vectors */
+    std::vector<char> selected(num_cen_, clusters == nullptr && !lazy_);
+    if (clusters) {
+        for (auto cid : *clusters) {
+            CHECK_LT(cid, num_cen_) << "Bad cluster id";
+            selected[cid] = true;
+        }
+        for (size_t cid = 0; cid < num_cen_; ++cid) {
+            cluster_sizes[cid] = selected[cid] ? cluster_sizes[cid] : 0;
+        }
+        partial_ = true;
+    }
+    size_t load_threads = 0;
+    if (!lazy_) {
+        allocate_clusters(cluster_sizes);
+        BS::thread_pool pool(num_threads);
+        load_threads = pool.get_thread_count();
+        pool.detach_loop(size_t(0), num_cen_, [&](size_t cid) {
+            if (selected[cid]) {
+                auto buf = file.read(IndexSection::Cluster, cid);
+                MemoryIStream is(buf);
+                parallel_clusters_[cid].load(is);
+            }
+        });
+        pool.wait();
+        finalize_placement();
+    }
+
+    if (storage.tiered) {
+        std::vector<uint64_t> offsets(num_cen_, 0);
+        for (size_t cid = 0; cid < num_cen_; ++cid) {
+            if (selected[cid]) {
+                offsets[cid] = file.find(IndexSection::Cluster, cid)->offset;
+            }
+        }
+        tiered_ = std::make_unique<TieredLongStore>(filename, std::move(offsets), storage.tier_cache_mb << 20,
+                                                    storage.tier_io_threads);
+        LOG(INFO) << "Tiered storage, long codes stay in " << filename << ": " << tiered_->toString();
+    }
+
+    if (file.find(IndexSection::ExternalIds)) {
+        auto buf = file.read(IndexSection::ExternalIds);
+        CHECK_EQ(buf.size(), sizeof(uint64_t) * num_data_);
+        external_ids_.resize(num_data_);
+        std::memcpy(external_ids_.data(), buf.data(), buf.size());
+    }
+    if (file.find(IndexSection::Pca)) {
+        LOG(INFO) << "\tLoading PCA...\n";
+        auto buf = file.read(IndexSection::Pca);
+        MemoryIStream is(buf);
+        pca_ = std::make_unique<utils::PCARotator>();
+        pca_->load(is);
+        CHECK_EQ(pca_->D, num_dim_) << "PCA dimension mismatch";
+    }
+    if (lazy_) {
+        LOG(INFO) << fmt::format("Lazy clusters, read from {} on first probe into a {} MiB cache", filename,
+                                 storage.lazy_cache_mb);
+    }
+    LOG(INFO) << fmt::format("Index loaded, {} of {} clusters with {} threads. tm: {:.3f} S",
+                             std::count(selected.begin(), selected.end(), true), num_cen_,
+                             load_threads, stopw.getElapsedTimeMicro() / 1e6);
+}
+
+inline bool IVF::verify(const char *filename)
+{
+    const auto error = IndexFileReader::check(filename);
+    if (!error.empty()) {
+        LOG(WARNING) << filename << ": " << error;
+        return false;
+    }
+    IndexFileReader file(filename);
+    if (file.header().magic != kIndexMagic) {
+        LOG(WARNING) << filename << " is not an IVF index";
+        return false;
+    }
+    return file.verify() == 0;
+}
+
 /*
  * @brief Search for k nearest neighbors
  *
@@ -272,30 +1022,31 @@ inline void IVF::load(const char *filename)
  * @param nprobe Number of clusters to search
  * @param results Result pool
  */
-template <DistType kDistType>
+template <DistType kDistType, typename Profiler>
 inline void IVF::search(const Eigen::RowVectorXf &__restrict__ ori_query, size_t topk, size_t nprobe,
                         SearcherConfig searcher_cfg, PID *__restrict__ results,
-                        QueryRuntimeMetrics *runtime_metrics)
+                        QueryRuntimeMetrics *runtime_metrics, utils::SearchProfile *profile, float *distances)
 {
     CHECK_EQ(ori_query.cols(), num_dim_);
+    Profiler profiler;
+    const auto t_begin = profiler.now();
+    const auto &query = transform_query(ori_query, searcher_cfg);
 
     /* Compute distance to original centroids using original query */
     std::vector<Candidate> centroid_dist(nprobe);
-    this->initer_->centroids_distances(ori_query, nprobe, searcher_cfg.dist_type, centroid_dist);
-
-    utils::ResultPool KNNs(topk, searcher_cfg.dist_type == DistType::IP);
-
-    SAQSearcher<kDistType> searchers(*saq_data_.get(), searcher_cfg, ori_query);
+    this->initer_->centroids_distances(query, nprobe, searcher_cfg.dist_type, centroid_dist);
+    profiler.add(utils::SearchStage::Route, t_begin);
 
-    // LOG(INFO) << "Searching clusters";
-    for (size_t i = 0; i < nprobe; ++i) {
-        PID cid = centroid_dist[i].id;
-        searchers.searchCluster(&parallel_clusters_[cid], KNNs);
-    }
-
-    KNNs.copy_results(results);
-    if (runtime_metrics) {
-        *runtime_metrics = searchers.getRuntimeMetrics();
+    const bool greater = searcher_cfg.dist_type == DistType::IP;
+    utils::ResultPool KNNs(topk, greater);
+    search_probed<kDistType, Profiler>(query, centroid_dist, searcher_cfg, KNNs, runtime_metrics, profiler.profile());
+    copy_pool(KNNs, greater, results, distances);
+    if constexpr (Profiler::kEnabled) {
+        profiler.profile()->num_queries = 1;
+        profiler.profile()->total_cycles = profiler.now() - t_begin;
+        if (profile) {
+            profile->merge(*profiler.profile());
+        }
     }
 
     // if (FLAGS_DEBUG) {
@@ -310,21 +1061,259 @@ inline void IVF::search(const Eigen::RowVectorXf &__restrict__ ori_query, size_t
     // }
 }
 
+template <DistType kDistType>
+inline void IVF::search_batch(const Eigen::Ref<const FloatRowMat> &queries, size_t topk, size_t nprobe,
+                              SearcherConfig searcher_cfg, PID *__restrict__ results, float *distances,
+                              QueryRuntimeMetrics *runtime_metrics)
+{
+    CHECK_EQ(queries.cols(), num_dim_);
+    const size_t num_queries = queries.rows();
+    FloatRowMat mapped;
+    if (pca_ && searcher_cfg.apply_pca) {
+        pca_->transform(queries, mapped, searcher_cfg.dist_type != DistType::IP); // one GEMM for the batch
+    }
+    const Eigen::Ref<const FloatRowMat> batch = mapped.rows() ? Eigen::Ref<const FloatRowMat>(mapped) : queries;
+
+    std::vector<std::vector<Candidate>> centroid_dists;
+    this->initer_->centroids_distances_batch(batch, nprobe, searcher_cfg.dist_type, centroid_dists);
+
+    const bool greater = searcher_cfg.dist_type == DistType::IP;
+    std::vector<utils::ResultPool> pools(num_queries, utils::ResultPool(topk, greater));
+    if (lazy_ || tiered_ || !node_pools_.empty()) {
+        for (size_t i = 0; i < num_queries; ++i) {
+            search_probed<kDistType>(batch.row(i), centroid_dists[i], searcher_cfg, pools[i],
+                                     runtime_metrics ? &runtime_metrics[i] : nullptr);
+        }
+        copy_pools(pools, greater, results, distances);
+        return;
+    }
+
+    /* (probe rank, cluster, query): each query scans its clusters nearest first like search(),
+       the queries probing a cluster at the same rank scan it back to back */
+    std::vector<std::tuple<uint32_t, PID, uint32_t>> probes;
+    probes.reserve(num_queries * nprobe);
+    for (size_t i = 0; i < num_queries; ++i) {
+        for (size_t r = 0; r < centroid_dists[i].size(); ++r) {
+            probes.emplace_back(uint32_t(r), centroid_dists[i][r].id, uint32_t(i));
+        }
+    }
+    std::sort(probes.begin(), probes.end());
+
+    std::vector<std::unique_ptr<SAQSearcher<kDistType>>> searchers(num_queries);
+    std::vector<Eigen::RowVectorXf> rows(num_queries);
+    for (size_t i = 0; i < num_queries; ++i) {
+        rows[i] = batch.row(i);
+        searchers[i] = std::make_unique<SAQSearcher<kDistType>>(*saq_data_.get(), searcher_cfg, rows[i]);
+    }
+    const auto &clusters = local_clusters();
+    for (auto [rank, cid, i] : probes) {
+        searchers[i]->searchCluster(&clusters[cid], pools[i]);
+    }
+    copy_pools(pools, greater, results, distances);
+    if (runtime_metrics) {
+        for (size_t i = 0; i < num_queries; ++i) {
+            runtime_metrics[i] = searchers[i]->getRuntimeMetrics();
+        }
+    }
+}
+
+template <DistType kDistType>
+inline void IVF::search_rerank(const Eigen::RowVectorXf &__restrict__ ori_query, size_t topk, size_t nprobe,
+                               SearcherConfig searcher_cfg, const VectorStore &store, float rerank_factor,
+                               PID *__restrict__ results, float *__restrict__ distances,
+                               QueryRuntimeMetrics *runtime_metrics)
+{
+    CHECK_EQ(ori_query.cols(), num_dim_);
+    CHECK_EQ(store.dim(), num_dim_) << "Vector store dimension mismatch";
+    const auto &query = transform_query(ori_query, searcher_cfg);
+
+    std::vector<Candidate> centroid_dist(nprobe);
+    this->initer_->centroids_distances(query, nprobe, searcher_cfg.dist_type, centroid_dist);
+
+    const bool greater = searcher_cfg.dist_type == DistType::IP;
+    const size_t num_cand = std::max(topk, static_cast<size_t>(std::ceil(topk * rerank_factor)));
+    utils::ResultPool candidates(num_cand, greater);
+    search_probed<kDistType>(query, centroid_dist, searcher_cfg, candidates, runtime_metrics);
+
+    utils::StopW stopw;
+    std::vector<PID> ids(candidates.size());
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ids[i] = candidates.get(i).first;
+    }
+    utils::ResultPool KNNs(topk, greater);
+    store.rerank(ori_query.data(), ids.data(), ids.size(), searcher_cfg.dist_type, KNNs);
+    copy_pool(KNNs, greater, results, distances);
+    if (runtime_metrics) {
+        runtime_metrics->rerank_cnt = ids.size();
+        runtime_metrics->rerank_ns = stopw.getElapsedTimeNano();
+    }
+}
+
+template <DistType kDistType, typename Profiler>
+inline void IVF::search_probed(const Eigen::RowVectorXf &query, const std::vector<Candidate> &centroid_dist,
+                               const SearcherConfig &searcher_cfg, utils::ResultPool &KNNs,
+                               QueryRuntimeMetrics *runtime_metrics, utils::SearchProfile *profile)
+{
+    if (tiered_) {
+        search_tiered<kDistType>(query, centroid_dist, searcher_cfg, KNNs, runtime_metrics);
+        return;
+    }
+
+    using Searcher = SAQSearcher<kDistType, Profiler>;
+    auto add_profile = [profile](Searcher &searcher) {
+        if constexpr (Profiler::kEnabled) {
+            if (profile) {
+                profile->merge(*searcher.getProfile());
+            }
+        }
+    };
+    Searcher searchers(*saq_data_.get(), searcher_cfg, query);
+
+    if (lazy_) {
+        size_t hits = 0;
+        for (const auto &cand : centroid_dist) {
+            bool hit = false;
+            auto cluster = lazy_->get(cand.id, &hit); // pinned until scanned
+            searchers.searchCluster(cluster.get(), KNNs);
+            hits += hit;
+        }
+        add_profile(searchers);
+        if (runtime_metrics) {
+            *runtime_metrics = searchers.getRuntimeMetrics();
+            runtime_metrics->cluster_hits = hits;
+            runtime_metrics->cluster_misses = centroid_dist.size() - hits;
+        }
+        return;
+    }
+
+    if (node_pools_.empty()) {
+        const auto &clusters = local_clusters();
+        for (const auto &cand : centroid_dist) {
+            searchers.searchCluster(&clusters[cand.id], KNNs);
+        }
+        add_profile(searchers);
+        if (runtime_metrics) {
+            *runtime_metrics = searchers.getRuntimeMetrics();
+        }
+        return;
+    }
+
+    /* NumaMode::Partition: clusters of other nodes are scanned by workers of those nodes */
+    const size_t topk = KNNs.capacity();
+    const bool greater = searcher_cfg.dist_type == DistType::IP;
+    const int local = topo_.current_node();
+    std::vector<std::vector<PID>> node_cids(node_pools_.size());
+    for (const auto &cand : centroid_dist) {
+        node_cids[cluster_node_[cand.id]].push_back(cand.id);
+    }
+    std::vector<std::future<std::pair<utils::ResultPool, QueryRuntimeMetrics>>> remote;
+    std::vector<utils::SearchProfile> node_profiles(Profiler::kEnabled ? node_pools_.size() : 0);
+    for (size_t n = 0; n < node_pools_.size(); ++n) {
+        if ((int)n == local || node_cids[n].empty()) {
+            continue;
+        }
+        remote.push_back(node_pools_[n]->submit_task([&, n] {
+            utils::ResultPool pool(topk, greater);
+            Searcher node_searcher(*saq_data_.get(), searcher_cfg, query);
+            for (auto cid : node_cids[n]) {
+                node_searcher.searchCluster(&parallel_clusters_[cid], pool);
+            }
+            if constexpr (Profiler::kEnabled) {
+                node_profiles[n] = *node_searcher.getProfile();
+            }
+            return std::make_pair(std::move(pool), node_searcher.getRuntimeMetrics());
+        }));
+    }
+    for (auto cid : node_cids[local]) {
+        searchers.searchCluster(&parallel_clusters_[cid], KNNs);
+    }
+    add_profile(searchers);
+    QueryRuntimeMetrics metrics = searchers.getRuntimeMetrics();
+    for (auto &f : remote) {
+        auto [pool, node_metrics] = f.get();
+        KNNs.merge(pool);
+        metrics.merge(node_metrics);
+    }
+    if (profile) {
+        for (const auto &node_profile : node_profiles) {
+            profile->merge(node_profile);
+        }
+    }
+    if (runtime_metrics) {
+        *runtime_metrics = metrics;
+    }
+}
+
+/**
+ * @brief Search of tiered clusters, in two phases per chunk of blocks
+ *
+ * The fast scan of a chunk collects candidates whose long data is then fetched on the I/O
+ * threads, while the fast scan of the next chunk runs. Chunks keep the k-th distance used to
+ * collect candidates close to the one of an in-memory scan. Two searchers take turns by
+ * cluster, so each keeps the state of its cluster until its last chunk is refined.
+ */
+template <DistType kDistType>
+inline void IVF::search_tiered(const Eigen::RowVectorXf &query, const std::vector<Candidate> &centroid_dist,
+                               const SearcherConfig &searcher_cfg, utils::ResultPool &KNNs,
+                               QueryRuntimeMetrics *runtime_metrics)
+{
+    constexpr size_t kChunkBlocks = 8;
+    struct Chunk {
+        PID cid;
+        size_t searcher, blk_begin, blk_end;
+    };
+    std::vector<Chunk> chunks;
+    size_t num_scanned = 0; // empty clusters do not take a turn
+    for (const auto &cand : centroid_dist) {
+        const size_t num_blocks = parallel_clusters_[cand.id].num_blocks_;
+        for (size_t b = 0; b < num_blocks; b += kChunkBlocks) {
+            chunks.push_back({cand.id, num_scanned % 2, b, std::min(b + kChunkBlocks, num_blocks)});
+        }
+        num_scanned += num_blocks > 0;
+    }
+
+    SAQSearcher<kDistType> searchers[2] = {{*saq_data_, searcher_cfg, query}, {*saq_data_, searcher_cfg, query}};
+    TieredCandidates cands[2];
+    std::future<void> pending;
+    for (size_t i = 0; i <= chunks.size(); ++i) {
+        std::future<void> fetching;
+        if (i < chunks.size()) {
+            const auto &chunk = chunks[i];
+            searchers[chunk.searcher].collectBlocks(&parallel_clusters_[chunk.cid], chunk.blk_begin, chunk.blk_end,
+                                                    KNNs.distk(), cands[i % 2]);
+            fetching = tiered_->fetch_async(chunk.cid, cands[i % 2]);
+        }
+        if (i > 0) {
+            pending.get();
+            searchers[chunks[i - 1].searcher].refineCluster(cands[(i - 1) % 2], KNNs);
+        }
+        pending = std::move(fetching);
+    }
+    if (runtime_metrics) {
+        *runtime_metrics = searchers[0].getRuntimeMetrics();
+        runtime_metrics->merge(searchers[1].getRuntimeMetrics());
+    }
+}
+
 template <DistType kDistType>
 inline void IVF::estimate(const Eigen::RowVectorXf &__restrict__ ori_query, size_t nprobe,
                           SearcherConfig searcher_cfg,
                           std::vector<std::pair<PID, float>> &dist_list, std::vector<float> *fast_dist_list, std::vector<float> *vars_dist_list, QueryRuntimeMetrics *runtime_metrics)
 {
     CHECK_EQ(ori_query.cols(), num_dim_);
+    CHECK(!tiered_) << "estimate() needs the long codes in memory";
+    const auto &query = transform_query(ori_query, searcher_cfg);
 
     /* Compute distance to original centroids using original query */
     std::vector<Candidate> centroid_dist(nprobe);
-    this->initer_->centroids_distances(ori_query, nprobe, searcher_cfg.dist_type, centroid_dist);
+    this->initer_->centroids_distances(query, nprobe, searcher_cfg.dist_type, centroid_dist);
 
-    SaqCluEstimator<kDistType> estimator(*saq_data_.get(), searcher_cfg, ori_query);
+    SaqCluEstimator<kDistType> estimator(*saq_data_.get(), searcher_cfg, query);
+    const auto &clusters = local_clusters();
     for (size_t j = 0; j < nprobe; ++j) {
         PID cid = centroid_dist[j].id;
-        const auto &pcluster = parallel_clusters_[cid];
+        ClusterCache::ClusterPtr pinned = lazy_ ? lazy_->get(cid) : nullptr;
+        const auto &pcluster = lazy_ ? *pinned : clusters[cid];
 
         // Prepare estimator for this cluster
         estimator.prepare(&pcluster);
@@ -343,7 +1332,7 @@ inline void IVF::estimate(const Eigen::RowVectorXf &__restrict__ ori_query, size
                 _mm512_store_ps(vardist_t + 16, t[1]);
             }
 
-            PID data_id = pcluster.ids()[vec_idx];
+            PID data_id = pcluster.id(vec_idx);
             float est_dist = estimator.compAccurateDist(vec_idx);
 
             dist_list.emplace_back(data_id, est_dist);
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <fmt/core.h>
+
+#include "quantization/cluster_data.hpp"
+
+namespace saqlib {
+/**
+ * @brief Memory held by an index, see IVF::memory_report()
+ */
+struct MemoryReport {
+    struct Section {
+        std::string name;
+        size_t bytes = 0;
+        size_t padding = 0; // part of `bytes` spent on alignment
+    };
+
+    struct Segment {
+        size_t num_dim = 0; // padded dimensions of the segment
+        size_t num_bits = 0;
+        SegmentMemory memory; // summed over the clusters in memory
+    };
+
+    size_t num_data = 0;
+    std::vector<Section> sections;
+    std::vector<Segment> segments;      // one per entry of the quantization plan
+    std::vector<size_t> cluster_sizes;  // number of vectors of each cluster
+    size_t padding_vectors = 0;         // vectors padding the last block of the clusters
+
+    size_t total() const {
+        size_t bytes = 0;
+        for (const auto &s : sections) {
+            bytes += s.bytes;
+        }
+        return bytes;
+    }
+
+    std::string toString() const {
+        const double n = std::max<size_t>(num_data, 1);
+        std::string str = fmt::format("Index memory: {:.2f} MiB for {} vectors, {:.1f} bytes per vector\n",
+                                      total() / 1048576.0, num_data, total() / n);
+        str += fmt::format("  {:<22}{:>12}{:>12}{:>12}\n", "section", "MiB", "B/vector", "padding");
+        for (const auto &s : sections) {
+            str += fmt::format("  {:<22}{:>12.2f}{:>12.2f}{:>11.1f}%\n", s.name, s.bytes / 1048576.0, s.bytes / n,
+                               s.bytes ? 100.0 * s.padding / s.bytes : 0.0);
+        }
+
+        str += fmt::format("  {:<8}{:>6}{:>6}{:>14}{:>14}{:>14}{:>14}{:>12}\n", "segment", "dims", "bits",
+                           "short_codes", "short_fac", "long_codes", "long_fac", "B/vector");
+        for (size_t i = 0; i < segments.size(); ++i) {
+            const auto &m = segments[i].memory;
+            str += fmt::format("  {:<8}{:>6}{:>6}{:>14}{:>14}{:>14}{:>14}{:>12.2f}\n", i, segments[i].num_dim,
+                               segments[i].num_bits, m.short_codes, m.short_factors, m.long_codes, m.long_factors,
+                               m.total() / n);
+        }
+
+        if (cluster_sizes.empty()) {
+            return str;
+        }
+        auto sizes = cluster_sizes;
+        std::sort(sizes.begin(), sizes.end());
+        auto pct = [&](double p) { return sizes[std::min(sizes.size() - 1, size_t(p * sizes.size()))]; };
+        str += fmt::format("  clusters: {}, {} empty, sizes min {} p50 {} p90 {} p99 {} max {}, "
+                           "{} padding vectors ({:.2f}%)\n",
+                           sizes.size(), std::count(sizes.begin(), sizes.end(), size_t(0)), sizes.front(), pct(0.5),
+                           pct(0.9), pct(0.99), sizes.back(), padding_vectors, 100.0 * padding_vectors / n);
+        // clusters by size, in power of two buckets
+        std::vector<size_t> buckets;
+        for (auto size : sizes) {
+            const size_t b = size ? 64 - __builtin_clzll(size) : 0;
+            buckets.resize(std::max(buckets.size(), b + 1), 0);
+            buckets[b] += 1;
+        }
+        str += "  cluster size histogram:";
+        for (size_t b = 0; b < buckets.size(); ++b) {
+            if (buckets[b]) {
+                str += b ? fmt::format(" [{}, {}): {}", size_t(1) << (b - 1), size_t(1) << b, buckets[b])
+                         : fmt::format(" 0: {}", buckets[b]);
+            }
+        }
+        return str + "\n";
+    }
+};
+} // namespace saqlib
@@ -0,0 +1,446 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "glog/logging.h"
+#include <fmt/core.h>
+
+#include "defines.hpp"
+#include "index/index_file.hpp"
+#include "index/initializer.hpp"
+#include "index/ivf.hpp"
+#include "quantization/config.h"
+#include "quantization/saq_data.hpp"
+#include "utils/BS_thread_pool.hpp"
+#include "utils/crc32c.hpp"
+#include "utils/pool.hpp"
+
+namespace saqlib
+{
+/**
+ * @brief How the vectors of a ShardedIVF are split
+ */
+enum class ShardMode : uint32_t {
+    Cluster = 0, // each shard holds a range of clusters with all their vectors
+    Id = 1,      // each shard holds a range of vector ids, from every cluster
+};
+
+/**
+ * @brief IVF index split into shards that are built, saved and loaded independently
+ *
+ * All shards quantize with one SaqData (plan and rotators), so their distances are comparable
+ * and their results merge directly. Each shard is a complete IVF whose clusters store the
+ * global ids of their vectors:
+ * - ShardMode::Cluster: shard s holds clusters [begin, end), with their centroids.
+ * - ShardMode::Id: shard s holds the vectors with ids in [begin, end), in all clusters.
+ *
+ * A manifest file keeps the global centroids, the shared SaqData and the shard table. Shard s
+ * is an ordinary index file named shard_filename(manifest, s). Builds can be spread over
+ * machines: prepare() and save_manifest() once, then load_manifest(), construct_shard() and
+ * save_shard() on each machine.
+ *
+ * search() probes the global centroids once and fans the probed clusters out to the shards.
+ * Queries are in the index space, PCA is not applied.
+ */
+class ShardedIVF
+{
+  public:
+    static constexpr uint64_t kManifestMagic = kManifestFileMagic;
+
+    struct ShardInfo {
+        uint64_t begin;    // first cluster (ShardMode::Cluster) or vector id (ShardMode::Id)
+        uint64_t end;      // one past the last
+        uint64_t num_data; // vectors in the shard
+    };
+
+  private:
+    size_t num_data_ = 0;
+    size_t num_dim_ = 0;
+    size_t num_cen_ = 0;
+    ShardMode mode_ = ShardMode::Cluster;
+    QuantizeConfig cfg_;
+    std::unique_ptr<FlatInitializer> initer_; // global centroids, probed by search()
+    std::shared_ptr<SaqData> saq_data_;       // shared by all shards
+    uint32_t quant_crc_ = 0;                  // CRC32C of the saved saq_data_, checked against the shard files
+    std::vector<ShardInfo> shards_;
+    std::vector<uint32_t> cluster_shard_;     // ShardMode::Cluster, shard of each cluster
+    //  ======= Presistence data above  =======
+    std::vector<std::unique_ptr<IVF>> ivfs_; // nullptr for shards not built or loaded
+    std::unique_ptr<BS::thread_pool<>> pool_; // fan-out of search(), nullptr searches on the calling thread
+    std::string manifest_;                    // file of the last load_manifest()
+
+    void set_saq_data(std::shared_ptr<SaqData> data)
+    {
+        saq_data_ = std::move(data);
+        std::ostringstream os;
+        saq_data_->save(os);
+        const auto bytes = std::move(os).str();
+        quant_crc_ = utils::crc32c(bytes.data(), bytes.size());
+    }
+
+    void index_shards()
+    {
+        ivfs_.resize(shards_.size());
+        cluster_shard_.clear();
+        if (mode_ == ShardMode::Cluster) {
+            cluster_shard_.resize(num_cen_);
+            for (size_t s = 0; s < shards_.size(); ++s) {
+                std::fill(cluster_shard_.begin() + shards_[s].begin, cluster_shard_.begin() + shards_[s].end, s);
+            }
+        }
+        if (!pool_) {
+            set_search_threads(std::min<size_t>(shards_.size(), std::thread::hardware_concurrency()));
+        }
+    }
+
+  public:
+    explicit ShardedIVF() = default;
+
+    /**
+     * @param num_shards shards to split the index into, at most `k` for ShardMode::Cluster
+     */
+    explicit ShardedIVF(size_t n, size_t num_dim, size_t k, QuantizeConfig cfg, size_t num_shards,
+                        ShardMode mode = ShardMode::Cluster)
+        : num_data_(n), num_dim_(num_dim), num_cen_(k), mode_(mode), cfg_(std::move(cfg)), shards_(num_shards)
+    {
+        CHECK_GT(num_shards, 0u);
+        CHECK(mode_ != ShardMode::Cluster || num_shards <= k) << "More shards than clusters";
+    }
+    ShardedIVF(const ShardedIVF &) = delete;
+
+    auto num_data() const { return num_data_; }
+    auto num_dim() const { return num_dim_; }
+    auto k() const { return num_cen_; }
+    auto mode() const { return mode_; }
+    size_t num_shards() const { return shards_.size(); }
+    const ShardInfo &shard_info(size_t s) const { return shards_[s]; }
+    const SaqData *get_saq_data() const { return saq_data_.get(); }
+
+    /**
+     * @brief The quantization data of the shards, e.g. for IVF::set_saq_data() of an index to
+     * compare with
+     */
+    std::shared_ptr<SaqData> shared_saq_data() const { return saq_data_; }
+
+    /**
+     * @brief The index of shard `s`, nullptr if it is not built or loaded
+     */
+    const IVF *shard(size_t s) const { return ivfs_[s].get(); }
+
+    static std::string shard_filename(const std::string &manifest, size_t s)
+    {
+        return fmt::format("{}.shard{}", manifest, s);
+    }
+
+    /**
+     * @brief Threads scanning the shards of one query. 0 scans them on the calling thread.
+     */
+    void set_search_threads(size_t num_threads)
+    {
+        pool_ = num_threads ? std::make_unique<BS::thread_pool<>>(num_threads) : nullptr;
+    }
+
+    /**
+     * @brief Make the shared quantization data and split the index into shards
+     *
+     * @param data vectors, or a sample of them, to compute the variance from
+     * @param cluster_ids cluster of each of the `n` vectors, to balance ShardMode::Cluster shards
+     */
+    void prepare(const FloatRowMat &data, const FloatRowMat &centroids, const PID *cluster_ids)
+    {
+        CHECK_EQ(static_cast<size_t>(centroids.rows()), num_cen_);
+        initer_ = std::make_unique<FlatInitializer>(num_dim_, num_cen_);
+        initer_->set_centroids(centroids);
+
+        auto cfg = cfg_;
+        if (cfg.planner.avg_cluster_size <= 0) {
+            cfg.planner.avg_cluster_size = float(num_data_) / num_cen_;
+        }
+        SaqDataMaker maker(cfg, num_dim_);
+        maker.compute_variance(data);
+        set_saq_data(maker.return_data());
+
+        /* Cut the clusters, or the ids, into ranges of about the same number of vectors */
+        const size_t num_shards = shards_.size();
+        std::vector<size_t> sizes(num_cen_, 0);
+        for (size_t i = 0; i < num_data_; ++i) {
+            CHECK_LT(cluster_ids[i], num_cen_) << "Bad cluster id";
+            sizes[cluster_ids[i]] += 1;
+        }
+        if (mode_ == ShardMode::Id) {
+            for (size_t s = 0; s < num_shards; ++s) {
+                shards_[s] = {num_data_ * s / num_shards, num_data_ * (s + 1) / num_shards, 0};
+                shards_[s].num_data = shards_[s].end - shards_[s].begin;
+            }
+        } else {
+            size_t cid = 0, acc = 0;
+            for (size_t s = 0; s < num_shards; ++s) {
+                shards_[s] = {cid, cid, 0};
+                const size_t target = num_data_ * (s + 1) / num_shards;
+                // leave at least one cluster to each of the following shards
+                while (cid < num_cen_ - (num_shards - s - 1) && (cid == shards_[s].begin || acc < target ||
+                                                                s + 1 == num_shards)) {
+                    acc += sizes[cid];
+                    shards_[s].num_data += sizes[cid];
+                    ++cid;
+                }
+                shards_[s].end = cid;
+            }
+        }
+        index_shards();
+        for (size_t s = 0; s < num_shards; ++s) {
+            LOG(INFO) << fmt::format("Shard {}: [{}, {}) {}, {} vectors", s, shards_[s].begin, shards_[s].end,
+                                     mode_ == ShardMode::Cluster ? "clusters" : "ids", shards_[s].num_data);
+        }
+    }
+
+    /**
+     * @brief Build shard `s` with the shared quantization data
+     *
+     * @param data all vectors, rows are indexed by global id
+     * @param cluster_ids cluster of each vector
+     */
+    void construct_shard(size_t s, const FloatRowMat &data, const PID *cluster_ids, int num_threads = 64)
+    {
+        CHECK(saq_data_) << "prepare() or load_manifest() first";
+        CHECK_LT(s, shards_.size());
+        const auto &info = shards_[s];
+        const bool by_cluster = mode_ == ShardMode::Cluster;
+        const size_t num_cen = by_cluster ? info.end - info.begin : num_cen_;
+
+        std::vector<std::vector<PID>> id_lists(num_cen);
+        const size_t id_begin = by_cluster ? 0 : info.begin;
+        const size_t id_end = by_cluster ? num_data_ : info.end;
+        for (size_t i = id_begin; i < id_end; ++i) {
+            const PID cid = cluster_ids[i];
+            if (!by_cluster) {
+                id_lists[cid].push_back((PID)i);
+            } else if (cid >= info.begin && cid < info.end) {
+                id_lists[cid - info.begin].push_back((PID)i);
+            }
+        }
+        size_t num_data = 0;
+        for (const auto &ids : id_lists) {
+            num_data += ids.size();
+        }
+        CHECK_EQ(num_data, info.num_data) << "Cluster ids differ from the ones given to prepare()";
+
+        FloatRowMat centroids = initer_->centroids().middleRows(by_cluster ? info.begin : 0, num_cen);
+        ivfs_[s] = std::make_unique<IVF>(num_data, num_dim_, num_cen, cfg_);
+        ivfs_[s]->set_saq_data(saq_data_);
+        ivfs_[s]->construct(data, centroids, id_lists, num_threads);
+    }
+
+    /**
+     * @brief prepare() and build all shards
+     */
+    void construct(const FloatRowMat &data, const FloatRowMat &centroids, const PID *cluster_ids, int num_threads = 64)
+    {
+        prepare(data, centroids, cluster_ids);
+        for (size_t s = 0; s < shards_.size(); ++s) {
+            construct_shard(s, data, cluster_ids, num_threads);
+        }
+    }
+
+    void save_manifest(const char *filename) const
+    {
+        CHECK(saq_data_) << "ShardedIVF not prepared";
+        IndexFileHeader header;
+        header.magic = kManifestMagic;
+        header.version = IVF::kIndexVersion;
+        header.num_data = num_data_;
+        header.num_dim = num_dim_;
+        header.num_cen = num_cen_;
+        IndexFileWriter writer(filename, header, 3);
+        writer.add(IndexSection::Centroids, 0, [&](std::ostream &os) { initer_->save(os, filename); });
+        writer.add(IndexSection::QuantData, 0, [&](std::ostream &os) { saq_data_->save(os); });
+        writer.add(IndexSection::Shards, 0, [&](std::ostream &os) {
+            const uint32_t mode = static_cast<uint32_t>(mode_);
+            const uint64_t num_shards = shards_.size();
+            os.write((const char *)&mode, sizeof(uint32_t));
+            os.write((const char *)&quant_crc_, sizeof(uint32_t));
+            os.write((const char *)&num_shards, sizeof(uint64_t));
+            os.write((const char *)shards_.data(), sizeof(ShardInfo) * num_shards);
+        });
+        writer.finish();
+    }
+
+    /**
+     * @brief Save shard `s` to shard_filename(manifest, s)
+     */
+    void save_shard(size_t s, const char *manifest) const
+    {
+        CHECK(ivfs_[s]) << fmt::format("Shard {} is not built or loaded", s);
+        ivfs_[s]->save(shard_filename(manifest, s).c_str());
+    }
+
+    void save(const char *manifest) const
+    {
+        save_manifest(manifest);
+        for (size_t s = 0; s < shards_.size(); ++s) {
+            save_shard(s, manifest);
+        }
+    }
+
+    /**
+     * @brief Load the manifest only, the shards are left unloaded
+     */
+    void load_manifest(const char *filename)
+    {
+        IndexFileReader file(filename);
+        CHECK_EQ(file.header().magic, kManifestMagic) << filename << " is not a sharded index manifest";
+        num_data_ = file.header().num_data;
+        num_dim_ = file.header().num_dim;
+        num_cen_ = file.header().num_cen;
+        {
+            auto buf = file.read(IndexSection::Centroids);
+            MemoryIStream is(buf);
+            initer_ = std::make_unique<FlatInitializer>(num_dim_, num_cen_);
+            initer_->load(is, filename);
+        }
+        {
+            auto buf = file.read(IndexSection::QuantData);
+            MemoryIStream is(buf);
+            auto data = std::make_shared<SaqData>();
+            data->load(is);
+            cfg_ = data->cfg;
+            set_saq_data(std::move(data));
+        }
+        auto buf = file.read(IndexSection::Shards);
+        uint32_t mode = 0, crc = 0;
+        uint64_t num_shards = 0;
+        CHECK_GE(buf.size(), 16u) << filename << ": truncated shard table";
+        std::memcpy(&mode, buf.data(), sizeof(uint32_t));
+        std::memcpy(&crc, buf.data() + 4, sizeof(uint32_t));
+        std::memcpy(&num_shards, buf.data() + 8, sizeof(uint64_t));
+        CHECK(num_shards == (buf.size() - 16) / sizeof(ShardInfo) && (buf.size() - 16) % sizeof(ShardInfo) == 0)
+            << fmt::format("{}: shard table of {} bytes for {} shards", filename, buf.size(), num_shards);
+        CHECK_EQ(crc, quant_crc_);
+        CHECK(mode == static_cast<uint32_t>(ShardMode::Cluster) || mode == static_cast<uint32_t>(ShardMode::Id))
+            << filename << ": unknown shard mode " << mode;
+        mode_ = static_cast<ShardMode>(mode);
+        shards_.resize(num_shards);
+        std::memcpy(shards_.data(), buf.data() + 16, sizeof(ShardInfo) * num_shards);
+        const size_t limit = mode_ == ShardMode::Cluster ? num_cen_ : num_data_;
+        for (size_t s = 0; s < num_shards; ++s) {
+            CHECK(shards_[s].begin <= shards_[s].end && shards_[s].end <= limit)
+                << fmt::format("{}: shard {} covers [{}, {}), beyond the {} {}", filename, s, shards_[s].begin,
+                               shards_[s].end, limit, mode_ == ShardMode::Cluster ? "clusters" : "vectors");
+        }
+        ivfs_.clear();
+        index_shards();
+        manifest_ = filename;
+    }
+
+    /**
+     * @brief Load, or reload, shard `s` from the files next to the last loaded manifest. Not
+     * to be called while searching.
+     */
+    void load_shard(size_t s, StorageConfig storage = {}, size_t num_threads = 0)
+    {
+        CHECK(!manifest_.empty()) << "load_manifest() first";
+        CHECK_LT(s, shards_.size());
+        const auto filename = shard_filename(manifest_, s);
+        {
+            IndexFileReader file(filename.c_str());
+            const auto *quant = file.find(IndexSection::QuantData);
+            CHECK(quant && quant->crc == quant_crc_)
+                << filename << " is not quantized with the data of " << manifest_;
+            CHECK_EQ(file.header().num_data, shards_[s].num_data) << filename << " does not match the manifest";
+        }
+        auto ivf = std::make_unique<IVF>();
+        ivf->load(filename.c_str(), storage, nullptr, num_threads);
+        ivf->set_saq_data(saq_data_); // same bytes, drop the copy
+        ivfs_[s] = std::move(ivf);
+    }
+
+    void load(const char *manifest, StorageConfig storage = {}, size_t num_threads = 0)
+    {
+        load_manifest(manifest);
+        for (size_t s = 0; s < shards_.size(); ++s) {
+            load_shard(s, storage, num_threads);
+        }
+    }
+
+    template <DistType kDistType = DistType::Any>
+    void search(const Eigen::RowVectorXf &__restrict__ query, size_t topk, size_t nprobe,
+                SearcherConfig searcher_cfg, PID *__restrict__ results,
+                QueryRuntimeMetrics *runtime_metrics = nullptr);
+};
+
+/**
+ * @brief Search all shards for the k nearest neighbors
+ *
+ * The probed clusters keep their order within each shard. With a thread pool, the other
+ * shards are submitted to the pool first, each into its own ResultPool, then the first
+ * shard is scanned by the calling thread and the pools are merged at the end.
+ */
+template <DistType kDistType>
+inline void ShardedIVF::search(const Eigen::RowVectorXf &__restrict__ query, size_t topk, size_t nprobe,
+                               SearcherConfig searcher_cfg, PID *__restrict__ results,
+                               QueryRuntimeMetrics *runtime_metrics)
+{
+    CHECK_EQ(query.cols(), num_dim_);
+    std::vector<Candidate> centroid_dist(nprobe);
+    initer_->centroids_distances(query, nprobe, searcher_cfg.dist_type, centroid_dist);
+
+    const size_t num_shards = shards_.size();
+    std::vector<std::vector<Candidate>> probes(num_shards);
+    for (const auto &cand : centroid_dist) {
+        if (mode_ == ShardMode::Cluster) {
+            const auto s = cluster_shard_[cand.id];
+            probes[s].emplace_back(cand.id - shards_[s].begin, cand.distance);
+        } else {
+            for (auto &p : probes) {
+                p.push_back(cand);
+            }
+        }
+    }
+
+    const bool greater = searcher_cfg.dist_type == DistType::IP;
+    utils::ResultPool KNNs(topk, greater);
+    QueryRuntimeMetrics metrics;
+    std::vector<std::future<std::pair<utils::ResultPool, QueryRuntimeMetrics>>> remote;
+    std::vector<size_t> local;
+    for (size_t s = 0; s < num_shards; ++s) {
+        if (probes[s].empty()) {
+            continue;
+        }
+        CHECK(ivfs_[s]) << fmt::format("Shard {} is not loaded", s);
+        if (!pool_ || local.empty()) {
+            local.push_back(s);
+            continue;
+        }
+        remote.push_back(pool_->submit_task([&, s] {
+            utils::ResultPool pool(topk, greater);
+            QueryRuntimeMetrics shard_metrics;
+            ivfs_[s]->search_probed<kDistType>(query, probes[s], searcher_cfg, pool, &shard_metrics);
+            return std::make_pair(std::move(pool), shard_metrics);
+        }));
+    }
+    // the remote shards are all in flight before the calling thread scans its own
+    for (auto s : local) {
+        QueryRuntimeMetrics shard_metrics;
+        ivfs_[s]->search_probed<kDistType>(query, probes[s], searcher_cfg, KNNs, &shard_metrics);
+        metrics.merge(shard_metrics);
+    }
+    for (auto &f : remote) {
+        auto [pool, shard_metrics] = f.get();
+        KNNs.merge(pool);
+        metrics.merge(shard_metrics);
+    }
+    KNNs.copy_results(results);
+    if (runtime_metrics) {
+        *runtime_metrics = metrics;
+    }
+}
+} // namespace saqlib
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fmt/core.h>
+#include <glog/logging.h>
+
+#include "quantization/cluster_data.hpp"
+#include "quantization/saq_searcher.hpp"
+#include "utils/BS_thread_pool.hpp"
+#include "utils/block_cache.hpp"
+
+namespace saqlib {
+/**
+ * @brief Long codes and long factors of tiered clusters, served from the index file
+ *
+ * The clusters keep their short codes, short factors and ids in memory. The long data of the
+ * candidates of a cluster is gathered from the cluster sections of the index file through an
+ * LRU block cache, on a small pool of I/O threads so that it overlaps the scan of the next
+ * cluster.
+ */
+class TieredLongStore {
+    utils::BlockCache cache_;
+    std::vector<uint64_t> cluster_offset_; // file offset of the section of each cluster
+    std::unique_ptr<BS::thread_pool<>> io_pool_; // nullptr fetches on the query thread
+
+  public:
+    /**
+     * @param cluster_offset file offset of the data written by SaqCluData::save() for each cluster
+     * @param cache_bytes memory for cached blocks of the file
+     * @param io_threads threads issuing reads, shared by all queries. 0 reads on the query
+     * threads, which saves a hand-off per fetch when the cache holds the working set.
+     */
+    TieredLongStore(const char *filename, std::vector<uint64_t> cluster_offset, size_t cache_bytes,
+                    size_t io_threads)
+        : cache_(filename, cache_bytes), cluster_offset_(std::move(cluster_offset)) {
+        if (io_threads) {
+            io_pool_ = std::make_unique<BS::thread_pool<>>(io_threads);
+        }
+    }
+
+    /**
+     * @brief Fill `cands.records` with the long data of the candidates of cluster `cid`
+     */
+    void fetch(size_t cid, TieredCandidates &cands) {
+        const auto *clu = cands.cluster;
+        const size_t rec_bytes = clu->long_record_bytes();
+        cands.records.resize(cands.size() * rec_bytes);
+
+        std::vector<utils::BlockCache::Request> reqs;
+        reqs.reserve(cands.size() * (clu->num_segments_ + 1));
+        for (size_t k = 0; k < cands.size(); ++k) {
+            uint8_t *rec = cands.records.data() + k * rec_bytes;
+            clu->long_ranges(cands.idx[k], [&](size_t pos, size_t bytes, size_t rec_offset) {
+                reqs.push_back({cluster_offset_[cid] + pos, bytes, rec + rec_offset});
+            });
+        }
+        cache_.read_batch(reqs, &cands.block_hits, &cands.block_misses);
+    }
+
+    /**
+     * @brief fetch() on the I/O threads. `cands` must stay alive until the future is ready.
+     */
+    std::future<void> fetch_async(size_t cid, TieredCandidates &cands) {
+        if (io_pool_) {
+            return io_pool_->submit_task([this, cid, &cands] { fetch(cid, cands); });
+        }
+        std::promise<void> done;
+        fetch(cid, cands);
+        done.set_value();
+        return done.get_future();
+    }
+
+    const utils::BlockCache &cache() const { return cache_; }
+    utils::BlockCache &cache() { return cache_; }
+
+    std::string toString() const {
+        const size_t total = cache_.hits() + cache_.misses();
+        return fmt::format("block cache {:.1f} MiB, {} hits, {} misses ({:.1f}% hit rate), {} I/O threads",
+                           cache_.capacity_bytes() / 1048576.0, cache_.hits(), cache_.misses(),
+                           total ? 100.0 * cache_.hits() / total : 0.0, io_pool_ ? io_pool_->get_thread_count() : 0);
+    }
+};
+} // namespace saqlib
@@ -0,0 +1,291 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <immintrin.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "defines.hpp"
+#include "utils/IO.hpp"
+#include "utils/half.hpp"
+#include "utils/pool.hpp"
+
+namespace saqlib {
+enum class StoreType : uint8_t {
+    Fp32 = 0,
+    Fp16 = 1,
+    Int8 = 2, // symmetric, one float scale per vector
+};
+
+/**
+ * @brief Full-precision vectors read through a memory map, for exact re-ranking
+ *
+ * Opens a store file written by write(), or a .fvecs/.fbin file in place as an fp32 store.
+ * Rows are fetched at random, so rerank() prefetches the rows of the next candidates while
+ * computing the distance of the current one.
+ */
+class VectorStore {
+    static constexpr char kMagic[8] = {'S', 'A', 'Q', 'V', 'S', 'T', 'O', 'R'};
+    static constexpr uint32_t kVersion = 1;
+    static constexpr size_t kHeaderBytes = 64;
+    static constexpr size_t kPrefetchAhead = 8; // candidates
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t type;
+        uint64_t rows;
+        uint32_t dim;
+        uint32_t row_bytes;
+    };
+
+    std::shared_ptr<utils::MappedFile> file_;
+    utils::VecsView<float> view_; // .fvecs/.fbin opened in place
+    const char *data_ = nullptr;
+    StoreType type_ = StoreType::Fp32;
+    size_t rows_ = 0;
+    size_t dim_ = 0;
+    size_t row_bytes_ = 0;
+
+    static size_t row_bytes(StoreType type, size_t dim) {
+        switch (type) {
+        case StoreType::Fp16:
+            return dim * sizeof(uint16_t);
+        case StoreType::Int8:
+            return sizeof(float) + dim;
+        default:
+            return dim * sizeof(float);
+        }
+    }
+
+    static void encode(const float *x, size_t dim, StoreType type, char *dst) {
+        switch (type) {
+        case StoreType::Fp32:
+            std::memcpy(dst, x, dim * sizeof(float));
+            break;
+        case StoreType::Fp16:
+            for (size_t i = 0; i < dim; ++i) {
+                DCHECK_LE(std::abs(x[i]), utils::kFp16Max) << "Element " << x[i] << " is out of the fp16 range";
+                const uint16_t h = _cvtss_sh(x[i], _MM_FROUND_TO_NEAREST_INT);
+                std::memcpy(dst + i * sizeof(uint16_t), &h, sizeof(uint16_t));
+            }
+            break;
+        case StoreType::Int8: {
+            float amax = 0;
+            for (size_t i = 0; i < dim; ++i) {
+                amax = std::max(amax, std::abs(x[i]));
+            }
+            const float scale = amax > 0 ? amax / 127 : 1.0f;
+            std::memcpy(dst, &scale, sizeof(float));
+            for (size_t i = 0; i < dim; ++i) {
+                dst[sizeof(float) + i] = static_cast<int8_t>(std::lrint(std::clamp(x[i] / scale, -127.0f, 127.0f)));
+            }
+            break;
+        }
+        }
+    }
+
+#if defined(__AVX512F__)
+    // 16 elements of a row from `i` as floats, the lanes off `mask` are zero
+    template <StoreType kType>
+    static __m512 load16(const char *row, size_t i, __mmask16 mask) {
+        if constexpr (kType == StoreType::Fp32) {
+            return _mm512_maskz_loadu_ps(mask, row + i * sizeof(float));
+        } else if constexpr (kType == StoreType::Fp16) {
+            return _mm512_cvtph_ps(_mm256_maskz_loadu_epi16(mask, row + i * sizeof(uint16_t)));
+        } else {
+            return _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_maskz_loadu_epi8(mask, row + sizeof(float) + i)));
+        }
+    }
+#endif
+
+    template <StoreType kType>
+    static float element(const char *row, size_t i) {
+        if constexpr (kType == StoreType::Fp32) {
+            float v;
+            std::memcpy(&v, row + i * sizeof(float), sizeof(float));
+            return v;
+        } else if constexpr (kType == StoreType::Fp16) {
+            uint16_t h;
+            std::memcpy(&h, row + i * sizeof(uint16_t), sizeof(uint16_t));
+            return _cvtsh_ss(h);
+        } else {
+            return static_cast<int8_t>(row[sizeof(float) + i]);
+        }
+    }
+
+    template <StoreType kType, DistType kDistType>
+    float distance_impl(const float *query, const char *row) const {
+        float scale = 1.0f;
+        if constexpr (kType == StoreType::Int8) {
+            std::memcpy(&scale, row, sizeof(float));
+        }
+        float result = 0;
+#if defined(__AVX512F__)
+        const __m512 scale16 = _mm512_set1_ps(scale);
+        __m512 sum = _mm512_setzero_ps();
+        for (size_t i = 0; i < dim_; i += 16) {
+            const __mmask16 mask = dim_ - i >= 16 ? __mmask16(0xFFFF) : __mmask16((1u << (dim_ - i)) - 1);
+            const __m512 q = _mm512_maskz_loadu_ps(mask, query + i);
+            const __m512 x = load16<kType>(row, i, mask);
+            if constexpr (kDistType == DistType::IP) {
+                sum = _mm512_fmadd_ps(q, x, sum);
+            } else {
+                const __m512 t = _mm512_fnmadd_ps(scale16, x, q); // q - scale * x
+                sum = _mm512_fmadd_ps(t, t, sum);
+            }
+        }
+        result = _mm512_reduce_add_ps(sum);
+#else
+        for (size_t i = 0; i < dim_; ++i) {
+            const float x = element<kType>(row, i);
+            if constexpr (kDistType == DistType::IP) {
+                result += query[i] * x;
+            } else {
+                const float t = query[i] - scale * x;
+                result += t * t;
+            }
+        }
+#endif
+        if constexpr (kDistType == DistType::IP) {
+            result *= scale;
+        }
+        return result;
+    }
+
+    template <DistType kDistType>
+    float distance_dispatch(const float *query, const char *row) const {
+        switch (type_) {
+        case StoreType::Fp16:
+            return distance_impl<StoreType::Fp16, kDistType>(query, row);
+        case StoreType::Int8:
+            return distance_impl<StoreType::Int8, kDistType>(query, row);
+        default:
+            return distance_impl<StoreType::Fp32, kDistType>(query, row);
+        }
+    }
+
+  public:
+    VectorStore() = default;
+
+    explicit VectorStore(const char *filename) { open(filename); }
+
+    void open(const char *filename) {
+        const std::string name(filename);
+        if (utils::is_vecs_file(name) || utils::is_bin_file(name)) {
+            view_ = utils::VecsView<float>(filename);
+            file_.reset();
+            type_ = StoreType::Fp32;
+            rows_ = view_.rows();
+            dim_ = view_.cols();
+            row_bytes_ = (dim_ + (view_.contiguous() ? 0 : 1)) * sizeof(float);
+            data_ = reinterpret_cast<const char *>(view_.row(0));
+            return;
+        }
+        file_ = std::make_shared<utils::MappedFile>(filename);
+        CHECK_GE(file_->size(), kHeaderBytes) << "Vector store " << filename << " has no header";
+        Header header;
+        std::memcpy(&header, file_->data(), sizeof(header));
+        CHECK(std::memcmp(header.magic, kMagic, sizeof(kMagic)) == 0) << filename << " is not a vector store";
+        CHECK_EQ(header.version, kVersion) << "Unsupported vector store version";
+        CHECK_LE(header.type, uint32_t(StoreType::Int8)) << "Unknown vector store type";
+        type_ = static_cast<StoreType>(header.type);
+        rows_ = header.rows;
+        dim_ = header.dim;
+        row_bytes_ = header.row_bytes;
+        CHECK_EQ(row_bytes_, row_bytes(type_, dim_)) << "Bad row size in " << filename;
+        CHECK_GE(file_->size(), kHeaderBytes + rows_ * row_bytes_) << "Vector store " << filename << " is truncated";
+        data_ = file_->data() + kHeaderBytes;
+        madvise(const_cast<char *>(file_->data()), file_->size(), MADV_RANDOM); // rows are read by candidate
+    }
+
+    /**
+     * @brief Write the rows of `stream` to a store file of the given type
+     *
+     * An fp16 store of vectors with elements beyond the fp16 range is refused before anything is
+     * written, as re-ranking by clamped elements would not be exact.
+     */
+    static void write(const char *filename, utils::VectorStream &stream, StoreType type) {
+        const size_t dim = stream.cols();
+        if (type == StoreType::Fp16) {
+            float amax = 0;
+            stream.reset();
+            while (const auto *chunk = stream.next()) {
+                amax = std::max(amax, chunk->cwiseAbs().maxCoeff());
+            }
+            CHECK_LE(amax, utils::kFp16Max) << "Elements of the vectors reach " << amax
+                                     << ", out of the fp16 range, use an fp32 or int8 store";
+        }
+        Header header{};
+        std::memcpy(header.magic, kMagic, sizeof(kMagic));
+        header.version = kVersion;
+        header.type = static_cast<uint32_t>(type);
+        header.rows = stream.rows();
+        header.dim = dim;
+        header.row_bytes = row_bytes(type, dim);
+
+        std::ofstream os(filename, std::ios::binary);
+        CHECK(os.good()) << "Cannot write " << filename;
+        char header_buf[kHeaderBytes] = {};
+        std::memcpy(header_buf, &header, sizeof(header));
+        os.write(header_buf, kHeaderBytes);
+        std::vector<char> buf;
+        stream.reset();
+        while (const auto *chunk = stream.next()) {
+            buf.resize(chunk->rows() * header.row_bytes);
+            for (Eigen::Index i = 0; i < chunk->rows(); ++i) {
+                encode(&(*chunk)(i, 0), dim, type, buf.data() + i * header.row_bytes);
+            }
+            os.write(buf.data(), buf.size());
+        }
+        CHECK(os.good()) << "Cannot write " << filename;
+    }
+
+    size_t rows() const { return rows_; }
+    size_t dim() const { return dim_; }
+    StoreType type() const { return type_; }
+
+    const char *row(PID id) const {
+        DCHECK_LT(id, rows_);
+        return data_ + id * row_bytes_;
+    }
+
+    void prefetch(PID id) const {
+        const char *p = row(id);
+        for (size_t off = 0; off < row_bytes_; off += 64) {
+            _mm_prefetch(p + off, _MM_HINT_T0);
+        }
+    }
+
+    /**
+     * @brief Distance of `query` (dim() floats) to vector `id`, as stored
+     */
+    float distance(const float *query, PID id, DistType dist_type) const {
+        return dist_type == DistType::IP ? distance_dispatch<DistType::IP>(query, row(id))
+                                         : distance_dispatch<DistType::L2Sqr>(query, row(id));
+    }
+
+    /**
+     * @brief Insert the candidates `ids` into `out` with their distances to `query`
+     */
+    void rerank(const float *query, const PID *ids, size_t num, DistType dist_type, utils::ResultPool &out) const {
+        for (size_t i = 0; i < std::min(kPrefetchAhead, num); ++i) {
+            prefetch(ids[i]);
+        }
+        for (size_t i = 0; i < num; ++i) {
+            if (i + kPrefetchAhead < num) {
+                prefetch(ids[i + kPrefetchAhead]);
+            }
+            out.insert(ids[i], distance(query, ids[i], dist_type));
+        }
+    }
+};
+} // namespace saqlib
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstdint>
@@ -135,6 +136,23 @@ class CAQEncoder {
         }
     }
 
+    /**
+     * @brief Upper bound of the factors of any code of a vector with residual norm `o_l2norm`,
+     * in a segment whose centroid has norm `c_l2norm`
+     *
+     * After rescale_vmx_to1(), every coordinate of o_a is in [-1, 1] and at least delta / 2
+     * away from 0, and the initial code has cos(o, o_a) >= 1 / (2 sqrt(D)), which
+     * code_adjustment() only raises. So <c, o_a> <= sqrt(D) |c|, fac_rescale <= 2^(B+1) |o|
+     * and fac_error <= 2 sqrt(2) eps |o|^2.
+     */
+    static double factor_bound(double o_l2norm, double c_l2norm, size_t num_dim_pad, size_t num_bits) {
+        if (num_bits == 0) {
+            return o_l2norm;
+        }
+        return std::max({std::sqrt(double(num_dim_pad)) * c_l2norm, std::ldexp(o_l2norm, num_bits + 1),
+                         2 * std::sqrt(2.0) * kConstEpsilon * o_l2norm * o_l2norm});
+    }
+
     void encode(const FloatVec &o, CaqCode &caq) {
         if (num_bits_ == 0) {
             caq = CaqCode();
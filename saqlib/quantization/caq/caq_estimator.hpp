@@ -16,12 +16,33 @@
 // #include "quantization/fastscan/lut.old.hpp"
 #include "quantization/quantizer_data.hpp"
 #include "quantization/single_data.hpp"
+#include "utils/stage_profiler.hpp"
 
 namespace saqlib {
 struct QueryRuntimeMetrics {
     size_t fast_bitsum = 0;
     size_t acc_bitsum = 0;
     size_t total_comp_cnt = 0;
+    size_t long_block_hits = 0;   // tiered storage, blocks of long codes found in the cache
+    size_t long_block_misses = 0; // tiered storage, blocks of long codes read from the file
+    size_t factor_bytes = 0;      // bytes of short and long factors read
+    size_t cluster_hits = 0;      // lazy clusters, probes of clusters found in the cache
+    size_t cluster_misses = 0;    // lazy clusters, probes of clusters read from the file
+    size_t rerank_cnt = 0;        // candidates re-ranked with full-precision vectors
+    size_t rerank_ns = 0;         // time spent re-ranking
+
+    void merge(const QueryRuntimeMetrics &other) {
+        fast_bitsum += other.fast_bitsum;
+        acc_bitsum += other.acc_bitsum;
+        total_comp_cnt += other.total_comp_cnt;
+        long_block_hits += other.long_block_hits;
+        long_block_misses += other.long_block_misses;
+        factor_bytes += other.factor_bytes;
+        cluster_hits += other.cluster_hits;
+        cluster_misses += other.cluster_misses;
+        rerank_cnt += other.rerank_cnt;
+        rerank_ns += other.rerank_ns;
+    }
 };
 
 template <DistType kDistType = DistType::Any>
@@ -39,6 +60,7 @@ class CaqCluEstimator {
     float q_l2sqr_ = 0;
     Lut lut_;
     const CAQClusterData *curr_cluster_;
+    size_t factor_bytes_ = 0; // bytes of one factor of curr_cluster_
 
     QueryRuntimeMetrics runtime_statics_;
 
@@ -92,17 +114,33 @@ class CaqCluEstimator {
      * @param cur_cluster Pointer to current cluster data
      */
     void prepare(const CAQClusterData *cur_cluster) {
+        utils::NoProfiler profiler;
+        prepare(cur_cluster, profiler);
+    }
+
+    /**
+     * @brief prepare(), timing the LUT build and the rest into `profiler`
+     */
+    template <typename Profiler>
+    void prepare(const CAQClusterData *cur_cluster, Profiler &profiler) {
         // TODO: prepare only once instead of for each cluster, if factor_ip_cent_oa is set.
+        auto t = profiler.now();
         curr_cluster_ = cur_cluster;
+        factor_bytes_ = utils::factor_bytes(cur_cluster->factor_type_);
         const auto &centroid = cur_cluster->centroid();
         if (isIpDist()) {
             ip_q_c_ = query_data_.dot(centroid);
+            profiler.add(utils::SearchStage::Prepare, t);
+            t = profiler.now();
             lut_.prepare(query_data_);
-            q_l2sqr_ = lut_.getQL2Sqr();
         } else {
-            lut_.prepare(query_data_ - centroid);
-            q_l2sqr_ = lut_.getQL2Sqr();
+            FloatVec residual = query_data_ - centroid;
+            profiler.add(utils::SearchStage::Prepare, t);
+            t = profiler.now();
+            lut_.prepare(std::move(residual));
         }
+        q_l2sqr_ = lut_.getQL2Sqr();
+        profiler.add(utils::SearchStage::Lut, t);
     }
 
     /**
@@ -124,15 +162,15 @@ class CaqCluEstimator {
             }
             return;
         }
-        const float *factor_x = curr_cluster_->factor_o_l2norm(block_idx); // (o_r-c)^2, sqr_x
         __m512 factor_vec = _mm512_set1_ps(q_l2sqr_ - 2 * without_ip_prune_bound_);
         __m512 zero_vec = _mm512_setzero_ps();
 
         for (size_t j = 0; j < KFastScanSize; j += 16) {
-            __m512 factor_x_vec = _mm512_load_ps(&factor_x[j]);
+            __m512 factor_x_vec = curr_cluster_->factor_o_l2norm16(block_idx, j); // |o_r-c|, sqr_x
             __m512 squared_vec = _mm512_mul_ps(factor_x_vec, factor_x_vec);
             fst_distances[j / 16] = _mm512_max_ps(zero_vec, _mm512_add_ps(squared_vec, factor_vec));
         }
+        runtime_statics_.factor_bytes += KFastScanSize * factor_bytes_;
     }
 
     /**
@@ -151,8 +189,10 @@ class CaqCluEstimator {
             return;
         }
 
-        const float *o_l2norm = curr_cluster_->factor_o_l2norm(block_idx); // |o_r-c|, |x|
+        alignas(64) float o_l2norm_buf[KFastScanSize];
+        const float *o_l2norm = curr_cluster_->factor_o_l2norm_block(block_idx, o_l2norm_buf); // |o_r-c|, |x|
         lut_.compFastIP(o_l2norm, curr_cluster_->short_code(block_idx), fst_distances);
+        runtime_statics_.factor_bytes += KFastScanSize * factor_bytes_;
 
         if (fst_distances == nullptr) {
             return;
@@ -188,10 +228,30 @@ class CaqCluEstimator {
      * @return float Accurate distance between query and the specified vector
      */
     float compAccurateDist(size_t vec_idx) {
-        auto blk_idx = vec_idx / KFastScanSize;
-        auto j = vec_idx % KFastScanSize;
+        if (num_bits_ == 0) {
+            return compAccurateDist(vec_idx, 0, nullptr, ExFactor());
+        }
+        return compAccurateDist(vec_idx, lut_.getShortIP(vec_idx % KFastScanSize), curr_cluster_->long_code(vec_idx),
+                                curr_cluster_->long_factor(vec_idx));
+    }
+
+    /**
+     * @brief 1-bit part of the inner product of the j-th vector of the last block passed to compFastDist()
+     */
+    float getShortIP(size_t j) const { return lut_.getShortIP(j); }
+
+    /**
+     * @brief Compute accurate distance for a vector whose long code is not in the cluster,
+     * e.g. read from the index file in tiered storage
+     *
+     * @param vec_idx Index of the vector within the current cluster data
+     * @param short_ip getShortIP() of the vector, saved when its block was scanned
+     * @param long_code Long code of the vector
+     * @param ex_fac Long factor of the vector
+     */
+    float compAccurateDist(size_t vec_idx, float short_ip, const uint8_t *long_code, const ExFactor &ex_fac) {
         // For L2 distance, we need to compute the squared distance
-        const auto o_l2norm = curr_cluster_->factor_o_l2norm(blk_idx)[j];
+        const auto o_l2norm = curr_cluster_->factor_o_l2norm(vec_idx);
         const float o_l2sqr = o_l2norm * o_l2norm;
         if (num_bits_ == 0) {
             if (isIpDist()) {
@@ -201,12 +261,10 @@ class CaqCluEstimator {
             }
         }
 
-        const uint8_t *long_code = curr_cluster_->long_code(vec_idx);
-        const ExFactor &ex_fac = curr_cluster_->long_factor(vec_idx);
-
-        float ip_o_q = ex_fac.rescale * lut_.getExtIP(long_code, sq_delta_, j);
+        float ip_o_q = ex_fac.rescale * lut_.getExtIP(long_code, sq_delta_, short_ip);
 
         runtime_statics_.acc_bitsum += num_dim_padded_ * (num_bits_ - 1);
+        runtime_statics_.factor_bytes += 2 * factor_bytes_;
 
         if (cfg_.dist_type == DistType::IP) {
             return ip_o_q + ip_q_c_;
@@ -419,28 +477,22 @@ class CaqCluEstimatorSingle : public CaqEstimatorSingleImpl<kDistType> {
     }
 
     float varsEstDist(size_t vec_idx) {
-        auto block_idx = vec_idx / KFastScanSize;
-        auto j = vec_idx % KFastScanSize;
-        auto o_l2norm = curr_cluster_->factor_o_l2norm(block_idx)[j];
+        auto o_l2norm = curr_cluster_->factor_o_l2norm(vec_idx);
         return Impl::varsEstDist(o_l2norm);
     }
 
     float compFastDist(size_t vec_idx) {
-        auto block_idx = vec_idx / KFastScanSize;
-        auto j = vec_idx % KFastScanSize;
-        auto o_l2norm = curr_cluster_->factor_o_l2norm(block_idx)[j];
+        auto o_l2norm = curr_cluster_->factor_o_l2norm(vec_idx);
         auto short_code = (const uint64_t *)curr_cluster_->short_code_single(vec_idx);
 
         return Impl::compFastDist(o_l2norm, short_code);
     }
 
     float compAccurateDist(size_t vec_idx) {
-        auto block_idx = vec_idx / KFastScanSize;
-        auto j = vec_idx % KFastScanSize;
-        auto o_l2norm = curr_cluster_->factor_o_l2norm(block_idx)[j];
+        auto o_l2norm = curr_cluster_->factor_o_l2norm(vec_idx);
         auto short_code = (const uint64_t *)curr_cluster_->short_code_single(vec_idx);
         const uint8_t *long_code = curr_cluster_->long_code(vec_idx);
-        const ExFactor &ex_fac = curr_cluster_->long_factor(vec_idx);
+        const ExFactor ex_fac = curr_cluster_->long_factor(vec_idx);
 
         return Impl::compAccurateDist(o_l2norm, short_code, long_code, ex_fac);
     }
@@ -2,6 +2,7 @@
 
 #include <cassert>
 #include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <stdlib.h>
 #include <vector>
@@ -9,6 +10,9 @@
 #include <glog/logging.h>
 
 #include "defines.hpp"
+#include "quantization/packed_ids.hpp"
+#include "utils/arena.hpp"
+#include "utils/half.hpp"
 #include "utils/memory.hpp"
 #include "utils/tools.hpp"
 
@@ -49,6 +53,34 @@ struct ExFactor {
     float error = 0;
 };
 
+/**
+ * @brief Bytes held in memory by one segment of a cluster. `*_padding` is the part of a
+ * section spent on alignment, included in its bytes.
+ */
+struct SegmentMemory {
+    size_t short_factors = 0;
+    size_t short_codes = 0;
+    size_t long_codes = 0;
+    size_t long_factors = 0;
+    size_t centroid = 0;               // rotated centroid of the segment
+    size_t short_factors_padding = 0;  // vectors padding the last block
+    size_t short_codes_padding = 0;    // vectors padding the last block
+    size_t long_codes_padding = 0;     // long codes rounded up to SaqCluData::kLongCodeAlignBytes
+
+    void merge(const SegmentMemory &other) {
+        short_factors += other.short_factors;
+        short_codes += other.short_codes;
+        long_codes += other.long_codes;
+        long_factors += other.long_factors;
+        centroid += other.centroid;
+        short_factors_padding += other.short_factors_padding;
+        short_codes_padding += other.short_codes_padding;
+        long_codes_padding += other.long_codes_padding;
+    }
+
+    size_t total() const { return short_factors + short_codes + long_codes + long_factors + centroid; }
+};
+
 class SaqCluData;
 
 class CAQClusterData {
@@ -62,19 +94,20 @@ class CAQClusterData {
     const size_t num_dim_padded_; // Padded number of dimension (multiple of 64)
     const size_t num_bits_;       // bits
     const size_t num_blocks_;     // Num of blocks
+    const FactorType factor_type_; // precision of short and long factors
   private:
-    size_t shortb_factors_num_; // number of short block factors (in float)
-    size_t shortb_code_bytes_;  // bytes of short block code
-    size_t longb_code_bytes_;   // bytes of long block code
+    size_t shortb_factors_bytes_; // bytes of short block factors
+    size_t shortb_code_bytes_;    // bytes of short block code
+    size_t longb_code_bytes_;     // bytes of long block code
 
     size_t num_parallel_clusters_ = 1; // number of parallel clusters, that is, segments
 
     bool should_free_ = false;
-    float *short_factors_ = nullptr;   // short factors
+    uint8_t *short_factors_ = nullptr; // short factors
     uint8_t *short_code_ = nullptr;    // short code
     uint8_t *long_code_ = nullptr;     // long code
-    ExFactor *long_factors_ = nullptr; // long factors of vectors
-    PID *ids_ = nullptr;               // PID of vectors
+    uint8_t *long_factors_ = nullptr;  // long factors of vectors, ExFactor in factor_type_
+    const uint8_t *ids_ = nullptr;     // PID of vectors, see PackedIds
     FloatVec centroid_;                // Rotated centroid of clusters
 
   public:
@@ -87,14 +120,17 @@ class CAQClusterData {
      * @param long_code long code for re-ranking
      * @param ex_factor factors for re-ranking
      * @param ids id for vectors in the cluster
+     * @param factor_type precision of the short and long factors
      */
-    explicit CAQClusterData(size_t num_vec, size_t num_dim_paded, size_t num_bits)
+    explicit CAQClusterData(size_t num_vec, size_t num_dim_paded, size_t num_bits,
+                            FactorType factor_type = FactorType::Fp32)
         : num_vec_(num_vec),
           num_vec_align_(utils::rd_up_to_multiple_of(num_vec, KFastScanSize)),
           num_dim_padded_(num_dim_paded),
           num_bits_(num_bits),
           num_blocks_(utils::div_rd_up(num_vec, KFastScanSize)),
-          shortb_factors_num_(KFastScanSize * kNumShortFactors),
+          factor_type_(factor_type),
+          shortb_factors_bytes_(KFastScanSize * kNumShortFactors * utils::factor_bytes(factor_type)),
           shortb_code_bytes_(num_bits ? num_dim_paded * KFastScanSize / 8 * sizeof(uint8_t) : 0),
           longb_code_bytes_(num_bits ? num_dim_paded * (num_bits - 1) / 8 : 0) {
         centroid_.resize(num_dim_paded);
@@ -106,7 +142,7 @@ class CAQClusterData {
             std::free(short_code_);
             std::free(long_code_);
             std::free(long_factors_);
-            std::free(ids_);
+            std::free(const_cast<uint8_t *>(ids_));
         }
     }
 
@@ -131,12 +167,52 @@ class CAQClusterData {
         return short_code(block_idx) + num_dim_padded_ / 8 * j;
     }
 
-    auto factor_o_l2norm(size_t block_idx) { return &short_factors_[block_idx * shortb_factors_num_]; }
-    auto factor_o_l2norm(size_t block_idx) const { return &short_factors_[block_idx * shortb_factors_num_]; }
+    /**
+     * @brief Return short factors of i-th block: |o_r-c| of its vectors, then <c, o_a> (optional),
+     * stored in factor_type_
+     */
+    auto short_factors(size_t block_idx) { return &short_factors_[block_idx * shortb_factors_bytes_]; }
+    auto short_factors(size_t block_idx) const { return &short_factors_[block_idx * shortb_factors_bytes_]; }
+
+    /**
+     * @brief Return |o_r-c| of i-th vector in this cluster
+     */
+    float factor_o_l2norm(size_t vec_idx) const {
+        const auto *p = short_factors(vec_idx / KFastScanSize);
+        return utils::decode_factor(p + vec_idx % KFastScanSize * utils::factor_bytes(factor_type_), factor_type_);
+    }
+
+    /**
+     * @brief Load |o_r-c| of vectors j..j+15 of a block
+     */
+    __m512 factor_o_l2norm16(size_t block_idx, size_t j) const {
+        return utils::load16_factors(short_factors(block_idx) + j * utils::factor_bytes(factor_type_), factor_type_);
+    }
+
+    /**
+     * @brief Return |o_r-c| of the vectors of a block as floats, decoded into `buf` unless stored as Fp32
+     */
+    const float *factor_o_l2norm_block(size_t block_idx, float *buf) const {
+        if (factor_type_ == FactorType::Fp32) {
+            return reinterpret_cast<const float *>(short_factors(block_idx));
+        }
+        for (size_t j = 0; j < KFastScanSize; j += 16) {
+            _mm512_storeu_ps(buf + j, factor_o_l2norm16(block_idx, j));
+        }
+        return buf;
+    }
 
-    // ip_cent_oa is optional
-    auto factor_ip_cent_oa(size_t block_idx) { return factor_o_l2norm(block_idx) + KFastScanSize; }
-    auto factor_ip_cent_oa(size_t block_idx) const { return factor_o_l2norm(block_idx) + KFastScanSize; }
+    /**
+     * @brief Store the short factors of a block, 32 values each
+     */
+    void set_short_factors(size_t block_idx, const float *o_l2norm, const float *ip_cent_oa) {
+        auto *p = short_factors(block_idx);
+        const size_t bytes = utils::factor_bytes(factor_type_);
+        for (size_t j = 0; j < KFastScanSize; ++j) {
+            utils::encode_factor(o_l2norm[j], factor_type_, p + j * bytes);
+            utils::encode_factor(ip_cent_oa[j], factor_type_, p + (KFastScanSize + j) * bytes);
+        }
+    }
 
     /**
      * @brief Return long code for i-th vector in this cluster
@@ -150,27 +226,50 @@ class CAQClusterData {
         return &long_code_[vec_idx * longb_code_bytes_];
     }
 
+    /**
+     * @brief Bytes of one long factor
+     */
+    size_t ex_factor_bytes() const { return 2 * utils::factor_bytes(factor_type_); }
+
+    /**
+     * @brief Decode a long factor stored in factor_type_
+     */
+    ExFactor decode_long_factor(const uint8_t *p) const {
+        const size_t bytes = utils::factor_bytes(factor_type_);
+        return {utils::decode_factor(p, factor_type_), utils::decode_factor(p + bytes, factor_type_)};
+    }
+
     /**
      * @brief Return long factor of i-th vector in this cluster
      */
-    ExFactor &long_factor(size_t vec_idx) {
-        return long_factors_[vec_idx * num_parallel_clusters_];
+    ExFactor long_factor(size_t vec_idx) const {
+        return decode_long_factor(&long_factors_[vec_idx * num_parallel_clusters_ * ex_factor_bytes()]);
     }
-    ExFactor &long_factor(size_t vec_idx) const {
-        return long_factors_[vec_idx * num_parallel_clusters_];
+    void set_long_factor(size_t vec_idx, const ExFactor &ex_fac) {
+        auto *p = &long_factors_[vec_idx * num_parallel_clusters_ * ex_factor_bytes()];
+        utils::encode_factor(ex_fac.rescale, factor_type_, p);
+        utils::encode_factor(ex_fac.error, factor_type_, p + utils::factor_bytes(factor_type_));
     }
 
     auto &centroid() { return centroid_; }
     auto &centroid() const { return centroid_; }
 
     /**
-     * @brief Return pointer to ids
+     * @brief Return id of i-th vector in this cluster
      */
-    PID *ids() { return this->ids_; }
-    PID *ids() const { return this->ids_; }
+    PID id(size_t vec_idx) const {
+        DCHECK_LT(vec_idx, num_vec_);
+        return PackedIds::get(ids_, num_blocks_, vec_idx);
+    }
 
     auto num_vec() const { return num_vec_; }
     auto num_blocks() const { return num_blocks_; }
+
+    /**
+     * @brief Bytes of the long code of one vector in this segment
+     */
+    size_t ex_code_bytes() const { return num_bits_ ? num_dim_padded_ * (num_bits_ - 1) / 8 : 0; }
+
     auto iter() const { return num_vec_ / KFastScanSize; }
     auto remain() const { return num_vec_ % KFastScanSize; }
 
@@ -197,47 +296,71 @@ class CAQClusterData {
 };
 
 class SaqCluData {
+  public:
     static constexpr size_t kLongCodeAlignBytes = 16;
 
-  public:
     const size_t num_vec_;       // Num of vectors in this segment
     const size_t num_vec_align_; // Num of vectors in this segment
     const size_t num_blocks_;    // Num of blocks
     const size_t num_segments_;  // Num of segments
+    const FactorType factor_type_; // precision of short and long factors
   private:
     std::vector<CAQClusterData> segments_;
-    size_t shortb_factors_fcnt_ = 0;  // bytes of short factors for all segments
+    size_t shortb_factors_bytes_ = 0; // bytes of short factors for all segments
     size_t shortb_code_bytes_ = 0;    // bytes of short code for all segments
     size_t longb_code_bytes_ = 0;     // bytes of long block for all segments
     size_t longb_code_bytes_tot_ = 0; // bytes of long block for all segments
+    bool interleaved_ = false;        // multi-segment blocks stored as [factors | codes] per segment
+    bool compact_ = false;            // long codes of each segment stored contiguously
+    bool tiered_ = false;             // long codes and long factors are left in the index file
+    std::vector<size_t> long_seg_begin_; // offset of the long codes of each segment in long_code_
+    memory::HugePageArena *arena_;    // storage owner. nullptr means the arrays are freed by this object
 
     // ========================= presistence data below =========================
-    float *short_factors_;                                    // short factors
-    uint8_t *short_code_;                                     // short code
-    uint8_t *long_code_;                                      // long code
-    ExFactor *long_factors_;                                  // extra factors of vectors
-    std::vector<PID, memory::AlignedAllocator<PID, 64>> ids_; // PID of vectors
+    uint8_t *short_factors_; // short factors
+    uint8_t *short_code_;    // short code
+    uint8_t *long_code_;     // long code
+    uint8_t *long_factors_;  // extra factors of vectors, ExFactor in factor_type_
+    uint8_t *ids_ = nullptr; // PID of vectors, see PackedIds
+    size_t id_bytes_ = 0;    // bytes of ids_
 
   public:
     /**
      * @param num number of vectors
      * @param quant_plan_ quantization plan for each segment. <num_dims, bits>
+     * @param use_compact_layout store the long codes of each segment contiguously
+     * @param use_interleaved_layout store the short factors and codes of all segments of a
+     * block in one 64-byte aligned region, in the order they are scanned. Only changes the
+     * in-memory layout, save() and load() use the same format either way.
+     * @param arena allocate all arrays from this arena, which must outlive the cluster.
+     * nullptr allocates them individually.
+     * @param tiered do not keep the long codes and long factors in memory. load() skips them,
+     * they are read from the index file with long_ranges().
+     * @param factor_type precision of the short and long factors, part of the saved format
      */
-    explicit SaqCluData(size_t num_vec, const std::vector<std::pair<size_t, size_t>> &quant_plan, bool use_compact_layout = false)
+    explicit SaqCluData(size_t num_vec, const std::vector<std::pair<size_t, size_t>> &quant_plan,
+                        bool use_compact_layout = false, bool use_interleaved_layout = false,
+                        memory::HugePageArena *arena = nullptr, bool tiered = false,
+                        FactorType factor_type = FactorType::Fp32)
         : num_vec_(num_vec),
           num_vec_align_(utils::rd_up_to_multiple_of(num_vec, KFastScanSize)),
           num_blocks_(utils::div_rd_up(num_vec, KFastScanSize)),
-          num_segments_(quant_plan.size()) {
+          num_segments_(quant_plan.size()),
+          factor_type_(factor_type),
+          tiered_(tiered),
+          arena_(arena) {
         if (num_segments_ == 1)
             use_compact_layout = true;
+        compact_ = use_compact_layout;
+        interleaved_ = use_interleaved_layout && num_segments_ > 1;
 
         segments_.reserve(quant_plan.size());
         for (size_t i = 0; i < quant_plan.size(); ++i) {
             auto dim_padded = quant_plan[i].first;
             DCHECK_EQ(dim_padded % kDimPaddingSize, 0);
-            auto &c = segments_.emplace_back(num_vec, dim_padded, quant_plan[i].second);
+            auto &c = segments_.emplace_back(num_vec, dim_padded, quant_plan[i].second, factor_type);
             c.num_parallel_clusters_ = num_segments_;
-            shortb_factors_fcnt_ += c.shortb_factors_num_;
+            shortb_factors_bytes_ += c.shortb_factors_bytes_;
             shortb_code_bytes_ += c.shortb_code_bytes_;
 
             if (use_compact_layout) {
@@ -249,55 +372,67 @@ class SaqCluData {
             }
         }
 
-        // assign long code and EX_FACTOR
-        if (quant_plan.size() == 1) {
-            auto blk_bytes = (shortb_factors_fcnt_ * sizeof(float) + shortb_code_bytes_);
-            short_code_ = memory::align_mm<64, uint8_t>(blk_bytes * num_blocks_);
+        // assign short factors and codes
+        if (quant_plan.size() == 1 || interleaved_) {
+            // one region per block: [factors | codes] of each segment in turn.
+            // Factors take 256 (128 in 16 bits) bytes and codes a multiple of 256 bytes, so every part is
+            // 64-byte aligned.
+            auto blk_bytes = (shortb_factors_bytes_ + shortb_code_bytes_);
+            short_code_ = alloc<uint8_t>(blk_bytes * num_blocks_);
             shortb_code_bytes_ = blk_bytes;
             short_factors_ = nullptr;
-            shortb_factors_fcnt_ = 0;
+            shortb_factors_bytes_ = 0;
             size_t ptr = 0;
             for (size_t i = 0; i < quant_plan.size(); ++i) {
                 auto &c = segments_[i];
 
-                c.short_factors_ = reinterpret_cast<float *>(short_code_ + ptr);
-                ptr += c.shortb_factors_num_ * sizeof(float);
-                c.shortb_factors_num_ = blk_bytes / sizeof(float);
+                c.short_factors_ = short_code_ + ptr;
+                ptr += c.shortb_factors_bytes_;
+                c.shortb_factors_bytes_ = blk_bytes;
 
                 c.short_code_ = short_code_ + ptr;
                 ptr += c.shortb_code_bytes_;
                 c.shortb_code_bytes_ = blk_bytes;
+                DCHECK_EQ(ptr % 64, 0);
             }
             // CHECK_EQ(ptr, blk_bytes);
             assert(ptr == blk_bytes);
         } else {
-            // TODO: optimize layout of short factors and codes
-            short_factors_ = memory::align_mm<64, float>(shortb_factors_fcnt_ * num_blocks_);
-            short_code_ = memory::align_mm<64, uint8_t>(shortb_code_bytes_ * num_blocks_);
+            short_factors_ = alloc<uint8_t>(shortb_factors_bytes_ * num_blocks_);
+            short_code_ = alloc<uint8_t>(shortb_code_bytes_ * num_blocks_);
             size_t shortb_factors_begin = 0;
             size_t shortb_code_begin = 0;
             for (size_t i = 0; i < quant_plan.size(); ++i) {
                 auto &c = segments_[i];
 
                 c.short_factors_ = short_factors_ + shortb_factors_begin;
-                shortb_factors_begin += c.shortb_factors_num_;
-                c.shortb_factors_num_ = shortb_factors_fcnt_;
+                shortb_factors_begin += c.shortb_factors_bytes_;
+                c.shortb_factors_bytes_ = shortb_factors_bytes_;
 
                 c.short_code_ = short_code_ + shortb_code_begin;
                 shortb_code_begin += c.shortb_code_bytes_;
                 c.shortb_code_bytes_ = shortb_code_bytes_;
             }
-            assert(shortb_factors_fcnt_ == shortb_factors_begin);
+            assert(shortb_factors_bytes_ == shortb_factors_begin);
             assert(shortb_code_bytes_ == shortb_code_begin);
         }
 
-        // assign long code and long_factor
-        long_code_ = memory::align_mm<64, uint8_t>(longb_code_bytes_tot_);
-        long_factors_ = memory::align_mm<64, ExFactor>(num_vec * num_segments_);
-        ids_.resize(num_vec, 0);
+        // assign long code and long_factor. Ids are sized by their values, see set_ids()
+        long_code_ = tiered_ ? nullptr : alloc<uint8_t>(longb_code_bytes_tot_);
+        long_factors_ = tiered_ ? nullptr : alloc<uint8_t>(num_vec * long_factor_bytes());
         size_t longb_begin = 0;
         for (size_t i = 0; i < quant_plan.size(); ++i) {
             auto &c = segments_[i];
+            long_seg_begin_.push_back(longb_begin);
+            if (tiered_) {
+                longb_begin += use_compact_layout
+                                   ? utils::rd_up_to_multiple_of(c.longb_code_bytes_ * num_vec, kLongCodeAlignBytes)
+                                   : utils::rd_up_to_multiple_of(c.longb_code_bytes_, kLongCodeAlignBytes);
+                if (!use_compact_layout) {
+                    c.longb_code_bytes_ = longb_code_bytes_;
+                }
+                continue;
+            }
             if (use_compact_layout) {
                 c.long_code_ = long_code_ + longb_begin;
                 longb_begin += utils::rd_up_to_multiple_of(c.longb_code_bytes_ * num_vec, kLongCodeAlignBytes);
@@ -307,13 +442,16 @@ class SaqCluData {
                 c.longb_code_bytes_ = longb_code_bytes_;
             }
 
-            c.long_factors_ = long_factors_ + i;
-            c.ids_ = ids_.data();
+            c.long_factors_ = long_factors_ + i * c.ex_factor_bytes();
         }
         assert(longb_begin == longb_code_bytes_tot_ || longb_begin == longb_code_bytes_);
     }
 
     ~SaqCluData() {
+        if (arena_) {
+            return;
+        }
+        std::free(ids_);
         if (short_factors_) {
             std::free(short_factors_);
         }
@@ -326,33 +464,228 @@ class SaqCluData {
     auto &get_segment(size_t idx) const { return segments_[idx]; }
 
     /**
-     * @brief Return pointer to ids
+     * @brief Return id of i-th vector in this cluster
+     */
+    PID id(size_t vec_idx) const {
+        DCHECK_LT(vec_idx, num_vec_);
+        return PackedIds::get(ids_, num_blocks_, vec_idx);
+    }
+
+    size_t id_bytes() const { return id_bytes_; }
+
+    /**
+     * @brief Bytes of segment `seg` held in memory, ids are counted by id_bytes()
+     */
+    SegmentMemory segment_memory(size_t seg) const {
+        const auto &c = segments_[seg];
+        const size_t factor_bytes = CAQClusterData::kNumShortFactors * utils::factor_bytes(factor_type_);
+        const size_t code_bytes = c.num_bits_ ? c.num_dim_padded_ / 8 : 0; // 1 bit per dimension
+        const size_t pad_vecs = num_vec_align_ - num_vec_;
+        SegmentMemory m;
+        m.short_factors = num_vec_align_ * factor_bytes;
+        m.short_codes = num_vec_align_ * code_bytes;
+        m.short_factors_padding = pad_vecs * factor_bytes;
+        m.short_codes_padding = pad_vecs * code_bytes;
+        m.centroid = c.num_dim_padded_ * sizeof(float);
+        if (!tiered_) {
+            const size_t ex_bytes = c.ex_code_bytes();
+            m.long_codes = compact_ ? utils::rd_up_to_multiple_of(ex_bytes * num_vec_, kLongCodeAlignBytes)
+                                    : utils::rd_up_to_multiple_of(ex_bytes, kLongCodeAlignBytes) * num_vec_;
+            m.long_codes_padding = m.long_codes - ex_bytes * num_vec_;
+            m.long_factors = num_vec_ * c.ex_factor_bytes();
+        }
+        return m;
+    }
+
+    bool tiered() const { return tiered_; }
+
+    /**
+     * @brief Bytes of the long factors of all segments of one vector
+     */
+    size_t long_factor_bytes() const { return num_segments_ * 2 * utils::factor_bytes(factor_type_); }
+
+    /**
+     * @brief Long factor of a segment in a record gathered by long_ranges()
+     */
+    ExFactor record_long_factor(const uint8_t *record, size_t seg) const {
+        return segments_[seg].decode_long_factor(record + long_factor_offset() + seg * segments_[seg].ex_factor_bytes());
+    }
+
+    /**
+     * @brief Bytes of the long codes and long factors of one vector, as gathered by long_ranges()
+     */
+    size_t long_record_bytes() const {
+        return utils::rd_up_to_multiple_of(long_factor_offset() + long_factor_bytes(), 64);
+    }
+
+    /**
+     * @brief Offset of the long code of a segment in a record of long_record_bytes()
+     */
+    size_t long_code_offset(size_t seg) const {
+        size_t offset = 0;
+        for (size_t i = 0; i < seg; ++i) {
+            offset += utils::rd_up_to_multiple_of(segments_[i].ex_code_bytes(), kLongCodeAlignBytes);
+        }
+        return offset;
+    }
+
+    /**
+     * @brief Offset of the long factors of all segments in a record of long_record_bytes()
+     */
+    size_t long_factor_offset() const { return long_code_offset(num_segments_); }
+
+    /**
+     * @brief Visit the byte ranges of the data written by save() that hold the long codes and
+     * long factors of a vector, as `func(pos, bytes, record_offset)`
+     */
+    template <typename Func>
+    void long_ranges(size_t vec_idx, Func &&func) const {
+        const size_t begin = short_bytes();
+        bool quantized = false;
+        for (size_t i = 0; i < num_segments_; ++i) {
+            const auto &c = segments_[i];
+            if (c.ex_code_bytes()) {
+                func(begin + long_seg_begin_[i] + vec_idx * c.longb_code_bytes_, c.ex_code_bytes(),
+                     long_code_offset(i));
+            }
+            quantized |= c.num_bits_ > 0;
+        }
+        // segments of 0 bits do not use their long factors
+        if (quantized) {
+            func(begin + longb_code_bytes_ * num_vec_ + vec_idx * long_factor_bytes(), long_factor_bytes(),
+                 long_factor_offset());
+        }
+    }
+
+    /**
+     * @brief Encode the ids of the vectors. Allocates from the arena, if any.
      */
-    PID *ids() { return this->ids_.data(); }
-    const PID *ids() const { return ids_.data(); }
+    void set_ids(const PID *ids) {
+        uint8_t *packed = alloc_ids(PackedIds::encoded_bytes(ids, num_vec_));
+        PackedIds::encode(ids, num_vec_, packed);
+    }
 
     auto iter() const { return num_vec_ / KFastScanSize; }
     auto remain() const { return num_vec_ % KFastScanSize; }
 
-    void load(std::ifstream &input) {
-        input.read((char *)short_factors_, shortb_factors_fcnt_ * num_blocks_ * sizeof(float));
-        input.read((char *)short_code_, shortb_code_bytes_ * num_blocks_);
-        input.read((char *)long_code_, longb_code_bytes_ * num_vec_);
-        input.read((char *)long_factors_, num_vec_ * num_segments_ * sizeof(ExFactor));
-        input.read((char *)ids_.data(), ids_.size() * sizeof(PID));
+    /**
+     * @brief Copy the data of `other`, which must be built with the same plan and layout
+     */
+    void copy_from(const SaqCluData &other) {
+        CHECK_EQ(num_vec_, other.num_vec_);
+        CHECK_EQ(num_segments_, other.num_segments_);
+        CHECK_EQ(shortb_code_bytes_, other.shortb_code_bytes_);
+        CHECK_EQ(longb_code_bytes_tot_, other.longb_code_bytes_tot_);
+        CHECK_EQ(interleaved_, other.interleaved_);
+        CHECK_EQ(tiered_, other.tiered_);
+        CHECK(factor_type_ == other.factor_type_);
+        if (short_factors_) {
+            std::memcpy(short_factors_, other.short_factors_, shortb_factors_bytes_ * num_blocks_);
+        }
+        std::memcpy(short_code_, other.short_code_, shortb_code_bytes_ * num_blocks_);
+        if (!tiered_) {
+            std::memcpy(long_code_, other.long_code_, longb_code_bytes_tot_);
+            std::memcpy(long_factors_, other.long_factors_, num_vec_ * long_factor_bytes());
+        }
+        std::memcpy(alloc_ids(other.id_bytes_), other.ids_, other.id_bytes_);
+        for (size_t i = 0; i < num_segments_; ++i) {
+            segments_[i].centroid_ = other.segments_[i].centroid_;
+        }
+    }
+
+    /**
+     * @param packed_ids the ids are stored packed, as written by save(). Index files
+     * without a header store them as raw PIDs.
+     */
+    void load(std::istream &input, bool packed_ids = true) {
+        if (interleaved_) {
+            visit_short_parts([&](void *ptr, size_t bytes) { input.read((char *)ptr, bytes); });
+        } else {
+            input.read((char *)short_factors_, shortb_factors_bytes_ * num_blocks_);
+            input.read((char *)short_code_, shortb_code_bytes_ * num_blocks_);
+        }
+        if (tiered_) {
+            input.ignore(longb_code_bytes_ * num_vec_ + num_vec_ * long_factor_bytes());
+        } else {
+            input.read((char *)long_code_, longb_code_bytes_ * num_vec_);
+            input.read((char *)long_factors_, num_vec_ * long_factor_bytes());
+        }
+        if (packed_ids) {
+            size_t bytes = 0;
+            input.read((char *)&bytes, sizeof(size_t));
+            input.read((char *)alloc_ids(bytes), bytes);
+        } else {
+            std::vector<PID> ids(num_vec_);
+            input.read((char *)ids.data(), num_vec_ * sizeof(PID));
+            set_ids(ids.data());
+        }
         for (auto &clu : segments_) {
             input.read((char *)clu.centroid_.data(), clu.centroid_.cols() * sizeof(float));
         }
     }
-    void save(std::ofstream &output) const {
-        output.write((char *)short_factors_, shortb_factors_fcnt_ * num_blocks_ * sizeof(float));
-        output.write((char *)short_code_, shortb_code_bytes_ * num_blocks_);
+    void save(std::ostream &output) const {
+        CHECK(!tiered_) << "The long codes of a tiered cluster are not in memory";
+        if (interleaved_) {
+            visit_short_parts([&](const void *ptr, size_t bytes) { output.write((const char *)ptr, bytes); });
+        } else {
+            output.write((char *)short_factors_, shortb_factors_bytes_ * num_blocks_);
+            output.write((char *)short_code_, shortb_code_bytes_ * num_blocks_);
+        }
         output.write((char *)long_code_, longb_code_bytes_ * num_vec_);
-        output.write((char *)long_factors_, num_vec_ * num_segments_ * sizeof(ExFactor));
-        output.write((char *)ids_.data(), ids_.size() * sizeof(PID));
+        output.write((char *)long_factors_, num_vec_ * long_factor_bytes());
+        output.write((char *)&id_bytes_, sizeof(size_t));
+        output.write((char *)ids_, id_bytes_);
         for (auto &clu : segments_) {
             output.write((char *)clu.centroid_.data(), clu.centroid_.cols() * sizeof(float));
         }
     }
+  private:
+    /**
+     * @brief Bytes written by save() before the long codes
+     */
+    size_t short_bytes() const {
+        return shortb_factors_bytes_ * num_blocks_ + shortb_code_bytes_ * num_blocks_;
+    }
+
+    template <typename T>
+    T *alloc(size_t num) {
+        if (arena_) {
+            return arena_->allocate_array<T>(num); // already zeroed
+        }
+        return memory::align_mm<64, T>(num);
+    }
+
+    uint8_t *alloc_ids(size_t bytes) {
+        if (!arena_) {
+            std::free(ids_);
+        }
+        ids_ = alloc<uint8_t>(bytes);
+        id_bytes_ = bytes;
+        for (auto &c : segments_) {
+            c.ids_ = ids_;
+        }
+        return ids_;
+    }
+
+    /**
+     * @brief Visit the short data of an interleaved cluster in the order of the separate
+     * layout: factors of all blocks (segments inner), then codes of all blocks
+     */
+    template <typename Func>
+    void visit_short_parts(Func &&func) const {
+        for (size_t b = 0; b < num_blocks_; ++b) {
+            for (const auto &c : segments_) {
+                func(c.short_factors(b),
+                     CAQClusterData::kNumShortFactors * KFastScanSize * utils::factor_bytes(factor_type_));
+            }
+        }
+        for (size_t b = 0; b < num_blocks_; ++b) {
+            for (const auto &c : segments_) {
+                if (c.num_bits_) {
+                    func(c.short_code(b), c.num_dim_padded_ * KFastScanSize / 8);
+                }
+            }
+        }
+    }
 };
 } // namespace saqlib
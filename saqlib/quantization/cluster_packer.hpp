@@ -4,6 +4,10 @@
 #include <cmath>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <limits>
+
+#include <glog/logging.h>
 
 #include "defines.hpp"
 #include "quantization/cluster_data.hpp"
@@ -14,6 +18,9 @@
 namespace saqlib {
 /**
  * @brief Handles the packing of CAQ codes and factors for cluster data
+ *
+ * A packer covers the blocks [blk_begin, blk_end) of the cluster, so disjoint block
+ * ranges of one cluster can be packed concurrently.
  */
 class ClusterPacker {
   private:
@@ -21,9 +28,11 @@ class ClusterPacker {
     const size_t num_bits_;
     const size_t shortcode_byte_num_;
     const uint16_t short_bit_;
-    const size_t total_blocks_;
+    const size_t blk_begin_;
+    const size_t total_blocks_; // blocks covered by this packer
+    const size_t vec_begin_;
     const bool use_fastscan_;
-    void (*compacted_code_func_)(uint8_t *o_compact, const uint16_t *o_raw, size_t num_dim);
+    void (*compacted_code_func_)(uint8_t *o_compact, const int32_t *o_raw, size_t num_dim);
 
     // Cluster data reference
     CAQClusterData &clus_;
@@ -33,24 +42,32 @@ class ClusterPacker {
     memory::UniqueArray<float> fac_o_l2norm_;
     memory::UniqueArray<float> fac_ip_cent_oa_;
     memory::UniqueArray<uint8_t> short_codes_;
-    Uint16Vec long_code_;
 
   public:
-    ClusterPacker(size_t num_dim_pad, size_t num_bits, CAQClusterData &clus, bool use_fastscan)
+    ClusterPacker(size_t num_dim_pad, size_t num_bits, CAQClusterData &clus, bool use_fastscan,
+                  size_t blk_begin = 0, size_t blk_end = std::numeric_limits<size_t>::max())
         : num_dim_pad_(num_dim_pad), num_bits_(num_bits),
           shortcode_byte_num_(num_dim_pad / 8),
           short_bit_(num_bits ? (1 << (num_bits - 1)) : 0),
-          total_blocks_(clus.num_blocks()),
+          blk_begin_(blk_begin),
+          total_blocks_(std::min(blk_end, clus.num_blocks()) - blk_begin),
+          vec_begin_(blk_begin * KFastScanSize),
           use_fastscan_(use_fastscan),
-          compacted_code_func_(num_bits ? utils::get_compacted_code16_func(num_bits - 1) : nullptr),
+          compacted_code_func_(num_bits ? utils::get_compacted_code32_func(num_bits - 1) : nullptr),
           clus_(clus),
           fac_o_l2norm_(memory::make_unique_array<float>(KFastScanSize * total_blocks_)),
           fac_ip_cent_oa_(memory::make_unique_array<float>(KFastScanSize * total_blocks_)),
           short_codes_(num_bits ? memory::make_unique_array<uint8_t>(
                                       shortcode_byte_num_ * KFastScanSize * total_blocks_)
-                                : memory::make_unique_array<uint8_t>(0)),
-          long_code_(1, num_dim_pad_) {
+                                : memory::make_unique_array<uint8_t>(0)) {
+        DCHECK_LE(blk_begin, std::min(blk_end, clus.num_blocks()));
         centroid_ = &clus.centroid();
+        // zero the padding lanes of the last block so the packed output is deterministic
+        std::memset(fac_o_l2norm_.get(), 0, sizeof(float) * KFastScanSize * total_blocks_);
+        std::memset(fac_ip_cent_oa_.get(), 0, sizeof(float) * KFastScanSize * total_blocks_);
+        if (num_bits_) {
+            std::memset(short_codes_.get(), 0, shortcode_byte_num_ * KFastScanSize * total_blocks_);
+        }
     }
 
     /**
@@ -59,7 +76,9 @@ class ClusterPacker {
      * @param caq CAQ single data containing codes and factors
      */
     void store_and_pack(size_t i, const CaqCode &caq) {
-        fac_o_l2norm_[i] = caq.o_l2norm;
+        const size_t li = i - vec_begin_; // index within this packer's buffers
+        DCHECK_LT(li, total_blocks_ * KFastScanSize);
+        fac_o_l2norm_[li] = caq.o_l2norm;
 
         if (num_bits_ == 0) {
             return; // No packing needed for 0 bits
@@ -68,17 +87,12 @@ class ClusterPacker {
         const auto ip_cent_oa = centroid_->dot(caq.get_oa());
 
         // Store short data
-        fac_ip_cent_oa_[i] = ip_cent_oa; // Optional
-        pack_short_codes(caq.code, &short_codes_[i * shortcode_byte_num_]);
+        fac_ip_cent_oa_[li] = ip_cent_oa; // Optional
+        pack_short_codes(caq.code, &short_codes_[li * shortcode_byte_num_]);
 
-        // Store long data
-        auto &ex_fac = clus_.long_factor(i);
-        ex_fac.rescale = caq.fac_rescale;
-        ex_fac.error = caq.fac_error;
-        for (size_t j = 0; j < num_dim_pad_; ++j) {
-            long_code_[j] = caq.code[j] & (short_bit_ - 1);
-        }
-        compacted_code_func_(clus_.long_code(i), &long_code_(0, 0), num_dim_pad_);
+        // Store long data, the compact function keeps only the low num_bits - 1 bits
+        clus_.set_long_factor(i, {caq.fac_rescale, caq.fac_error});
+        compacted_code_func_(clus_.long_code(i), caq.code.data(), num_dim_pad_);
     }
 
     /**
@@ -87,57 +101,40 @@ class ClusterPacker {
     void finalize_and_store() {
         // Store short data block by block
         for (size_t i = 0; i < total_blocks_; ++i) {
+            const size_t blk = blk_begin_ + i; // block index in the cluster
             // copy codes
             if (num_bits_) {
                 auto begin_idx = i * shortcode_byte_num_ * KFastScanSize;
                 if (use_fastscan_) {
                     fastscan::pack_codes(num_dim_pad_,
                                          &short_codes_[begin_idx],
-                                         KFastScanSize, clus_.short_code(i));
+                                         KFastScanSize, clus_.short_code(blk));
                 } else {
-                    // convert uint8_t to uint64_t for big-endian
-                    for (size_t j = 0; j < shortcode_byte_num_ * KFastScanSize; j += 8) {
-                        std::swap(short_codes_[begin_idx + j + 0], short_codes_[begin_idx + j + 7]);
-                        std::swap(short_codes_[begin_idx + j + 1], short_codes_[begin_idx + j + 6]);
-                        std::swap(short_codes_[begin_idx + j + 2], short_codes_[begin_idx + j + 5]);
-                        std::swap(short_codes_[begin_idx + j + 3], short_codes_[begin_idx + j + 4]);
-                    }
-                    std::memcpy(clus_.short_code(i),
+                    // already stored as big-endian uint64_t by pack_short_codes
+                    std::memcpy(clus_.short_code(blk),
                                 &short_codes_[begin_idx], shortcode_byte_num_ * KFastScanSize);
                 }
             }
 
-            // copy factors
-            std::memcpy(clus_.factor_o_l2norm(i), &fac_o_l2norm_[i * KFastScanSize],
-                        sizeof(float) * KFastScanSize);
-
-            // ip_cent_oa is optional
-            if (auto ip = clus_.factor_ip_cent_oa(i); ip) {
-                std::memcpy(ip, &fac_ip_cent_oa_[i * KFastScanSize], sizeof(float) * KFastScanSize);
-            }
+            // copy factors, converted to the precision of the cluster
+            clus_.set_short_factors(blk, &fac_o_l2norm_[i * KFastScanSize], &fac_ip_cent_oa_[i * KFastScanSize]);
         }
     }
 
   private:
     /**
      * @brief Pack short codes from CAQ codes
+     *
+     * The top bit plane is extracted 64 dims at a time. Fastscan takes MSB-first bytes,
+     * the plain layout takes every 64 dims as a big-endian uint64_t.
      * @param code Original CAQ codes (Eigen::VectorXi)
      * @param short_code_begin Output buffer for short codes
      */
     void pack_short_codes(const Eigen::VectorXi &code, uint8_t *short_code_begin) {
-        for (size_t j = 0; j < shortcode_byte_num_; ++j) {
-            uint8_t byte = 0;
-            const size_t base_idx = j * 8;
-            byte |= (code[base_idx + 0] & short_bit_) ? 0x80 : 0;
-            byte |= (code[base_idx + 1] & short_bit_) ? 0x40 : 0;
-            byte |= (code[base_idx + 2] & short_bit_) ? 0x20 : 0;
-            byte |= (code[base_idx + 3] & short_bit_) ? 0x10 : 0;
-            byte |= (code[base_idx + 4] & short_bit_) ? 0x08 : 0;
-            byte |= (code[base_idx + 5] & short_bit_) ? 0x04 : 0;
-            byte |= (code[base_idx + 6] & short_bit_) ? 0x02 : 0;
-            byte |= (code[base_idx + 7] & short_bit_) ? 0x01 : 0;
-
-            short_code_begin[j] = byte;
+        if (use_fastscan_) {
+            utils::pack_bit_plane_msb(short_code_begin, code.data(), short_bit_, num_dim_pad_);
+        } else {
+            utils::pack_bit_plane_u64(short_code_begin, code.data(), short_bit_, num_dim_pad_);
         }
     }
 };
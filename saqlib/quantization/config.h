@@ -2,6 +2,7 @@
 
 #include <cstdlib>
 #include <cstring>
+#include <string>
 
 #include <fmt/core.h>
 
@@ -18,13 +19,61 @@ struct QuantSingleConfig {
     int caq_ori_qB = 0;                            // [Experiment Only] Original quantization bits. 0 means disable.
 };
 
+enum class PlannerMode : int {
+    Error = 0,     // minimize the variance error proxy only (default)
+    Latency = 1,   // minimize error subject to `budget` ns of scan cost per vector
+    ErrorBound = 2 // minimize scan cost subject to error <= `budget` * total variance
+};
+
+/**
+ * @brief Options of the segmentation planner. Only used while building the plan,
+ * so they are not persisted with the index.
+ */
+struct PlannerConfig {
+    PlannerMode mode = PlannerMode::Error;
+    float budget = 0;            // latency (ns per scanned vector) or relative error budget
+    float avg_cluster_size = 0;  // vectors per probed cluster. 0 means num_data / num_clusters
+    float acc_ratio = 0.1;       // fraction of scanned vectors reaching the accurate stage
+    std::string cost_model;      // file of a saved ScanCostModel. Empty to calibrate on this host
+};
+
+/**
+ * @brief Placement of the cluster data on multi-socket hosts
+ */
+enum class NumaMode {
+    None = 0,      // default memory policy
+    Replicate = 1, // one copy of the clusters per node, queries read the copy of their node
+    Partition = 2, // clusters spread over the nodes, each scanned by workers of its node. Each node prunes
+                   // against the k-th distance of its own results, so it may keep neighbors that None prunes
+};
+
+/**
+ * @brief In-memory storage of the cluster data. The index file is the same for all
+ * options, so they are chosen again on every load.
+ */
+struct StorageConfig {
+    bool interleaved_layout = false; // keep each block's short factors and codes of all segments together
+    bool huge_page = false;          // carve cluster storage out of a huge-page backed arena
+    bool prefault = false;           // fault in arena pages at allocation instead of on first access
+    NumaMode numa = NumaMode::None;  // placement of the clusters on NUMA nodes
+    bool tiered = false;             // leave long codes and long factors in the index file, read them for candidates
+    size_t tier_cache_mb = 1024;     // tiered, block cache of the index file
+    size_t tier_io_threads = 8;      // tiered, threads reading the index file. 0 reads on the search threads
+    bool lazy = false;               // read each cluster from the index file on its first probe
+    size_t lazy_cache_mb = 4096;     // lazy, LRU cache of the clusters read
+};
+
 struct QuantizeConfig {
     float avg_bits = 0;              // average bits for quantization.
     int seg_eqseg = 0;               // segment equally into this number of segments. 0 means disable.
     bool enable_segmentation = true; // enable SAQ or not.
     bool use_compact_layout = false; // use compact memory layout for segmentation.
+    FactorType factor_type = FactorType::Fp32; // precision of the stored factors. Fits the padding, forced to Fp32 for old indexes
 
     QuantSingleConfig single; // CAQ configuration
+    // ========= members below are not persisted with the index, `planner` must stay first =========
+    PlannerConfig planner; // segmentation planner options
+    StorageConfig storage; // in-memory layout of cluster data
 
     std::string toString() const {
         std::string args_str;
@@ -69,6 +118,16 @@ struct QuantizeConfig {
         if (use_compact_layout) {
             args_str += "_compactlayout";
         }
+        if (factor_type == FactorType::Fp16) {
+            args_str += "_fp16";
+        } else if (factor_type == FactorType::Bf16) {
+            args_str += "_bf16";
+        }
+        if (enable_segmentation && planner.mode == PlannerMode::Latency) {
+            args_str += fmt::format("_lat{}", planner.budget);
+        } else if (enable_segmentation && planner.mode == PlannerMode::ErrorBound) {
+            args_str += fmt::format("_errb{}", planner.budget);
+        }
         return args_str;
     }
 };
@@ -76,5 +135,6 @@ struct QuantizeConfig {
 struct SearcherConfig {
     float searcher_vars_bound_m = 4;      // searcher variance prune bound m. Larger value means more accurate but slower.
     DistType dist_type = DistType::L2Sqr; // distance type. L2Sqr or IP
+    bool apply_pca = true;                // apply the index PCA (if any) to incoming raw queries
 };
 } // namespace saqlib
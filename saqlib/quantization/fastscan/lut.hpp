@@ -118,11 +118,27 @@ class Lut
         }
     }
 
-    float getExtIP(const uint8_t *long_code, float delta, size_t j)
+    float getExtIP(const uint8_t *long_code, float delta, size_t j) const
+    {
+        return getExtIP(long_code, delta, ip_xb_qprime_[j]);
+    }
+
+    /**
+     * @brief Same as getExtIP(), with the 1-bit part saved by getShortIP() while the block was scanned
+     */
+    float getExtIP(const uint8_t *long_code, float delta, float short_ip) const
     {
         constexpr double vl = -1;
         double ex_ip = IP_FUNC(query_.data(), long_code, num_dim_padded_);
-        return (ip_xb_qprime_[j] + ex_ip * delta + (vl + delta / 2) * sum_q_);
+        return (short_ip + ex_ip * delta + (vl + delta / 2) * sum_q_);
+    }
+
+    /**
+     * @brief 1-bit part of the inner product of the j-th vector of the last block passed to compFastIP()
+     */
+    float getShortIP(size_t j) const
+    {
+        return ip_xb_qprime_[j];
     }
 };
 
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <glog/logging.h>
+
+#include "defines.hpp"
+#include "utils/tools.hpp"
+
+namespace saqlib {
+/**
+ * @brief Ids of a cluster, frame-of-reference coded and bit-packed per block of KFastScanSize
+ *
+ * Layout: one BlockHeader per block, then the packed deltas of all blocks, then 8 bytes of
+ * padding so every id can be read with one unaligned 64-bit load. A block stores the
+ * smallest id as its base and `width` bits per delta, so clusters of consecutive or nearby
+ * ids take far fewer than 32 bits per vector.
+ */
+class PackedIds {
+  public:
+    struct BlockHeader {
+        PID base;              // smallest id of the block
+        uint32_t offset_width; // offset of the deltas in 4-byte words << 6 | bits per delta
+    };
+    static_assert(sizeof(BlockHeader) == 8);
+
+    static constexpr size_t kPaddingBytes = 8;
+
+    /**
+     * @brief Bytes needed to encode `num` ids
+     */
+    static size_t encoded_bytes(const PID *ids, size_t num) {
+        const size_t num_blocks = utils::div_rd_up(num, KFastScanSize);
+        size_t bytes = num_blocks * sizeof(BlockHeader) + kPaddingBytes;
+        for (size_t b = 0; b < num_blocks; ++b) {
+            bytes += block_width(ids, num, b) * KFastScanSize / 8;
+        }
+        return bytes;
+    }
+
+    /**
+     * @brief Encode `num` ids into `out`, which must hold encoded_bytes() zeroed bytes
+     */
+    static void encode(const PID *ids, size_t num, uint8_t *out) {
+        const size_t num_blocks = utils::div_rd_up(num, KFastScanSize);
+        auto *headers = reinterpret_cast<BlockHeader *>(out);
+        uint8_t *payload = out + num_blocks * sizeof(BlockHeader);
+        size_t offset_words = 0;
+        for (size_t b = 0; b < num_blocks; ++b) {
+            const size_t begin = b * KFastScanSize;
+            const size_t end = std::min(begin + KFastScanSize, num);
+            const PID base = *std::min_element(ids + begin, ids + end);
+            const uint32_t width = block_width(ids, num, b);
+            CHECK_LT(offset_words, 1ul << 26) << "Too many ids in one cluster";
+            headers[b] = {base, static_cast<uint32_t>(offset_words << 6) | width};
+
+            uint8_t *dst = payload + offset_words * 4;
+            for (size_t j = 0; width && j < end - begin; ++j) {
+                const uint64_t delta = ids[begin + j] - base;
+                const size_t pos = j * width;
+                uint64_t word;
+                std::memcpy(&word, dst + pos / 8, sizeof(word));
+                word |= delta << (pos % 8);
+                std::memcpy(dst + pos / 8, &word, sizeof(word));
+            }
+            offset_words += width * KFastScanSize / 32;
+        }
+    }
+
+    /**
+     * @brief Decode the id of the idx-th vector
+     */
+    static PID get(const uint8_t *packed, size_t num_blocks, size_t idx) {
+        const auto &hdr = reinterpret_cast<const BlockHeader *>(packed)[idx / KFastScanSize];
+        const uint32_t width = hdr.offset_width & 63;
+        const uint8_t *src = packed + num_blocks * sizeof(BlockHeader) + (hdr.offset_width >> 6) * 4;
+        const size_t pos = (idx % KFastScanSize) * width;
+        uint64_t word;
+        std::memcpy(&word, src + pos / 8, sizeof(word));
+        return hdr.base + static_cast<PID>((word >> (pos % 8)) & ((1ull << width) - 1));
+    }
+
+  private:
+    static uint32_t block_width(const PID *ids, size_t num, size_t b) {
+        const size_t begin = b * KFastScanSize;
+        const size_t end = std::min(begin + KFastScanSize, num);
+        auto [mi, mx] = std::minmax_element(ids + begin, ids + end);
+        return std::bit_width(static_cast<uint32_t>(*mx - *mi));
+    }
+};
+} // namespace saqlib
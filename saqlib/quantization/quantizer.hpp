@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstddef>
@@ -38,28 +39,61 @@ class QuantizerCluster {
     virtual ~QuantizerCluster() {}
 
     virtual void quantize(const FloatRowMat &or_vecs, const FloatVec &centroid, CAQClusterData &clus) const {
-        CHECK_EQ(or_vecs.cols(), num_dim_pad_) << "Input vector dimension does not match quantizer dimension";
-        CHECK_EQ(centroid.cols(), num_dim_pad_) << "Centroid dimension does not match quantizer dimension";
+        prepare_centroid(centroid, clus);
+        quantize_blocks(or_vecs, clus, 0, clus.num_blocks(), metrics_);
+    }
 
-        FloatRowMat o_vecs;
+    /**
+     * @brief Store the (rotated) centroid of the cluster. Must precede quantize_blocks().
+     */
+    void prepare_centroid(const FloatVec &centroid, CAQClusterData &clus) const {
+        CHECK_EQ(centroid.cols(), num_dim_pad_) << "Centroid dimension does not match quantizer dimension";
         if (data_->rotator) {
             clus.centroid() = centroid * data_->rotator->get_P(); // rotated centroid
-            o_vecs = (or_vecs * data_->rotator->get_P()).rowwise() - clus.centroid();
         } else {
             clus.centroid() = centroid; // centroid
+        }
+    }
+
+    /**
+     * @brief Quantize the vectors of blocks [blk_begin, blk_end) of a cluster
+     *
+     * Disjoint block ranges of the same cluster can be quantized concurrently, and the codes are
+     * the same however the cluster is split into ranges.
+     *
+     * @param or_vecs Vectors of the range, row r is vector blk_begin * KFastScanSize + r
+     * @param metrics Metrics to update, owned by the caller
+     */
+    void quantize_blocks(const FloatRowMat &or_vecs, CAQClusterData &clus, size_t blk_begin, size_t blk_end,
+                         QuantMetrics &metrics) const {
+        CHECK_EQ(or_vecs.cols(), num_dim_pad_) << "Input vector dimension does not match quantizer dimension";
+
+        FloatRowMat o_vecs;
+        if (data_->rotator) {
+            // One GEMM per block: the rounding of a GEMM depends on its size, and the codes must
+            // not depend on how the blocks of the cluster were split into ranges
+            o_vecs.resize(or_vecs.rows(), num_dim_pad_);
+            for (Eigen::Index r = 0; r < or_vecs.rows(); r += KFastScanSize) {
+                const Eigen::Index n = std::min<Eigen::Index>(KFastScanSize, or_vecs.rows() - r);
+                o_vecs.middleRows(r, n).noalias() = or_vecs.middleRows(r, n) * data_->rotator->get_P();
+            }
+            o_vecs.rowwise() -= clus.centroid();
+        } else {
             o_vecs = or_vecs.rowwise() - clus.centroid();
         }
 
-        const size_t num_points = clus.num_vec(); // Num of point in this cluster
+        const size_t vec_begin = blk_begin * KFastScanSize;
+        const size_t vec_end = std::min(blk_end * KFastScanSize, clus.num_vec());
+        DCHECK_EQ((size_t)or_vecs.rows(), vec_end - vec_begin);
 
         // TODO: Support other quantization types
         CHECK(data_->cfg.quant_type == BaseQuantType::CAQ) << "Only CAQ is supported for DataQuantizer";
         CAQEncoder encoder(num_dim_pad_, num_bits_, data_->cfg);
-        ClusterPacker packer(num_dim_pad_, num_bits_, clus, data_->cfg.use_fastscan);
+        ClusterPacker packer(num_dim_pad_, num_bits_, clus, data_->cfg.use_fastscan, blk_begin, blk_end);
 
         CaqCode caq;
-        for (size_t i = 0; i < num_points; ++i) {
-            const auto &curr_vec = o_vecs.row(i);
+        for (size_t i = vec_begin; i < vec_end; ++i) {
+            const auto &curr_vec = o_vecs.row(i - vec_begin);
 
             encoder.encode_and_fac(curr_vec, caq);
             packer.store_and_pack(i, caq);
@@ -71,7 +105,7 @@ class QuantizerCluster {
             if (oa_l2sqr && o_l2norm) {
                 ipre = std::abs(caq.ip_o_oa) / o_l2norm / std::sqrt(oa_l2sqr);
             }
-            metrics_.norm_ip_o_oa.insert(ipre);
+            metrics.norm_ip_o_oa.insert(ipre);
         }
 
         // Finalize and store all packed data
@@ -176,26 +210,9 @@ class QuantizerSingle {
      * @param short_code_begin Output buffer for short codes
      */
     void pack_short_codes(const Eigen::VectorXi &code, uint8_t *short_code_begin) const {
-        const size_t shortcode_byte_num = num_dim_pad_ / 8;
-        const uint16_t short_bit = num_bits_ ? (1 << (num_bits_ - 1)) : 0;
-
-        for (size_t j = 0; j < shortcode_byte_num; ++j) {
-            uint8_t byte = 0;
-            const size_t base_idx = j * 8;
-
-            // Pack 8 bits into one byte (MSB first)
-            byte |= (code[base_idx + 0] & short_bit) ? 0x80 : 0;
-            byte |= (code[base_idx + 1] & short_bit) ? 0x40 : 0;
-            byte |= (code[base_idx + 2] & short_bit) ? 0x20 : 0;
-            byte |= (code[base_idx + 3] & short_bit) ? 0x10 : 0;
-            byte |= (code[base_idx + 4] & short_bit) ? 0x08 : 0;
-            byte |= (code[base_idx + 5] & short_bit) ? 0x04 : 0;
-            byte |= (code[base_idx + 6] & short_bit) ? 0x02 : 0;
-            byte |= (code[base_idx + 7] & short_bit) ? 0x01 : 0;
-
-            auto j_cov = j + 7 - 2 * (j % 8); // reverse every 8 uint8_t for no-fastscan
-            short_code_begin[j_cov] = byte;
-        }
+        const int32_t short_bit = num_bits_ ? (1 << (num_bits_ - 1)) : 0;
+        // MSB first, every 64 dims reversed as a big-endian uint64_t for no-fastscan
+        utils::pack_bit_plane_u64(short_code_begin, code.data(), short_bit, num_dim_pad_);
     }
 
     /**
@@ -204,17 +221,9 @@ class QuantizerSingle {
      * @param long_code_begin Output buffer for long codes
      */
     void pack_long_codes(const Eigen::VectorXi &code, uint8_t *long_code_begin) const {
-        const uint16_t short_bit = 1 << (num_bits_ - 1);
-        auto compacted_code_func = utils::get_compacted_code16_func(num_bits_ - 1);
-
-        Uint16Vec long_code_buffer;
-        long_code_buffer.resize(num_dim_pad_);
-        for (size_t j = 0; j < num_dim_pad_; ++j) {
-            long_code_buffer[j] = code[j] & (short_bit - 1);
-        }
-
-        // Compact the long codes
-        compacted_code_func(long_code_begin, &long_code_buffer(0, 0), num_dim_pad_);
+        // Compact the low num_bits_ - 1 bits straight from the code
+        auto compacted_code_func = utils::get_compacted_code32_func(num_bits_ - 1);
+        compacted_code_func(long_code_begin, code.data(), num_dim_pad_);
     }
 };
 
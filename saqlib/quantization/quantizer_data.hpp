@@ -23,7 +23,7 @@ struct BaseQuantizerData {
         }
     }
 
-    void save(std::ofstream &output) const {
+    void save(std::ostream &output) const {
         output.write(reinterpret_cast<const char *>(&num_dim_pad), sizeof(size_t));
         output.write(reinterpret_cast<const char *>(&num_bits), sizeof(size_t));
         output.write(reinterpret_cast<const char *>(&cfg), sizeof(QuantSingleConfig));
@@ -34,7 +34,7 @@ struct BaseQuantizerData {
         }
     }
 
-    void load(std::ifstream &input) {
+    void load(std::istream &input) {
         input.read(reinterpret_cast<char *>(&num_dim_pad), sizeof(size_t));
         input.read(reinterpret_cast<char *>(&num_bits), sizeof(size_t));
         input.read(reinterpret_cast<char *>(&cfg), sizeof(QuantSingleConfig));
@@ -1,9 +1,14 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
 #include <fstream>
+#include <immintrin.h>
+#include <limits>
 #include <memory>
 #include <vector>
 
@@ -13,6 +18,7 @@
 #include "defines.hpp"
 #include "quantization/config.h"
 #include "quantization/quantizer_data.hpp"
+#include "quantization/scan_cost_model.hpp"
 #include "utils/IO.hpp"
 #include "utils/tools.hpp"
 
@@ -26,8 +32,13 @@ struct SaqData {
     std::vector<BaseQuantizerData> base_datas;
     QuantPlanT quant_plan; // quantization plan, each pair is (dimension length, bits)
 
-    void save(std::ofstream &output) const {
-        output.write(reinterpret_cast<const char *>(&cfg), sizeof(QuantizeConfig));
+    // planner and later options only affect building or the in-memory layout, persist the fields before them
+    static constexpr size_t kPersistCfgBytes = offsetof(QuantizeConfig, planner);
+    static_assert(offsetof(QuantizeConfig, factor_type) < offsetof(QuantizeConfig, single),
+                  "factor_type must stay in the padding before `single` to keep the format");
+
+    void save(std::ostream &output) const {
+        output.write(reinterpret_cast<const char *>(&cfg), kPersistCfgBytes);
         output.write(reinterpret_cast<const char *>(&num_dim), sizeof(size_t));
         utils::save_floatvec(output, data_variance);
 
@@ -38,8 +49,18 @@ struct SaqData {
         }
     }
 
-    void load(std::ifstream &input) {
-        input.read(reinterpret_cast<char *>(&cfg), sizeof(QuantizeConfig));
+    /**
+     * @brief Load the quantization data. `legacy` files (without the sectioned header) wrote
+     * the padding now holding factor_type uninitialized, so their factors are read as Fp32
+     */
+    void load(std::istream &input, bool legacy = false) {
+        cfg = QuantizeConfig();
+        input.read(reinterpret_cast<char *>(&cfg), kPersistCfgBytes);
+        if (legacy) {
+            cfg.factor_type = FactorType::Fp32;
+        }
+        CHECK_LE(static_cast<uint8_t>(cfg.factor_type), static_cast<uint8_t>(FactorType::Bf16))
+            << "Bad factor type in the index file";
         input.read(reinterpret_cast<char *>(&num_dim), sizeof(size_t));
         utils::load_floatvec(input, data_variance);
         CHECK_EQ(data_variance.cols(), num_dim) << "data_variance size mismatch with num_dim";
@@ -122,6 +143,10 @@ class SaqDataMaker {
         if (data_->cfg.enable_segmentation) {
             if (data_->cfg.seg_eqseg > 0) {
                 data_->quant_plan = equal_segmentation(data_->cfg.seg_eqseg);
+            } else if (data_->cfg.planner.mode != PlannerMode::Error) {
+                const auto &cost_model = data_->cfg.planner.cost_model;
+                const auto model = cost_model.empty() ? ScanCostModel::host() : ScanCostModel::load(cost_model.c_str());
+                data_->quant_plan = latency_aware_plan(data_->data_variance, data_->cfg.avg_bits, model);
             } else {
                 data_->quant_plan = dynamic_programming(data_->data_variance, data_->cfg.avg_bits);
             }
@@ -144,80 +169,123 @@ class SaqDataMaker {
         return quant_plan;
     }
 
+    /**
+     * @brief dst[k] = min(dst[k], src[k] + v) and record `code` on strict improvement
+     */
+    static void relax_layer(const double *src, double *dst, uint16_t *trace, size_t num, double v, uint16_t code) {
+        const __m512d v512 = _mm512_set1_pd(v);
+        const __m128i code128 = _mm_set1_epi16(static_cast<short>(code));
+        for (size_t k = 0; k < num; k += 8) {
+            const __mmask8 valid = num - k >= 8 ? 0xff : static_cast<__mmask8>((1u << (num - k)) - 1);
+            __m512d cand = _mm512_add_pd(_mm512_maskz_loadu_pd(valid, src + k), v512);
+            __m512d cur = _mm512_maskz_loadu_pd(valid, dst + k);
+            __mmask8 better = _mm512_mask_cmp_pd_mask(valid, cand, cur, _CMP_LT_OQ);
+            _mm512_mask_storeu_pd(dst + k, better, cand);
+            _mm_mask_storeu_epi16(trace + k, better, code128);
+        }
+    }
+
+    /**
+     * @brief Search the bits allocation plan minimizing the estimated error
+     *
+     * f[ns][i][u]: min error of covering the first i blocks (of kDimPaddingSize dims) with ns
+     * segments using u units of kDimPaddingSize bits. Every segment consumes b * j + 1 units
+     * (codes plus short factors), so the budget is tracked in units instead of bits. Only two
+     * layers of f are kept, and per (ns, i) only the reachable unit range [ns + i, ns + 13i]
+     * is visited. For a fixed (i, j, b) the transition is a shifted element-wise min over that
+     * range, done with AVX-512 in the same candidate order as a scalar scan, so ties resolve
+     * identically. The backtrack table stores (prev_i << 4) + bits in 16 bits per state.
+     */
     QuantPlanT dynamic_programming(const FloatVec &data_variance, float avg_bits) {
         CHECK_EQ(data_variance.cols(), num_dim_padded_);
 
         const auto num_bit_factors = kNumShortFactors * sizeof(float) * 8;
+        static_assert(kNumShortFactors * sizeof(float) * 8 % kDimPaddingSize == 0);
+        const size_t fac_units = num_bit_factors / kDimPaddingSize;
         const size_t tot_bits = avg_bits * num_dim_padded_ + num_bit_factors;
+        const size_t tot_units = tot_bits / kDimPaddingSize;
         const size_t max_num_segs = avg_bits < 2 ? num_dim_padded_ / kDimPaddingSize : num_dim_padded_ / kDimPaddingSize / 2;
         constexpr auto valid_lmt = std::numeric_limits<double>::max();
-        auto f = std::vector<std::vector<std::vector<std::pair<double, size_t>>>>(
-            max_num_segs + 1, std::vector<std::vector<std::pair<double, size_t>>>(
-                                  num_dim_padded_ / kDimPaddingSize + 1, std::vector<std::pair<double, size_t>>(
-                                                                             tot_bits + 1, {valid_lmt, 0})));
         const size_t i_end = num_dim_padded_ / kDimPaddingSize;
+        CHECK_LT(i_end, 1ul << 12) << "Too many blocks for the backtrack table";
+
+        const size_t row_size = tot_units + 1;
+        const size_t layer_size = (i_end + 1) * row_size;
+        std::vector<double> f_cur(layer_size, valid_lmt);
+        std::vector<double> f_nxt(layer_size);
+        std::vector<uint16_t> trace((max_num_segs + 1) * layer_size, 0);
+
+        std::vector<float> blk_vars(i_end);
+        for (size_t k = 0; k < i_end; ++k) {
+            blk_vars[k] = data_variance.segment(k * kDimPaddingSize, kDimPaddingSize).sum();
+        }
+
         size_t ans_ns = 0;
-        size_t ans_i = i_end;
-        size_t ans_b = tot_bits;
-        f[0][0][0] = {0, 0};
+        size_t ans_u = tot_units;
+        double ans_f = valid_lmt;
+        f_cur[0] = 0;
         for (size_t ns = 0; ns <= max_num_segs; ns++) {
-            for (size_t i = 0; i <= i_end; i++) {
-                for (size_t used_bits = 0; used_bits <= tot_bits; ++used_bits)
-                    if (f[ns][i][used_bits].first < valid_lmt) {
-                        if (i == i_end) {
-                            if (f[ns][i][used_bits].first * (1.01) < f[ans_ns][ans_i][ans_b].first) {
-                                ans_ns = ns;
-                                ans_i = i;
-                                ans_b = used_bits;
-                            }
-                            continue;
-                        }
-                        if (ns == max_num_segs) {
-                            continue;
-                        }
+            const double *f_end = &f_cur[i_end * row_size];
+            for (size_t u = 0; u <= tot_units; ++u) {
+                if (f_end[u] < valid_lmt && f_end[u] * (1.01) < ans_f) {
+                    ans_ns = ns;
+                    ans_u = u;
+                    ans_f = f_end[u];
+                }
+            }
+            if (ns == max_num_segs) {
+                break;
+            }
 
-                        double var_sum = 0;
-                        for (size_t j = 1; (i + j) * kDimPaddingSize <= num_dim_padded_; j++) {
-                            var_sum += data_variance.segment((i + j - 1) * kDimPaddingSize, kDimPaddingSize).sum();
-
-                            for (size_t b = 1; b <= kMaxQuantBit; ++b) {
-                                auto B_new = used_bits + b * j * kDimPaddingSize + num_bit_factors;
-                                if (B_new > tot_bits)
-                                    break;
-                                auto v = var_sum / (1 << b);
-                                auto &f_to = f[ns + 1][i + j][B_new];
-                                if (f_to.first > f[ns][i][used_bits].first + v) {
-                                    f_to.first = f[ns][i][used_bits].first + v;
-                                    f_to.second = (i << 4) + b;
-                                }
-                            }
-                        }
-                        auto err0 = var_sum;
-                        if (f[ns][i][used_bits].first + err0 < f[1 + ns][i_end][used_bits].first) {
-                            f[1 + ns][i_end][used_bits].first = f[ns][i][used_bits].first + err0;
-                            f[1 + ns][i_end][used_bits].second = (i << 4) + 0;
+            std::fill(f_nxt.begin(), f_nxt.end(), valid_lmt);
+            uint16_t *tr_nxt = &trace[(ns + 1) * layer_size];
+            for (size_t i = 0; i < i_end; i++) {
+                const size_t u_lo = ns * fac_units + i;
+                const size_t u_hi = std::min(tot_units, ns * fac_units + kMaxQuantBit * i);
+                if (u_lo > u_hi) {
+                    continue;
+                }
+                const double *f_from = &f_cur[i * row_size];
+
+                double var_sum = 0;
+                for (size_t j = 1; i + j <= i_end; j++) {
+                    var_sum += blk_vars[i + j - 1];
+                    const size_t to_row = (i + j) * row_size;
+                    // larger b comes from smaller u, keep the visiting order of the scalar version
+                    for (size_t b = kMaxQuantBit; b >= 1; --b) {
+                        const size_t shift = b * j + fac_units;
+                        if (u_lo + shift > tot_units) {
+                            continue;
                         }
+                        const size_t num = std::min(u_hi, tot_units - shift) - u_lo + 1;
+                        relax_layer(f_from + u_lo, &f_nxt[to_row + u_lo + shift], &tr_nxt[to_row + u_lo + shift],
+                                    num, var_sum / (1 << b), (i << 4) + b);
                     }
+                }
+                auto err0 = var_sum;
+                relax_layer(f_from + u_lo, &f_nxt[i_end * row_size + u_lo], &tr_nxt[i_end * row_size + u_lo],
+                            u_hi - u_lo + 1, err0, (i << 4) + 0);
             }
+            std::swap(f_cur, f_nxt);
         }
 
         // Backtrack to get the most optimized quantization plan
         QuantPlanT quant_plan;
         {
             size_t ns = ans_ns;
-            size_t i = ans_i;
-            size_t B = ans_b;
+            size_t i = i_end;
+            size_t u = ans_u;
             while (i > 0) {
-                auto &f_cur = f[ns][i][B];
-                auto pev_i = (f_cur.second >> 4);
-                auto curr_bits = f_cur.second & 0xf;
+                auto code = trace[ns * layer_size + i * row_size + u];
+                auto pev_i = static_cast<size_t>(code >> 4);
+                auto curr_bits = static_cast<size_t>(code & 0xf);
                 auto curr_dim_len = (i - pev_i) * kDimPaddingSize;
                 quant_plan.emplace_back(curr_dim_len, curr_bits);
 
                 ns--;
                 i = pev_i;
                 if (curr_bits)
-                    B -= curr_bits * curr_dim_len + num_bit_factors;
+                    u -= curr_bits * (curr_dim_len / kDimPaddingSize) + fac_units;
             }
 
             // Reverse the plan since we constructed it by working backwards
@@ -225,5 +293,189 @@ class SaqDataMaker {
         }
         return quant_plan;
     }
+
+    struct PlanEstimate {
+        QuantPlanT plan;
+        double error = 0; // sum of variance / 2^bits
+        double cost = 0;  // ns per scanned vector
+    };
+
+    /**
+     * @brief Plan minimizing error + lambda * cost under the bits budget
+     *
+     * f[i][u]: min objective covering the first i blocks with u units of kDimPaddingSize bits.
+     * The number of segments is not bounded here, the per-segment cost takes its place.
+     *
+     * @param seg_cost Cost of a segment of j blocks with b bits at [j * (kMaxQuantBit + 1) + b]
+     */
+    PlanEstimate lagrangian_plan(const std::vector<float> &blk_vars, const std::vector<double> &seg_cost,
+                                 size_t tot_units, double lambda) const {
+        constexpr auto valid_lmt = std::numeric_limits<double>::max();
+        const size_t fac_units = kNumShortFactors * sizeof(float) * 8 / kDimPaddingSize;
+        const size_t i_end = blk_vars.size();
+        const size_t row_size = tot_units + 1;
+        std::vector<double> f((i_end + 1) * row_size, valid_lmt);
+        std::vector<uint16_t> trace((i_end + 1) * row_size, 0);
+
+        f[0] = 0;
+        for (size_t i = 0; i < i_end; i++) {
+            const size_t u_lo = i ? i + fac_units : 0;
+            if (u_lo > tot_units) {
+                break;
+            }
+            const double *f_from = &f[i * row_size];
+            double var_sum = 0;
+            for (size_t j = 1; i + j <= i_end; j++) {
+                var_sum += blk_vars[i + j - 1];
+                const size_t to_row = (i + j) * row_size;
+                for (size_t b = 1; b <= kMaxQuantBit; ++b) {
+                    const size_t shift = b * j + fac_units;
+                    if (u_lo + shift > tot_units) {
+                        break;
+                    }
+                    auto v = var_sum / (1 << b) + lambda * seg_cost[j * (kMaxQuantBit + 1) + b];
+                    relax_layer(f_from + u_lo, &f[to_row + u_lo + shift], &trace[to_row + u_lo + shift],
+                                tot_units - shift - u_lo + 1, v, (i << 4) + b);
+                }
+            }
+            auto v0 = var_sum + lambda * seg_cost[(i_end - i) * (kMaxQuantBit + 1)];
+            relax_layer(f_from + u_lo, &f[i_end * row_size + u_lo], &trace[i_end * row_size + u_lo],
+                        tot_units - u_lo + 1, v0, (i << 4) + 0);
+        }
+
+        const double *f_end = &f[i_end * row_size];
+        size_t u = std::min_element(f_end, f_end + row_size) - f_end;
+
+        QuantPlanT plan;
+        for (size_t i = i_end; i > 0;) {
+            auto code = trace[i * row_size + u];
+            auto pev_i = static_cast<size_t>(code >> 4);
+            auto bits = static_cast<size_t>(code & 0xf);
+            auto num_blks = i - pev_i;
+            plan.emplace_back(num_blks * kDimPaddingSize, bits);
+            i = pev_i;
+            if (bits)
+                u -= bits * num_blks + fac_units;
+        }
+        std::reverse(plan.begin(), plan.end());
+        return estimate_plan(std::move(plan), blk_vars, seg_cost);
+    }
+
+    /**
+     * @brief Error and cost of `plan`, with the segment costs of lagrangian_plan()
+     */
+    static PlanEstimate estimate_plan(QuantPlanT plan, const std::vector<float> &blk_vars,
+                                      const std::vector<double> &seg_cost) {
+        PlanEstimate res;
+        size_t blk = 0;
+        for (auto [dim, bits] : plan) {
+            const size_t num_blks = dim / kDimPaddingSize;
+            double var_sum = 0;
+            for (size_t k = blk; k < blk + num_blks; ++k) {
+                var_sum += blk_vars[k];
+            }
+            res.error += var_sum / (1 << bits);
+            res.cost += seg_cost[num_blks * (kMaxQuantBit + 1) + bits];
+            blk += num_blks;
+        }
+        res.plan = std::move(plan);
+        return res;
+    }
+
+    /**
+     * @brief Cost of every segment under `model`, indexed as lagrangian_plan() expects
+     */
+    std::vector<double> segment_costs(const ScanCostModel &model) const {
+        const auto &planner = data_->cfg.planner;
+        const size_t i_end = num_dim_padded_ / kDimPaddingSize;
+        const double avg_clu = planner.avg_cluster_size > 0 ? planner.avg_cluster_size : 256;
+        std::vector<double> seg_cost((i_end + 1) * (kMaxQuantBit + 1));
+        for (size_t j = 1; j <= i_end; ++j) {
+            for (size_t b = 0; b <= kMaxQuantBit; ++b) {
+                seg_cost[j * (kMaxQuantBit + 1) + b] = model.segment_cost(j * kDimPaddingSize, b, avg_clu, planner.acc_ratio);
+            }
+        }
+        return seg_cost;
+    }
+
+    /**
+     * @brief Latency-aware segmentation planning
+     *
+     * Segment costs come from `model`: ScanCostModel::host(), a micro-benchmark of the
+     * fastscan, LUT and long code kernels on this machine, or the model saved in
+     * cfg.planner.cost_model. The Lagrangian weight is searched so that the plan meets
+     * cfg.planner.budget:
+     *  - PlannerMode::Latency: min error with cost <= budget (ns per scanned vector)
+     *  - PlannerMode::ErrorBound: min cost with error <= budget * total variance
+     * If the plan of dynamic_programming() meets a latency budget, it is kept, so a budget
+     * that does not bind plans as PlannerMode::Error does.
+     */
+    QuantPlanT latency_aware_plan(const FloatVec &data_variance, float avg_bits, const ScanCostModel &model) {
+        CHECK_EQ(data_variance.cols(), num_dim_padded_);
+        const auto &planner = data_->cfg.planner;
+        CHECK_GT(planner.budget, 0) << "planner budget must be set for latency-aware planning";
+        LOG(INFO) << "Scan cost model (ns): " << model.toString();
+
+        const size_t num_bit_factors = kNumShortFactors * sizeof(float) * 8;
+        const size_t tot_units = static_cast<size_t>(avg_bits * num_dim_padded_ + num_bit_factors) / kDimPaddingSize;
+        const size_t i_end = num_dim_padded_ / kDimPaddingSize;
+        CHECK_LT(i_end, 1ul << 12) << "Too many blocks for the backtrack table";
+
+        std::vector<float> blk_vars(i_end);
+        double tot_var = 0;
+        for (size_t k = 0; k < i_end; ++k) {
+            blk_vars[k] = data_variance.segment(k * kDimPaddingSize, kDimPaddingSize).sum();
+            tot_var += blk_vars[k];
+        }
+        const auto seg_cost = segment_costs(model);
+
+        auto plan_at = [&](double lambda) { return lagrangian_plan(blk_vars, seg_cost, tot_units, lambda); };
+        // cost decreases and error increases with lambda
+        auto feasible = [&](const PlanEstimate &p) {
+            return planner.mode == PlannerMode::Latency ? p.cost <= planner.budget : p.error <= planner.budget * tot_var;
+        };
+
+        if (planner.mode == PlannerMode::Latency) {
+            auto dp = estimate_plan(dynamic_programming(data_variance, avg_bits), blk_vars, seg_cost);
+            if (feasible(dp)) {
+                LOG(INFO) << fmt::format("Latency-aware plan: the min error plan meets the budget, cost {:.1f} ns/vec",
+                                         dp.cost);
+                return dp.plan;
+            }
+        }
+
+        auto lo = plan_at(0); // min error
+        auto hi = plan_at(tot_var * 1e12); // min cost
+        PlanEstimate best;
+        if (planner.mode == PlannerMode::Latency && feasible(lo)) {
+            best = lo;
+        } else if (planner.mode == PlannerMode::ErrorBound && feasible(hi)) {
+            best = hi;
+        } else if (!feasible(planner.mode == PlannerMode::Latency ? hi : lo)) {
+            LOG(WARNING) << fmt::format("Planner budget {} can not be met, use the closest plan", planner.budget);
+            best = planner.mode == PlannerMode::Latency ? hi : lo;
+        } else {
+            // bisect lambda in log space. Latency: smallest feasible lambda, ErrorBound: largest.
+            double l_lo = std::log(tot_var * 1e-12 + 1e-30), l_hi = std::log(tot_var * 1e12 + 1e-30);
+            best = planner.mode == PlannerMode::Latency ? hi : lo;
+            for (int it = 0; it < 48; ++it) {
+                double mid = (l_lo + l_hi) / 2;
+                auto p = plan_at(std::exp(mid));
+                bool ok = feasible(p);
+                if (ok) {
+                    best = std::move(p);
+                }
+                if (ok == (planner.mode == PlannerMode::Latency)) {
+                    l_hi = mid;
+                } else {
+                    l_lo = mid;
+                }
+            }
+        }
+
+        LOG(INFO) << fmt::format("Latency-aware plan: {} segments, rel. error {:.4e} (min {:.4e}), cost {:.1f} ns/vec (max {:.1f})",
+                                 best.plan.size(), best.error / tot_var, lo.error / tot_var, best.cost, lo.cost);
+        return best.plan;
+    }
 };
 } // namespace saqlib
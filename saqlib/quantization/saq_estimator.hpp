@@ -63,6 +63,7 @@ class SaqEstimatorBase {
             auto metrics = estimator.getRuntimeMetrics();
             runtime_metrics.acc_bitsum += metrics.acc_bitsum;
             runtime_metrics.fast_bitsum += metrics.fast_bitsum;
+            runtime_metrics.factor_bytes += metrics.factor_bytes;
         }
         return runtime_metrics;
     }
@@ -108,10 +109,16 @@ class SaqCluEstimator : public SaqEstimatorBase<CaqCluEstimator<kDistType>> {
      * @param saq_clust Pointer to SAQ cluster data to search within
      */
     void prepare(const SaqCluData *saq_clust) {
+        utils::NoProfiler profiler;
+        prepare(saq_clust, profiler);
+    }
+
+    template <typename Profiler>
+    void prepare(const SaqCluData *saq_clust, Profiler &profiler) {
         curr_saq_cluster_ = saq_clust;
         DCHECK_EQ(estimators_.size(), saq_clust->num_segments_);
         for (size_t c_i = 0; c_i < estimators_.size(); ++c_i) {
-            estimators_[c_i].prepare(&saq_clust->get_segment(c_i));
+            estimators_[c_i].prepare(&saq_clust->get_segment(c_i), profiler);
         }
     }
 
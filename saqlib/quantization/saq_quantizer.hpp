@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
 #include <cstddef>
 #include <cstring>
@@ -13,6 +14,7 @@
 #include "quantization/cluster_data.hpp"
 #include "quantization/quantizer.hpp"
 #include "quantization/saq_data.hpp"
+#include "utils/half.hpp"
 #include "utils/tools.hpp"
 
 namespace saqlib {
@@ -33,10 +35,80 @@ class SAQuantizer {
 
     void quantize_cluster(const FloatRowMat &data, const FloatVec &centroid, const std::vector<PID> &IDs,
                           SaqCluData &saq_clus) {
+        double bound = 0;
+        for (auto id : IDs) {
+            bound = std::max(bound, factor_bound(&data(id, 0), centroid));
+        }
+        utils::check_factor_range(saq_clus.factor_type_, bound);
+        prepare_cluster(centroid, IDs, saq_clus);
+        quantize_blocks(data, saq_clus, 0, saq_clus.num_blocks_);
+    }
+
+    /**
+     * @brief Upper bound of the factors of vector `vec` in the cluster of `centroid`, in all segments
+     *
+     * Computed from the norms of the segments before quantization, see CAQEncoder::factor_bound().
+     * The residual norm of a segment does not change with its rotation.
+     */
+    double factor_bound(const float *vec, const FloatVec &centroid) const {
+        double bound = 0;
+        for (size_t ci = 0, offset = 0; ci < data_quans_.size(); ++ci) {
+            const auto &quan = *data_quans_[ci];
+            const size_t copy_size = std::min(quan.num_dim_pad_, num_dim_ - offset);
+            const auto cen = centroid.segment(offset, copy_size);
+            const double o_l2norm = (Eigen::Map<const FloatVec>(vec + offset, copy_size) - cen).norm();
+            bound = std::max(bound, CAQEncoder::factor_bound(o_l2norm, cen.norm(), quan.num_dim_pad_, quan.num_bits_));
+            offset += quan.num_dim_pad_;
+        }
+        return bound;
+    }
+
+    /**
+     * @brief Store the ids and the per-segment centroids of a cluster
+     *
+     * Must be called once per cluster before quantize_blocks().
+     */
+    void prepare_cluster(const FloatVec &centroid, const std::vector<PID> &IDs, SaqCluData &saq_clus) const {
         CHECK_EQ(saq_clus.num_segments_, data_quans_.size());
-        std::copy(IDs.begin(), IDs.end(), saq_clus.ids());
+        CHECK_EQ(IDs.size(), saq_clus.num_vec_);
+        saq_clus.set_ids(IDs.data());
+
+        for (size_t ci = 0, offset = 0; ci < saq_clus.num_segments_; ++ci) {
+            auto &clus = saq_clus.get_segment(ci);
+            const size_t copy_size = std::min(clus.num_dim_padded_, num_dim_ - offset);
+
+            FloatVec cen(clus.num_dim_padded_);
+            cen.setZero();
+            // Copy centroid data
+            cen.head(copy_size) = centroid.segment(offset, copy_size);
 
-        const size_t num_points = saq_clus.num_vec_;
+            data_quans_[ci]->prepare_centroid(cen, clus);
+            offset += clus.num_dim_padded_;
+        }
+    }
+
+    /**
+     * @brief Quantize blocks [blk_begin, blk_end) of a prepared cluster in all segments
+     *
+     * @param metrics Metrics to update. Uses the per-segment quantizer metrics if null,
+     *                which is not thread safe.
+     */
+    void quantize_blocks(const FloatRowMat &data, SaqCluData &saq_clus, size_t blk_begin, size_t blk_end,
+                         QuantMetrics *metrics = nullptr) const {
+        quantize_blocks_from([&](PID id) { return &data(id, 0); }, saq_clus, blk_begin, blk_end, metrics);
+    }
+
+    /**
+     * @brief quantize_blocks() reading the vector of id `id` from `row(id)`, a `const float *`
+     *
+     * For callers that do not hold the whole dataset, e.g. a build streaming the base set.
+     */
+    template <class RowFn>
+    void quantize_blocks_from(RowFn &&row, SaqCluData &saq_clus, size_t blk_begin, size_t blk_end,
+                              QuantMetrics *metrics = nullptr) const {
+        const size_t vec_begin = blk_begin * KFastScanSize;
+        const size_t vec_end = std::min(blk_end * KFastScanSize, saq_clus.num_vec_);
+        const size_t num_points = vec_end - vec_begin;
         for (size_t ci = 0, offset = 0; ci < saq_clus.num_segments_; ++ci) {
             auto &clus = saq_clus.get_segment(ci);
             const size_t copy_size = std::min(clus.num_dim_padded_, num_dim_ - offset);
@@ -45,16 +117,12 @@ class SAQuantizer {
             vecs.setZero();
             // Copy data for each row individually
             for (size_t r = 0; r < num_points; ++r) {
-                auto id = clus.ids()[r];
-                vecs.row(r).head(copy_size) = data.row(id).segment(offset, copy_size);
+                auto id = saq_clus.id(vec_begin + r);
+                vecs.row(r).head(copy_size) = Eigen::Map<const FloatVec>(row(id) + offset, copy_size);
             }
 
-            FloatVec cen(clus.num_dim_padded_);
-            cen.setZero();
-            // Copy centroid data
-            cen.head(copy_size) = centroid.segment(offset, copy_size);
-
-            data_quans_[ci]->quantize(vecs, cen, clus);
+            auto &quan = data_quans_[ci];
+            quan->quantize_blocks(vecs, clus, blk_begin, blk_end, metrics ? *metrics : quan->metrics_);
             offset += clus.num_dim_padded_;
         }
     }
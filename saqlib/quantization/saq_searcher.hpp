@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <bit>
 #include <cstring>
 #include <immintrin.h>
@@ -16,16 +17,54 @@
 #include "quantization/saq_estimator.hpp"
 #include "utils/memory.hpp"
 #include "utils/pool.hpp"
+#include "utils/stage_profiler.hpp"
 
 namespace saqlib {
-template <DistType kDistType = DistType::Any>
+/**
+ * @brief Vectors of a cluster left after the fast scan, whose long codes are fetched before
+ * they are refined. See SAQSearcher::collectBlocks() and SAQSearcher::refineCluster().
+ */
+struct TieredCandidates {
+    const SaqCluData *cluster = nullptr;
+    std::vector<uint32_t> idx;   // index of the vector in the cluster
+    std::vector<float> est;      // estimated distance after the fast scan
+    std::vector<float> blk_bound; // bound of the block of the vector, see SAQSearcher::fastScanBlock()
+    std::vector<float> seg_est;  // part of `est` from each segment, candidate-major
+    std::vector<float> short_ip; // getShortIP() of each segment, candidate-major
+    std::vector<uint8_t, memory::AlignedAllocator<uint8_t>> records; // long data, long_record_bytes() per candidate
+    size_t block_hits = 0;
+    size_t block_misses = 0;
+
+    void clear(const SaqCluData *clu) {
+        cluster = clu;
+        idx.clear();
+        est.clear();
+        blk_bound.clear();
+        seg_est.clear();
+        short_ip.clear();
+        block_hits = 0;
+        block_misses = 0;
+    }
+    size_t size() const { return idx.size(); }
+};
+
+/**
+ * @tparam Profiler utils::NoProfiler, or utils::CycleProfiler to record the cycles and survivors
+ * of each stage of searchCluster() into getProfile()
+ */
+template <DistType kDistType = DistType::Any, typename Profiler = utils::NoProfiler>
 class SAQSearcher : public SaqCluEstimator<kDistType> {
     using SaqCluEstimator<kDistType>::FAST_ARRAY;
     using SaqCluEstimator<kDistType>::estimators_;
+    using Stage = utils::SearchStage;
 
     float *clu_dist_;
     __m512 *clu_dist512_;
     QueryRuntimeMetrics runtime_metrics_;
+    [[no_unique_address]] Profiler profiler_;
+
+    // only used when Profiler::kEnabled
+    utils::SearchProfile &profile() { return *profiler_.profile(); }
 
   public:
     /**
@@ -54,6 +93,11 @@ class SAQSearcher : public SaqCluEstimator<kDistType> {
         return runtime_metrics_;
     }
 
+    /**
+     * @brief Stages of the clusters searched so far, nullptr without profiler
+     */
+    utils::SearchProfile *getProfile() { return profiler_.profile(); }
+
     /**
      * @brief Search for nearest neighbors in multiple clusters
      *
@@ -76,114 +120,284 @@ class SAQSearcher : public SaqCluEstimator<kDistType> {
         }
 
         // 0. prepare current cluster
-        this->prepare(saq_clust);
+        this->prepare(saq_clust, profiler_);
 
         auto num_blocks = saq_clust->num_blocks_;
         float distk = KNNs.distk();
         const auto num_points = saq_clust->num_vec_;
+        if constexpr (Profiler::kEnabled) {
+            profile().num_clusters++;
+            profile().num_vectors += num_points;
+        }
 
         float PORTABLE_ALIGN64 curr_dist[KFastScanSize];
-        __m512 curr_dist512[FAST_ARRAY];
+        // stages chain: each one starts where the previous ended
+        auto t = profiler_.now();
         for (size_t blk_idx = 0; blk_idx < num_blocks; ++blk_idx) {
-            curr_dist512[0] = _mm512_setzero_ps();
-            curr_dist512[1] = _mm512_setzero_ps();
+            // 1. and 2. variance and 1-bit estimates, prune the whole block
+            if (fastScanBlock<enable_var>(saq_clust, blk_idx, distk, curr_dist, t) > distk) {
+                continue;
+            }
 
+            // 3. use full bits to compute accurate distance
             const auto blk_begin = blk_idx * KFastScanSize;
-            float mi = std::numeric_limits<float>::max();
-
-            // 1. computes distance estimates using variance information for early pruning.
-            if constexpr (enable_var) {
-                for (size_t c_i = 0; c_i < clus_num; ++c_i) {
-                    auto &estimator = estimators_[c_i];
-                    auto cd = &clu_dist512_[c_i * FAST_ARRAY];
-                    estimator.varsEstDist(blk_idx, cd);
-
-                    curr_dist512[0] = _mm512_add_ps(curr_dist512[0], cd[0]);
-                    curr_dist512[1] = _mm512_add_ps(curr_dist512[1], cd[1]);
-                }
-
-                mi = _mm512_reduce_min_ps(_mm512_min_ps(curr_dist512[0], curr_dist512[1]));
-                if (mi > distk) {
-                    continue;
+            for (size_t j = 0; j < KFastScanSize; ++j) {
+                if (curr_dist[j] < distk) {
+                    auto idx = blk_begin + j;
+                    if (idx >= num_points) {
+                        break;
+                    }
+                    float acc_dist = curr_dist[j];
+                    for (size_t c_i = 0; c_i < clus_num; ++c_i) {
+                        auto &estimator = estimators_[c_i];
+                        if constexpr (Profiler::kEnabled) {
+                            profile().segment(c_i).acc_in++;
+                        }
+                        acc_dist += estimator.compAccurateDist(idx) - clu_dist_[c_i * KFastScanSize + j];
+                        if (acc_dist >= distk) {
+                            break;
+                        }
+                    }
+                    t = profiler_.add(Stage::Accurate, t);
+                    if constexpr (Profiler::kEnabled) {
+                        profile().inserted += acc_dist < distk;
+                    }
+                    KNNs.insert_lazy(acc_dist, [&] { return saq_clust->id(idx); });
+                    distk = KNNs.distk();
+                    t = profiler_.add(Stage::Insert, t);
                 }
             }
+        }
 
-            // 2. use 1st bit to compute fast distance
-            for (size_t c_i = 0; c_i < clus_num; ++c_i) {
-                auto &cur_cluster = saq_clust->get_segment(c_i);
-                auto &estimator = estimators_[c_i];
-                auto cd = &clu_dist512_[c_i * FAST_ARRAY];
+        runtime_metrics_.fast_bitsum = 0;
+        runtime_metrics_.acc_bitsum = 0;
+        runtime_metrics_.factor_bytes = 0;
+        for (size_t c_i = 0; c_i < clus_num; ++c_i) {
+            auto &estimator = estimators_[c_i];
+            auto metrics = estimator.getRuntimeMetrics();
+            runtime_metrics_.acc_bitsum += metrics.acc_bitsum;
+            runtime_metrics_.fast_bitsum += metrics.fast_bitsum;
+            runtime_metrics_.factor_bytes += metrics.factor_bytes;
+        }
+        runtime_metrics_.total_comp_cnt += num_blocks * KFastScanSize;
+    }
 
-                if (cur_cluster.num_bits_ == 0)
-                    continue;
-                if constexpr (enable_var) {
-                    curr_dist512[0] = _mm512_sub_ps(curr_dist512[0], cd[0]);
-                    curr_dist512[1] = _mm512_sub_ps(curr_dist512[1], cd[1]);
-                }
+    /**
+     * @brief First phase of searchCluster() for a cluster without long codes in memory
+     *
+     * Runs the variance and 1-bit stages on blocks [blk_begin, blk_end) and keeps the vectors
+     * that would reach the accurate stage. The blocks of a cluster are collected in order,
+     * starting with block 0 which prepares the searcher for the cluster. The candidates must
+     * be refined by this searcher before it starts another cluster.
+     *
+     * @param distk current k-th distance of the result pool
+     * @param cands output candidates, their long data is to be filled by the caller
+     */
+    template <bool enable_var = true>
+    void collectBlocks(const SaqCluData *saq_clust, size_t blk_begin, size_t blk_end, float distk,
+                       TieredCandidates &cands) {
+        auto clus_num = saq_clust->num_segments_;
+        CHECK_EQ(clus_num, estimators_.size());
+        if (blk_begin == 0) {
+            this->prepare(saq_clust);
+        }
+        DCHECK_EQ(this->curr_saq_cluster_, saq_clust);
+        cands.clear(saq_clust);
 
-                estimator.compFastDist(blk_idx, cd);
-                curr_dist512[0] = _mm512_add_ps(curr_dist512[0], cd[0]);
-                curr_dist512[1] = _mm512_add_ps(curr_dist512[1], cd[1]);
+        const auto num_points = saq_clust->num_vec_;
+        // a single segment is scanned without the variance stage, as in scanCluster()
+        const bool use_var = enable_var && clus_num > 1;
 
-                mi = _mm512_reduce_min_ps(_mm512_min_ps(curr_dist512[0], curr_dist512[1]));
-                if (mi > distk) {
-                    break;
+        float PORTABLE_ALIGN64 curr_dist[KFastScanSize];
+        auto t = profiler_.now();
+        for (size_t blk_idx = blk_begin; blk_idx < blk_end; ++blk_idx) {
+            const float bound = use_var ? fastScanBlock<enable_var>(saq_clust, blk_idx, distk, curr_dist, t)
+                                        : fastScanBlock<false>(saq_clust, blk_idx, distk, curr_dist, t);
+            if (bound > distk) {
+                continue;
+            }
+            const auto vec_begin = blk_idx * KFastScanSize;
+            for (size_t j = 0; j < KFastScanSize && vec_begin + j < num_points; ++j) {
+                if (curr_dist[j] < distk) {
+                    cands.idx.push_back(vec_begin + j);
+                    cands.est.push_back(curr_dist[j]);
+                    cands.blk_bound.push_back(bound);
+                    for (size_t c_i = 0; c_i < clus_num; ++c_i) {
+                        cands.seg_est.push_back(clu_dist_[c_i * KFastScanSize + j]);
+                        cands.short_ip.push_back(estimators_[c_i].getShortIP(j));
+                    }
                 }
             }
+        }
+        runtime_metrics_.total_comp_cnt += (blk_end - blk_begin) * KFastScanSize;
+    }
 
-            // 3. use full bits to compute accurate distance
-            if (mi <= distk) {
-                _mm512_store_ps(curr_dist, curr_dist512[0]);
-                _mm512_store_ps(curr_dist + 16, curr_dist512[1]);
+    /**
+     * @brief Second phase: accurate distances of the candidates from their fetched long data
+     *
+     * The candidates were collected against an older k-th distance, so the checks of the
+     * in-memory scan are applied again with the current one: the block bound and the fast
+     * estimate at the start of each block (scanCluster()), or the fast estimate against the
+     * running k-th distance with several segments (searchCluster()). Results are the same as
+     * searching the cluster in memory.
+     */
+    void refineCluster(const TieredCandidates &cands, utils::ResultPool &KNNs) {
+        const auto *saq_clust = cands.cluster;
+        const auto clus_num = saq_clust->num_segments_;
+        const size_t rec_bytes = saq_clust->long_record_bytes();
+        CHECK_GE(cands.records.size(), cands.size() * rec_bytes);
+        std::vector<size_t> code_offset(clus_num);
+        for (size_t c_i = 0; c_i < clus_num; ++c_i) {
+            code_offset[c_i] = saq_clust->long_code_offset(c_i);
+        }
 
-                for (size_t c_i = 0; c_i < clus_num; ++c_i) {
-                    _mm512_store_ps(clu_dist_ + c_i * KFastScanSize, clu_dist512_[c_i * FAST_ARRAY]);
-                    _mm512_store_ps(clu_dist_ + c_i * KFastScanSize + 16, clu_dist512_[c_i * FAST_ARRAY + 1]);
+        float distk = KNNs.distk();
+        float blk_distk = distk; // k-th distance when the block of the candidate was reached
+        size_t blk_idx = std::numeric_limits<size_t>::max();
+        for (size_t k = 0; k < cands.size(); ++k) {
+            const auto idx = cands.idx[k];
+            if (idx / KFastScanSize != blk_idx) {
+                blk_idx = idx / KFastScanSize;
+                blk_distk = distk;
+            }
+            if (cands.blk_bound[k] > blk_distk) {
+                continue;
+            }
+            const uint8_t *rec = cands.records.data() + k * rec_bytes;
+            float acc_dist;
+            if (clus_num == 1) {
+                if (cands.est[k] >= blk_distk) {
+                    continue;
                 }
-                for (size_t j = 0; j < KFastScanSize; ++j) {
-                    if (curr_dist[j] < distk) {
-                        auto idx = blk_begin + j;
-                        if (idx >= num_points) {
-                            break;
-                        }
-                        float acc_dist = curr_dist[j];
-                        for (size_t c_i = 0; c_i < clus_num; ++c_i) {
-                            auto &estimator = estimators_[c_i];
-                            acc_dist += estimator.compAccurateDist(idx) - clu_dist_[c_i * KFastScanSize + j];
-                            if (acc_dist >= distk) {
-                                break;
-                            }
-                        }
-                        KNNs.insert(saq_clust->ids()[idx], acc_dist);
-                        distk = KNNs.distk();
+                acc_dist = estimators_[0].compAccurateDist(idx, cands.short_ip[k], rec + code_offset[0],
+                                                           saq_clust->record_long_factor(rec, 0));
+            } else {
+                if (cands.est[k] >= distk) {
+                    continue;
+                }
+                acc_dist = cands.est[k];
+                for (size_t c_i = 0; c_i < clus_num; ++c_i) {
+                    acc_dist += estimators_[c_i].compAccurateDist(idx, cands.short_ip[k * clus_num + c_i],
+                                                                  rec + code_offset[c_i],
+                                                                  saq_clust->record_long_factor(rec, c_i)) -
+                                cands.seg_est[k * clus_num + c_i];
+                    if (acc_dist >= distk) {
+                        break;
                     }
                 }
             }
+            KNNs.insert_lazy(acc_dist, [&] { return saq_clust->id(idx); });
+            distk = KNNs.distk();
         }
 
         runtime_metrics_.fast_bitsum = 0;
         runtime_metrics_.acc_bitsum = 0;
+        runtime_metrics_.factor_bytes = 0;
         for (size_t c_i = 0; c_i < clus_num; ++c_i) {
-            auto &estimator = estimators_[c_i];
-            auto metrics = estimator.getRuntimeMetrics();
+            auto metrics = estimators_[c_i].getRuntimeMetrics();
             runtime_metrics_.acc_bitsum += metrics.acc_bitsum;
             runtime_metrics_.fast_bitsum += metrics.fast_bitsum;
+            runtime_metrics_.factor_bytes += metrics.factor_bytes;
         }
-        runtime_metrics_.total_comp_cnt += num_blocks * KFastScanSize;
+        runtime_metrics_.long_block_hits += cands.block_hits;
+        runtime_metrics_.long_block_misses += cands.block_misses;
     }
 
   private:
+    /**
+     * @brief Variance and 1-bit stages of one block, shared by searchCluster() and collectBlocks()
+     *
+     * Returns the bound of the block: the largest minimum estimate checked against `distk`, so
+     * the block is pruned by any k-th distance under it. If it is not above `distk`, the
+     * estimated distances are stored in `curr_dist` and the part of each segment in clu_dist_.
+     * @param t end of the previous stage, see StageProfiler::add()
+     */
+    template <bool enable_var>
+    float fastScanBlock(const SaqCluData *saq_clust, size_t blk_idx, float distk, float *curr_dist, uint64_t &t) {
+        const auto clus_num = saq_clust->num_segments_;
+        __m512 curr_dist512[FAST_ARRAY];
+        curr_dist512[0] = _mm512_setzero_ps();
+        curr_dist512[1] = _mm512_setzero_ps();
+        float mi = std::numeric_limits<float>::max();
+        float bound = std::numeric_limits<float>::lowest();
+
+        // computes distance estimates using variance information for early pruning.
+        if constexpr (enable_var) {
+            for (size_t c_i = 0; c_i < clus_num; ++c_i) {
+                auto cd = &clu_dist512_[c_i * FAST_ARRAY];
+                estimators_[c_i].varsEstDist(blk_idx, cd);
+                curr_dist512[0] = _mm512_add_ps(curr_dist512[0], cd[0]);
+                curr_dist512[1] = _mm512_add_ps(curr_dist512[1], cd[1]);
+            }
+
+            mi = _mm512_reduce_min_ps(_mm512_min_ps(curr_dist512[0], curr_dist512[1]));
+            t = profiler_.add(Stage::Vars, t);
+            bound = mi;
+            if (mi > distk) {
+                return bound;
+            }
+            if constexpr (Profiler::kEnabled) {
+                profile().vars_kept += KFastScanSize;
+            }
+        }
+
+        // use 1st bit to compute fast distance, replacing the variance estimate segment by segment
+        for (size_t c_i = 0; c_i < clus_num; ++c_i) {
+            auto cd = &clu_dist512_[c_i * FAST_ARRAY];
+            if (saq_clust->get_segment(c_i).num_bits_ == 0)
+                continue;
+            if constexpr (enable_var) {
+                curr_dist512[0] = _mm512_sub_ps(curr_dist512[0], cd[0]);
+                curr_dist512[1] = _mm512_sub_ps(curr_dist512[1], cd[1]);
+            }
+
+            estimators_[c_i].compFastDist(blk_idx, cd);
+            curr_dist512[0] = _mm512_add_ps(curr_dist512[0], cd[0]);
+            curr_dist512[1] = _mm512_add_ps(curr_dist512[1], cd[1]);
+
+            mi = _mm512_reduce_min_ps(_mm512_min_ps(curr_dist512[0], curr_dist512[1]));
+            t = profiler_.add(Stage::Fast, t);
+            if constexpr (Profiler::kEnabled) {
+                profile().segment(c_i).fast_in += KFastScanSize;
+                profile().segment(c_i).fast_kept += mi <= distk ? KFastScanSize : 0;
+            }
+            bound = std::max(bound, mi);
+            if (mi > distk) {
+                return bound;
+            }
+        }
+        bound = std::max(bound, mi); // max without any stage
+        if (bound > distk) {
+            return bound;
+        }
+
+        _mm512_store_ps(curr_dist, curr_dist512[0]);
+        _mm512_store_ps(curr_dist + 16, curr_dist512[1]);
+        for (size_t c_i = 0; c_i < clus_num; ++c_i) {
+            _mm512_store_ps(clu_dist_ + c_i * KFastScanSize, clu_dist512_[c_i * FAST_ARRAY]);
+            _mm512_store_ps(clu_dist_ + c_i * KFastScanSize + 16, clu_dist512_[c_i * FAST_ARRAY + 1]);
+        }
+        return bound;
+    }
+
     void scanCluster(const CAQClusterData *clusters, utils::ResultPool &KNNs) {
         auto &estimator = estimators_[0];
-        estimator.prepare(clusters);
+        estimator.prepare(clusters, profiler_);
 
         float distk = KNNs.distk();
 
         auto num_blocks = clusters->num_blocks();
+        if constexpr (Profiler::kEnabled) {
+            profile().num_clusters++;
+            profile().num_vectors += clusters->num_vec_;
+        }
 
         __m512 est_dist[2];
+        // stages chain: each one starts where the previous ended
+        auto t = profiler_.now();
         for (size_t blk_idx = 0; blk_idx < num_blocks; ++blk_idx) {
-            auto curr_num_points = (blk_idx == num_blocks - 1) ? clusters->num_vec_ % KFastScanSize : KFastScanSize;
+            auto curr_num_points =
+                (blk_idx == num_blocks - 1) ? clusters->num_vec_ - KFastScanSize * blk_idx : KFastScanSize;
 
             estimator.compFastDist(blk_idx, est_dist);
 
@@ -193,6 +407,13 @@ class SAQSearcher : public SaqCluEstimator<kDistType> {
 
             // The following line is important: the number of num_points is not necessarily 32.
             mask = (mask & ((1ull << curr_num_points) - 1));
+            t = profiler_.add(Stage::Fast, t);
+            if constexpr (Profiler::kEnabled) {
+                // a single segment prunes vector by vector
+                profile().segment(0).fast_in += curr_num_points;
+                profile().segment(0).fast_kept += std::popcount(mask);
+                profile().segment(0).acc_in += std::popcount(mask);
+            }
 
             // incremental distance computation - V2
             while (mask) {
@@ -200,10 +421,14 @@ class SAQSearcher : public SaqCluEstimator<kDistType> {
                 uint32_t lb = 1u << j;
                 auto idx = KFastScanSize * blk_idx + j;
                 mask -= lb;
-                PID id = clusters->ids()[idx];
                 auto ex_dist = estimator.compAccurateDist(idx);
-                KNNs.insert(id, ex_dist);
+                t = profiler_.add(Stage::Accurate, t);
+                if constexpr (Profiler::kEnabled) {
+                    profile().inserted += ex_dist < distk;
+                }
+                KNNs.insert_lazy(ex_dist, [&] { return clusters->id(idx); });
                 distk = KNNs.distk();
+                t = profiler_.add(Stage::Insert, t);
             }
         }
 
@@ -211,6 +436,7 @@ class SAQSearcher : public SaqCluEstimator<kDistType> {
         runtime_metrics_.total_comp_cnt += num_blocks * KFastScanSize;
         runtime_metrics_.acc_bitsum = metrics.acc_bitsum;
         runtime_metrics_.fast_bitsum = metrics.fast_bitsum;
+        runtime_metrics_.factor_bytes = metrics.factor_bytes;
     }
 };
 } // namespace saqlib
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <immintrin.h>
+#include <istream>
+#include <ostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fmt/core.h>
+#include <glog/logging.h>
+
+#include "defines.hpp"
+#include "quantization/fastscan/lut.hpp"
+#include "utils/StopW.hpp"
+#include "utils/code_helper.hpp"
+#include "utils/memory.hpp"
+
+namespace saqlib {
+/**
+ * @brief Host-calibrated cost model of scanning one SAQ segment
+ *
+ * Every kernel cost is fitted as `c0 + c1 * dim` (ns) from a micro-benchmark at a few
+ * segment widths:
+ *  - fast:  fastscan::accumulate_hacc over one block of KFastScanSize vectors
+ *  - lut:   Lut::prepare, done once per probed cluster and segment
+ *  - ip[e]: CodeHelper<e>::compute_ip on one long code with e extra bits
+ *
+ * A model can be saved and loaded again, so plans can be reproduced on other hosts.
+ */
+class ScanCostModel {
+  public:
+    struct Linear {
+        double c0 = 0; // ns
+        double c1 = 0; // ns per dimension
+        double operator()(size_t dim) const { return c0 + c1 * dim; }
+    };
+
+    Linear fast;
+    Linear lut;
+    std::array<Linear, KMaxQuantizeBits> ip;
+
+    /**
+     * @brief Estimated cost (ns) per scanned vector of a segment
+     *
+     * @param dim Segment dimension
+     * @param bits Segment bits, 0 means the segment only contributes its variance
+     * @param avg_cluster_size Vectors per probed cluster, amortizes the LUT build
+     * @param acc_ratio Fraction of vectors reaching the accurate stage
+     */
+    double segment_cost(size_t dim, size_t bits, double avg_cluster_size, double acc_ratio) const {
+        if (bits == 0) {
+            return fast.c0 / KFastScanSize; // variance estimate, no code is touched
+        }
+        return fast(dim) / KFastScanSize + lut(dim) / avg_cluster_size + acc_ratio * ip[bits - 1](dim);
+    }
+
+    std::string toString() const {
+        std::string str = fmt::format("fast {:.1f}+{:.3f}d lut {:.1f}+{:.3f}d ip", fast.c0, fast.c1, lut.c0, lut.c1);
+        for (size_t e = 0; e < ip.size(); ++e) {
+            str += fmt::format(" [{}]{:.1f}+{:.3f}d", e, ip[e].c0, ip[e].c1);
+        }
+        return str;
+    }
+
+    /**
+     * @brief Write the coefficients as text, one kernel per line
+     */
+    void save(std::ostream &os) const {
+        os.precision(17);
+        os << "fast " << fast.c0 << ' ' << fast.c1 << '\n';
+        os << "lut " << lut.c0 << ' ' << lut.c1 << '\n';
+        for (size_t e = 0; e < ip.size(); ++e) {
+            os << "ip" << e << ' ' << ip[e].c0 << ' ' << ip[e].c1 << '\n';
+        }
+    }
+
+    void save(const char *filename) const {
+        std::ofstream os(filename);
+        CHECK(os.is_open()) << "Cannot open " << filename;
+        save(os);
+        CHECK(os.good()) << "Cannot write " << filename;
+    }
+
+    static ScanCostModel load(std::istream &is) {
+        ScanCostModel model;
+        auto read = [&](const std::string &name, Linear &l) {
+            std::string key;
+            CHECK(is >> key >> l.c0 >> l.c1 && key == name) << "Bad scan cost model, expected " << name;
+        };
+        read("fast", model.fast);
+        read("lut", model.lut);
+        for (size_t e = 0; e < model.ip.size(); ++e) {
+            read(fmt::format("ip{}", e), model.ip[e]);
+        }
+        return model;
+    }
+
+    static ScanCostModel load(const char *filename) {
+        std::ifstream is(filename);
+        CHECK(is.is_open()) << "Cannot open " << filename;
+        return load(is);
+    }
+
+    /**
+     * @brief Calibrated model of this host. Measured once per process.
+     */
+    static const ScanCostModel &host() {
+        static const ScanCostModel model = calibrate();
+        return model;
+    }
+
+    static ScanCostModel calibrate() {
+        constexpr std::array<size_t, 3> kDims = {64, 256, 1024};
+        constexpr size_t kMaxDim = kDims.back();
+        std::mt19937 gen(7);
+        std::uniform_int_distribution<int> byte_dist(0, 255);
+        std::normal_distribution<float> float_dist(0, 1);
+
+        FloatVec query(kMaxDim);
+        for (auto &x : query) {
+            x = float_dist(gen);
+        }
+        // large enough for the short codes of a block or the longest long code
+        const size_t code_bytes = kMaxDim * KFastScanSize / 8 * 2;
+        auto codes = memory::make_unique_array<uint8_t>(code_bytes, 64);
+        for (size_t i = 0; i < code_bytes; ++i) {
+            codes[i] = byte_dist(gen);
+        }
+
+        ScanCostModel model;
+        volatile float sink = 0;
+
+        model.fast = fit(kDims, [&](size_t dim) {
+            Lut lut(dim, 0);
+            lut.prepare(query.head(dim));
+            __m512 dist[2];
+            return time_ns([&]() {
+                lut.compFastIP(query.data(), codes.get(), dist);
+                sink = sink + _mm512_reduce_add_ps(dist[0]);
+            });
+        });
+
+        model.lut = fit(kDims, [&](size_t dim) {
+            Lut lut(dim, 0);
+            FloatVec q = query.head(dim);
+            return time_ns([&]() { lut.prepare(q); });
+        });
+
+        for (size_t e = 0; e < KMaxQuantizeBits; ++e) {
+            auto ip_func = utils::get_IP_FUNC(e);
+            model.ip[e] = fit(kDims, [&](size_t dim) {
+                return time_ns([&]() { sink = sink + ip_func(query.data(), codes.get(), dim); });
+            });
+        }
+        (void)sink;
+        return model;
+    }
+
+  private:
+    /**
+     * @brief Average ns of `func` over enough repetitions to run ~1ms, best of 3
+     */
+    template <typename Func>
+    static double time_ns(Func &&func) {
+        size_t reps = 16;
+        for (;;) {
+            utils::StopW stopw;
+            for (size_t r = 0; r < reps; ++r) {
+                func();
+            }
+            if (stopw.getElapsedTimeMicro() > 1000 || reps > (1ul << 24)) {
+                break;
+            }
+            reps *= 2;
+        }
+        double best = std::numeric_limits<double>::max();
+        for (int t = 0; t < 3; ++t) {
+            utils::StopW stopw;
+            for (size_t r = 0; r < reps; ++r) {
+                func();
+            }
+            best = std::min(best, (double)stopw.getElapsedTimeNano() / reps);
+        }
+        return best;
+    }
+
+    /**
+     * @brief Least squares fit of `measure(dim)` against dim
+     */
+    template <size_t N, typename Func>
+    static Linear fit(const std::array<size_t, N> &dims, Func &&measure) {
+        double sx = 0, sy = 0, sxx = 0, sxy = 0;
+        for (auto d : dims) {
+            double y = measure(d);
+            sx += d;
+            sy += y;
+            sxx += double(d) * d;
+            sxy += d * y;
+        }
+        Linear l;
+        l.c1 = std::max(0.0, (N * sxy - sx * sy) / (N * sxx - sx * sx));
+        l.c0 = std::max(0.0, (sy - l.c1 * sx) / N);
+        return l;
+    }
+};
+} // namespace saqlib
@@ -0,0 +1,281 @@
+#pragma once
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "defines.hpp"
+
+/**
+ * Wire format of saq_server, in host byte order (the server only listens locally).
+ *
+ * Every message is a 32-byte header followed by `payload_bytes` of payload:
+ *  - Search: `num_queries * dim` floats, answered by `num_queries * topk` ids, closest
+ *    first. `nprobe` is at most the number of clusters, `num_queries` and `topk` at most the
+ *    limits of the server. A rejected search is answered once its payload is read and dropped.
+ *  - Reload: the path of the new index file, answered by an empty payload once it serves.
+ *  - Info: no payload, answered by an InfoReply.
+ * A response with a status other than Ok carries an error message as payload.
+ */
+namespace saqlib::server {
+constexpr uint32_t kRequestMagic = 0x52514153;  // "SAQR"
+constexpr uint32_t kResponseMagic = 0x41514153; // "SAQA"
+constexpr uint64_t kMaxPayloadBytes = 1ull << 30;
+
+enum class Op : uint16_t {
+    Search = 1,
+    Reload = 2,
+    Info = 3,
+};
+
+enum class Status : uint16_t {
+    Ok = 0,
+    BadRequest = 1,
+    Error = 2,
+};
+
+struct RequestHeader {
+    uint32_t magic = kRequestMagic;
+    uint16_t op = 0;
+    uint16_t reserved = 0;
+    uint32_t num_queries = 0;
+    uint32_t dim = 0;
+    uint32_t topk = 0;
+    uint32_t nprobe = 0;
+    uint64_t payload_bytes = 0;
+};
+
+struct ResponseHeader {
+    uint32_t magic = kResponseMagic;
+    uint16_t status = 0;
+    uint16_t op = 0;
+    uint32_t num_queries = 0;
+    uint32_t topk = 0;
+    uint64_t index_version = 0; // bumped by every reload
+    uint64_t payload_bytes = 0;
+};
+
+struct InfoReply {
+    uint64_t num_data = 0;
+    uint32_t dim = 0;
+    uint32_t num_clusters = 0;
+};
+
+static_assert(sizeof(RequestHeader) == 32 && sizeof(ResponseHeader) == 32, "headers must be packed");
+
+/**
+ * @brief Read exactly `len` bytes, false on EOF or error
+ */
+inline bool read_full(int fd, void *buf, size_t len) {
+    auto *p = static_cast<char *>(buf);
+    while (len) {
+        const ssize_t n = ::read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * @brief Read and drop `len` bytes, false on EOF or error
+ */
+inline bool skip_full(int fd, uint64_t len) {
+    char buf[1 << 16];
+    while (len) {
+        const size_t n = std::min<uint64_t>(len, sizeof(buf));
+        if (!read_full(fd, buf, n)) {
+            return false;
+        }
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * @brief Write exactly `len` bytes, false on error
+ */
+inline bool write_full(int fd, const void *buf, size_t len) {
+    const auto *p = static_cast<const char *>(buf);
+    while (len) {
+        const ssize_t n = ::send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * @brief Socket listening on a Unix domain socket `unix_path` if it is set, else on
+ * localhost TCP `port`. -1 with errno set on failure
+ */
+inline int listen_socket(const std::string &unix_path, int port) {
+    int fd = -1;
+    bool bound = false;
+    if (!unix_path.empty()) {
+        sockaddr_un addr{};
+        if (unix_path.size() >= sizeof(addr.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        addr.sun_family = AF_UNIX;
+        std::memcpy(addr.sun_path, unix_path.c_str(), unix_path.size());
+        fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        ::unlink(unix_path.c_str()); // left by a previous run
+        bound = fd >= 0 && ::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0;
+    } else {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        const int one = 1;
+        bound = fd >= 0 && ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == 0 &&
+                ::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0;
+    }
+    if (bound && ::listen(fd, SOMAXCONN) == 0) {
+        return fd;
+    }
+    const int err = errno;
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    errno = err;
+    return -1;
+}
+
+/**
+ * @brief Blocking connection to saq_server, one request at a time
+ */
+class SearchClient {
+    int fd_ = -1;
+    uint64_t index_version_ = 0;
+    std::string error_;
+
+    bool request(const RequestHeader &req, const void *payload, ResponseHeader &resp, std::vector<char> &reply) {
+        CHECK_EQ(req.payload_bytes == 0, payload == nullptr);
+        CHECK(write_full(fd_, &req, sizeof(req)) && (!payload || write_full(fd_, payload, req.payload_bytes)))
+            << "saq_server connection lost";
+        CHECK(read_full(fd_, &resp, sizeof(resp)) && resp.magic == kResponseMagic) << "saq_server connection lost";
+        CHECK_LE(resp.payload_bytes, kMaxPayloadBytes);
+        reply.resize(resp.payload_bytes);
+        CHECK(read_full(fd_, reply.data(), reply.size())) << "saq_server connection lost";
+        index_version_ = resp.index_version;
+        if (resp.status != uint16_t(Status::Ok)) {
+            error_.assign(reply.begin(), reply.end());
+            return false;
+        }
+        return true;
+    }
+
+  public:
+    /**
+     * @brief Connect to the Unix domain socket `unix_path` if it is set, else to localhost TCP `port`
+     */
+    SearchClient(const std::string &unix_path, int port) {
+        int ret;
+        if (!unix_path.empty()) {
+            sockaddr_un addr{};
+            CHECK_LT(unix_path.size(), sizeof(addr.sun_path)) << "Socket path too long";
+            addr.sun_family = AF_UNIX;
+            std::memcpy(addr.sun_path, unix_path.c_str(), unix_path.size());
+            fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            ret = ::connect(fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+        } else {
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(port);
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            fd_ = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            ret = ::connect(fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+            const int one = 1;
+            ::setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        CHECK(fd_ >= 0 && ret == 0) << "Cannot connect to saq_server at "
+                                    << (unix_path.empty() ? "port " + std::to_string(port) : unix_path) << ": "
+                                    << std::strerror(errno);
+    }
+
+    SearchClient(const SearchClient &) = delete;
+    SearchClient &operator=(const SearchClient &) = delete;
+
+    ~SearchClient() { ::close(fd_); }
+
+    /**
+     * @brief `topk` ids of each of the `num_queries` rows of `queries` into `results`
+     * @return false if the server rejected the request, see error()
+     */
+    bool search(const float *queries, size_t num_queries, size_t dim, size_t topk, size_t nprobe, PID *results) {
+        RequestHeader req;
+        req.op = uint16_t(Op::Search);
+        req.num_queries = num_queries;
+        req.dim = dim;
+        req.topk = topk;
+        req.nprobe = nprobe;
+        req.payload_bytes = num_queries * dim * sizeof(float);
+        ResponseHeader resp;
+        std::vector<char> reply;
+        if (!request(req, req.payload_bytes ? queries : nullptr, resp, reply)) {
+            return false;
+        }
+        CHECK_EQ(reply.size(), num_queries * topk * sizeof(PID)) << "Bad saq_server reply";
+        std::memcpy(results, reply.data(), reply.size());
+        return true;
+    }
+
+    /**
+     * @brief Make the server swap to the index in `filename`, returns once it serves it
+     */
+    bool reload(const std::string &filename) {
+        RequestHeader req;
+        req.op = uint16_t(Op::Reload);
+        req.payload_bytes = filename.size();
+        ResponseHeader resp;
+        std::vector<char> reply;
+        return request(req, filename.empty() ? nullptr : filename.data(), resp, reply);
+    }
+
+    bool info(InfoReply &info) {
+        RequestHeader req;
+        req.op = uint16_t(Op::Info);
+        ResponseHeader resp;
+        std::vector<char> reply;
+        if (!request(req, nullptr, resp, reply)) {
+            return false;
+        }
+        CHECK_EQ(reply.size(), sizeof(InfoReply)) << "Bad saq_server reply";
+        std::memcpy(&info, reply.data(), sizeof(InfoReply));
+        return true;
+    }
+
+    /**
+     * @brief Version of the index that answered the last request
+     */
+    uint64_t index_version() const { return index_version_; }
+
+    const std::string &error() const { return error_; }
+};
+} // namespace saqlib::server
@@ -0,0 +1,334 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <fmt/core.h>
+#include <glog/logging.h>
+
+#include "defines.hpp"
+#include "index/ivf.hpp"
+#include "quantization/config.h"
+#include "server/protocol.hpp"
+#include "utils/BS_thread_pool.hpp"
+#include "utils/IO.hpp"
+#include "utils/StopW.hpp"
+#include "utils/numa.hpp"
+
+namespace saqlib::server {
+struct ServerConfig {
+    std::string unix_path;  // Unix domain socket, used if set
+    int port = 0;           // localhost TCP port otherwise
+    size_t num_threads = 0; // search workers, 0 for all cores
+    bool pin_threads = false;
+    StorageConfig storage; // of every index loaded
+    SearcherConfig searcher_cfg;
+    size_t max_topk = 4096;
+    size_t max_queries = 1 << 16; // per request
+};
+
+/**
+ * @brief kNN requests of local clients served from an index that can be swapped while serving
+ *
+ * Every connection has its own thread, which reads a request and runs its queries on the shared
+ * worker pool, a batch split into one IVF::search_batch() per worker. The index is published as
+ * an immutable snapshot: a request takes a reference to the current one for its whole duration,
+ * and reload() loads the new index aside and then replaces the pointer, RCU-style. Requests in
+ * flight finish on the old index, which is freed with its last reference.
+ */
+class SearchServer {
+    struct Snapshot {
+        std::shared_ptr<IVF> ivf;
+        std::string filename;
+        uint64_t version;
+    };
+
+    struct Connection {
+        int fd;
+        std::thread thread;
+        std::atomic<bool> done{false};
+    };
+
+    const ServerConfig cfg_;
+    BS::thread_pool<> pool_;
+    std::atomic<std::shared_ptr<const Snapshot>> snapshot_;
+    std::mutex reload_mtx_; // one reload at a time
+
+    int listen_fd_ = -1;
+    std::thread acceptor_;
+    std::mutex conn_mtx_;
+    std::list<Connection> conns_;
+    std::atomic<bool> stopping_{false};
+
+    std::atomic<size_t> num_requests_{0};
+    std::atomic<size_t> num_queries_{0};
+    std::atomic<size_t> num_errors_{0};
+
+    std::shared_ptr<IVF> load_index(const std::string &filename) const {
+        auto ivf = std::make_shared<IVF>();
+        ivf->load(filename.c_str(), cfg_.storage);
+        return ivf;
+    }
+
+    void search(IVF &ivf, const float *queries, size_t num_queries, size_t topk, size_t nprobe, PID *results) {
+        const Eigen::Map<const FloatRowMat> batch(queries, num_queries, ivf.num_dim());
+        const size_t num_blocks = std::min(num_queries, size_t(pool_.get_thread_count()));
+        pool_.submit_blocks(
+                 size_t(0), num_queries,
+                 [&](size_t begin, size_t end) {
+                     ivf.search_batch(batch.middleRows(begin, end - begin), topk, nprobe, cfg_.searcher_cfg,
+                                      results + begin * topk);
+                 },
+                 num_blocks)
+            .wait();
+    }
+
+    static bool respond(int fd, ResponseHeader &resp, const void *payload, size_t bytes) {
+        resp.payload_bytes = bytes;
+        return write_full(fd, &resp, sizeof(resp)) && (!bytes || write_full(fd, payload, bytes));
+    }
+
+    static bool respond_error(int fd, ResponseHeader &resp, Status status, const std::string &message) {
+        resp.status = uint16_t(status);
+        resp.num_queries = resp.topk = 0;
+        return respond(fd, resp, message.data(), message.size());
+    }
+
+    /**
+     * @brief Why the search request `req` is rejected, "" if it is valid. Only reads the header,
+     * so nothing is allocated for a bad request
+     */
+    std::string check_search(const RequestHeader &req, const IVF &ivf) const {
+        if (req.dim != ivf.num_dim()) {
+            return fmt::format("query dimension {}, index dimension {}", req.dim, ivf.num_dim());
+        }
+        if (req.payload_bytes != uint64_t(req.num_queries) * req.dim * sizeof(float)) {
+            return "payload size does not match the queries";
+        }
+        if (req.num_queries > cfg_.max_queries) {
+            return fmt::format("at most {} queries per request", cfg_.max_queries);
+        }
+        if (req.topk == 0 || req.topk > cfg_.max_topk) {
+            return fmt::format("topk must be in [1, {}]", cfg_.max_topk);
+        }
+        if (req.nprobe == 0 || req.nprobe > ivf.num_clusters()) {
+            return fmt::format("nprobe must be in [1, {}]", ivf.num_clusters());
+        }
+        return "";
+    }
+
+    void serve(int fd) {
+        RequestHeader req;
+        std::vector<char> payload;
+        std::vector<PID> results;
+        while (read_full(fd, &req, sizeof(req))) {
+            ResponseHeader resp;
+            resp.op = req.op;
+            if (req.magic != kRequestMagic || req.payload_bytes > kMaxPayloadBytes) {
+                num_errors_.fetch_add(1, std::memory_order_relaxed);
+                respond_error(fd, resp, Status::BadRequest, "bad request header"); // the stream is lost
+                return;
+            }
+            num_requests_.fetch_add(1, std::memory_order_relaxed);
+            const auto snapshot = snapshot_.load(); // pinned until the response is sent
+            resp.index_version = snapshot->version;
+            IVF &ivf = *snapshot->ivf;
+
+            // a rejected search is answered without buffering its payload
+            if (static_cast<Op>(req.op) == Op::Search) {
+                if (const auto error = check_search(req, ivf); !error.empty()) {
+                    num_errors_.fetch_add(1, std::memory_order_relaxed);
+                    if (!skip_full(fd, req.payload_bytes) || !respond_error(fd, resp, Status::BadRequest, error)) {
+                        return;
+                    }
+                    continue;
+                }
+            }
+            payload.resize(req.payload_bytes);
+            if (!read_full(fd, payload.data(), payload.size())) {
+                return;
+            }
+
+            bool ok = true;
+            switch (static_cast<Op>(req.op)) {
+            case Op::Search: {
+                results.resize(size_t(req.num_queries) * req.topk);
+                if (req.num_queries) {
+                    search(ivf, reinterpret_cast<const float *>(payload.data()), req.num_queries, req.topk, req.nprobe,
+                           results.data());
+                }
+                num_queries_.fetch_add(req.num_queries, std::memory_order_relaxed);
+                resp.num_queries = req.num_queries;
+                resp.topk = req.topk;
+                ok = respond(fd, resp, results.data(), results.size() * sizeof(PID));
+                break;
+            }
+            case Op::Reload: {
+                std::string error;
+                const uint64_t version = reload(std::string(payload.begin(), payload.end()), &error);
+                if (!version) {
+                    num_errors_.fetch_add(1, std::memory_order_relaxed);
+                    ok = respond_error(fd, resp, Status::Error, error);
+                    break;
+                }
+                resp.index_version = version;
+                ok = respond(fd, resp, nullptr, 0);
+                break;
+            }
+            case Op::Info: {
+                InfoReply info;
+                info.num_data = ivf.num_data();
+                info.dim = ivf.num_dim();
+                info.num_clusters = ivf.num_clusters();
+                ok = respond(fd, resp, &info, sizeof(info));
+                break;
+            }
+            default:
+                num_errors_.fetch_add(1, std::memory_order_relaxed);
+                ok = respond_error(fd, resp, Status::BadRequest, fmt::format("unknown op {}", req.op));
+            }
+            if (!ok) {
+                return;
+            }
+        }
+    }
+
+    // joins the threads of the closed connections
+    void reap() {
+        std::lock_guard<std::mutex> lock(conn_mtx_);
+        for (auto it = conns_.begin(); it != conns_.end();) {
+            if (it->done.load()) {
+                it->thread.join();
+                ::close(it->fd);
+                it = conns_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void accept_loop() {
+        while (!stopping_.load()) {
+            const int fd = ::accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                LOG_IF(ERROR, !stopping_.load()) << "saq_server accept failed: " << std::strerror(errno);
+                return;
+            }
+            if (cfg_.unix_path.empty()) {
+                const int one = 1;
+                ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            }
+            reap();
+            std::lock_guard<std::mutex> lock(conn_mtx_);
+            auto &conn = conns_.emplace_back();
+            conn.fd = fd;
+            conn.thread = std::thread([this, &conn] {
+                serve(conn.fd);
+                conn.done.store(true);
+            });
+        }
+    }
+
+  public:
+    /**
+     * @brief Load the index in `filename`, start() serves it
+     */
+    SearchServer(const std::string &filename, const ServerConfig &cfg)
+        : cfg_(cfg), pool_(cfg.num_threads,
+                           cfg.pin_threads ? utils::AffinityInit::spread(utils::NumaTopology::host())
+                                           : utils::AffinityInit{}) {
+        CHECK(!cfg_.unix_path.empty() || cfg_.port > 0) << "saq_server needs a socket path or a port";
+        snapshot_.store(std::make_shared<const Snapshot>(Snapshot{load_index(filename), filename, 1}));
+    }
+
+    SearchServer(const SearchServer &) = delete;
+    SearchServer &operator=(const SearchServer &) = delete;
+
+    ~SearchServer() { stop(); }
+
+    /**
+     * @brief Listen and serve connections on a background thread
+     */
+    void start() {
+        CHECK_LT(listen_fd_, 0) << "saq_server already started";
+        listen_fd_ = listen_socket(cfg_.unix_path, cfg_.port);
+        CHECK_GE(listen_fd_, 0) << "Cannot listen on "
+                                << (cfg_.unix_path.empty() ? fmt::format("port {}", cfg_.port) : cfg_.unix_path)
+                                << ": " << std::strerror(errno);
+        acceptor_ = std::thread([this] { accept_loop(); });
+    }
+
+    /**
+     * @brief Stop accepting, close the connections and wait for the requests being served
+     */
+    void stop() {
+        if (listen_fd_ < 0 || stopping_.exchange(true)) {
+            return;
+        }
+        ::shutdown(listen_fd_, SHUT_RDWR); // wakes accept()
+        acceptor_.join();
+        ::close(listen_fd_);
+        if (!cfg_.unix_path.empty()) {
+            ::unlink(cfg_.unix_path.c_str());
+        }
+        std::lock_guard<std::mutex> lock(conn_mtx_);
+        for (auto &conn : conns_) {
+            ::shutdown(conn.fd, SHUT_RDWR);
+        }
+        for (auto &conn : conns_) {
+            conn.thread.join();
+            ::close(conn.fd);
+        }
+        conns_.clear();
+    }
+
+    /**
+     * @brief Swap to the index in `filename`
+     *
+     * The file is checked against its checksums first, so a damaged file, or one written before
+     * checksums, is refused instead of stopping the server. Requests arriving while it loads are
+     * served by the current index.
+     * @return version of the new index, 0 if it was refused, with the reason in `error`
+     */
+    uint64_t reload(const std::string &filename, std::string *error = nullptr) {
+        std::lock_guard<std::mutex> lock(reload_mtx_);
+        if (!utils::file_exists(filename.c_str()) || !IVF::verify(filename.c_str())) {
+            if (error) {
+                *error = fmt::format("{} is missing or fails its checksums", filename);
+            }
+            return 0;
+        }
+        utils::StopW stopw;
+        auto ivf = load_index(filename);
+        const uint64_t version = snapshot_.load()->version + 1;
+        snapshot_.store(std::make_shared<const Snapshot>(Snapshot{std::move(ivf), filename, version}));
+        LOG(INFO) << fmt::format("saq_server serves {} as version {}, loaded in {:.3f} S", filename, version,
+                                 stopw.getElapsedTimeMicro() / 1e6);
+        return version;
+    }
+
+    uint64_t version() const { return snapshot_.load()->version; }
+    std::string filename() const { return snapshot_.load()->filename; }
+
+    std::string toString() const {
+        return fmt::format("index {} (version {}), {} requests, {} queries, {} errors", filename(), version(),
+                           num_requests_.load(), num_queries_.load(), num_errors_.load());
+    }
+};
+} // namespace saqlib::server
@@ -1,24 +1,35 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
 #include <fstream>
+#include <future>
 #include <iostream>
+#include <memory>
 #include <stdint.h>
+#include <string>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <type_traits>
+#include <unistd.h>
 #include <vector>
 
 #include "third/Eigen/Core"
+#include "utils/BS_thread_pool.hpp"
 
 namespace saqlib::utils {
 template <typename T>
-void save_vector(std::ofstream &output, const std::vector<T> &vec) {
+void save_vector(std::ostream &output, const std::vector<T> &vec) {
     output.write(reinterpret_cast<const char *>(&vec.size()), sizeof(size_t));
     for (const auto &item : vec) {
         output.write(reinterpret_cast<const char *>(&item), sizeof(T));
     }
 }
 template <typename T>
-void load_vector(std::ifstream &input, std::vector<T> &vec) {
+void load_vector(std::istream &input, std::vector<T> &vec) {
     size_t size;
     input.read(reinterpret_cast<char *>(&size), sizeof(size_t));
     vec.clear();
@@ -28,13 +39,13 @@ void load_vector(std::ifstream &input, std::vector<T> &vec) {
     }
 }
 
-inline void save_floatvec(std::ofstream &output, const Eigen::RowVectorXf &vec) {
+inline void save_floatvec(std::ostream &output, const Eigen::RowVectorXf &vec) {
     size_t size = vec.size();
     output.write(reinterpret_cast<const char *>(&size), sizeof(size_t));
     output.write(reinterpret_cast<const char *>(vec.data()), sizeof(float) * size);
 }
 
-inline size_t load_floatvec(std::ifstream &input, Eigen::RowVectorXf &vec) {
+inline size_t load_floatvec(std::istream &input, Eigen::RowVectorXf &vec) {
     size_t size;
     input.read(reinterpret_cast<char *>(&size), sizeof(size_t));
     vec.resize(size);
@@ -50,72 +61,185 @@ inline size_t get_filesize(const char *filename) {
 }
 
 inline bool file_exists(const char *filename) {
-    std::ifstream f(filename);
-    if (!f.good()) {
-        f.close();
-        return false;
-    }
-    f.close();
-    return true;
+    struct stat64 stat_buf;
+    return stat64(filename, &stat_buf) == 0;
 }
 
-template <typename T>
-T *load_vecs(const char *filename) {
-    if (!file_exists(filename)) {
-        std::cerr << "File " << filename << " not exists\n";
-        abort();
+/**
+ * @brief Read-only memory map of a whole file
+ */
+class MappedFile {
+    int fd_ = -1;
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+
+  public:
+    explicit MappedFile(const char *filename) {
+        fd_ = open(filename, O_RDONLY);
+        if (fd_ < 0) {
+            std::cerr << "Cannot open " << filename << ": " << std::strerror(errno) << '\n';
+            abort();
+        }
+        struct stat64 stat_buf;
+        fstat64(fd_, &stat_buf);
+        size_ = stat_buf.st_size;
+        if (size_ == 0) {
+            return;
+        }
+        void *p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+        if (p == MAP_FAILED) {
+            std::cerr << "Cannot map " << filename << ": " << std::strerror(errno) << '\n';
+            abort();
+        }
+        madvise(p, size_, MADV_WILLNEED); // start the read-ahead of the whole file
+        data_ = static_cast<const char *>(p);
     }
 
-    uint32_t cols;
-    size_t file_size = get_filesize(filename);
-    std::ifstream input(filename, std::ios::binary);
-
-    input.read((char *)&cols, sizeof(uint32_t));
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
 
-    size_t rows = file_size / (cols * sizeof(T) + sizeof(uint32_t));
-    T *data = new T[rows * cols];
+    ~MappedFile() {
+        if (data_) {
+            munmap(const_cast<char *>(data_), size_);
+        }
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
 
-    input.seekg(0, input.beg);
+    const char *data() const { return data_; }
+    size_t size() const { return size_; }
+};
 
-    for (size_t i = 0; i < rows; i++) {
-        input.read((char *)&cols, sizeof(uint32_t));
-        input.read((char *)&data[cols * i], sizeof(T) * cols);
-    }
+inline bool is_vecs_file(const std::string &filename) {
+    return filename.size() >= 4 && filename.compare(filename.size() - 4, 4, "vecs") == 0;
+}
 
-    input.close();
-    return data;
+inline bool is_bin_file(const std::string &filename) {
+    return filename.size() >= 3 && filename.compare(filename.size() - 3, 3, "bin") == 0;
 }
 
-template <typename T, class M>
-void load_vecs(const char *filename, M &Mat) {
-    if (!file_exists(filename)) {
-        std::cerr << "File " << filename << " not exists\n";
+/**
+ * @brief Zero-copy view of the vectors of a .fvecs/.ivecs or .fbin/.ibin file
+ *
+ * .bin files hold the rows back to back after a header of two uint32 (rows, cols), so mat()
+ * maps them as they are. .vecs files start every row with its dimension, so mat() maps them
+ * with an outer stride of one element more than a row. The file stays mapped while a copy
+ * of the view exists.
+ */
+template <typename T>
+class VecsView {
+  public:
+    using RowMat = Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+    using MapT = Eigen::Map<const RowMat, 0, Eigen::OuterStride<>>;
+
+  private:
+    std::shared_ptr<MappedFile> file_;
+    const T *data_ = nullptr;
+    size_t rows_ = 0;
+    size_t cols_ = 0;
+    size_t stride_ = 0; // elements from one row to the next
+
+    [[noreturn]] static void fail(const char *filename, const char *what) {
+        std::cerr << "File " << filename << ": " << what << '\n';
         abort();
     }
 
-    assert(typeid(T *) == typeid(Mat.data()));
-
-    uint32_t tmp;
-    size_t file_size = get_filesize(filename);
-    std::ifstream input(filename, std::ios::binary);
-
-    input.read((char *)&tmp, sizeof(uint32_t));
-
-    size_t cols = tmp;
-    size_t rows = file_size / (cols * sizeof(T) + sizeof(uint32_t));
-    Mat = M(rows, cols);
-
-    input.seekg(0, input.beg);
+  public:
+    VecsView() = default;
+
+    explicit VecsView(const char *filename) {
+        if (!file_exists(filename)) {
+            std::cerr << "File " << filename << " not exists\n";
+            abort();
+        }
+        file_ = std::make_shared<MappedFile>(filename);
+        const char *base = file_->data();
+        const size_t bytes = file_->size();
+        uint32_t header[2] = {0, 0};
+        if (is_vecs_file(filename)) {
+            if (sizeof(T) != sizeof(uint32_t)) {
+                fail(filename, "strided views of .vecs files need 4-byte elements");
+            }
+            if (bytes == 0) {
+                return;
+            }
+            std::memcpy(header, base, sizeof(uint32_t));
+            cols_ = header[0];
+            stride_ = cols_ + 1;
+            const size_t row_bytes = stride_ * sizeof(T);
+            rows_ = bytes / row_bytes;
+            if (bytes % row_bytes) {
+                fail(filename, "size is not a multiple of the row size");
+            }
+            std::memcpy(header, base + (rows_ - 1) * row_bytes, sizeof(uint32_t));
+            if (header[0] != cols_) {
+                fail(filename, "rows of different dimensions");
+            }
+            data_ = reinterpret_cast<const T *>(base + sizeof(uint32_t));
+        } else if (is_bin_file(filename)) {
+            if (bytes < sizeof(header)) {
+                fail(filename, "missing header");
+            }
+            std::memcpy(header, base, sizeof(header));
+            rows_ = header[0];
+            cols_ = stride_ = header[1];
+            if (bytes < sizeof(header) + rows_ * cols_ * sizeof(T)) {
+                fail(filename, "truncated");
+            }
+            data_ = reinterpret_cast<const T *>(base + sizeof(header));
+        } else {
+            fail(filename, "unsupported file format");
+        }
+    }
 
-    for (size_t i = 0; i < rows; i++) {
-        input.read((char *)&tmp, sizeof(uint32_t));
-        input.read((char *)&Mat(i, 0), sizeof(T) * cols);
+    size_t rows() const { return rows_; }
+    size_t cols() const { return cols_; }
+    bool contiguous() const { return stride_ == cols_; }
+    const T *row(size_t i) const { return data_ + i * stride_; }
+
+    MapT mat() const { return MapT(data_, rows_, cols_, Eigen::OuterStride<>(stride_)); }
+
+    /**
+     * @brief Copy into a row-major matrix, with `num_threads` threads (0 for all cores)
+     * @param padded_cols columns of `out`, the ones past cols() are zeroed. 0 keeps cols().
+     */
+    template <class M>
+    void copy_to(M &out, size_t padded_cols = 0, size_t num_threads = 0) const {
+        static_assert(M::IsRowMajor, "copy_to() needs a row-major matrix");
+        static_assert(std::is_same_v<typename M::Scalar, T>, "element type mismatch");
+        padded_cols = std::max(padded_cols, cols_);
+        out = M(rows_, padded_cols);
+        if (rows_ == 0) {
+            return;
+        }
+        BS::thread_pool pool(num_threads);
+        pool.detach_blocks(size_t(0), rows_, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                T *dst = &out(i, 0);
+                std::memcpy(dst, row(i), sizeof(T) * cols_);
+                std::fill(dst + cols_, dst + padded_cols, T(0));
+            }
+        });
+        pool.wait();
     }
+};
+
+template <typename T>
+T *load_vecs(const char *filename) {
+    VecsView<T> view(filename);
+    T *data = new T[view.rows() * view.cols()];
+    Eigen::Map<typename VecsView<T>::RowMat>(data, view.rows(), view.cols()) = view.mat();
+    return data;
+}
 
+template <typename T, class M>
+void load_vecs(const char *filename, M &Mat) {
+    VecsView<T> view(filename);
+    view.copy_to(Mat);
     std::cout << "File " << filename << " loaded (";
-    std::cout << "Rows " << rows << " Cols " << cols << ")\n"
+    std::cout << "Rows " << view.rows() << " Cols " << view.cols() << ")\n"
               << std::flush;
-    input.close();
 }
 
 template <typename T, class M>
@@ -142,42 +266,217 @@ void save_vecs(const char *filename, const M &Mat) {
 
 template <typename T, class M>
 void load_bin(const char *filename, M &Mat) {
-    if (!file_exists(filename)) {
-        std::cerr << "File " << filename << " not exists\n";
-        abort();
-    }
-
-    assert(typeid(T *) == typeid(Mat.data()));
-
-    uint32_t rows, cols;
-    std::ifstream input(filename, std::ios::binary);
-
-    input.read((char *)&rows, sizeof(uint32_t));
-    input.read((char *)&cols, sizeof(uint32_t));
-
-    Mat = M(rows, cols);
-
-    for (size_t i = 0; i < rows; i++) {
-        input.read((char *)&Mat(i, 0), sizeof(T) * cols);
-    }
-
+    VecsView<T> view(filename);
+    view.copy_to(Mat);
     std::cout << "File " << filename << " loaded (";
-    std::cout << "Rows " << rows << " Cols " << cols << ")\n"
+    std::cout << "Rows " << view.rows() << " Cols " << view.cols() << ")\n"
               << std::flush;
-    input.close();
 }
 
 // load based on file extension
 template <typename T, class M>
 void load_something(const char *filename, M &row_mat) {
     std::string filename_str(filename);
-    if (filename_str.rfind("vecs") == filename_str.size() - 4) {
+    if (is_vecs_file(filename_str)) {
         load_vecs<T, M>(filename, row_mat);
-    } else if (filename_str.rfind("bin") == filename_str.size() - 3) {
+    } else if (is_bin_file(filename_str)) {
         load_bin<T, M>(filename, row_mat);
     } else {
         std::cerr << "Unsupported file format: " << filename << std::endl;
         exit(1);
     }
 }
-} // namespace saqlib::utils
\ No newline at end of file
+/**
+ * @brief Rows of a .fvecs/.fbin or uint8 .bvecs/.u8bin file in chunks, read ahead on a background thread
+ *
+ * next() hands out the rows converted to float, `chunk_rows` at a time (fewer in the last chunk)
+ * and zero padded to `padded_cols` columns. While the caller works on one chunk the next one is
+ * read into a second buffer, so a pass over the file holds two chunks whatever its size.
+ */
+class VectorStream {
+  public:
+    using Chunk = Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+
+  private:
+    std::string filename_;
+    int fd_ = -1;
+    bool vecs_ = false;     // rows prefixed by their dimension
+    size_t elem_bytes_ = 4; // 4 for float, 1 for uint8
+    size_t header_bytes_ = 0;
+    size_t row_bytes_ = 0;
+    size_t rows_ = 0;
+    size_t cols_ = 0;
+    size_t padded_cols_ = 0;
+    size_t chunk_rows_ = 0;
+
+    Chunk chunks_[2];
+    std::vector<char> staging_[2];
+    size_t fill_ = 0;      // buffer being read into
+    size_t next_row_ = 0;  // first row of the chunk being read
+    std::future<void> pending_;
+    BS::thread_pool<> reader_{1};
+
+    [[noreturn]] void fail(const std::string &what) const {
+        std::cerr << "File " << filename_ << ": " << what << '\n';
+        abort();
+    }
+
+    static bool ends_with(const std::string &str, const char *suffix) {
+        const size_t n = std::strlen(suffix);
+        return str.size() >= n && str.compare(str.size() - n, n, suffix) == 0;
+    }
+
+    void pread_all(char *dst, size_t bytes, size_t offset) const {
+        while (bytes) {
+            const ssize_t got = pread(fd_, dst, bytes, offset);
+            if (got <= 0) {
+                fail(got < 0 ? std::strerror(errno) : "truncated");
+            }
+            dst += got;
+            bytes -= got;
+            offset += got;
+        }
+    }
+
+    void read_chunk(size_t b, size_t first, size_t n) {
+        Chunk &chunk = chunks_[b];
+        if ((size_t)chunk.rows() != n) {
+            chunk.resize(n, padded_cols_);
+        }
+        const size_t offset = header_bytes_ + first * row_bytes_;
+        if (!vecs_ && elem_bytes_ == sizeof(float) && padded_cols_ == cols_) {
+            pread_all(reinterpret_cast<char *>(chunk.data()), n * row_bytes_, offset);
+            return;
+        }
+        auto &buf = staging_[b];
+        buf.resize(n * row_bytes_);
+        pread_all(buf.data(), buf.size(), offset);
+        const size_t prefix = vecs_ ? sizeof(uint32_t) : 0;
+        for (size_t i = 0; i < n; ++i) {
+            const char *src = buf.data() + i * row_bytes_;
+            if (vecs_) {
+                uint32_t dim;
+                std::memcpy(&dim, src, sizeof(dim));
+                if (dim != cols_) {
+                    fail("rows of different dimensions");
+                }
+            }
+            float *dst = &chunk(i, 0);
+            if (elem_bytes_ == sizeof(float)) {
+                std::memcpy(dst, src + prefix, sizeof(float) * cols_);
+            } else {
+                const auto *u8 = reinterpret_cast<const uint8_t *>(src + prefix);
+                std::copy(u8, u8 + cols_, dst);
+            }
+            std::fill(dst + cols_, dst + padded_cols_, 0.0f);
+        }
+    }
+
+    void read_ahead() {
+        if (next_row_ >= rows_) {
+            return;
+        }
+        const size_t n = std::min(chunk_rows_, rows_ - next_row_);
+        pending_ = reader_.submit_task([this, b = fill_, first = next_row_, n] { read_chunk(b, first, n); });
+    }
+
+  public:
+    /**
+     * @param chunk_rows rows per chunk
+     * @param padded_cols columns of the chunks, the ones past cols() are zero. 0 keeps cols().
+     */
+    VectorStream(const char *filename, size_t chunk_rows, size_t padded_cols = 0)
+        : filename_(filename), chunk_rows_(std::max<size_t>(chunk_rows, 1)) {
+        if (ends_with(filename_, "fvecs") || ends_with(filename_, "bvecs")) {
+            vecs_ = true;
+            elem_bytes_ = ends_with(filename_, "bvecs") ? 1 : sizeof(float);
+        } else if (ends_with(filename_, "fbin") || ends_with(filename_, "u8bin")) {
+            elem_bytes_ = ends_with(filename_, "u8bin") ? 1 : sizeof(float);
+        } else {
+            fail("unsupported file format, expected .fvecs, .bvecs, .fbin or .u8bin");
+        }
+        fd_ = open(filename, O_RDONLY);
+        if (fd_ < 0) {
+            fail(std::strerror(errno));
+        }
+        struct stat64 stat_buf;
+        fstat64(fd_, &stat_buf);
+        const size_t bytes = stat_buf.st_size;
+        uint32_t header[2] = {0, 0};
+        if (vecs_) {
+            if (bytes != 0) {
+                pread_all(reinterpret_cast<char *>(header), sizeof(uint32_t), 0);
+                cols_ = header[0];
+                row_bytes_ = sizeof(uint32_t) + cols_ * elem_bytes_;
+                rows_ = bytes / row_bytes_;
+                if (bytes % row_bytes_) {
+                    fail("size is not a multiple of the row size");
+                }
+            }
+        } else {
+            if (bytes < sizeof(header)) {
+                fail("missing header");
+            }
+            pread_all(reinterpret_cast<char *>(header), sizeof(header), 0);
+            rows_ = header[0];
+            cols_ = header[1];
+            header_bytes_ = sizeof(header);
+            row_bytes_ = cols_ * elem_bytes_;
+            if (bytes < header_bytes_ + rows_ * row_bytes_) {
+                fail("truncated");
+            }
+        }
+        padded_cols_ = std::max(padded_cols, cols_);
+        read_ahead();
+    }
+
+    VectorStream(const VectorStream &) = delete;
+    VectorStream &operator=(const VectorStream &) = delete;
+
+    ~VectorStream() {
+        if (pending_.valid()) {
+            pending_.wait();
+        }
+        close(fd_);
+    }
+
+    size_t rows() const { return rows_; }
+    size_t cols() const { return cols_; }
+    size_t padded_cols() const { return padded_cols_; }
+    size_t chunk_rows() const { return chunk_rows_; }
+
+    /**
+     * @brief The next chunk and the file row it starts at, nullptr after the last one
+     *
+     * The chunk stays valid, and may be modified, until the following call to next() or reset().
+     */
+    Chunk *next(size_t *first_row = nullptr) {
+        if (!pending_.valid()) {
+            return nullptr;
+        }
+        pending_.get();
+        Chunk *chunk = &chunks_[fill_];
+        if (first_row) {
+            *first_row = next_row_;
+        }
+        next_row_ += chunk->rows();
+        fill_ ^= 1;
+        read_ahead();
+        return chunk;
+    }
+
+    /**
+     * @brief Restart from the first row
+     */
+    void reset() {
+        if (next_row_ == 0 && (pending_.valid() || rows_ == 0)) {
+            return; // nothing handed out yet
+        }
+        if (pending_.valid()) {
+            pending_.get();
+        }
+        next_row_ = 0;
+        read_ahead();
+    }
+};
+} // namespace saqlib::utils
@@ -0,0 +1,191 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <sys/mman.h>
+#include <vector>
+
+#include <fmt/core.h>
+#include <glog/logging.h>
+
+#include "utils/numa.hpp"
+#include "utils/tools.hpp"
+
+namespace saqlib::memory {
+/**
+ * @brief Bump allocator over a few large anonymous mappings
+ *
+ * Meant for storage that lives as long as the index, so nothing is freed individually.
+ * With `huge_page`, a region is first mapped from the hugetlbfs pool (MAP_HUGETLB) and
+ * falls back to transparent huge pages (MADV_HUGEPAGE) when the pool is too small.
+ * Returned memory is zeroed and all members are thread safe. With `prefault`, pages are
+ * touched as they are handed out instead of on first access. With `numa_node`, regions are
+ * bound to that node (kernel id) before any page is touched.
+ */
+class HugePageArena {
+  public:
+    static constexpr size_t kHugePageSize = 2ul << 20;
+    static constexpr size_t kPageSize = 4096;
+
+    struct Stats {
+        size_t num_regions = 0;
+        size_t num_hugetlb_regions = 0;
+        size_t mapped_bytes = 0;
+        size_t used_bytes = 0;
+    };
+
+  private:
+    struct Region {
+        char *base;
+        size_t bytes;
+        bool hugetlb;
+    };
+
+    const bool huge_page_;
+    const bool prefault_;
+    const size_t region_bytes_;
+    const int numa_node_;
+    std::vector<Region> regions_;
+    size_t region_used_ = 0; // bytes used in the last region
+    size_t used_bytes_ = 0;
+    mutable std::mutex mtx_;
+
+  public:
+    /**
+     * @param huge_page back the regions by huge pages
+     * @param prefault touch pages when they are allocated
+     * @param region_bytes default size of a region. Larger requests get their own region.
+     * @param numa_node kernel id of the node to bind the regions to, -1 for the default policy
+     */
+    explicit HugePageArena(bool huge_page = true, bool prefault = false, size_t region_bytes = 1ul << 30,
+                           int numa_node = -1)
+        : huge_page_(huge_page), prefault_(prefault),
+          region_bytes_(utils::rd_up_to_multiple_of(region_bytes, kHugePageSize)), numa_node_(numa_node) {}
+
+    HugePageArena(const HugePageArena &) = delete;
+    HugePageArena &operator=(const HugePageArena &) = delete;
+
+    ~HugePageArena() {
+        for (auto &r : regions_) {
+            munmap(r.base, r.bytes);
+        }
+    }
+
+    /**
+     * @brief Make sure the next `bytes` can be served from a single region
+     */
+    void reserve(size_t bytes) {
+        std::lock_guard lock(mtx_);
+        if (regions_.empty() || regions_.back().bytes - region_used_ < bytes) {
+            map_region(bytes);
+        }
+    }
+
+    void *allocate(size_t bytes, size_t alignment = 64) {
+        DCHECK_EQ(alignment & (alignment - 1), 0u);
+        std::unique_lock lock(mtx_);
+        size_t off = utils::rd_up_to_multiple_of(region_used_, alignment);
+        if (regions_.empty() || off + bytes > regions_.back().bytes) {
+            map_region(bytes);
+            off = 0;
+        }
+        char *p = regions_.back().base + off;
+        region_used_ = off + bytes;
+        used_bytes_ += bytes;
+        lock.unlock();
+        if (prefault_) {
+            touch(p, bytes);
+        }
+        return p;
+    }
+
+    template <typename T>
+    T *allocate_array(size_t num, size_t alignment = 64) {
+        return static_cast<T *>(allocate(num * sizeof(T), std::max(alignment, alignof(T))));
+    }
+
+    /**
+     * @brief Unmap the untouched tail of the last region, once no more allocations are expected
+     */
+    void shrink_to_fit() {
+        std::lock_guard lock(mtx_);
+        if (regions_.empty()) {
+            return;
+        }
+        auto &r = regions_.back();
+        size_t keep = std::max(utils::rd_up_to_multiple_of(region_used_, kHugePageSize), kHugePageSize);
+        if (keep < r.bytes) {
+            munmap(r.base + keep, r.bytes - keep);
+            r.bytes = keep;
+        }
+    }
+
+    Stats stats() const {
+        std::lock_guard lock(mtx_);
+        Stats s;
+        s.num_regions = regions_.size();
+        for (const auto &r : regions_) {
+            s.num_hugetlb_regions += r.hugetlb;
+            s.mapped_bytes += r.bytes;
+        }
+        s.used_bytes = used_bytes_;
+        return s;
+    }
+
+    std::string toString() const {
+        auto s = stats();
+        return fmt::format("{} regions ({} hugetlb, {} THP), {:.1f} MiB mapped, {:.1f} MiB used{}{}",
+                           s.num_regions, s.num_hugetlb_regions, huge_page_ ? s.num_regions - s.num_hugetlb_regions : 0,
+                           s.mapped_bytes / 1048576.0, s.used_bytes / 1048576.0, prefault_ ? ", prefaulted" : "",
+                           numa_node_ >= 0 ? fmt::format(", node {}", numa_node_) : "");
+    }
+
+  private:
+    void map_region(size_t min_bytes) {
+        const size_t bytes = utils::rd_up_to_multiple_of(std::max(min_bytes, region_bytes_), kHugePageSize);
+        void *p = MAP_FAILED;
+        bool hugetlb = false;
+        if (huge_page_) {
+            p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            hugetlb = p != MAP_FAILED;
+        }
+        if (p == MAP_FAILED) {
+            // over-map by one huge page so the region can start on a huge page boundary
+            const size_t map_bytes = bytes + (huge_page_ ? kHugePageSize : 0);
+            p = mmap(nullptr, map_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            CHECK(p != MAP_FAILED) << fmt::format("mmap of {} bytes failed: {}", map_bytes, std::strerror(errno));
+            if (huge_page_) {
+                auto raw = reinterpret_cast<uintptr_t>(p);
+                auto aligned = utils::rd_up_to_multiple_of(raw, kHugePageSize);
+                if (aligned > raw) {
+                    munmap(p, aligned - raw);
+                }
+                if (aligned + bytes < raw + map_bytes) {
+                    munmap(reinterpret_cast<void *>(aligned + bytes), raw + map_bytes - aligned - bytes);
+                }
+                p = reinterpret_cast<void *>(aligned);
+                madvise(p, bytes, MADV_HUGEPAGE);
+            }
+        }
+        if (numa_node_ >= 0) {
+            utils::bind_to_node(p, bytes, numa_node_);
+        }
+        regions_.push_back({static_cast<char *>(p), bytes, hugetlb});
+        region_used_ = 0;
+    }
+
+    static void touch(char *p, size_t bytes) {
+        auto *v = reinterpret_cast<volatile char *>(p);
+        for (size_t i = 0; i < bytes; i += kPageSize) {
+            v[i] = 0;
+        }
+        if (bytes) {
+            v[bytes - 1] = 0;
+        }
+    }
+};
+} // namespace saqlib::memory
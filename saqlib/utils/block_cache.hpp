@@ -0,0 +1,225 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include <fmt/core.h>
+#include <glog/logging.h>
+
+namespace saqlib::utils {
+/**
+ * @brief Read-only cache of fixed-size blocks of a file, with LRU eviction
+ *
+ * The cache is split into shards with one lock each so that search threads rarely
+ * contend. Missing blocks of one read_batch() call are read together, with one preadv per
+ * run of consecutive blocks.
+ */
+class BlockCache {
+  public:
+    struct Request {
+        uint64_t offset; // in the file
+        size_t bytes;
+        void *dst;
+    };
+
+  private:
+    static constexpr size_t kNumShards = 16;
+    static constexpr size_t kMaxRunBlocks = 64; // blocks read by one preadv
+    static constexpr size_t kMemoSlots = 64;    // blocks remembered by one read_batch()
+
+    using Block = std::shared_ptr<char[]>;
+
+    struct Shard {
+        std::mutex mtx;
+        std::list<uint64_t> lru; // most recently used first
+        std::unordered_map<uint64_t, std::pair<Block, std::list<uint64_t>::iterator>> blocks;
+    };
+
+    int fd_ = -1;
+    const size_t block_bytes_;
+    size_t shard_capacity_; // blocks per shard
+    Shard shards_[kNumShards];
+    std::atomic<size_t> hits_{0};
+    std::atomic<size_t> misses_{0};
+
+  public:
+    /**
+     * @param capacity_bytes memory used for cached blocks, at least one block per shard is kept
+     */
+    BlockCache(const char *filename, size_t capacity_bytes, size_t block_bytes = 4096)
+        : block_bytes_(block_bytes),
+          shard_capacity_(std::max<size_t>(1, capacity_bytes / block_bytes / kNumShards)) {
+        fd_ = open(filename, O_RDONLY);
+        CHECK_GE(fd_, 0) << fmt::format("Cannot open {}: {}", filename, std::strerror(errno));
+    }
+
+    BlockCache(const BlockCache &) = delete;
+    BlockCache &operator=(const BlockCache &) = delete;
+
+    ~BlockCache() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    size_t block_bytes() const { return block_bytes_; }
+    size_t capacity_bytes() const { return shard_capacity_ * kNumShards * block_bytes_; }
+    size_t hits() const { return hits_.load(std::memory_order_relaxed); }
+    size_t misses() const { return misses_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Bytes of the blocks in the cache
+     */
+    size_t bytes() {
+        size_t num_blocks = 0;
+        for (auto &shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            num_blocks += shard.blocks.size();
+        }
+        return num_blocks * block_bytes_;
+    }
+
+    /**
+     * @brief Copy the requested byte ranges of the file, reading the missing blocks
+     * @param hits, misses optional per-call counts of blocks found and read
+     */
+    void read_batch(const std::vector<Request> &reqs, size_t *hits = nullptr, size_t *misses = nullptr) {
+        struct Part {
+            uint64_t block;
+            size_t in_block, bytes;
+            char *dst;
+        };
+        std::vector<Part> missing;
+        // blocks found by this call, requests of nearby vectors mostly share them
+        uint64_t memo_no[kMemoSlots];
+        Block memo[kMemoSlots];
+        std::fill(memo_no, memo_no + kMemoSlots, UINT64_MAX);
+        size_t num_hits = 0;
+        for (const auto &r : reqs) {
+            auto *dst = static_cast<char *>(r.dst);
+            for (uint64_t pos = r.offset, end = r.offset + r.bytes; pos < end;) {
+                const uint64_t block = pos / block_bytes_;
+                const size_t in_block = pos % block_bytes_;
+                const size_t n = std::min<uint64_t>(end - pos, block_bytes_ - in_block);
+                const size_t slot = block % kMemoSlots;
+                if (memo_no[slot] != block) {
+                    memo[slot] = lookup(block);
+                    memo_no[slot] = memo[slot] ? block : UINT64_MAX;
+                    num_hits += memo[slot] != nullptr;
+                }
+                if (memo[slot]) {
+                    std::memcpy(dst, memo[slot].get() + in_block, n);
+                } else {
+                    missing.push_back({block, in_block, n, dst});
+                }
+                dst += n;
+                pos += n;
+            }
+        }
+
+        std::vector<uint64_t> need(missing.size());
+        for (size_t i = 0; i < missing.size(); ++i) {
+            need[i] = missing[i].block;
+        }
+        std::sort(need.begin(), need.end());
+        need.erase(std::unique(need.begin(), need.end()), need.end());
+        // blocks are held here, so they stay valid if evicted meanwhile
+        std::vector<Block> got(need.size());
+        for (size_t k = 0; k < need.size();) {
+            size_t end = k + 1;
+            while (end < need.size() && end - k < kMaxRunBlocks && need[end] == need[end - 1] + 1) {
+                ++end;
+            }
+            read_run(need[k], end - k, &got[k]);
+            k = end;
+        }
+        for (size_t k = 0; k < need.size(); ++k) {
+            insert(need[k], got[k]);
+        }
+        for (const auto &part : missing) {
+            const auto k = std::lower_bound(need.begin(), need.end(), part.block) - need.begin();
+            std::memcpy(part.dst, got[k].get() + part.in_block, part.bytes);
+        }
+
+        hits_.fetch_add(num_hits, std::memory_order_relaxed);
+        misses_.fetch_add(need.size(), std::memory_order_relaxed);
+        if (hits) {
+            *hits += num_hits;
+        }
+        if (misses) {
+            *misses += need.size();
+        }
+    }
+
+    void read(uint64_t offset, size_t bytes, void *dst) { read_batch({{offset, bytes, dst}}); }
+
+  private:
+    Shard &shard_of(uint64_t block) { return shards_[(block * 0x9E3779B97F4A7C15ull) >> 60]; }
+
+    Block lookup(uint64_t block) {
+        auto &shard = shard_of(block);
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        auto it = shard.blocks.find(block);
+        if (it == shard.blocks.end()) {
+            return nullptr;
+        }
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second.second);
+        return it->second.first;
+    }
+
+    void insert(uint64_t block, Block data) {
+        auto &shard = shard_of(block);
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        if (shard.blocks.count(block)) {
+            return; // read by another thread meanwhile
+        }
+        shard.lru.push_front(block);
+        shard.blocks.emplace(block, std::make_pair(std::move(data), shard.lru.begin()));
+        if (shard.blocks.size() > shard_capacity_) {
+            shard.blocks.erase(shard.lru.back());
+            shard.lru.pop_back();
+        }
+    }
+
+    /**
+     * @brief Read `num` consecutive blocks with one preadv. The part past the end of the file is zeroed.
+     */
+    void read_run(uint64_t first, size_t num, Block *out) {
+        std::vector<iovec> iov(num);
+        for (size_t i = 0; i < num; ++i) {
+            out[i] = std::make_shared<char[]>(block_bytes_);
+            iov[i] = {out[i].get(), block_bytes_};
+        }
+        uint64_t offset = first * block_bytes_;
+        size_t iov_idx = 0;
+        while (iov_idx < num) {
+            ssize_t n = preadv(fd_, &iov[iov_idx], std::min<size_t>(num - iov_idx, IOV_MAX), offset);
+            CHECK_GE(n, 0) << fmt::format("Cannot read block at offset {}: {}", offset, std::strerror(errno));
+            if (n == 0) {
+                break; // end of file, blocks are zero-initialized
+            }
+            offset += n;
+            for (size_t left = n; left;) {
+                const size_t step = std::min(left, iov[iov_idx].iov_len);
+                iov[iov_idx].iov_base = static_cast<char *>(iov[iov_idx].iov_base) + step;
+                iov[iov_idx].iov_len -= step;
+                left -= step;
+                iov_idx += iov[iov_idx].iov_len == 0;
+            }
+        }
+    }
+};
+} // namespace saqlib::utils
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <immintrin.h>
+#include <limits>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "defines.hpp"
+#include "utils/BS_thread_pool.hpp"
+#include "utils/pool.hpp"
+
+namespace saqlib::utils {
+/**
+ * @brief Exact k nearest neighbours of a set of queries, over a base set given in chunks
+ *
+ * The queries are cut into blocks of kQueryBlock and the chunk into tiles of kDataBlock rows;
+ * the inner products of a tile are one GEMM, and L2 is ranked by |x|^2 - 2<q, x> from norms
+ * computed once per chunk. Every row of the tile is compared 16 lanes at a time with the k-th
+ * distance of its query, with a margin for the rounding of the GEMM, and only the survivors
+ * get their distance computed directly and inserted. The kept distances are thus the same as
+ * a plain scan's. Each task owns a block of queries, so the pools need no locks.
+ */
+class BruteForceKNN {
+  public:
+    static constexpr size_t kQueryBlock = 32;
+    static constexpr size_t kDataBlock = 256;
+
+  private:
+    const FloatRowMat &queries_;
+    const bool ip_;
+    std::vector<float> query_norms_; // squared
+    std::vector<ResultPool> pools_;
+    size_t num_scanned_ = 0;
+    size_t num_inserted_ = 0; // survivors of the filter
+
+    // Keys of one tile row, smaller is closer: |x|^2 - 2<q, x> for L2, -<q, x> for IP
+    void keys(const float *ips, const float *data_norms, size_t n, float *out) const {
+        if (ip_) {
+            for (size_t j = 0; j < n; ++j) {
+                out[j] = -ips[j];
+            }
+        } else {
+            for (size_t j = 0; j < n; ++j) {
+                out[j] = data_norms[j] - 2 * ips[j];
+            }
+        }
+    }
+
+    // Key a candidate must beat to enter the pool of query `qi`
+    float key_bound(size_t qi, float slack) {
+        auto &pool = pools_[qi];
+        if (pool.size() < pool.capacity()) {
+            return std::numeric_limits<float>::max();
+        }
+        return (ip_ ? -pool.distk() : pool.distk() - query_norms_[qi]) + slack;
+    }
+
+    void scan_block(const FloatRowMat &data, const std::vector<float> &data_norms, float max_data_norm, PID first_id,
+                    size_t q_begin, size_t q_end, size_t &inserted) {
+        const size_t num_q = q_end - q_begin;
+        const size_t dim = queries_.cols();
+        FloatRowMat ips(num_q, kDataBlock);
+        std::vector<float> key(kDataBlock);
+        std::vector<float> slacks(num_q);
+        for (size_t r = 0; r < num_q; ++r) {
+            // twice the rounding bound of float sums of `dim` terms of size up to |q|^2 + |x|^2
+            constexpr float kEps = std::numeric_limits<float>::epsilon();
+            slacks[r] = 2 * kEps * dim * (query_norms_[q_begin + r] + max_data_norm);
+        }
+        const auto query_block = queries_.middleRows(q_begin, num_q);
+
+        for (size_t t = 0; t < size_t(data.rows()); t += kDataBlock) {
+            const size_t n = std::min(kDataBlock, size_t(data.rows()) - t);
+            ips.leftCols(n).noalias() = query_block * data.middleRows(t, n).transpose();
+            for (size_t r = 0; r < num_q; ++r) {
+                const size_t qi = q_begin + r;
+                const auto query = queries_.row(qi);
+                auto &pool = pools_[qi];
+                keys(&ips(r, 0), data_norms.data() + t, n, key.data());
+                float bound = key_bound(qi, slacks[r]);
+                auto insert = [&](size_t j) {
+                    const auto x = data.row(t + j);
+                    const float dist = ip_ ? query.dot(x) : (x - query).squaredNorm();
+                    pool.insert(first_id + t + j, dist);
+                    bound = key_bound(qi, slacks[r]);
+                    ++inserted;
+                };
+                size_t j = 0;
+#if defined(__AVX512F__)
+                for (; j + 16 <= n; j += 16) {
+                    __mmask16 mask = _mm512_cmp_ps_mask(_mm512_loadu_ps(&key[j]), _mm512_set1_ps(bound), _CMP_LE_OQ);
+                    while (mask) {
+                        const size_t lane = __builtin_ctz(mask);
+                        mask &= mask - 1;
+                        if (key[j + lane] <= bound) { // the bound shrinks with every insert
+                            insert(j + lane);
+                        }
+                    }
+                }
+#endif
+                for (; j < n; ++j) {
+                    if (key[j] <= bound) {
+                        insert(j);
+                    }
+                }
+            }
+        }
+    }
+
+  public:
+    /**
+     * @param queries kept by reference, must outlive the object
+     * @param ip rank by largest inner product instead of smallest L2 distance
+     */
+    BruteForceKNN(const FloatRowMat &queries, size_t k, bool ip) : queries_(queries), ip_(ip) {
+        query_norms_.resize(queries.rows());
+        pools_.reserve(queries.rows());
+        for (size_t i = 0; i < size_t(queries.rows()); ++i) {
+            query_norms_[i] = queries.row(i).squaredNorm();
+            pools_.emplace_back(k, ip);
+        }
+    }
+
+    /**
+     * @brief Scan a chunk of the base set, whose first row has id `first_id`, on `pool`
+     */
+    void add(const FloatRowMat &data, PID first_id, BS::thread_pool<> &pool) {
+        CHECK_EQ(data.cols(), queries_.cols()) << "Data and query dimension mismatch";
+        const size_t num_data = data.rows();
+        std::vector<float> data_norms(num_data);
+        pool.detach_blocks(size_t(0), num_data, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                data_norms[i] = data.row(i).squaredNorm();
+            }
+        });
+        pool.wait();
+        const float max_data_norm = num_data ? *std::max_element(data_norms.begin(), data_norms.end()) : 0;
+
+        // blocks small enough to give every thread work
+        const size_t num_queries = queries_.rows();
+        const size_t block = std::clamp<size_t>(num_queries / pool.get_thread_count(), 1, kQueryBlock);
+        const size_t num_blocks = (num_queries + block - 1) / block;
+        std::vector<size_t> inserted(num_blocks, 0);
+        pool.detach_loop(size_t(0), num_blocks, [&](size_t b) {
+            scan_block(data, data_norms, max_data_norm, first_id, b * block, std::min(num_queries, (b + 1) * block),
+                       inserted[b]);
+        });
+        pool.wait();
+        num_scanned_ += num_data * num_queries;
+        for (auto n : inserted) {
+            num_inserted_ += n;
+        }
+    }
+
+    ResultPool &results(size_t qi) { return pools_[qi]; }
+
+    /**
+     * @brief Fraction of the (query, vector) pairs that passed the filter
+     */
+    double insert_rate() const { return num_scanned_ ? double(num_inserted_) / num_scanned_ : 0.0; }
+};
+} // namespace saqlib::utils
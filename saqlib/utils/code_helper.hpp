@@ -12,6 +12,76 @@
 
 namespace saqlib::utils {
 
+/**
+ * @brief Narrow 64 int32 codes to bytes holding `(code >> shift) & mask`
+ */
+inline void narrow_chunk64(uint8_t *out, const int32_t *in, int shift, int32_t mask) {
+#if defined(__AVX512F__)
+    const __m512i m = _mm512_set1_epi32(mask);
+    for (size_t i = 0; i < 64; i += 16) {
+        __m512i v = _mm512_loadu_si512(in + i);
+        v = _mm512_and_si512(_mm512_srai_epi32(v, shift), m);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm512_cvtepi32_epi8(v));
+    }
+#else
+    for (size_t i = 0; i < 64; ++i) {
+        out[i] = (in[i] >> shift) & mask;
+    }
+#endif
+}
+
+/**
+ * @brief Mask of `code[k] & bit` over 64 codes, dim k at bit k
+ */
+inline uint64_t extract_bit_plane64(const int32_t *code, int32_t bit) {
+#if defined(__AVX512F__)
+    const __m512i b = _mm512_set1_epi32(bit);
+    uint64_t m0 = _mm512_test_epi32_mask(_mm512_loadu_si512(code + 0), b);
+    uint64_t m1 = _mm512_test_epi32_mask(_mm512_loadu_si512(code + 16), b);
+    uint64_t m2 = _mm512_test_epi32_mask(_mm512_loadu_si512(code + 32), b);
+    uint64_t m3 = _mm512_test_epi32_mask(_mm512_loadu_si512(code + 48), b);
+    return m0 | (m1 << 16) | (m2 << 32) | (m3 << 48);
+#else
+    uint64_t m = 0;
+    for (size_t k = 0; k < 64; ++k) {
+        m |= uint64_t((code[k] & bit) != 0) << k;
+    }
+    return m;
+#endif
+}
+
+/**
+ * @brief Reverse the bit order inside every byte of `x`
+ */
+inline uint64_t reverse_bits_in_bytes(uint64_t x) {
+    x = ((x >> 1) & 0x5555555555555555ull) | ((x & 0x5555555555555555ull) << 1);
+    x = ((x >> 2) & 0x3333333333333333ull) | ((x & 0x3333333333333333ull) << 2);
+    x = ((x >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((x & 0x0F0F0F0F0F0F0F0Full) << 4);
+    return x;
+}
+
+/**
+ * @brief Pack bit `bit` of every code into MSB-first bytes (dim 8j goes to bit 7 of byte j).
+ * This is the input layout of fastscan::pack_codes.
+ */
+inline void pack_bit_plane_msb(uint8_t *out, const int32_t *code, int32_t bit, size_t num_dim) {
+    for (size_t d = 0; d < num_dim; d += 64) {
+        uint64_t w = reverse_bits_in_bytes(extract_bit_plane64(code + d, bit));
+        std::memcpy(out + d / 8, &w, sizeof(w));
+    }
+}
+
+/**
+ * @brief Same as pack_bit_plane_msb with every 8 bytes reversed, so each 64 dims read
+ * as one uint64 with dim 0 at the top bit. This is the non-fastscan short code layout.
+ */
+inline void pack_bit_plane_u64(uint8_t *out, const int32_t *code, int32_t bit, size_t num_dim) {
+    for (size_t d = 0; d < num_dim; d += 64) {
+        uint64_t w = __builtin_bswap64(reverse_bits_in_bytes(extract_bit_plane64(code + d, bit)));
+        std::memcpy(out + d / 8, &w, sizeof(w));
+    }
+}
+
 template <size_t kBits>
 class CodeHelper {
     template <typename T>
@@ -79,6 +149,34 @@ class CodeHelper {
         }
     }
 
+    /**
+     * @brief Compact the low kBits bits of int32 codes directly, 64 dims at a time.
+     * Produces the same layout as compacted_code16 without a widened copy of the code.
+     */
+    static void compacted_code32(uint8_t *o_compact, const int32_t *o_raw32, size_t num_dim) {
+        if constexpr (kBits > 0) {
+            alignas(64) uint8_t chunk[64];
+            for (size_t d = 0; d < num_dim; d += 64) {
+                if constexpr (kBits > 8) {
+                    narrow_chunk64(o_compact + d, o_raw32 + d, 0, 0xFF);
+                    narrow_chunk64(chunk, o_raw32 + d, 8, (1 << (kBits - 8)) - 1);
+                    CodeHelper<kBits - 8>::compact_chunk64(o_compact + num_dim, chunk, d, num_dim);
+                } else {
+                    narrow_chunk64(chunk, o_raw32 + d, 0, (1 << kBits) - 1);
+                    compact_chunk64(o_compact, chunk, d, num_dim);
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Write the 64 dims [d, d + 64) of a code into its compacted layout. The code
+     * length only matters to layouts split in parts, see CodeHelper<5>
+     */
+    static void compact_chunk64(uint8_t *o_compact, const uint8_t *chunk, size_t d, size_t /* num_dim */) {
+        compacted_code8(o_compact + d * kBits / 8, chunk, 64);
+    }
+
     static float compute_ip(const float *__restrict__ query, const uint8_t *__restrict__ y, size_t D) {
         if constexpr (kBits == 0)
             return 0;
@@ -368,6 +466,17 @@ inline void CodeHelper<5>::compacted_code8(uint8_t *o_compact, const uint8_t *o_
     CodeHelper<4>::compacted_code8(o_compact, o4.get(), num_dim);
 }
 
+template <>
+inline void CodeHelper<5>::compact_chunk64(uint8_t *o_compact, const uint8_t *chunk, size_t d, size_t num_dim) {
+    // 4 bit part first, 1 bit part after all the 4 bit codes
+    CodeHelper<1>::compacted_code8(o_compact + (num_dim * 4 / 8) + d / 8, chunk, 64);
+    alignas(64) uint8_t o4[64];
+    for (size_t i = 0; i < 64; i++) {
+        o4[i] = chunk[i] >> 1;
+    }
+    CodeHelper<4>::compacted_code8(o_compact + d * 4 / 8, o4, 64);
+}
+
 template <>
 inline float CodeHelper<5>::compute_ip(const float *__restrict__ query, const uint8_t *__restrict__ y, size_t D) {
     return 2 * CodeHelper<4>::compute_ip(query, y, D) + CodeHelper<1>::compute_ip(query, y + (D * 4 / 8), D);
@@ -681,6 +790,48 @@ inline auto get_compacted_code16_func(int bits) -> void (*)(uint8_t *o_compact,
     return nullptr;
 }
 
+inline auto get_compacted_code32_func(int bits) -> void (*)(uint8_t *o_compact, const int32_t *o_raw, size_t num_dim) {
+    switch (bits) {
+    case 0:
+        return CodeHelper<0>::compacted_code32;
+    case 1:
+        return CodeHelper<1>::compacted_code32;
+    case 2:
+        return CodeHelper<2>::compacted_code32;
+    case 3:
+        return CodeHelper<3>::compacted_code32;
+    case 4:
+        return CodeHelper<4>::compacted_code32;
+    case 5:
+        return CodeHelper<5>::compacted_code32;
+    case 6:
+        return CodeHelper<6>::compacted_code32;
+    case 7:
+        return CodeHelper<7>::compacted_code32;
+    case 8:
+        return CodeHelper<8>::compacted_code32;
+    case 9:
+        return CodeHelper<9>::compacted_code32;
+    case 10:
+        return CodeHelper<10>::compacted_code32;
+    case 11:
+        return CodeHelper<11>::compacted_code32;
+    case 12:
+        return CodeHelper<12>::compacted_code32;
+    case 13:
+        return CodeHelper<13>::compacted_code32;
+    case 14:
+        return CodeHelper<14>::compacted_code32;
+    case 15:
+        return CodeHelper<15>::compacted_code32;
+    case 16:
+        return CodeHelper<16>::compacted_code32;
+    default:
+        assert(false);
+    }
+    return nullptr;
+}
+
 inline auto get_compacted_code8_func(int bits) -> void (*)(uint8_t *o_compact, const uint8_t *o_raw, size_t num_dim) {
     switch (bits) {
     case 0:
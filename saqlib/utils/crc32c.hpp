@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
+namespace saqlib::utils {
+namespace detail {
+constexpr uint32_t kCrc32cPoly = 0x82F63B78; // reflected Castagnoli polynomial
+
+inline uint32_t crc32c_u8(uint32_t crc, uint8_t v) {
+#if defined(__SSE4_2__)
+    return _mm_crc32_u8(crc, v);
+#else
+    crc ^= v;
+    for (int k = 0; k < 8; ++k) {
+        crc = (crc >> 1) ^ (kCrc32cPoly & (0u - (crc & 1)));
+    }
+    return crc;
+#endif
+}
+
+inline uint32_t crc32c_u64(uint32_t crc, uint64_t v) {
+#if defined(__SSE4_2__)
+    return static_cast<uint32_t>(_mm_crc32_u64(crc, v));
+#else
+    for (int k = 0; k < 8; ++k) {
+        crc = crc32c_u8(crc, static_cast<uint8_t>(v >> (8 * k)));
+    }
+    return crc;
+#endif
+}
+
+/**
+ * @brief Raw CRC update (no pre/post inversion) over `bytes` bytes
+ */
+inline uint32_t crc32c_update(uint32_t crc, const uint8_t *p, size_t bytes) {
+    for (; bytes >= 8; p += 8, bytes -= 8) {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof(v));
+        crc = crc32c_u64(crc, v);
+    }
+    for (; bytes; ++p, --bytes) {
+        crc = crc32c_u8(crc, *p);
+    }
+    return crc;
+}
+
+/**
+ * @brief Advance a raw CRC state over `bytes` zero bytes, by table lookup
+ *
+ * The raw update is linear in the state, so crc(A || B) = shift(crc(A)) ^ crc0(B) where
+ * shift() skips len(B) zero bytes. This lets independent lanes be merged.
+ */
+class Crc32cShift {
+    uint32_t table_[4][256];
+
+  public:
+    explicit Crc32cShift(size_t bytes) {
+        uint32_t basis[32];
+        for (int i = 0; i < 32; ++i) {
+            uint32_t crc = 1u << i;
+            for (size_t j = 0; j < bytes / 8; ++j) {
+                crc = crc32c_u64(crc, 0);
+            }
+            for (size_t j = 0; j < bytes % 8; ++j) {
+                crc = crc32c_u8(crc, 0);
+            }
+            basis[i] = crc;
+        }
+        for (int k = 0; k < 4; ++k) {
+            for (uint32_t b = 0; b < 256; ++b) {
+                uint32_t v = 0;
+                for (int j = 0; j < 8; ++j) {
+                    if (b >> j & 1) {
+                        v ^= basis[8 * k + j];
+                    }
+                }
+                table_[k][b] = v;
+            }
+        }
+    }
+
+    uint32_t operator()(uint32_t crc) const {
+        return table_[0][crc & 255] ^ table_[1][(crc >> 8) & 255] ^ table_[2][(crc >> 16) & 255] ^
+               table_[3][crc >> 24];
+    }
+};
+} // namespace detail
+
+/**
+ * @brief CRC32C (Castagnoli) of a buffer. Pass the previous result as `crc` to continue it.
+ *
+ * Large buffers are split into three lanes hashed with interleaved crc32 instructions,
+ * which hides the latency of the instruction, and merged with a precomputed shift.
+ */
+inline uint32_t crc32c(const void *data, size_t bytes, uint32_t crc = 0) {
+    constexpr size_t kLane = 4096;
+    static const detail::Crc32cShift shift(kLane);
+
+    auto *p = static_cast<const uint8_t *>(data);
+    crc = ~crc;
+    for (; bytes >= 3 * kLane; p += 3 * kLane, bytes -= 3 * kLane) {
+        uint32_t a = crc, b = 0, c = 0;
+        for (size_t i = 0; i < kLane; i += 8) {
+            uint64_t va, vb, vc;
+            std::memcpy(&va, p + i, 8);
+            std::memcpy(&vb, p + kLane + i, 8);
+            std::memcpy(&vc, p + 2 * kLane + i, 8);
+            a = detail::crc32c_u64(a, va);
+            b = detail::crc32c_u64(b, vb);
+            c = detail::crc32c_u64(c, vc);
+        }
+        crc = shift(shift(a) ^ b) ^ c;
+    }
+    return ~detail::crc32c_update(crc, p, bytes);
+}
+} // namespace saqlib::utils
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+
+#include <glog/logging.h>
+
+#include "defines.hpp"
+
+namespace saqlib::utils {
+constexpr float kFp16Max = 65504.0f; // largest finite IEEE half
+
+inline size_t factor_bytes(FactorType type) { return type == FactorType::Fp32 ? sizeof(float) : sizeof(uint16_t); }
+
+/**
+ * @brief Fail if factors up to `bound` in absolute value do not fit in `type`
+ *
+ * Called before quantization with the bound of SAQuantizer::factor_bound(), rather than
+ * failing on the first factor beyond the fp16 range in the middle of a build.
+ */
+inline void check_factor_range(FactorType type, double bound) {
+    CHECK(type != FactorType::Fp16 || bound <= kFp16Max)
+        << "Factors of the data may reach " << bound << ", out of the fp16 range, use bf16 or fp32 factors";
+}
+
+/**
+ * @brief Store `v` at `dst` in the given precision, rounding to nearest even. Factors beyond
+ * the fp16 range are rejected by check_factor_range() before quantization.
+ */
+inline void encode_factor(float v, FactorType type, void *dst) {
+    uint16_t h = 0;
+    switch (type) {
+    case FactorType::Fp32:
+        std::memcpy(dst, &v, sizeof(float));
+        return;
+    case FactorType::Fp16:
+        DCHECK_LE(std::abs(v), kFp16Max) << "Factor " << v << " is out of the fp16 range";
+        h = _cvtss_sh(v, _MM_FROUND_TO_NEAREST_INT);
+        break;
+    case FactorType::Bf16: {
+        uint32_t bits;
+        std::memcpy(&bits, &v, sizeof(float));
+        h = static_cast<uint16_t>((bits + 0x7FFF + ((bits >> 16) & 1)) >> 16);
+        break;
+    }
+    }
+    std::memcpy(dst, &h, sizeof(uint16_t));
+}
+
+inline float decode_factor(const void *src, FactorType type) {
+    if (type == FactorType::Fp32) {
+        float v;
+        std::memcpy(&v, src, sizeof(float));
+        return v;
+    }
+    uint16_t h;
+    std::memcpy(&h, src, sizeof(uint16_t));
+    if (type == FactorType::Fp16) {
+        return _cvtsh_ss(h);
+    }
+    const uint32_t bits = static_cast<uint32_t>(h) << 16;
+    float v;
+    std::memcpy(&v, &bits, sizeof(float));
+    return v;
+}
+
+/**
+ * @brief Load 16 consecutive factors as floats
+ */
+inline __m512 load16_factors(const void *src, FactorType type) {
+    switch (type) {
+    case FactorType::Fp16:
+        return _mm512_cvtph_ps(_mm256_loadu_si256(static_cast<const __m256i *>(src)));
+    case FactorType::Bf16:
+        return _mm512_castsi512_ps(
+            _mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256(static_cast<const __m256i *>(src))), 16));
+    default:
+        return _mm512_loadu_ps(static_cast<const float *>(src));
+    }
+}
+} // namespace saqlib::utils
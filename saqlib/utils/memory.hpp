@@ -20,7 +20,7 @@ inline T *align_mm(size_t size) {
     if (HUGE_PAGE) {
         madvise(p, nbytes, MADV_HUGEPAGE);
     }
-    std::memset(p, 0, size);
+    std::memset(p, 0, nbytes);
     return static_cast<T *>(p);
 }
 
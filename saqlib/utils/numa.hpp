@@ -0,0 +1,191 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <glog/logging.h>
+
+namespace saqlib::utils {
+/**
+ * @brief CPUs of each NUMA node, read from sysfs
+ *
+ * A host without NUMA information is reported as one node holding all CPUs. Nodes are
+ * indexed densely from 0, `node_ids` keeps the kernel ids for memory binding.
+ */
+struct NumaTopology {
+    std::vector<int> node_ids;              // kernel id of each node
+    std::vector<std::vector<int>> node_cpus; // CPUs of each node
+    std::vector<int> cpu_node;              // node index of each CPU, -1 if unknown
+
+    size_t num_nodes() const { return node_cpus.size(); }
+
+    int node_of_cpu(int cpu) const {
+        return (cpu >= 0 && static_cast<size_t>(cpu) < cpu_node.size() && cpu_node[cpu] >= 0) ? cpu_node[cpu] : 0;
+    }
+
+    /**
+     * @brief Node index of the CPU the calling thread runs on
+     */
+    int current_node() const { return num_nodes() > 1 ? node_of_cpu(sched_getcpu()) : 0; }
+
+    /**
+     * @brief All CPUs, round robin over nodes, so the first k CPUs are spread evenly
+     */
+    std::vector<int> interleaved_cpus() const {
+        std::vector<int> cpus;
+        for (size_t i = 0;; ++i) {
+            size_t added = 0;
+            for (const auto &node : node_cpus) {
+                if (i < node.size()) {
+                    cpus.push_back(node[i]);
+                    ++added;
+                }
+            }
+            if (added == 0) {
+                return cpus;
+            }
+        }
+    }
+
+    static std::vector<int> parse_cpulist(const std::string &list) {
+        std::vector<int> cpus;
+        size_t pos = 0;
+        while (pos < list.size()) {
+            size_t end = list.find(',', pos);
+            if (end == std::string::npos) {
+                end = list.size();
+            }
+            auto item = list.substr(pos, end - pos);
+            auto dash = item.find('-');
+            if (!item.empty() && item.find_first_not_of(" \n") != std::string::npos) {
+                int lo = std::stoi(item.substr(0, dash));
+                int hi = dash == std::string::npos ? lo : std::stoi(item.substr(dash + 1));
+                for (int c = lo; c <= hi; ++c) {
+                    cpus.push_back(c);
+                }
+            }
+            pos = end + 1;
+        }
+        return cpus;
+    }
+
+    static NumaTopology load(const std::string &root = "/sys/devices/system/node") {
+        NumaTopology topo;
+        std::error_code ec;
+        std::vector<int> ids;
+        for (const auto &entry : std::filesystem::directory_iterator(root, ec)) {
+            auto name = entry.path().filename().string();
+            if (name.rfind("node", 0) == 0 && name.size() > 4 && std::isdigit(name[4])) {
+                ids.push_back(std::stoi(name.substr(4)));
+            }
+        }
+        std::sort(ids.begin(), ids.end());
+        for (int id : ids) {
+            std::ifstream in(root + "/node" + std::to_string(id) + "/cpulist");
+            std::string list;
+            std::getline(in, list);
+            auto cpus = parse_cpulist(list);
+            if (!cpus.empty()) { // skip memory-only nodes
+                topo.node_ids.push_back(id);
+                topo.node_cpus.push_back(std::move(cpus));
+            }
+        }
+        if (topo.node_cpus.empty()) {
+            topo.node_ids = {-1};
+            topo.node_cpus.emplace_back();
+            for (unsigned c = 0; c < std::max(1u, std::thread::hardware_concurrency()); ++c) {
+                topo.node_cpus[0].push_back(c);
+            }
+        }
+        for (size_t n = 0; n < topo.num_nodes(); ++n) {
+            for (int c : topo.node_cpus[n]) {
+                if (static_cast<size_t>(c) >= topo.cpu_node.size()) {
+                    topo.cpu_node.resize(c + 1, -1);
+                }
+                topo.cpu_node[c] = n;
+            }
+        }
+        return topo;
+    }
+
+    /**
+     * @brief Topology of this host. Read once per process.
+     */
+    static const NumaTopology &host() {
+        static const NumaTopology topo = load();
+        return topo;
+    }
+};
+
+/**
+ * @brief Restrict the calling thread to `cpus`
+ */
+inline bool pin_thread(const std::vector<int> &cpus) {
+    if (cpus.empty()) {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int c : cpus) {
+        CPU_SET(c, &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+/**
+ * @brief Bind the pages of [addr, addr + bytes) to NUMA node `node_id` (kernel id).
+ * `addr` must be page aligned. Pages already faulted in are not moved.
+ */
+inline bool bind_to_node(void *addr, size_t bytes, int node_id) {
+    if (node_id < 0) {
+        return false;
+    }
+    constexpr size_t kBitsPerWord = 8 * sizeof(unsigned long);
+    std::vector<unsigned long> mask(node_id / kBitsPerWord + 1, 0);
+    mask[node_id / kBitsPerWord] |= 1ul << (node_id % kBitsPerWord);
+    long ret = syscall(SYS_mbind, addr, bytes, MPOL_BIND, mask.data(), mask.size() * kBitsPerWord + 1, 0);
+    LOG_IF(WARNING, ret != 0) << "mbind to node " << node_id << " failed, memory stays unbound";
+    return ret == 0;
+}
+
+/**
+ * @brief Initialization function of BS::thread_pool pinning worker i to `cpu_sets[i % size]`
+ */
+struct AffinityInit {
+    std::vector<std::vector<int>> cpu_sets;
+
+    void operator()(size_t idx) const {
+        if (!cpu_sets.empty()) {
+            pin_thread(cpu_sets[idx % cpu_sets.size()]);
+        }
+    }
+
+    /**
+     * @brief One CPU per worker, spread round robin over the nodes
+     */
+    static AffinityInit spread(const NumaTopology &topo) {
+        AffinityInit init;
+        for (int c : topo.interleaved_cpus()) {
+            init.cpu_sets.push_back({c});
+        }
+        return init;
+    }
+
+    /**
+     * @brief Every worker may run on any CPU of node `n`
+     */
+    static AffinityInit node(const NumaTopology &topo, size_t n) { return AffinityInit{{topo.node_cpus[n]}}; }
+};
+} // namespace saqlib::utils
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <numeric>
+#include <vector>
+
+#include "third/Eigen/Dense"
+#include <glog/logging.h>
+
+#include "defines.hpp"
+#include "utils/rotator.hpp"
+
+namespace saqlib::utils {
+/**
+ * @brief Streaming PCA builder
+ *
+ * Accumulates the first and second moments of the data block by block (in double
+ * precision, shifted by the mean of the first block for numerical stability), so the
+ * full dataset never needs to be resident. `build()` solves the covariance with
+ * Eigen's self-adjoint eigensolver and returns a PCARotator whose rows of P are the
+ * principal directions sorted by decreasing variance.
+ */
+class PCABuilder {
+    using DoubleRowMat = Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+    using DoubleVec = Eigen::RowVectorXd;
+
+    size_t D;
+    size_t num_ = 0;
+    DoubleVec shift_; // mean of the first block
+    DoubleVec sum_;   // sum of (x - shift)
+    DoubleRowMat xtx_; // sum of (x - shift)^T (x - shift), lower triangle only
+    FloatVec variance_;
+
+  public:
+    explicit PCABuilder(size_t dim)
+        : D(dim), sum_(DoubleVec::Zero(dim)), xtx_(DoubleRowMat::Zero(dim, dim)) {}
+
+    size_t num_added() const { return num_; }
+
+    /**
+     * @brief Accumulate one block of row vectors
+     */
+    template <typename Derived>
+    void add(const Eigen::MatrixBase<Derived> &block) {
+        CHECK_EQ((size_t)block.cols(), D) << "PCA dimension mismatch";
+        if (block.rows() == 0) {
+            return;
+        }
+        if (num_ == 0) {
+            shift_ = block.template cast<double>().colwise().mean();
+        }
+        DoubleRowMat X = block.template cast<double>().rowwise() - shift_;
+        sum_ += X.colwise().sum();
+        xtx_.selfadjointView<Eigen::Lower>().rankUpdate(X.transpose());
+        num_ += block.rows();
+    }
+
+    /**
+     * @brief Accumulate a whole matrix in blocks of `block_rows` rows
+     */
+    void add_all(const FloatRowMat &data, size_t block_rows = 16384) {
+        for (size_t i = 0; i < (size_t)data.rows(); i += block_rows) {
+            add(data.middleRows(i, std::min(block_rows, (size_t)data.rows() - i)));
+        }
+    }
+
+    /**
+     * @brief Solve the covariance and return the PCA transform
+     *
+     * Also records the per-component variance (eigenvalues), see variance().
+     */
+    PCARotatorPtr build() {
+        CHECK_GT(num_, 0) << "PCA requires at least one vector";
+        const double n = static_cast<double>(num_);
+        DoubleVec mean_shifted = sum_ / n;
+        DoubleRowMat cov = xtx_.selfadjointView<Eigen::Lower>();
+        cov /= n;
+        cov.noalias() -= mean_shifted.transpose() * mean_shifted;
+
+        Eigen::SelfAdjointEigenSolver<DoubleRowMat> solver(cov);
+        CHECK(solver.info() == Eigen::Success) << "PCA eigen decomposition failed";
+
+        // Eigen returns eigenvalues in increasing order
+        const auto &evals = solver.eigenvalues();
+        const auto &evecs = solver.eigenvectors();
+        FloatRowMat P(D, D);
+        variance_.resize(D);
+        for (size_t i = 0; i < D; ++i) {
+            size_t src = D - 1 - i;
+            P.row(i) = evecs.col(src).transpose().cast<float>();
+            variance_[i] = static_cast<float>(std::max(evals[src], 0.0));
+        }
+
+        auto pca = std::make_unique<PCARotator>();
+        pca->set(std::move(P), (mean_shifted + shift_).cast<float>());
+        return pca;
+    }
+
+    /**
+     * @brief Variance of each principal component, valid after build()
+     */
+    const FloatVec &variance() const { return variance_; }
+};
+} // namespace saqlib::utils
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace saqlib::utils {
+/**
+ * @brief Hardware event counter of this process (perf_event_open, user space only)
+ *
+ * Threads created after the counter are counted as well, so create it before the thread
+ * pool to be measured. valid() is false when perf events are not available, e.g. in
+ * containers or with perf_event_paranoid > 2.
+ */
+class PerfCounter {
+    int fd_ = -1;
+
+  public:
+    PerfCounter(uint32_t type, uint64_t config) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_ = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    /**
+     * @brief Data TLB misses of loads
+     */
+    static PerfCounter dtlb_load_misses() {
+        return PerfCounter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    }
+
+    PerfCounter(const PerfCounter &) = delete;
+    PerfCounter &operator=(const PerfCounter &) = delete;
+    PerfCounter(PerfCounter &&other) noexcept : fd_(other.fd_) { other.fd_ = -1; }
+
+    ~PerfCounter() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    bool valid() const { return fd_ >= 0; }
+
+    void start() {
+        if (valid()) {
+            ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    void stop() {
+        if (valid()) {
+            ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+
+    /**
+     * @brief Events counted between start() and stop(), 0 if not valid()
+     */
+    uint64_t read() const {
+        uint64_t count = 0;
+        if (valid() && ::read(fd_, &count, sizeof(count)) != sizeof(count)) {
+            count = 0;
+        }
+        return count;
+    }
+};
+} // namespace saqlib::utils
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
 #include <limits>
 #include <stdint.h>
 #include <vector>
@@ -12,9 +14,15 @@ namespace saqlib::utils {
 struct ResultPool {
   public:
     ResultPool(size_t capacity, bool greater = false)
-        : greater_(greater), ids_(capacity + 1), distances_(capacity + 1), capacity_(capacity) {}
+        : greater_(greater), ids_(capacity + 1, kInvalidPID), distances_(capacity + 1), capacity_(capacity) {}
 
-    void insert(PID u, float dist) {
+    void insert(PID u, float dist) { insert_lazy(dist, [u] { return u; }); }
+
+    /**
+     * @brief Same as insert(), but the id is only computed by `get_id` if the distance is kept
+     */
+    template <typename F>
+    void insert_lazy(float dist, F &&get_id) {
         if (greater_)
             dist = -dist; // Invert distance if greater is true
         if (size_ == capacity_ && dist > distances_[size_ - 1]) {
@@ -22,7 +30,7 @@ struct ResultPool {
         }
         size_t lo = find_bsearch(dist);
         std::memmove(&ids_[lo + 1], &ids_[lo], (size_ - lo) * sizeof(PID));
-        ids_[lo] = u;
+        ids_[lo] = get_id();
         std::memmove(&distances_[lo + 1], &distances_[lo], (size_ - lo) * sizeof(float));
         distances_[lo] = dist;
         size_ += (size_ < capacity_);
@@ -37,6 +45,19 @@ struct ResultPool {
 
     auto get(size_t i) { return std::make_pair(ids_[i], (greater_ ? -1 : 1) * distances_[i]); }
 
+    size_t size() const { return size_; }
+    size_t capacity() const { return capacity_; }
+
+    /**
+     * @brief Insert the results of another pool with the same ordering
+     */
+    void merge(const ResultPool &other) {
+        DCHECK_EQ(greater_, other.greater_);
+        for (size_t i = 0; i < other.size_; ++i) {
+            insert(other.ids_[i], greater_ ? -other.distances_[i] : other.distances_[i]);
+        }
+    }
+
   private:
     bool greater_ = false;
     std::vector<PID, memory::AlignedAllocator<PID>> ids_;
@@ -179,6 +200,95 @@ class AvgMaxRecorder {
     size_t cnt_{0};
 };
 
+/**
+ * @brief HDR-style histogram of latencies in ns
+ *
+ * Values below 2^kSubBits are counted exactly. Above, every power of two is split into
+ * 2^(kSubBits - 1) equal buckets, so a percentile is within 0.1% of the recorded value
+ * whatever its magnitude. Buckets are added as larger values arrive.
+ */
+class LatencyHistogram {
+  public:
+    static constexpr int kSubBits = 11;
+
+    void insert(uint64_t ns) {
+        const size_t idx = index(ns);
+        if (idx >= counts_.size()) {
+            counts_.resize(idx + 1, 0);
+        }
+        counts_[idx]++;
+        cnt_++;
+        sum_ += ns;
+        max_ = std::max(max_, ns);
+        min_ = std::min(min_, ns);
+    }
+
+    void merge(const LatencyHistogram &other) {
+        if (other.counts_.size() > counts_.size()) {
+            counts_.resize(other.counts_.size(), 0);
+        }
+        for (size_t i = 0; i < other.counts_.size(); ++i) {
+            counts_[i] += other.counts_[i];
+        }
+        cnt_ += other.cnt_;
+        sum_ += other.sum_;
+        max_ = std::max(max_, other.max_);
+        min_ = std::min(min_, other.min_);
+    }
+
+    void clean() { *this = LatencyHistogram(); }
+
+    /**
+     * @brief Smallest recorded value (to the bucket precision) that `q` of the values do not exceed
+     */
+    uint64_t percentile(double q) const {
+        if (cnt_ == 0) {
+            return 0;
+        }
+        const size_t rank = std::max<size_t>(1, std::ceil(q * cnt_));
+        size_t seen = 0;
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            seen += counts_[i];
+            if (seen >= rank) {
+                return std::min(highest_equivalent(i), max_);
+            }
+        }
+        return max_;
+    }
+
+    size_t count() const { return cnt_; }
+    uint64_t max() const { return cnt_ ? max_ : 0; }
+    uint64_t min() const { return cnt_ ? min_ : 0; }
+    double avg() const { return cnt_ ? double(sum_) / cnt_ : 0.0; }
+
+  private:
+    static constexpr uint64_t kSub = 1ull << kSubBits;
+    static constexpr uint64_t kHalf = kSub / 2;
+
+    std::vector<size_t> counts_;
+    size_t cnt_{0};
+    uint64_t sum_{0};
+    uint64_t max_{0};
+    uint64_t min_{std::numeric_limits<uint64_t>::max()};
+
+    static size_t index(uint64_t v) {
+        if (v < kSub) {
+            return v;
+        }
+        const int shift = 63 - __builtin_clzll(v) - kSubBits + 1; // v >> shift in [kHalf, kSub)
+        return (shift + 1) * kHalf + ((v >> shift) - kHalf);
+    }
+
+    static uint64_t highest_equivalent(size_t idx) {
+        if (idx < kSub) {
+            return idx;
+        }
+        const int shift = idx / kHalf - 1;
+        const uint64_t low = (idx % kHalf + kHalf) << shift;
+        return low + (1ull << shift) - 1;
+    }
+};
+
 class AvgMaxGroup {
   public:
     AvgMaxGroup() {}
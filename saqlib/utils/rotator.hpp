@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <fstream>
 #include <memory>
 
@@ -39,7 +40,7 @@ class Rotator {
     /*
      * Load the rotation matrix from disk
      */
-    virtual void load(std::ifstream &input) {
+    virtual void load(std::istream &input) {
         float element;
         for (size_t i = 0; i < D; ++i) {
             for (size_t j = 0; j < D; ++j) {
@@ -52,7 +53,7 @@ class Rotator {
     /*
      * Save the rotation matrix to disk
      */
-    virtual void save(std::ofstream &output) const {
+    virtual void save(std::ostream &output) const {
         float element;
         for (size_t i = 0; i < D; ++i) {
             for (size_t j = 0; j < D; ++j) {
@@ -86,19 +87,50 @@ class PCARotator {
     FloatVec mean; // mean vector
     FloatRowMat P; // Rotation Matrix
     void set(FloatRowMat mat, FloatVec mean) {
-        this->D = mean.rows();
+        this->D = mean.cols();
         this->mean = std::move(mean);
         this->P = std::move(mat);
     }
 
-    // template <typename T>
-    // void PCA(const T &A, T &RAND_A) const
-    // {
-    //     // Note that Eigen store Matrix by columns by default
-    //     RAND_A = (A.rowwise() - mean) * P.transpose();
-    // }
+    /*
+     * Project a single vector: RAND_A = (A - mean) * P^T.
+     * If `center` is false the mean is not subtracted, which keeps inner products
+     * rank-equivalent to the original space (the shift is constant per query).
+     */
+    void transform(const Eigen::RowVectorXf &A, Eigen::RowVectorXf &RAND_A, bool center = true) const {
+        if (center) {
+            RAND_A.noalias() = (A - mean) * P.transpose();
+        } else {
+            RAND_A.noalias() = A * P.transpose();
+        }
+    }
 
-    void load(std::ifstream &input) {
+    /*
+     * Project the rows of a batch of queries with one matrix product, see transform().
+     */
+    void transform(const Eigen::Ref<const FloatRowMat> &A, FloatRowMat &RAND_A, bool center = true) const {
+        if (center) {
+            RAND_A.noalias() = (A.rowwise() - mean) * P.transpose();
+        } else {
+            RAND_A.noalias() = A * P.transpose();
+        }
+    }
+
+    /*
+     * Project all rows of A in place, `block_rows` rows at a time so that the
+     * temporary never exceeds one block.
+     */
+    void transform_inplace(FloatRowMat &A, size_t block_rows = 65536) const {
+        CHECK_EQ(A.cols(), D) << "PCA dimension mismatch";
+        FloatRowMat buf;
+        for (size_t i = 0; i < (size_t)A.rows(); i += block_rows) {
+            size_t n = std::min(block_rows, (size_t)A.rows() - i);
+            buf.noalias() = (A.middleRows(i, n).rowwise() - mean) * P.transpose();
+            A.middleRows(i, n) = buf;
+        }
+    }
+
+    void load(std::istream &input) {
         input.read((char *)&D, sizeof(size_t));
         mean.resize(D);
         P.resize(D, D);
@@ -112,7 +144,7 @@ class PCARotator {
         }
     }
 
-    void save(std::ofstream &output) const {
+    void save(std::ostream &output) const {
         output.write((char *)&D, sizeof(size_t));
         output.write((char *)mean.data(), D * sizeof(float));
         for (size_t i = 0; i < D; ++i) {
@@ -122,4 +154,6 @@ class PCARotator {
         }
     }
 };
+
+using PCARotatorPtr = std::unique_ptr<PCARotator>;
 } // namespace saqlib::utils
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <x86intrin.h>
+
+#include <fmt/core.h>
+
+namespace saqlib::utils {
+enum class SearchStage : size_t {
+    Route,    // query transform and centroid distances, IVF::search()
+    Prepare,  // per cluster and segment setup of CaqCluEstimator::prepare(), without the LUT
+    Lut,      // LUT build of CaqCluEstimator::prepare()
+    Vars,     // variance estimates of the blocks
+    Fast,     // 1-bit fast estimates of the blocks
+    Accurate, // accurate distances of the candidates
+    Insert,   // insertions into the result pool
+    kNum
+};
+
+inline const char *stage_name(SearchStage s) {
+    constexpr const char *kNames[] = {"route", "prepare", "lut", "vars", "fast", "accurate", "insert"};
+    return kNames[static_cast<size_t>(s)];
+}
+
+/**
+ * @brief Vectors reaching each stage of one segment. With several segments the fast stage
+ * prunes whole blocks, so fast_in and fast_kept count the vectors of the blocks (the last block
+ * of a cluster in full); a cluster of one segment prunes vector by vector.
+ */
+struct SegmentSurvivors {
+    uint64_t fast_in = 0;   // vectors of the blocks whose fast estimate of this segment is computed
+    uint64_t fast_kept = 0; // of those, vectors of the blocks still under the k-th distance after it
+    uint64_t acc_in = 0;    // candidates whose accurate distance of this segment is computed
+};
+
+/**
+ * @brief Per-stage cycles (rdtsc) and survivors of a search, see StageProfiler
+ */
+struct SearchProfile {
+    std::array<uint64_t, static_cast<size_t>(SearchStage::kNum)> cycles{};
+    uint64_t total_cycles = 0; // of the whole IVF::search(), stages and the rest
+    uint64_t num_queries = 0;
+    uint64_t num_clusters = 0; // probed
+    uint64_t num_vectors = 0;  // of the probed clusters
+    uint64_t vars_kept = 0;    // vectors of the blocks kept by the variance stage
+    uint64_t inserted = 0;     // candidates under the k-th distance after the accurate stage
+    std::vector<SegmentSurvivors> segments;
+
+    SegmentSurvivors &segment(size_t i) {
+        if (i >= segments.size()) {
+            segments.resize(i + 1);
+        }
+        return segments[i];
+    }
+
+    void merge(const SearchProfile &other) {
+        for (size_t s = 0; s < cycles.size(); ++s) {
+            cycles[s] += other.cycles[s];
+        }
+        total_cycles += other.total_cycles;
+        num_queries += other.num_queries;
+        num_clusters += other.num_clusters;
+        num_vectors += other.num_vectors;
+        vars_kept += other.vars_kept;
+        inserted += other.inserted;
+        for (size_t i = 0; i < other.segments.size(); ++i) {
+            auto &seg = segment(i);
+            seg.fast_in += other.segments[i].fast_in;
+            seg.fast_kept += other.segments[i].fast_kept;
+            seg.acc_in += other.segments[i].acc_in;
+        }
+    }
+
+    /**
+     * @brief Cycles of each stage and survivors per segment, averaged per query
+     */
+    std::string toString() const {
+        const double nq = num_queries ? num_queries : 1;
+        std::string str = fmt::format("kcycles/q: total {:.1f}", total_cycles / nq / 1e3);
+        for (size_t s = 0; s < cycles.size(); ++s) {
+            str += fmt::format(" {} {:.1f}", stage_name(static_cast<SearchStage>(s)), cycles[s] / nq / 1e3);
+        }
+        str += fmt::format("\nvectors/q: scanned {:.0f} vars_kept {:.0f} inserted {:.1f}", num_vectors / nq,
+                           vars_kept / nq, inserted / nq);
+        for (size_t i = 0; i < segments.size(); ++i) {
+            str += fmt::format("\n  segment {}: fast_in {:.0f} fast_kept {:.0f} acc_in {:.1f}", i,
+                               segments[i].fast_in / nq, segments[i].fast_kept / nq, segments[i].acc_in / nq);
+        }
+        return str;
+    }
+};
+
+/**
+ * @brief Instrumentation policy of the search path
+ *
+ * The searchers take the profiler as a template parameter: StageProfiler<false> (NoProfiler)
+ * has empty inline members and no state, so the default instantiations compile to the code
+ * without instrumentation. StageProfiler<true> (CycleProfiler) adds rdtsc cycles per stage
+ * and survivor counts into a SearchProfile. rdtsc counts reference cycles and costs tens of
+ * cycles (more in a VM), so the stages timed per candidate (accurate, insert) read higher
+ * than they run uninstrumented; compare profiles with each other, not with plain timings.
+ */
+template <bool kOn>
+class StageProfiler;
+
+template <>
+class StageProfiler<false> {
+  public:
+    static constexpr bool kEnabled = false;
+
+    uint64_t now() const { return 0; }
+    uint64_t add(SearchStage, uint64_t) { return 0; }
+    SearchProfile *profile() { return nullptr; }
+};
+
+template <>
+class StageProfiler<true> {
+    SearchProfile profile_;
+
+  public:
+    static constexpr bool kEnabled = true;
+
+    uint64_t now() const { return __rdtsc(); }
+
+    /**
+     * @brief Add the cycles since `start`, a value of now(), to stage `s`. Returns the end,
+     * so back-to-back stages chain with one rdtsc each
+     */
+    uint64_t add(SearchStage s, uint64_t start) {
+        const uint64_t end = __rdtsc();
+        profile_.cycles[static_cast<size_t>(s)] += end - start;
+        return end;
+    }
+
+    SearchProfile *profile() { return &profile_; }
+};
+
+using NoProfiler = StageProfiler<false>;
+using CycleProfiler = StageProfiler<true>;
+} // namespace saqlib::utils
@@ -7,6 +7,8 @@
 #include "defines.hpp"
 #include "utils/BS_thread_pool.hpp"
 #include "utils/IO.hpp"
+#include "utils/StopW.hpp"
+#include "utils/brute_force.hpp"
 #include "utils/memory.hpp"
 #include "utils/pool.hpp"
 #include "utils/space.hpp"
@@ -14,7 +16,6 @@
 using namespace saqlib;
 
 constexpr size_t TOPK = 1000;
-const size_t kNumThread = 100;
 
 size_t N;
 size_t DIM;
@@ -27,52 +28,44 @@ int main(int argc, char *argv[]) {
     std::string DATASET = FLAGS_dataset;
     DataFilePaths paths;
 
-    FloatRowMat data;
     FloatRowMat queries;
     FloatRowMat centroids;
     UintRowMat gt;
     UintRowMat cids;
 
-    utils::load_something<float, FloatRowMat>(paths.data_file.c_str(), data);
+    // the base set is read in chunks while the previous one is scanned
+    utils::VectorStream stream(paths.data_file.c_str(), FLAGS_stream_rows);
     utils::load_something<float, FloatRowMat>(paths.query_file.c_str(), queries);
 
-    N = data.rows();
+    N = stream.rows();
     DIM = queries.cols();
     NQ = queries.rows();
 
-    std::cout << "data loaded\n";
+    std::cout << "data opened\n";
     std::cout << "\tN: " << N << '\n'
               << "\tDIM: " << DIM << '\n';
     std::cout << "query loaded\n";
     std::cout << "\tNQ: " << NQ << '\n';
+    CHECK_EQ(stream.cols(), DIM) << "data and query dimensions differ";
 
-    BS::thread_pool pool(kNumThread);
+    BS::thread_pool pool(FLAGS_num_threads); // 0 for all cores
     gt.resize(NQ, TOPK);
 
     // if (FLAGS_DEBUG) {
     //     NQ = 1;
     // }
 
+    utils::BruteForceKNN knn(queries, TOPK, FLAGS_searcher_dist_type == 1);
+    utils::StopW stopw;
+    size_t first;
+    while (const auto *chunk = stream.next(&first)) {
+        knn.add(*chunk, first, pool);
+    }
     for (size_t qi = 0; qi < NQ; qi++) {
-        pool.detach_task([&, qi]() {
-            FloatVec query = queries.row(qi);
-            utils::ResultPool KNNs(TOPK, FLAGS_searcher_dist_type == 1);
-            if (FLAGS_searcher_dist_type == 0) { // L2Sqr
-                for (size_t id = 0; id < N; ++id) {
-                    auto dist = (data.row(id) - query).squaredNorm();
-                    KNNs.insert(id, dist);
-                }
-            } else { // IP
-                for (size_t id = 0; id < N; ++id) {
-                    auto dist = query.dot(data.row(id));
-                    KNNs.insert(id, dist);
-                }
-            }
-
-            KNNs.copy_results(gt.row(qi).data());
-        });
+        knn.results(qi).copy_results(gt.row(qi).data());
     }
-    pool.wait();
+    std::cout << "ground truth computed in " << stopw.getElapsedTimeMili() / 1000 << " s, "
+              << knn.insert_rate() * 100 << "% of the distances kept by the filter\n";
 
     if (utils::file_exists(paths.gt_file.data())) {
         std::cout << "ground truth file exists\n";
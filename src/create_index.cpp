@@ -1,5 +1,6 @@
 #include <fstream>
 #include <iostream>
+#include <memory>
 
 #include <fmt/core.h>
 #include <string>
@@ -9,6 +10,7 @@
 #include "index/ivf.hpp"
 #include "utils/IO.hpp"
 #include "utils/StopW.hpp"
+#include "utils/pca.hpp"
 
 using namespace saqlib;
 
@@ -24,7 +26,13 @@ class IndexCreator {
     void buildIndex(const std::string &dataset, size_t K, const QuantizeConfig &cfg, const std::string &args_str) {
         // Create file paths and load all data needed for index creation
         DataFilePaths paths;
-        utils::load_something<float, FloatRowMat>(paths.data_file.c_str(), data_);
+        // with -stream the base set is read in chunks, by a PCA pass and by the construction
+        std::unique_ptr<utils::VectorStream> stream;
+        if (FLAGS_stream) {
+            stream = std::make_unique<utils::VectorStream>(paths.data_file.c_str(), FLAGS_stream_rows);
+        } else {
+            utils::load_something<float, FloatRowMat>(paths.data_file.c_str(), data_);
+        }
         utils::load_something<float, FloatRowMat>(paths.centroids_file.c_str(), centroids_);
         utils::load_something<PID, UintRowMat>(paths.cids_file.c_str(), cids_);
         if (utils::file_exists(paths.data_vars_file.c_str())) {
@@ -33,15 +41,36 @@ class IndexCreator {
 
         size_t num_threads = FLAGS_num_threads ? FLAGS_num_threads : 64;
 
-        size_t num_vecs = data_.rows();
-        size_t num_dim = data_.cols();
+        size_t num_vecs = stream ? stream->rows() : data_.rows();
+        size_t num_dim = stream ? stream->cols() : data_.cols();
 
-        std::cout << "data loaded\n";
+        std::cout << (stream ? "data opened\n" : "data loaded\n");
         std::cout << "\tN: " << num_vecs << '\n';
         std::cout << "\tDIM: " << num_dim << '\n';
 
         utils::StopW stopw;
 
+        // Build PCA natively. Raw k-means centroids and assignments stay valid since
+        // the transform is an orthogonal projection after mean shift.
+        utils::PCARotatorPtr pca;
+        if (FLAGS_native_PCA) {
+            utils::PCABuilder builder(num_dim);
+            if (stream) {
+                while (const auto *chunk = stream->next()) {
+                    builder.add(*chunk);
+                }
+            } else {
+                builder.add_all(data_);
+            }
+            pca = builder.build();
+            if (!stream) {
+                pca->transform_inplace(data_);
+            }
+            pca->transform_inplace(centroids_);
+            data_vars_ = builder.variance();
+            LOG(INFO) << "PCA built. tm: " << stopw.getElapsedTimeMili() / 1000 << " S";
+        }
+
         // Create IVF index using unique_ptr
         ivf_ = std::make_unique<IVF>(num_vecs, num_dim, K, cfg);
 
@@ -50,13 +79,20 @@ class IndexCreator {
             ivf_->set_variance(std::move(data_vars_));
         }
 
-        ivf_->construct(data_, centroids_, cids_.data(), num_threads, FLAGS_use_1_centroid);
+        if (stream) {
+            ivf_->set_pca(std::move(pca)); // the chunks are transformed while streaming
+            ivf_->construct(*stream, centroids_, cids_.data(), num_threads, FLAGS_use_1_centroid);
+        } else {
+            ivf_->construct(data_, centroids_, cids_.data(), num_threads, FLAGS_use_1_centroid);
+            ivf_->set_pca(std::move(pca));
+        }
         float tm_sec = stopw.getElapsedTimeMili() / 1000;
         LOG(INFO) << "ivf constructed ";
         ivf_->save(paths.quant_file.c_str());
 
         std::cout << "index saved at: " << paths.quant_file << '\n';
         std::cout << "Indexing time: " << tm_sec << "seconds\n";
+        std::cout << ivf_->memory_report().toString();
 
         // === output to csv ===
         auto csv_path = fmt::format("{}/{}_{}.index.csv", paths.result_path, dataset, args_str);
@@ -4,16 +4,22 @@
 
 #include <fmt/core.h>
 #include <gflags/gflags.h>
+#include <glog/logging.h>
 
 #include "quantization/config.h"
+#include "quantization/scan_cost_model.hpp"
+#include "utils/IO.hpp"
 
 DEFINE_int32(num_threads, 0, "number of threads to use");
 // DEFINE_bool(enable_statistis, false, "Enable extra statistics (will slow down the program)");
 DEFINE_string(data_path, "", "dataset path");
 DEFINE_string(dataset, "", "dataset name.");
+DEFINE_bool(stream, false, "read the base set in chunks instead of loading it whole (create_index, test_relative_error)");
+DEFINE_int32(stream_rows, 65536, "rows per chunk when the base set is streamed. compute_gt always streams");
 DEFINE_double(B, 2, "number of bits for quantization.");
 DEFINE_int32(K, 4096, "Number of centroids");
 DEFINE_bool(enable_PCA, true, "use pretrained PCA");
+DEFINE_bool(native_PCA, false, "build PCA from the raw base vectors and store it in the index. Queries stay raw");
 DEFINE_bool(use_ipivf, false, "use IPIVF or not. If true, will use IPIVF searcher instead of CAQ searcher");
 DEFINE_bool(use_1_centroid, false, "use 1 centroid for each cluster. Only works with CAQ quantization");
 
@@ -27,12 +33,43 @@ DEFINE_int32(caq_ori_qB, 0, "(Experiment Only) Original quantization bits. 0 mea
 DEFINE_bool(enable_segmentation, true, "enable segmentation");
 DEFINE_int32(seg_eqseg, 0, "segmentation equalization");
 DEFINE_bool(use_compact_layout, false, "use compact memory layout");
+DEFINE_int32(factor_type, 0, "precision of the stored factors. 0: fp32, 1: fp16, 2: bf16");
 DEFINE_double(q_firstdim, 0, "only quantization first dimension");
+DEFINE_int32(planner_mode, 0, "segmentation planner. 0: min error, 1: min error under latency budget, 2: min latency under error budget");
+DEFINE_double(planner_budget, 0, "planner budget. ns per scanned vector for mode 1, relative error for mode 2");
+DEFINE_double(planner_acc_ratio, 0.1, "fraction of scanned vectors assumed to reach the accurate stage");
+DEFINE_string(planner_cost_model, "", "scan cost model of the planner. Written with the model of this host if missing, so later builds plan alike");
+
+// Storage config, does not change the index file
+DEFINE_bool(interleaved_layout, false, "keep short factors and codes of all segments of a block together in memory");
+DEFINE_bool(huge_page, false, "allocate cluster storage from a huge-page backed arena");
+DEFINE_bool(prefault, false, "fault in the arena pages when they are allocated. Only with -huge_page");
+DEFINE_int32(numa_mode, 0, "placement of the clusters on NUMA nodes. 0: none, 1: replicate per node, 2: partition over nodes");
+DEFINE_bool(tiered, false, "keep long codes in the index file and read them for the candidates of the fast scan");
+DEFINE_int32(tier_cache_mb, 1024, "block cache of the index file in MiB. Only with -tiered");
+DEFINE_int32(tier_io_threads, 8, "threads reading the index file, 0 reads on the search threads. Only with -tiered");
+DEFINE_bool(lazy, false, "read each cluster from the index file on its first probe instead of at load time");
+DEFINE_int32(lazy_cache_mb, 4096, "LRU cache of the clusters read, in MiB. Only with -lazy");
 
 // Searcher config
 DEFINE_double(searcher_vars_bound_m, 4, "");
 DEFINE_int32(searcher_dist_type, 0, "searcher distance type. 0: L2Sqr, 1: IP");
 
+inline saqlib::StorageConfig parseStorage() {
+    saqlib::StorageConfig storage;
+    storage.interleaved_layout = FLAGS_interleaved_layout;
+    storage.huge_page = FLAGS_huge_page;
+    storage.prefault = FLAGS_prefault;
+    CHECK(FLAGS_numa_mode >= 0 && FLAGS_numa_mode <= 2) << "Unknown numa_mode " << FLAGS_numa_mode;
+    storage.numa = static_cast<saqlib::NumaMode>(FLAGS_numa_mode);
+    storage.tiered = FLAGS_tiered;
+    storage.tier_cache_mb = FLAGS_tier_cache_mb;
+    storage.tier_io_threads = FLAGS_tier_io_threads;
+    storage.lazy = FLAGS_lazy;
+    storage.lazy_cache_mb = FLAGS_lazy_cache_mb;
+    return storage;
+}
+
 inline std::string parseArgs(saqlib::QuantizeConfig *config = nullptr) {
     saqlib::QuantizeConfig cfg;
     auto args_str = fmt::format("ivf{}", FLAGS_K);
@@ -58,13 +95,27 @@ inline std::string parseArgs(saqlib::QuantizeConfig *config = nullptr) {
     if (FLAGS_use_compact_layout) {
         cfg.use_compact_layout = true;
     }
+    CHECK(FLAGS_factor_type >= 0 && FLAGS_factor_type <= 2) << "Unknown factor_type " << FLAGS_factor_type;
+    cfg.factor_type = static_cast<saqlib::FactorType>(FLAGS_factor_type);
+    cfg.storage = parseStorage();
+    cfg.planner.mode = static_cast<saqlib::PlannerMode>(FLAGS_planner_mode);
+    cfg.planner.budget = FLAGS_planner_budget;
+    cfg.planner.acc_ratio = FLAGS_planner_acc_ratio;
+    if (!FLAGS_planner_cost_model.empty() && cfg.planner.mode != saqlib::PlannerMode::Error) {
+        if (!saqlib::utils::file_exists(FLAGS_planner_cost_model.c_str())) {
+            saqlib::ScanCostModel::host().save(FLAGS_planner_cost_model.c_str());
+        }
+        cfg.planner.cost_model = FLAGS_planner_cost_model;
+    }
 
     args_str += cfg.toString();
 
     if (config)
         *config = cfg;
 
-    if (FLAGS_enable_PCA) {
+    if (FLAGS_native_PCA) {
+        args_str += "_npca";
+    } else if (FLAGS_enable_PCA) {
         args_str += fmt::format("_pca");
     }
 
@@ -93,7 +144,7 @@ struct DataFilePaths {
     // Initialize file paths based on dataset parameters
     DataFilePaths() {
         const auto &dataset = FLAGS_dataset;
-        bool use_pca = FLAGS_enable_PCA;
+        bool use_pca = FLAGS_enable_PCA && !FLAGS_native_PCA; // native PCA reads raw files
         size_t K = FLAGS_K;
         auto args_str = parseArgs();
 
@@ -0,0 +1,239 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <fmt/core.h>
+
+#include "capi/saq_c.h"
+#include "defines.hpp"
+#include "index/ivf.hpp"
+#include "quantization/config.h"
+#include "utils/BS_thread_pool.hpp"
+#include "utils/IO.hpp"
+#include "utils/pca.hpp"
+
+using namespace saqlib;
+
+struct saq_index {
+    std::unique_ptr<IVF> ivf;
+    std::unique_ptr<BS::thread_pool<>> pool; // of saq_search_batch(), none for one thread
+};
+
+namespace {
+thread_local std::string last_error;
+
+int fail(int code, std::string message) {
+    last_error = std::move(message);
+    return code;
+}
+
+/**
+ * @brief Run `fn`, turning exceptions into error codes: nothing may unwind into C callers
+ */
+template <typename F>
+int guarded(F &&fn) {
+    last_error.clear();
+    try {
+        return fn();
+    } catch (const std::exception &e) {
+        return fail(SAQ_ERR_INTERNAL, e.what());
+    } catch (...) {
+        return fail(SAQ_ERR_INTERNAL, "unknown error");
+    }
+}
+
+int check_search(const saq_index *index, const saq_search_params *params, const void *ids) {
+    if (!index || !params || !ids) {
+        return fail(SAQ_ERR_INVALID_ARGUMENT, "null argument");
+    }
+    if (params->topk == 0) {
+        return fail(SAQ_ERR_INVALID_ARGUMENT, "topk must be positive");
+    }
+    if (params->nprobe == 0 || params->nprobe > index->ivf->num_clusters()) {
+        return fail(SAQ_ERR_INVALID_ARGUMENT,
+                    fmt::format("nprobe must be in [1, {}]", index->ivf->num_clusters()));
+    }
+    if (params->metric != SAQ_METRIC_L2 && params->metric != SAQ_METRIC_IP) {
+        return fail(SAQ_ERR_INVALID_ARGUMENT, fmt::format("unknown metric {}", params->metric));
+    }
+    return SAQ_OK;
+}
+
+SearcherConfig searcher_config(const saq_search_params *params) {
+    SearcherConfig cfg;
+    cfg.searcher_vars_bound_m = params->vars_bound_m;
+    cfg.dist_type = params->metric == SAQ_METRIC_IP ? DistType::IP : DistType::L2Sqr;
+    return cfg;
+}
+} // namespace
+
+extern "C" {
+int saq_abi_version(void) { return SAQ_ABI_VERSION; }
+
+const char *saq_last_error(void) { return last_error.c_str(); }
+
+void saq_build_params_init(saq_build_params *params) {
+    params->avg_bits = 4;
+    params->enable_segmentation = 1;
+    params->native_pca = 0;
+    params->num_threads = 0;
+}
+
+void saq_search_params_init(saq_search_params *params) {
+    params->topk = 10;
+    params->nprobe = 64;
+    params->metric = SAQ_METRIC_L2;
+    params->vars_bound_m = SearcherConfig().searcher_vars_bound_m;
+}
+
+int saq_build(const float *data, size_t n, size_t dim, const float *centroids, size_t num_clusters,
+              const uint32_t *cluster_ids, const saq_build_params *params, saq_index **index) {
+    return guarded([&]() -> int {
+        if (!data || !centroids || !cluster_ids || !params || !index) {
+            return fail(SAQ_ERR_INVALID_ARGUMENT, "null argument");
+        }
+        if (n == 0 || dim == 0 || num_clusters == 0 || num_clusters > n) {
+            return fail(SAQ_ERR_INVALID_ARGUMENT, "need 0 < num_clusters <= n and dim > 0");
+        }
+        if (!(params->avg_bits > 0 && params->avg_bits <= 16)) {
+            return fail(SAQ_ERR_INVALID_ARGUMENT, "avg_bits must be in (0, 16]");
+        }
+        const auto bad_id = std::find_if(cluster_ids, cluster_ids + n, [&](uint32_t c) { return c >= num_clusters; });
+        if (bad_id != cluster_ids + n) {
+            return fail(SAQ_ERR_INVALID_ARGUMENT, fmt::format("cluster id {} of row {} out of range", *bad_id,
+                                                              bad_id - cluster_ids));
+        }
+
+        // the construction reads Eigen matrices, so the data is copied once here
+        FloatRowMat data_mat = Eigen::Map<const FloatRowMat>(data, n, dim);
+        FloatRowMat centroid_mat = Eigen::Map<const FloatRowMat>(centroids, num_clusters, dim);
+        QuantizeConfig cfg;
+        cfg.avg_bits = params->avg_bits;
+        cfg.enable_segmentation = params->enable_segmentation != 0;
+
+        auto result = std::make_unique<saq_index>();
+        result->ivf = std::make_unique<IVF>(n, dim, num_clusters, cfg);
+        utils::PCARotatorPtr pca;
+        if (params->native_pca) {
+            utils::PCABuilder builder(dim);
+            builder.add_all(data_mat);
+            pca = builder.build();
+            pca->transform_inplace(data_mat);
+            pca->transform_inplace(centroid_mat);
+            result->ivf->set_variance(builder.variance());
+        }
+        const size_t num_threads = params->num_threads > 0 ? params->num_threads : std::thread::hardware_concurrency();
+        result->ivf->construct(data_mat, centroid_mat, cluster_ids, num_threads);
+        result->ivf->set_pca(std::move(pca));
+        *index = result.release();
+        return SAQ_OK;
+    });
+}
+
+int saq_load(const char *filename, saq_index **index) {
+    return guarded([&]() -> int {
+        if (!filename || !index) {
+            return fail(SAQ_ERR_INVALID_ARGUMENT, "null argument");
+        }
+        if (!utils::file_exists(filename)) {
+            return fail(SAQ_ERR_IO, fmt::format("{} does not exist", filename));
+        }
+        if (!IVF::verify(filename)) {
+            return fail(SAQ_ERR_IO, fmt::format("{} is damaged or not an index of format version 2", filename));
+        }
+        auto result = std::make_unique<saq_index>();
+        result->ivf = std::make_unique<IVF>();
+        result->ivf->load(filename);
+        *index = result.release();
+        return SAQ_OK;
+    });
+}
+
+int saq_save(const saq_index *index, const char *filename) {
+    return guarded([&]() -> int {
+        if (!index || !filename) {
+            return fail(SAQ_ERR_INVALID_ARGUMENT, "null argument");
+        }
+        if (index->ivf->get_pclusters().empty()) {
+            return fail(SAQ_ERR_INVALID_ARGUMENT, "index not constructed");
+        }
+        if (!std::ofstream(filename, std::ios::binary | std::ios::app)) {
+            return fail(SAQ_ERR_IO, fmt::format("cannot write {}: {}", filename, std::strerror(errno)));
+        }
+        index->ivf->save(filename);
+        return SAQ_OK;
+    });
+}
+
+void saq_free(saq_index *index) { delete index; }
+
+size_t saq_size(const saq_index *index) { return index ? index->ivf->num_data() : 0; }
+size_t saq_dim(const saq_index *index) { return index ? index->ivf->num_dim() : 0; }
+size_t saq_num_clusters(const saq_index *index) { return index ? index->ivf->num_clusters() : 0; }
+
+int saq_set_num_threads(saq_index *index, int num_threads) {
+    return guarded([&]() -> int {
+        if (!index || num_threads < 0) {
+            return fail(SAQ_ERR_INVALID_ARGUMENT, "need an index and num_threads >= 0");
+        }
+        if (num_threads == 1) {
+            index->pool.reset();
+        } else {
+            index->pool = std::make_unique<BS::thread_pool<>>(num_threads);
+        }
+        return SAQ_OK;
+    });
+}
+
+int saq_search(saq_index *index, const float *query, const saq_search_params *params, uint32_t *ids,
+               float *distances) {
+    return guarded([&]() -> int {
+        if (int ret = check_search(index, params, ids); ret != SAQ_OK) {
+            return ret;
+        }
+        if (!query) {
+            return fail(SAQ_ERR_INVALID_ARGUMENT, "null argument");
+        }
+        const Eigen::RowVectorXf row = Eigen::Map<const Eigen::RowVectorXf>(query, index->ivf->num_dim());
+        index->ivf->search(row, params->topk, params->nprobe, searcher_config(params), ids, nullptr, nullptr,
+                           distances);
+        return SAQ_OK;
+    });
+}
+
+int saq_search_batch(saq_index *index, const float *queries, size_t num_queries, const saq_search_params *params,
+                     uint32_t *ids, float *distances) {
+    return guarded([&]() -> int {
+        if (int ret = check_search(index, params, ids); ret != SAQ_OK) {
+            return ret;
+        }
+        if (num_queries == 0) {
+            return SAQ_OK;
+        }
+        if (!queries) {
+            return fail(SAQ_ERR_INVALID_ARGUMENT, "null argument");
+        }
+        const Eigen::Map<const FloatRowMat> batch(queries, num_queries, index->ivf->num_dim());
+        const SearcherConfig cfg = searcher_config(params);
+        const size_t topk = params->topk;
+        auto search_block = [&](size_t begin, size_t end) {
+            index->ivf->search_batch(batch.middleRows(begin, end - begin), topk, params->nprobe, cfg,
+                                    ids + begin * topk, distances ? distances + begin * topk : nullptr);
+        };
+        if (!index->pool || num_queries == 1) {
+            search_block(0, num_queries);
+        } else {
+            auto &pool = *index->pool;
+            pool.submit_blocks(size_t(0), num_queries, search_block,
+                               std::min(num_queries, size_t(pool.get_thread_count())))
+                .wait();
+        }
+        return SAQ_OK;
+    });
+}
+}
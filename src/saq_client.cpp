@@ -0,0 +1,148 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <fmt/core.h>
+#include <gflags/gflags.h>
+
+#include "define_options.h"
+
+#include "defines.hpp"
+#include "server/protocol.hpp"
+#include "utils/IO.hpp"
+#include "utils/StopW.hpp"
+
+using namespace saqlib;
+
+DEFINE_string(socket, "/tmp/saq_server.sock", "Unix domain socket of saq_server, unless -port is set");
+DEFINE_int32(port, 0, "localhost TCP port of saq_server instead of -socket. 0 disables");
+DEFINE_string(query_file, "", "queries. Empty means the query file of the dataset flags");
+DEFINE_string(gt_file, "", "ground truth for the recall. Empty means the one of the dataset flags, if it exists");
+DEFINE_int32(num_clients, 8, "concurrent connections, each sending one request at a time");
+DEFINE_int32(batch, 1, "queries per request");
+DEFINE_int32(topk, 100, "neighbours per query");
+DEFINE_int32(nprobe, 200, "clusters probed per query");
+DEFINE_double(duration_s, 10, "length of the run");
+DEFINE_string(reload_file, "", "index file the server swaps to halfway through the run. Empty disables");
+
+/**
+ * Load generator of saq_server: closed loop clients cycling over the queries, reporting the
+ * throughput, the request latencies and the recall of the first answer of each query.
+ */
+int main(int argc, char *argv[]) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    DataFilePaths paths;
+    const std::string query_file = FLAGS_query_file.empty() ? paths.query_file : FLAGS_query_file;
+    const std::string gt_file = FLAGS_gt_file.empty() ? paths.gt_file : FLAGS_gt_file;
+    CHECK(FLAGS_num_clients > 0 && FLAGS_batch > 0 && FLAGS_topk > 0 && FLAGS_nprobe > 0) << "Bad load parameters";
+
+    FloatRowMat queries;
+    utils::load_something<float, FloatRowMat>(query_file.c_str(), queries);
+    UintRowMat gt;
+    if (utils::file_exists(gt_file.c_str())) {
+        utils::load_something<PID, UintRowMat>(gt_file.c_str(), gt);
+        CHECK_EQ(gt.rows(), queries.rows()) << "Ground truth and query mismatch";
+    }
+    const size_t num_queries = queries.rows();
+    const size_t dim = queries.cols();
+    const size_t topk = FLAGS_topk;
+    const size_t batch = std::min<size_t>(FLAGS_batch, num_queries);
+
+    {
+        server::SearchClient client(FLAGS_socket, FLAGS_port);
+        server::InfoReply info;
+        CHECK(client.info(info)) << client.error();
+        CHECK_EQ(info.dim, dim) << "Query dimension does not match the served index";
+        std::cout << fmt::format("server index: {} vectors, {} dims, {} clusters, version {}\n", info.num_data,
+                                 info.dim, info.num_clusters, client.index_version());
+    }
+
+    std::vector<std::vector<PID>> results(num_queries); // first answer of each query
+    std::vector<std::atomic<bool>> answered(num_queries);
+    std::vector<std::vector<float>> latencies_us(FLAGS_num_clients);
+    std::vector<size_t> client_queries(FLAGS_num_clients, 0);
+    std::atomic<uint64_t> max_version{0};
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(FLAGS_duration_s);
+
+    utils::StopW stopw;
+    std::vector<std::thread> clients;
+    for (int c = 0; c < FLAGS_num_clients; ++c) {
+        clients.emplace_back([&, c] {
+            server::SearchClient client(FLAGS_socket, FLAGS_port);
+            std::vector<PID> ids(batch * topk);
+            FloatRowMat requests(batch, dim);
+            std::vector<size_t> rows(batch);
+            size_t next = c * batch % num_queries;
+            while (std::chrono::steady_clock::now() < deadline) {
+                for (size_t i = 0; i < batch; ++i) {
+                    rows[i] = (next + i) % num_queries;
+                    requests.row(i) = queries.row(rows[i]);
+                }
+                next = (next + batch * FLAGS_num_clients) % num_queries;
+                utils::StopW request_stopw;
+                CHECK(client.search(requests.data(), batch, dim, topk, FLAGS_nprobe, ids.data())) << client.error();
+                latencies_us[c].push_back(request_stopw.getElapsedTimeMicro());
+                client_queries[c] += batch;
+                for (size_t i = 0; i < batch; ++i) {
+                    if (!answered[rows[i]].exchange(true)) {
+                        results[rows[i]].assign(ids.begin() + i * topk, ids.begin() + (i + 1) * topk);
+                    }
+                }
+                uint64_t seen = max_version.load();
+                while (client.index_version() > seen && !max_version.compare_exchange_weak(seen, client.index_version())) {
+                }
+            }
+        });
+    }
+    if (!FLAGS_reload_file.empty()) {
+        std::this_thread::sleep_for(std::chrono::duration<double>(FLAGS_duration_s / 2));
+        server::SearchClient client(FLAGS_socket, FLAGS_port);
+        utils::StopW reload_stopw;
+        CHECK(client.reload(FLAGS_reload_file)) << client.error();
+        std::cout << fmt::format("swapped to {} (version {}) in {:.3f} S while serving\n", FLAGS_reload_file,
+                                 client.index_version(), reload_stopw.getElapsedTimeMicro() / 1e6);
+    }
+    for (auto &t : clients) {
+        t.join();
+    }
+    const double elapsed_s = stopw.getElapsedTimeMicro() / 1e6;
+
+    std::vector<float> all;
+    size_t total_queries = 0;
+    for (int c = 0; c < FLAGS_num_clients; ++c) {
+        all.insert(all.end(), latencies_us[c].begin(), latencies_us[c].end());
+        total_queries += client_queries[c];
+    }
+    std::sort(all.begin(), all.end());
+    auto percentile = [&](double p) { return all.empty() ? 0.0f : all[std::min(all.size() - 1, size_t(p * all.size()))]; };
+    double avg = 0;
+    for (auto l : all) {
+        avg += l;
+    }
+    avg = all.empty() ? 0 : avg / all.size();
+
+    std::cout << fmt::format("clients: {}\tbatch: {}\tqps: {:.1f}\trequests: {}\tlatency_us avg: {:.1f} p50: {:.1f} "
+                             "p90: {:.1f} p99: {:.1f} p99.9: {:.1f} max: {:.1f}\tindex version: {}",
+                             FLAGS_num_clients, batch, total_queries / elapsed_s, all.size(), avg, percentile(0.5),
+                             percentile(0.9), percentile(0.99), percentile(0.999), all.empty() ? 0.0f : all.back(),
+                             max_version.load());
+    if (gt.rows()) {
+        size_t correct = 0, total = 0;
+        for (size_t i = 0; i < num_queries; ++i) {
+            if (results[i].empty()) {
+                continue;
+            }
+            const PID *gt_begin = gt.row(i).data(), *gt_end = gt_begin + std::min<size_t>(topk, gt.cols());
+            for (size_t j = 0; j < topk; ++j) {
+                correct += std::find(gt_begin, gt_end, results[i][j]) != gt_end;
+            }
+            total += topk;
+        }
+        std::cout << fmt::format("\trecall: {:.4f}", total ? double(correct) / total : 0.0);
+    }
+    std::cout << std::endl;
+    return 0;
+}
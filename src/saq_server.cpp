@@ -0,0 +1,60 @@
+#include <csignal>
+#include <iostream>
+#include <pthread.h>
+
+#include <fmt/core.h>
+#include <gflags/gflags.h>
+
+#include "define_options.h"
+
+#include "server/search_server.hpp"
+
+using namespace saqlib;
+
+DEFINE_string(index, "", "index file to serve. Empty means the index of the dataset flags");
+DEFINE_string(socket, "/tmp/saq_server.sock", "Unix domain socket to listen on, unless -port is set");
+DEFINE_int32(port, 0, "localhost TCP port to listen on instead of -socket. 0 disables");
+DEFINE_bool(pin_threads, false, "pin each search thread to one CPU, spread round robin over the NUMA nodes");
+
+int main(int argc, char *argv[]) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+    // handled by the main thread only: SIGHUP reloads the index file, SIGINT and SIGTERM stop
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    server::ServerConfig cfg;
+    if (FLAGS_port > 0) {
+        cfg.port = FLAGS_port;
+    } else {
+        cfg.unix_path = FLAGS_socket;
+    }
+    cfg.num_threads = FLAGS_num_threads;
+    cfg.pin_threads = FLAGS_pin_threads;
+    cfg.storage = parseStorage();
+    cfg.searcher_cfg.searcher_vars_bound_m = FLAGS_searcher_vars_bound_m;
+    CHECK(FLAGS_searcher_dist_type == 0 || FLAGS_searcher_dist_type == 1)
+        << "Invalid searcher distance type: " << FLAGS_searcher_dist_type;
+    cfg.searcher_cfg.dist_type = FLAGS_searcher_dist_type == 1 ? DistType::IP : DistType::L2Sqr;
+
+    const std::string index_file = FLAGS_index.empty() ? DataFilePaths().quant_file : FLAGS_index;
+    server::SearchServer srv(index_file, cfg);
+    srv.start();
+    std::cout << fmt::format("serving {} on {}, SIGHUP reloads it\n", index_file,
+                             FLAGS_port > 0 ? fmt::format("127.0.0.1:{}", FLAGS_port) : FLAGS_socket);
+
+    int sig = 0;
+    while (sigwait(&signals, &sig) == 0 && sig == SIGHUP) {
+        std::string error;
+        if (!srv.reload(srv.filename(), &error)) {
+            LOG(ERROR) << "Reload refused: " << error;
+        }
+    }
+    srv.stop();
+    std::cout << srv.toString() << '\n';
+    return 0;
+}
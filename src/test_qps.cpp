@@ -1,6 +1,14 @@
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <sys/prctl.h>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <fmt/core.h>
@@ -9,16 +17,28 @@
 #include "define_options.h"
 
 #include "defines.hpp"
+#include "index/async_searcher.hpp"
 #include "index/ivf.hpp"
 #include "utils/BS_thread_pool.hpp"
 #include "utils/IO.hpp"
 #include "utils/StopW.hpp"
+#include "utils/numa.hpp"
+#include "utils/perf_counter.hpp"
 #include "utils/pool.hpp"
+#include "utils/stage_profiler.hpp"
 
 using namespace saqlib;
 
 DEFINE_int32(fix_nprobe, 0, "Fixed nprobe value for QPS test. 0 means [5, 4000]");
 DEFINE_int32(fix_thread, 24, "Fixed thread value for QPS test. 0 means [1, 48]");
+DEFINE_bool(pin_threads, false, "pin each search thread to one CPU, spread round robin over the NUMA nodes");
+DEFINE_double(rerank_factor, 0, "re-rank TOPK * rerank_factor candidates with full-precision vectors. 0 disables");
+DEFINE_int32(rerank_type, 0, "vectors of the re-ranking. 0: fp32 (the base file), 1: fp16 store, 2: int8 store");
+DEFINE_int32(async_batch, 0, "submit the queries one by one to an AsyncSearcher batching up to this many. 0 disables");
+DEFINE_int32(async_delay_us, 200, "longest wait of a query for its batch to fill. Only with -async_batch");
+DEFINE_double(arrival_rate, 0, "open loop: queries arrive at this rate per second, latencies count from the arrival. 0 runs closed loop");
+DEFINE_int32(arrival_dist, 0, "arrivals of -arrival_rate. 0: Poisson, 1: constant rate");
+DEFINE_bool(profile_stages, false, "count the cycles and survivors of each search stage, written to <result>_stages.csv");
 
 constexpr size_t TOPK = 100;
 constexpr size_t ROUND = 10;
@@ -31,8 +51,30 @@ struct Stats {
     float dist_ratio{0};
     float bw_mbps{0};
     float compute_kopps{0}; // computation pre seconds
+    float dtlb_miss_pq{-1}; // dTLB load misses per query, -1 if perf events are unavailable
+    float rerank_us{0};     // re-ranking time per query
+    utils::LatencyHistogram latency; // per query, from its arrival in open loop
+    utils::SearchProfile profile;    // with -profile_stages
+
+    float latency_ms(double q) const { return latency.percentile(q) / 1e6; }
 };
 
+using Clock = std::chrono::steady_clock;
+
+/**
+ * @brief Sleep until `t`. Callers lower their timer slack (PR_SET_TIMERSLACK), which would
+ * otherwise delay every wakeup by ~50us; spinning instead would take a core from the searchers
+ */
+void wait_until(Clock::time_point t) {
+    if (Clock::now() < t) {
+        std::this_thread::sleep_until(t);
+    }
+}
+
+uint64_t elapsed_ns(Clock::time_point since) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - since).count();
+}
+
 float relative_error(float x, float base) {
     return std::abs(x - base) / base;
 }
@@ -44,8 +86,24 @@ class QPSTester {
     UintRowMat gt_;
 
     IVF ivf_;
+    VectorStore store_; // vectors of the re-ranking, with -rerank_factor
+    std::mt19937_64 arrival_gen_{42};
 
   private:
+    /**
+     * @brief Arrival time of each of `n` queries (ns from the first) at -arrival_rate
+     */
+    std::vector<uint64_t> arrival_offsets_ns(size_t n) {
+        std::exponential_distribution<double> poisson_gap(FLAGS_arrival_rate);
+        std::vector<uint64_t> offsets(n);
+        double t = 0;
+        for (size_t i = 0; i < n; ++i) {
+            offsets[i] = t * 1e9;
+            t += FLAGS_arrival_dist == 0 ? poisson_gap(arrival_gen_) : 1 / FLAGS_arrival_rate;
+        }
+        return offsets;
+    }
+
     Stats run_search(const size_t nprobe, SearcherConfig &searcher_cfg, size_t num_threads) {
         size_t NQ = query_.rows();
         size_t total_count = TOPK * NQ;
@@ -53,8 +111,9 @@ class QPSTester {
 
         std::vector<std::vector<PID>> results(NQ, std::vector<PID>(TOPK));
         std::vector<QueryRuntimeMetrics> runtime_metrics(NQ);
-        std::vector<float> tm_ms(NQ);
+        std::vector<uint64_t> latency_ns(NQ);
         std::vector<float> dist_ratios(NQ);
+        std::vector<utils::SearchProfile> profiles(FLAGS_profile_stages ? NQ : 0);
 
         // std::vector<std::thread> threads;
         // utils::StopW tot_stopw;
@@ -74,14 +133,83 @@ class QPSTester {
         //     thread.join();
         // }
 
-        BS::thread_pool pool(num_threads);
+        // created before the pool so that its threads are counted
+        auto dtlb_misses = utils::PerfCounter::dtlb_load_misses();
+        BS::thread_pool pool(num_threads, FLAGS_pin_threads ? utils::AffinityInit::spread(utils::NumaTopology::host())
+                                                            : utils::AffinityInit{});
+        AsyncSearcherStats async_stats;
+        std::unique_ptr<AsyncSearcher<>> async;
+        if (FLAGS_async_batch > 0) {
+            AsyncSearcherConfig async_cfg;
+            async_cfg.topk = TOPK;
+            async_cfg.nprobe = nprobe;
+            async_cfg.searcher_cfg = searcher_cfg;
+            async_cfg.max_batch = FLAGS_async_batch;
+            async_cfg.max_delay_us = FLAGS_async_delay_us;
+            async_cfg.num_threads = num_threads;
+            async = std::make_unique<AsyncSearcher<>>(ivf_, async_cfg);
+        }
+
+        auto search_one = [&](size_t i) {
+            if (FLAGS_rerank_factor > 0) {
+                float distances[TOPK];
+                ivf_.search_rerank(query_.row(i), TOPK, nprobe, searcher_cfg, store_, FLAGS_rerank_factor,
+                                   results[i].data(), distances, &runtime_metrics[i]);
+            } else if (FLAGS_profile_stages) {
+                ivf_.search<DistType::Any, utils::CycleProfiler>(query_.row(i), TOPK, nprobe, searcher_cfg,
+                                                                 results[i].data(), &runtime_metrics[i], &profiles[i]);
+            } else {
+                ivf_.search(query_.row(i), TOPK, nprobe, searcher_cfg, results[i].data(), &runtime_metrics[i]);
+            }
+        };
+        // start query i in the background, its latency counts from `arrival`
+        auto issue = [&](size_t i, Clock::time_point arrival) {
+            if (async) {
+                async->submit(query_.row(i), [&, i, arrival](std::vector<PID> &&ids) {
+                    std::copy(ids.begin(), ids.end(), results[i].begin());
+                    latency_ns[i] = elapsed_ns(arrival);
+                });
+            } else {
+                pool.detach_task([&, i, arrival] {
+                    search_one(i);
+                    latency_ns[i] = elapsed_ns(arrival);
+                });
+            }
+        };
+
+        // latencies of the open loop and of -async_batch include the queueing, QPS is taken over the wall time
+        const bool open_loop = FLAGS_arrival_rate > 0;
         utils::StopW tot_stopw;
-        pool.detach_loop(0, NQ, [&](size_t i) {
-            utils::StopW stopw;
-            ivf_.search(query_.row(i), TOPK, nprobe, searcher_cfg, results[i].data(), &runtime_metrics[i]);
-            tm_ms[i] = stopw.getElapsedTimeMicro() / 1000.0;
-        });
-        pool.wait();
+        dtlb_misses.start();
+        if (open_loop) {
+            // queries arrive on a schedule that does not wait for the previous answers: when the
+            // searcher falls behind, the time queued is part of the latency (no coordinated omission)
+            const auto offsets = arrival_offsets_ns(NQ);
+            prctl(PR_SET_TIMERSLACK, 1);
+            const auto start = Clock::now();
+            for (size_t i = 0; i < NQ; ++i) {
+                const auto arrival = start + std::chrono::nanoseconds(offsets[i]);
+                wait_until(arrival);
+                issue(i, arrival);
+            }
+        } else if (async) {
+            for (size_t i = 0; i < NQ; ++i) {
+                issue(i, Clock::now());
+            }
+        } else {
+            pool.detach_loop(0, NQ, [&](size_t i) {
+                const auto begin = Clock::now();
+                search_one(i);
+                latency_ns[i] = elapsed_ns(begin);
+            });
+        }
+        if (async) {
+            async->wait();
+            async_stats = async->stats();
+        } else {
+            pool.wait();
+        }
+        dtlb_misses.stop();
         auto tot_tm_ms = tot_stopw.getElapsedTimeMili();
 
         pool.detach_loop(0, NQ, [&](size_t i) {
@@ -99,37 +227,71 @@ class QPSTester {
         });
         pool.wait();
 
-        utils::AvgMaxRecorder time_recorder_ms;
         utils::AvgMaxRecorder dist_ratio;
         size_t bandwith_sum_mb{0};
         size_t comput_sum_kop{0};
+        size_t long_misses{0};
+        size_t factor_bytes{0};
+        size_t cluster_misses{0};
+        size_t rerank_ns{0};
         // utils::AvgMaxRecorder bandwith_mbps;
         // utils::AvgMaxRecorder comput_kops;
         Stats curr_stats;
         for (size_t i = 0; i < NQ; ++i) {
-            time_recorder_ms.insert(tm_ms[i]);
+            curr_stats.latency.insert(latency_ns[i]);
             dist_ratio.insert(dist_ratios[i]);
             auto &m = runtime_metrics[i];
             // bandwith_mbps.insert((m.fast_bitsum + m.acc_bitsum) / 8.0 / 1024 / (tm_ms[i] / 1000));
             // comput_kops.insert(m.total_comp_cnt / 1000.0 / (tm_ms[i] / 1000));
             bandwith_sum_mb += (m.fast_bitsum + m.acc_bitsum) / 8.0 / 1024 / 1024;
             comput_sum_kop += m.total_comp_cnt / 1000.0;
+            long_misses += m.long_block_misses;
+            factor_bytes += m.factor_bytes;
+            cluster_misses += m.cluster_misses;
+            rerank_ns += m.rerank_ns;
+        }
+        for (const auto &profile : profiles) {
+            curr_stats.profile.merge(profile);
         }
 
         float recall = static_cast<float>(total_correct) / total_count;
         curr_stats.num_threads = num_threads;
         curr_stats.recall = recall;
-        curr_stats.avg_tm_ms = time_recorder_ms.avg();
-        curr_stats.qps = NQ * 1e3 / time_recorder_ms.sum() * num_threads;
+        curr_stats.avg_tm_ms = curr_stats.latency.avg() / 1e6;
+        curr_stats.qps = open_loop || async ? NQ * 1e3 / tot_tm_ms : num_threads * 1e3 / curr_stats.avg_tm_ms;
         curr_stats.dist_ratio = dist_ratio.avg();
         curr_stats.bw_mbps = bandwith_sum_mb / tot_tm_ms * 1000;
         curr_stats.compute_kopps = comput_sum_kop / tot_tm_ms * 1000;
+        curr_stats.rerank_us = rerank_ns / 1e3 / NQ;
+        if (dtlb_misses.valid()) {
+            curr_stats.dtlb_miss_pq = static_cast<float>(dtlb_misses.read()) / NQ;
+        }
 
         std::cout << "num_threads: " << num_threads << "\trecall: " << recall << "\tdist_rate: " << curr_stats.dist_ratio
-                  << " \tq_avg_tm: " << time_recorder_ms.avg() << "ms\tqps: " << curr_stats.qps << "\t";
+                  << " \tq_avg_tm: " << curr_stats.avg_tm_ms << "ms\tqps: " << curr_stats.qps << "\t";
+        std::cout << fmt::format("p50/p90/p99/p99.9/max: {:.3f}/{:.3f}/{:.3f}/{:.3f}/{:.3f}ms\t", curr_stats.latency_ms(0.5),
+                                 curr_stats.latency_ms(0.9), curr_stats.latency_ms(0.99), curr_stats.latency_ms(0.999),
+                                 curr_stats.latency.max() / 1e6);
 
         std::cout << "bw_mbps: " << curr_stats.bw_mbps << "MB/s\t";
         std::cout << "compute_kopps: " << curr_stats.compute_kopps << "KOP/s\t";
+        std::cout << "dtlb_miss/q: " << curr_stats.dtlb_miss_pq << "\t";
+        std::cout << "factor_kb/q: " << factor_bytes / 1024.0 / NQ << "\t";
+        if (FLAGS_tiered) {
+            std::cout << "long_block_miss/q: " << static_cast<float>(long_misses) / NQ << "\t";
+        }
+        if (FLAGS_lazy) {
+            std::cout << "cluster_miss/q: " << static_cast<float>(cluster_misses) / NQ << "\t";
+        }
+        if (FLAGS_rerank_factor > 0) {
+            std::cout << "rerank_us/q: " << curr_stats.rerank_us << "\t";
+        }
+        if (FLAGS_async_batch > 0) {
+            std::cout << '\n' << async_stats.toString();
+        }
+        if (FLAGS_profile_stages) {
+            std::cout << '\n' << curr_stats.profile.toString();
+        }
 
         std::cout << std::endl;
 
@@ -141,12 +303,20 @@ class QPSTester {
         auto sample = run_search(nprobe, searcher_cfg, num_threads);
         utils::AvgMaxRecorder qps;
         utils::AvgMaxRecorder avg_tm_ms;
+        utils::AvgMaxRecorder dtlb_miss_pq;
+        utils::AvgMaxRecorder rerank_us;
         qps.insert(sample.qps);
         avg_tm_ms.insert(sample.avg_tm_ms);
+        dtlb_miss_pq.insert(sample.dtlb_miss_pq);
+        rerank_us.insert(sample.rerank_us);
         for (size_t i = 1; i < round; i++) {
             auto stats = run_search(nprobe, searcher_cfg, num_threads);
+            sample.latency.merge(stats.latency);
+            sample.profile.merge(stats.profile);
             qps.insert(stats.qps);
             avg_tm_ms.insert(stats.avg_tm_ms);
+            dtlb_miss_pq.insert(stats.dtlb_miss_pq);
+            rerank_us.insert(stats.rerank_us);
             auto e = relative_error(stats.recall, sample.recall);
             LOG_IF(WARNING, e > 1e-6) << "!!!!! Unstable! recall error : " << stats.recall << " " << sample.recall << " " << e;
             e = relative_error(stats.qps, qps.avg());
@@ -156,6 +326,8 @@ class QPSTester {
         }
         sample.qps = qps.avg();
         sample.avg_tm_ms = avg_tm_ms.avg();
+        sample.dtlb_miss_pq = dtlb_miss_pq.avg();
+        sample.rerank_us = rerank_us.avg();
         return sample;
     }
 
@@ -177,7 +349,23 @@ class QPSTester {
 
         std::cout << "load index from " << paths.quant_file << '\n';
 
-        ivf_.load(paths.quant_file.c_str());
+        ivf_.load(paths.quant_file.c_str(), parseStorage());
+
+        if (FLAGS_rerank_factor > 0) {
+            CHECK(FLAGS_rerank_type >= 0 && FLAGS_rerank_type <= 2) << "Unknown rerank_type " << FLAGS_rerank_type;
+            const auto type = static_cast<StoreType>(FLAGS_rerank_type);
+            std::string store_file = paths.data_file;
+            if (type != StoreType::Fp32) {
+                store_file += type == StoreType::Fp16 ? ".f16.store" : ".i8.store";
+                if (!utils::file_exists(store_file.c_str())) {
+                    utils::VectorStream stream(paths.data_file.c_str(), FLAGS_stream_rows);
+                    VectorStore::write(store_file.c_str(), stream, type);
+                    std::cout << "vector store written to " << store_file << '\n';
+                }
+            }
+            store_.open(store_file.c_str());
+            std::cout << "re-rank " << FLAGS_rerank_factor << "x candidates with " << store_file << '\n';
+        }
     }
 
     void runQPSTests(const std::string &result_file, SearcherConfig &searcher_cfg) {
@@ -220,22 +408,83 @@ class QPSTester {
             nprob_list.push_back(FLAGS_fix_nprobe);
         }
 
+        // columns of a result row, the same in the CSV and the JSON file
+        auto columns = [](size_t nprobe, const Stats &stats) {
+            std::vector<std::pair<std::string, float>> cols{
+                {"nprobe", nprobe},
+                {"num_threads", stats.num_threads},
+                {"QPS", stats.qps},
+                {"avg_tm_ms", stats.avg_tm_ms},
+                {"recall", stats.recall},
+                {"ratio", stats.dist_ratio},
+                {"bw_mbps", stats.bw_mbps},
+                {"compute_kopps", stats.compute_kopps},
+                {"dtlb_miss_pq", stats.dtlb_miss_pq},
+                {"rerank_us", stats.rerank_us},
+                {"arrival_rate", FLAGS_arrival_rate},
+                {"p50_ms", stats.latency_ms(0.5)},
+                {"p90_ms", stats.latency_ms(0.9)},
+                {"p99_ms", stats.latency_ms(0.99)},
+                {"p999_ms", stats.latency_ms(0.999)},
+                {"max_ms", stats.latency.max() / 1e6f},
+            };
+            if (FLAGS_profile_stages) {
+                // per query averages, the survivors of each segment are in the _stages.csv file
+                const auto &prof = stats.profile;
+                const float nq = std::max<uint64_t>(prof.num_queries, 1);
+                cols.emplace_back("total_kcyc", prof.total_cycles / nq / 1e3f);
+                for (size_t s = 0; s < prof.cycles.size(); ++s) {
+                    cols.emplace_back(fmt::format("{}_kcyc", utils::stage_name(static_cast<utils::SearchStage>(s))),
+                                      prof.cycles[s] / nq / 1e3f);
+                }
+                cols.emplace_back("clusters_pq", prof.num_clusters / nq);
+                cols.emplace_back("scanned_pq", prof.num_vectors / nq);
+                cols.emplace_back("vars_kept_pq", prof.vars_kept / nq);
+                cols.emplace_back("inserted_pq", prof.inserted / nq);
+            }
+            return cols;
+        };
+
         std::ofstream csv_data(result_file + ".csv", std::ios::out);
-        std::string final_result = "nprobe,num_threads,QPS,avg_tm_ms,recall,ratio,bw_mbps,compute_kopps\n";
+        std::string final_result;
+        for (const auto &[name, value] : columns(0, Stats{})) {
+            final_result += fmt::format("{}{}", final_result.empty() ? "" : ",", name);
+        }
+        final_result += '\n';
         csv_data << final_result;
+        std::string json_rows;
+        std::ofstream stages_data;
+        if (FLAGS_profile_stages) {
+            stages_data.open(result_file + "_stages.csv", std::ios::out);
+            stages_data << "nprobe,num_threads,segment,fast_in_pq,fast_kept_pq,acc_in_pq\n";
+        }
 
         for (auto num_threads : thread_nums_list) {
             for (auto nprob : nprob_list) {
                 auto stats = run_search_multi(nprob, searcher_cfg, num_threads, ROUND);
-                auto ts = fmt::format("{},{},{},{},{},{},{},{}\n", nprob, stats.num_threads, stats.qps, stats.avg_tm_ms, stats.recall,
-                                      stats.dist_ratio, stats.bw_mbps, stats.compute_kopps);
+                std::string ts, js;
+                for (const auto &[name, value] : columns(nprob, stats)) {
+                    ts += fmt::format("{}{}", ts.empty() ? "" : ",", value);
+                    js += fmt::format("{}\"{}\": {}", js.empty() ? "" : ", ", name, value);
+                }
+                ts += '\n';
                 csv_data << ts;
                 final_result += ts;
+                json_rows += fmt::format("{}\n  {{{}}}", json_rows.empty() ? "" : ",", js);
+                const double nq = std::max<uint64_t>(stats.profile.num_queries, 1);
+                for (size_t seg = 0; seg < stats.profile.segments.size(); ++seg) {
+                    const auto &sv = stats.profile.segments[seg];
+                    stages_data << fmt::format("{},{},{},{},{},{}\n", nprob, num_threads, seg, sv.fast_in / nq,
+                                               sv.fast_kept / nq, sv.acc_in / nq);
+                }
             }
         }
         csv_data.close();
+        std::ofstream json_data(result_file + ".json", std::ios::out);
+        json_data << "[" << json_rows << "\n]\n";
+        json_data.close();
 
-        LOG(INFO) << "result log to file: " << result_file << ".csv";
+        LOG(INFO) << "result log to file: " << result_file << ".csv and .json";
         std::cout << final_result << std::endl;
     }
 };
@@ -272,6 +521,41 @@ int main(int argc, char *argv[]) {
     if (FLAGS_searcher_dist_type == 1) {
         result_file += "_ip";
     }
+    if (FLAGS_interleaved_layout) {
+        result_file += "_itl";
+    }
+    if (FLAGS_huge_page) {
+        result_file += FLAGS_prefault ? "_hppf" : "_hp";
+    }
+    if (FLAGS_numa_mode) {
+        result_file += fmt::format("_numa{}", FLAGS_numa_mode);
+    }
+    if (FLAGS_pin_threads) {
+        result_file += "_pin";
+    }
+    if (FLAGS_tiered) {
+        result_file += fmt::format("_tier{}m", FLAGS_tier_cache_mb);
+    }
+    if (FLAGS_lazy) {
+        result_file += fmt::format("_lazy{}m", FLAGS_lazy_cache_mb);
+    }
+    if (FLAGS_rerank_factor > 0) {
+        result_file += fmt::format("_rr{}t{}", FLAGS_rerank_factor, FLAGS_rerank_type);
+    }
+    if (FLAGS_async_batch > 0) {
+        CHECK(FLAGS_rerank_factor <= 0) << "-async_batch does not re-rank";
+        CHECK(!FLAGS_profile_stages) << "-profile_stages needs the searches of test_qps, not -async_batch";
+        result_file += fmt::format("_ab{}d{}", FLAGS_async_batch, FLAGS_async_delay_us);
+    }
+    if (FLAGS_arrival_rate > 0) {
+        CHECK(FLAGS_arrival_dist == 0 || FLAGS_arrival_dist == 1) << "Unknown arrival_dist " << FLAGS_arrival_dist;
+        result_file += fmt::format("_ol{}{}", FLAGS_arrival_rate, FLAGS_arrival_dist == 0 ? "p" : "c");
+    }
+
+    if (FLAGS_profile_stages) {
+        CHECK(FLAGS_rerank_factor <= 0) << "-profile_stages does not time the re-ranking";
+        result_file += "_prof";
+    }
 
     // Run QPS test with fixed nprobe
     QPSTester tester;
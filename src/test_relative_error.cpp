@@ -1,7 +1,8 @@
+#include <algorithm>
 #include <cmath>
 #include <fstream>
 #include <iostream>
-#include <mutex>
+#include <memory>
 #include <vector>
 
 #include <fmt/core.h>
@@ -42,67 +43,90 @@ class RelativeErrorTester {
     std::vector<Stats> statistics_;
     SearcherConfig searcher_cfg_;
 
-    void run_error(const size_t nprobe, FloatRowMat &data) {
+    std::unique_ptr<utils::VectorStream> stream_; // reads the base set with -stream, data_ is empty then
+
+    // Call fn(chunk, first row of the chunk) over the base set: the loaded matrix, or the chunks of the stream
+    template <class F>
+    void for_each_base_chunk(F &&fn) {
+        if (!stream_) {
+            fn(data_, size_t(0));
+            return;
+        }
+        stream_->reset();
+        size_t first;
+        while (const auto *chunk = stream_->next(&first)) {
+            fn(*chunk, first);
+        }
+    }
+
+    // Estimates all queries first, then compares them with the real distances in one pass over the base set
+    void run_error(const size_t nprobe) {
         size_t NQ = query_.rows();
         utils::AvgMaxRecorder time_recorder_ms;
 
         auto &curr_stats = statistics_.emplace_back(Stats());
+        if (searcher_cfg_.dist_type != DistType::L2Sqr && searcher_cfg_.dist_type != DistType::IP) {
+            throw std::runtime_error("Unsupported distance type for error test");
+        }
 
         const auto num_thread = FLAGS_num_threads ? FLAGS_num_threads : 24;
-        std::mutex mtx;
 
         // Use thread pool for parallel processing
         BS::thread_pool pool(num_thread);
-        std::vector<std::future<std::tuple<utils::AvgMaxRecorder, Stats>>> futures;
-
-        for (size_t i = 0; i < NQ; i++) {
-            futures.emplace_back(pool.submit_task([this, &data, nprobe, i]() {
+        std::vector<std::vector<std::pair<PID, float>>> dist_lists(NQ);
+        std::vector<Stats> query_stats(NQ);
+        std::vector<utils::AvgMaxRecorder> query_errors(NQ);
+
+        pool.detach_loop(size_t(0), NQ, [&](size_t i) {
+            const Eigen::RowVectorXf ori_query = query_.row(i);
+            QueryRuntimeMetrics runtime_metrics;
+            utils::StopW stopw;
+            ivf_->estimate(ori_query, nprobe, searcher_cfg_, dist_lists[i], nullptr, nullptr, &runtime_metrics);
+            query_stats[i].search_tm_ms = stopw.getElapsedTimeMili();
+            // by id, the order in which the base set is read
+            std::sort(dist_lists[i].begin(), dist_lists[i].end());
+        });
+        pool.wait();
+
+        std::vector<size_t> cursors(NQ, 0);
+        for_each_base_chunk([&](const FloatRowMat &data, size_t first) {
+            const size_t end = first + data.rows();
+            pool.detach_loop(size_t(0), NQ, [&](size_t i) {
                 const Eigen::RowVectorXf ori_query = query_.row(i);
-                QueryRuntimeMetrics runtime_metrics;
-                Stats stats;
-                std::vector<std::pair<PID, float>> dist_list;
-                utils::StopW stopw;
-                ivf_->estimate(ori_query, nprobe, searcher_cfg_, dist_list, nullptr, nullptr, &runtime_metrics);
-                stats.search_tm_ms = stopw.getElapsedTimeMili();
-
-                utils::AvgMaxRecorder query_error_recorder;
-                for (auto [data_id, est_dist] : dist_list) {
+                const auto &dist_list = dist_lists[i];
+                auto &stats = query_stats[i];
+                for (size_t &c = cursors[i]; c < dist_list.size() && dist_list[c].first < end; ++c) {
+                    auto [data_id, est_dist] = dist_list[c];
                     // Compute real distance using Eigen API
-                    auto data_vec = data.row(data_id);
+                    auto data_vec = data.row(data_id - first);
                     float real_dist;
 
                     if (searcher_cfg_.dist_type == DistType::L2Sqr) {
                         // L2 squared distance using Eigen
                         real_dist = (ori_query - data_vec).squaredNorm();
-                    } else if (searcher_cfg_.dist_type == DistType::IP) {
+                    } else {
                         // Inner product using Eigen
                         real_dist = ori_query.dot(data_vec);
-                    } else {
-                        throw std::runtime_error("Unsupported distance type for error test");
                     }
 
                     // Calculate relative error and insert into recorder
                     if (real_dist > 0) {
                         float relative_err = std::abs(est_dist - real_dist) / real_dist;
-                        // LOG(INFO) << "est_dist: " << est_dist << ", real_dist: " << real_dist << ", relative_err: " << relative_err;
-                        query_error_recorder.insert(relative_err);
+                        query_errors[i].insert(relative_err);
                         stats.histogram_rela_err_.insert(relative_err);
                     }
                     stats.histogram_real_dist.insert(real_dist);
                 }
-                return std::make_tuple(query_error_recorder, stats);
-            }));
-        }
-
-        for (auto &fut : futures) {
-            auto [query_error_recorder, stats] = fut.get();
+            });
+            pool.wait();
+        });
 
-            std::lock_guard<std::mutex> lck(mtx);
+        for (size_t i = 0; i < NQ; i++) {
+            const auto &stats = query_stats[i];
             time_recorder_ms.insert(stats.search_tm_ms);
 
-            // LOG(INFO) << query_error_recorder.avg();
             // Merge error statistics into total recorder
-            curr_stats.total_rerr.add(query_error_recorder);
+            curr_stats.total_rerr.add(query_errors[i]);
             curr_stats.histogram_rela_err_.merge(stats.histogram_rela_err_);
             curr_stats.histogram_real_dist.merge(stats.histogram_real_dist);
         }
@@ -135,11 +159,15 @@ class RelativeErrorTester {
   public:
     void loadData(const DataFilePaths &paths, const SearcherConfig &cfg) {
         searcher_cfg_ = cfg;
-        utils::load_something<float, FloatRowMat>(paths.data_file.c_str(), data_);
+        if (FLAGS_stream) {
+            stream_ = std::make_unique<utils::VectorStream>(paths.data_file.c_str(), FLAGS_stream_rows);
+        } else {
+            utils::load_something<float, FloatRowMat>(paths.data_file.c_str(), data_);
+        }
         utils::load_something<float, FloatRowMat>(paths.query_file.c_str(), query_);
 
         ivf_ = std::make_unique<IVF>();
-        ivf_->load(paths.quant_file.data());
+        ivf_->load(paths.quant_file.data(), parseStorage());
 
         // Output data information
         size_t N = ivf_->num_data();
@@ -157,14 +185,14 @@ class RelativeErrorTester {
     void runTest(const std::string &result_file) {
         auto K = FLAGS_K;
         if (K > 200 && !FLAGS_ALL) {
-            run_error(200, data_);
-            // run_error(100, data_);
-            // run_error(50, data_);
+            run_error(200);
+            // run_error(100);
+            // run_error(50);
         } else {
-            run_error(32, data_);
-            run_error(16, data_);
-            run_error(8, data_);
-            run_error(4, data_);
+            run_error(32);
+            run_error(16);
+            run_error(8);
+            run_error(4);
         }
 
         // === output to csv ===
@@ -1,13 +1,18 @@
 #pragma once
 
+#include <algorithm>
 #include <random>
 #include <string>
+#include <vector>
 
 #include <fmt/core.h>
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 
 #include "defines.hpp"
+#include "index/ivf.hpp"
+#include "quantization/config.h"
+#include "utils/BS_thread_pool.hpp"
 #include "utils/IO.hpp"
 #include "utils/tools.hpp"
 
@@ -87,3 +92,61 @@ class TestBase {
         }
     }
 };
+
+/**
+ * @brief Fixture of the IVF tests on synthetic data: `num_data` vectors of 128 dimensions in
+ * `num_centroids` clusters, and `num_query` queries searched for their `Topk` nearest
+ * neighbors in `Nprobe` clusters
+ */
+template <size_t Topk, size_t Nprobe>
+class IVFTestBase : public TestBase, public ::testing::Test {
+  protected:
+    static constexpr size_t kTopk = Topk;
+    static constexpr size_t kNprobe = Nprobe;
+    const size_t num_data_;
+    const size_t num_query_;
+    const size_t num_centroids_;
+    size_t search_threads_ = 1; // queries searched at once by searchAll()
+    SearcherConfig searcher_cfg_;
+
+    IVFTestBase(size_t num_data, size_t num_query, size_t num_centroids)
+        : num_data_(num_data), num_query_(num_query), num_centroids_(num_centroids) {}
+
+    void SetUp() override {
+        generateTestData(num_data_, num_query_, 128, num_centroids_);
+        searcher_cfg_.searcher_vars_bound_m = 4.0;
+        searcher_cfg_.dist_type = DistType::L2Sqr;
+    }
+
+    /**
+     * @brief Ids of the nearest neighbors of every query, the metrics of all queries are merged
+     * into `metrics` and their distances stored in `distances`, if given
+     */
+    std::vector<std::vector<PID>> searchAll(IVF &ivf, QueryRuntimeMetrics *metrics = nullptr,
+                                            std::vector<std::vector<float>> *distances = nullptr) {
+        std::vector<std::vector<PID>> results(num_query_, std::vector<PID>(kTopk));
+        std::vector<QueryRuntimeMetrics> query_metrics(num_query_);
+        if (distances) {
+            distances->assign(num_query_, std::vector<float>(kTopk));
+        }
+        auto search = [&](size_t i) {
+            ivf.search<DistType::L2Sqr>(query_.row(i), kTopk, kNprobe, searcher_cfg_, results[i].data(),
+                                        &query_metrics[i], nullptr, distances ? (*distances)[i].data() : nullptr);
+        };
+        if (search_threads_ > 1) {
+            BS::thread_pool pool(search_threads_);
+            pool.detach_loop(size_t(0), num_query_, search);
+            pool.wait();
+        } else {
+            for (size_t i = 0; i < num_query_; ++i) {
+                search(i);
+            }
+        }
+        for (const auto &m : query_metrics) {
+            if (metrics) {
+                metrics->merge(m);
+            }
+        }
+        return results;
+    }
+};
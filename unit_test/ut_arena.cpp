@@ -0,0 +1,145 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "utils/arena.hpp"
+
+using namespace saqlib;
+using memory::HugePageArena;
+
+namespace {
+constexpr size_t kMiB = 1ul << 20;
+
+// free pages of the hugetlbfs pool, 0 if it is not configured
+size_t free_huge_pages() {
+    std::ifstream meminfo("/proc/meminfo");
+    std::string key;
+    size_t value = 0;
+    while (meminfo >> key >> value) {
+        if (key == "HugePages_Free:") {
+            return value;
+        }
+        meminfo.ignore(256, '\n');
+    }
+    return 0;
+}
+
+bool aligned(const void *p, size_t alignment) { return reinterpret_cast<uintptr_t>(p) % alignment == 0; }
+} // namespace
+
+TEST(ArenaTest, AlignedAndZeroed) {
+    HugePageArena arena(false, false, 2 * kMiB);
+    std::vector<std::pair<char *, size_t>> blocks;
+    for (size_t alignment : {1ul, 8ul, 64ul, 256ul, 4096ul}) {
+        for (size_t bytes : {1ul, 3ul, 100ul, 5000ul}) {
+            auto *p = static_cast<char *>(arena.allocate(bytes, alignment));
+            EXPECT_TRUE(aligned(p, alignment)) << "alignment " << alignment << " bytes " << bytes;
+            EXPECT_EQ(std::count(p, p + bytes, 0), long(bytes)) << "alignment " << alignment << " bytes " << bytes;
+            std::memset(p, 0xff, bytes);
+            blocks.emplace_back(p, bytes);
+        }
+    }
+    auto *d = arena.allocate_array<double>(7, 1);
+    EXPECT_TRUE(aligned(d, alignof(double)));
+
+    // the filled blocks do not overlap
+    std::sort(blocks.begin(), blocks.end());
+    for (size_t i = 1; i < blocks.size(); ++i) {
+        EXPECT_LE(blocks[i - 1].first + blocks[i - 1].second, blocks[i].first);
+    }
+    EXPECT_EQ(arena.stats().num_regions, 1u);
+}
+
+TEST(ArenaTest, GrowsAcrossRegions) {
+    HugePageArena arena(true, true, 2 * kMiB);
+    for (int i = 0; i < 10; ++i) {
+        auto *p = static_cast<char *>(arena.allocate(kMiB));
+        p[0] = p[kMiB - 1] = 1;
+    }
+    auto s = arena.stats();
+    EXPECT_EQ(s.num_regions, 5u) << "two allocations per region";
+    EXPECT_EQ(s.mapped_bytes, 10 * kMiB);
+    EXPECT_EQ(s.used_bytes, 10 * kMiB);
+
+    // a request above the region size gets its own region, rounded to huge pages
+    auto *large = static_cast<char *>(arena.allocate(5 * kMiB));
+    EXPECT_TRUE(aligned(large, HugePageArena::kHugePageSize));
+    large[5 * kMiB - 1] = 1;
+    s = arena.stats();
+    EXPECT_EQ(s.num_regions, 6u);
+    EXPECT_EQ(s.mapped_bytes, 16 * kMiB);
+
+    // the tail of the large region serves the next allocation unless reserve() asks for more
+    auto *tail = static_cast<char *>(arena.allocate(kMiB / 2));
+    EXPECT_EQ(tail, large + 5 * kMiB);
+    arena.reserve(kMiB);
+    EXPECT_EQ(arena.stats().num_regions, 7u);
+    arena.reserve(kMiB);
+    EXPECT_EQ(arena.stats().num_regions, 7u) << "the new region already has room";
+    auto *next = static_cast<char *>(arena.allocate(kMiB));
+    EXPECT_TRUE(aligned(next, HugePageArena::kHugePageSize)) << "first block of the reserved region";
+
+    arena.shrink_to_fit();
+    s = arena.stats();
+    EXPECT_EQ(s.mapped_bytes, 18 * kMiB) << "the reserved region keeps one huge page";
+    EXPECT_EQ(s.used_bytes, 16 * kMiB + kMiB / 2);
+}
+
+TEST(ArenaTest, FallsBackWithoutHugetlbPages) {
+    // regions larger than the free hugetlbfs pool cannot come from it
+    const size_t region_bytes = (free_huge_pages() + 1) * HugePageArena::kHugePageSize;
+    HugePageArena arena(true, false, region_bytes);
+    auto *p = static_cast<char *>(arena.allocate(kMiB));
+    auto s = arena.stats();
+    EXPECT_EQ(s.num_regions, 1u);
+    EXPECT_EQ(s.num_hugetlb_regions, 0u);
+    EXPECT_EQ(s.mapped_bytes, region_bytes);
+    EXPECT_TRUE(aligned(p, HugePageArena::kHugePageSize)) << "transparent huge page regions start on a huge page";
+    EXPECT_EQ(std::count(p, p + kMiB, 0), long(kMiB));
+    std::memset(p, 1, kMiB);
+}
+
+TEST(ArenaTest, ConcurrentAllocations) {
+    constexpr size_t kThreads = 8;
+    constexpr size_t kPerThread = 2000;
+    HugePageArena arena(false, true, 2 * kMiB);
+    std::vector<std::vector<std::pair<char *, size_t>>> blocks(kThreads);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < kThreads; ++t) {
+        threads.emplace_back([&, t] {
+            for (size_t i = 0; i < kPerThread; ++i) {
+                const size_t bytes = 64 + (t * 131 + i * 17) % 4000;
+                if (i % 100 == 0) {
+                    arena.reserve(bytes);
+                }
+                auto *p = static_cast<char *>(arena.allocate(bytes));
+                std::memset(p, int(t + 1), bytes);
+                blocks[t].emplace_back(p, bytes);
+            }
+        });
+    }
+    for (auto &th : threads) {
+        th.join();
+    }
+
+    std::vector<std::pair<char *, size_t>> all;
+    size_t total = 0;
+    for (size_t t = 0; t < kThreads; ++t) {
+        for (auto [p, bytes] : blocks[t]) {
+            EXPECT_EQ(std::count(p, p + bytes, char(t + 1)), long(bytes)) << "thread " << t;
+            total += bytes;
+        }
+        all.insert(all.end(), blocks[t].begin(), blocks[t].end());
+    }
+    std::sort(all.begin(), all.end());
+    for (size_t i = 1; i < all.size(); ++i) {
+        ASSERT_LE(all[i - 1].first + all[i - 1].second, all[i].first);
+    }
+    EXPECT_EQ(arena.stats().used_bytes, total);
+}
@@ -0,0 +1,154 @@
+#include <atomic>
+#include <future>
+#include <stdexcept>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "defines.hpp"
+#include "index/async_searcher.hpp"
+#include "index/ivf.hpp"
+#include "quantization/config.h"
+#include "test_base.hpp"
+
+class AsyncSearcherTest : public IVFTestBase<10, 8> {
+  protected:
+    AsyncSearcherTest() : IVFTestBase(5000, 100, 32) {}
+};
+
+TEST_F(AsyncSearcherTest, SearchBatchMatchesSearch) {
+    QuantizeConfig config;
+    config.avg_bits = 4.0f;
+    IVF ivf(data_.rows(), data_.cols(), num_centroids_, config);
+    ivf.construct(data_, centroids_, cids_.data());
+    const auto expected = searchAll(ivf);
+
+    // each query scans its clusters in the order of search()
+    std::vector<PID> ids(num_query_ * kTopk);
+    ivf.search_batch<DistType::L2Sqr>(query_, kTopk, kNprobe, searcher_cfg_, ids.data());
+    std::vector<std::vector<PID>> results(num_query_);
+    for (size_t i = 0; i < num_query_; ++i) {
+        results[i].assign(ids.begin() + i * kTopk, ids.begin() + (i + 1) * kTopk);
+    }
+    EXPECT_EQ(results, expected);
+}
+
+TEST_F(AsyncSearcherTest, FuturesAndCallbacks) {
+    QuantizeConfig config;
+    config.avg_bits = 4.0f;
+    IVF ivf(data_.rows(), data_.cols(), num_centroids_, config);
+    ivf.construct(data_, centroids_, cids_.data());
+    const auto expected = searchAll(ivf);
+
+    AsyncSearcherConfig cfg;
+    cfg.topk = kTopk;
+    cfg.nprobe = kNprobe;
+    cfg.searcher_cfg = searcher_cfg_;
+    cfg.max_batch = 16;
+    cfg.max_delay_us = 1000;
+    cfg.num_threads = 2;
+
+    std::vector<std::vector<PID>> results(num_query_);
+    std::atomic<size_t> num_callbacks{0};
+    {
+        AsyncSearcher<DistType::L2Sqr> searcher(ivf, cfg);
+        std::vector<std::future<std::vector<PID>>> futures;
+        for (size_t i = 0; i < num_query_; ++i) {
+            if (i % 2) {
+                searcher.submit(query_.row(i), [&, i](std::vector<PID> &&ids) {
+                    results[i] = std::move(ids);
+                    num_callbacks.fetch_add(1);
+                });
+            } else {
+                futures.push_back(searcher.submit(query_.row(i)));
+            }
+        }
+        for (size_t i = 0; i < futures.size(); ++i) {
+            results[2 * i] = futures[i].get();
+        }
+        // the destructor delivers the callbacks still queued
+    }
+    EXPECT_EQ(num_callbacks.load(), num_query_ / 2);
+    for (const auto &ids : results) {
+        ASSERT_EQ(ids.size(), kTopk);
+    }
+    EXPECT_EQ(results, expected);
+}
+
+TEST_F(AsyncSearcherTest, ThrowingCallback) {
+    QuantizeConfig config;
+    config.avg_bits = 4.0f;
+    IVF ivf(data_.rows(), data_.cols(), num_centroids_, config);
+    ivf.construct(data_, centroids_, cids_.data());
+    const auto expected = searchAll(ivf);
+
+    AsyncSearcherConfig cfg;
+    cfg.topk = kTopk;
+    cfg.nprobe = kNprobe;
+    cfg.searcher_cfg = searcher_cfg_;
+    cfg.max_batch = 8;
+    cfg.num_threads = 2;
+    AsyncSearcher<DistType::L2Sqr> searcher(ivf, cfg);
+    std::vector<std::vector<PID>> results(num_query_);
+    std::vector<std::future<std::vector<PID>>> futures(num_query_);
+    for (size_t i = 0; i < num_query_; ++i) {
+        if (i % 3 == 0) {
+            searcher.submit(query_.row(i), [](std::vector<PID> &&) { throw std::runtime_error("callback"); });
+        } else if (i % 3 == 1) {
+            searcher.submit(query_.row(i), [&, i](std::vector<PID> &&ids) { results[i] = std::move(ids); });
+        } else {
+            futures[i] = searcher.submit(query_.row(i));
+        }
+    }
+    searcher.wait(); // returns although callbacks threw
+    for (size_t i = 0; i < num_query_; ++i) {
+        if (i % 3 == 1) {
+            EXPECT_EQ(results[i], expected[i]) << "query " << i;
+        } else if (i % 3 == 2) {
+            EXPECT_EQ(futures[i].get(), expected[i]) << "query " << i;
+        }
+    }
+}
+
+TEST_F(AsyncSearcherTest, Histograms) {
+    QuantizeConfig config;
+    config.avg_bits = 4.0f;
+    IVF ivf(data_.rows(), data_.cols(), num_centroids_, config);
+    ivf.construct(data_, centroids_, cids_.data());
+
+    AsyncSearcherConfig cfg;
+    cfg.topk = kTopk;
+    cfg.nprobe = kNprobe;
+    cfg.searcher_cfg = searcher_cfg_;
+    cfg.max_batch = 8;
+    cfg.max_delay_us = 100000; // batches are cut by size, except the last
+    cfg.num_threads = 1;
+
+    AsyncSearcherStats stats;
+    {
+        AsyncSearcher<DistType::L2Sqr> searcher(ivf, cfg);
+        std::vector<std::future<std::vector<PID>>> futures;
+        for (size_t i = 0; i < num_query_; ++i) {
+            futures.push_back(searcher.submit(query_.row(i)));
+        }
+        for (auto &f : futures) {
+            f.get();
+        }
+        EXPECT_EQ(searcher.queue_depth(), 0u);
+        stats = searcher.stats();
+    }
+    EXPECT_EQ(stats.num_queries, num_query_);
+    ASSERT_EQ(stats.batch_sizes.size(), cfg.max_batch + 1);
+    size_t queries = 0, batches = 0, depths = 0;
+    for (size_t size = 0; size < stats.batch_sizes.size(); ++size) {
+        queries += size * stats.batch_sizes[size];
+        batches += stats.batch_sizes[size];
+    }
+    for (auto n : stats.queue_depths) {
+        depths += n;
+    }
+    EXPECT_EQ(queries, num_query_);
+    EXPECT_EQ(batches, stats.num_batches);
+    EXPECT_EQ(depths, stats.num_batches);
+    EXPECT_GE(stats.batch_sizes[cfg.max_batch], num_query_ / cfg.max_batch - 1);
+}
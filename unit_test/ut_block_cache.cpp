@@ -0,0 +1,42 @@
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "utils/block_cache.hpp"
+
+using namespace saqlib;
+
+TEST(BlockCacheTest, ReadsMatchFile) {
+    const std::string path = testing::TempDir() + "ut_block_cache.bin";
+    std::mt19937 gen(3);
+    std::vector<char> content(1000003); // not a multiple of the block size
+    for (auto &c : content) {
+        c = static_cast<char>(gen());
+    }
+    std::ofstream(path, std::ios::binary).write(content.data(), content.size());
+
+    // 16 KiB of cache for ~1 MB of file, so blocks are evicted and read again
+    for (size_t capacity : {size_t(16) << 10, size_t(4) << 20}) {
+        utils::BlockCache cache(path.c_str(), capacity);
+        for (int t = 0; t < 200; ++t) {
+            std::vector<std::vector<char>> bufs(1 + gen() % 40);
+            std::vector<utils::BlockCache::Request> reqs;
+            for (auto &buf : bufs) {
+                const size_t offset = gen() % content.size();
+                buf.resize(std::min<size_t>(gen() % 10000, content.size() - offset));
+                reqs.push_back({offset, buf.size(), buf.data()});
+            }
+            cache.read_batch(reqs);
+            for (size_t i = 0; i < reqs.size(); ++i) {
+                ASSERT_TRUE(std::equal(bufs[i].begin(), bufs[i].end(), content.begin() + reqs[i].offset))
+                    << "capacity " << capacity << " case " << t << " request " << i;
+            }
+        }
+        EXPECT_GT(cache.hits(), 0u);
+        EXPECT_GT(cache.misses(), 0u);
+    }
+    std::remove(path.c_str());
+}
@@ -0,0 +1,46 @@
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "defines.hpp"
+#include "test_base.hpp"
+#include "utils/BS_thread_pool.hpp"
+#include "utils/brute_force.hpp"
+#include "utils/pool.hpp"
+
+class BruteForceTest : public TestBase, public ::testing::Test {
+  protected:
+    static constexpr size_t kTopk = 50;
+
+    void SetUp() override { generateTestData(5000, 70, 100); }
+
+    // a plain scan of every vector, as compute_gt did
+    std::vector<PID> naive(size_t qi, bool ip) {
+        utils::ResultPool pool(kTopk, ip);
+        for (size_t id = 0; id < size_t(data_.rows()); ++id) {
+            pool.insert(id, ip ? query_.row(qi).dot(data_.row(id)) : (data_.row(id) - query_.row(qi)).squaredNorm());
+        }
+        std::vector<PID> ids(kTopk);
+        pool.copy_results(ids.data());
+        return ids;
+    }
+};
+
+TEST_F(BruteForceTest, MatchesScan) {
+    BS::thread_pool pool(4);
+    for (bool ip : {false, true}) {
+        utils::BruteForceKNN knn(query_, kTopk, ip);
+        // chunks not aligned to the data blocks
+        for (size_t first = 0; first < size_t(data_.rows()); first += 1700) {
+            const size_t n = std::min<size_t>(1700, data_.rows() - first);
+            FloatRowMat chunk = data_.middleRows(first, n);
+            knn.add(chunk, first, pool);
+        }
+        for (size_t qi = 0; qi < size_t(query_.rows()); ++qi) {
+            std::vector<PID> ids(kTopk);
+            knn.results(qi).copy_results(ids.data());
+            EXPECT_EQ(ids, naive(qi, ip)) << "query " << qi << (ip ? " IP" : " L2");
+        }
+        EXPECT_LT(knn.insert_rate(), 0.5);
+    }
+}
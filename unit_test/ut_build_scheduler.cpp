@@ -0,0 +1,116 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "defines.hpp"
+#include "index/build_scheduler.hpp"
+#include "index/ivf.hpp"
+#include "quantization/config.h"
+#include "quantization/saq_data.hpp"
+#include "test_base.hpp"
+#include "utils/IO.hpp"
+#include "utils/tools.hpp"
+
+class BuildSchedulerTest : public IVFTestBase<10, 8> {
+  protected:
+    QuantizeConfig config_;
+    std::shared_ptr<SaqData> saq_data_;
+    std::vector<std::string> files_;
+
+    BuildSchedulerTest() : IVFTestBase(6000, 10, 16) { config_.avg_bits = 4.0f; }
+
+    void SetUp() override {
+        IVFTestBase::SetUp();
+        // fold clusters 3.. into cluster 3, so it holds most of the data and gets split
+        for (size_t i = 0; i < num_data_; ++i) {
+            cids_(i, 0) = std::min<PID>(cids_(i, 0), 3);
+        }
+        SaqDataMaker maker(config_, data_.cols());
+        maker.compute_variance(data_);
+        saq_data_ = maker.return_data();
+    }
+
+    void TearDown() override {
+        for (const auto &file : files_) {
+            std::remove(file.c_str());
+        }
+    }
+
+    std::vector<size_t> clusterSizes() const {
+        std::vector<size_t> sizes(num_centroids_, 0);
+        for (size_t i = 0; i < num_data_; ++i) {
+            sizes[cids_(i, 0)] += 1;
+        }
+        return sizes;
+    }
+
+    std::string path(const std::string &name) {
+        files_.push_back(testing::TempDir() + "ut_build_scheduler_" + name);
+        return files_.back();
+    }
+
+    // bytes of the index built with `num_threads`, from the matrix or from a stream of `base`
+    std::vector<char> build(int num_threads, const std::string &base = "") {
+        IVF ivf(data_.rows(), data_.cols(), num_centroids_, config_);
+        ivf.set_saq_data(saq_data_);
+        if (base.empty()) {
+            ivf.construct(data_, centroids_, cids_.data(), num_threads);
+        } else {
+            utils::VectorStream stream(base.c_str(), 1000);
+            ivf.construct(stream, centroids_, cids_.data(), num_threads);
+        }
+        const auto file = path(fmt::format("{}{}.index", base.empty() ? "mem" : "stream", num_threads));
+        ivf.save(file.c_str());
+        std::ifstream is(file, std::ios::binary);
+        return {std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>()};
+    }
+};
+
+TEST_F(BuildSchedulerTest, TasksCoverEveryBlockOnce) {
+    const auto sizes = clusterSizes();
+    for (size_t num_threads : {1, 4, 64}) {
+        BuildScheduler scheduler(sizes, num_threads);
+        EXPECT_GT(scheduler.num_split_clusters(), 0u) << num_threads << " threads";
+
+        std::vector<std::vector<int>> covered(sizes.size());
+        for (size_t cid = 0; cid < sizes.size(); ++cid) {
+            covered[cid].assign(utils::div_rd_up(sizes[cid], KFastScanSize), 0);
+        }
+        size_t prev_num_vec = num_data_;
+        for (const auto &task : scheduler.tasks()) {
+            ASSERT_LT(task.blk_begin, task.blk_end);
+            ASSERT_LE(task.blk_end, covered[task.cid].size());
+            EXPECT_LE(task.num_vec, prev_num_vec) << "tasks are issued largest first";
+            prev_num_vec = task.num_vec;
+            for (size_t blk = task.blk_begin; blk < task.blk_end; ++blk) {
+                covered[task.cid][blk] += 1;
+            }
+        }
+        for (size_t cid = 0; cid < sizes.size(); ++cid) {
+            EXPECT_TRUE(std::all_of(covered[cid].begin(), covered[cid].end(), [](int n) { return n == 1; }))
+                << "cluster " << cid << ", " << num_threads << " threads";
+        }
+    }
+}
+
+TEST_F(BuildSchedulerTest, ParallelBuildMatchesSerial) {
+    const auto serial = build(1);
+    ASSERT_FALSE(serial.empty());
+    for (int num_threads : {4, 8}) {
+        EXPECT_TRUE(build(num_threads) == serial) << num_threads << " threads";
+    }
+
+    // the stream build quantizes the same blocks in other ranges
+    const auto base = path("base.fvecs");
+    utils::save_vecs<float, FloatRowMat>(base.c_str(), data_);
+    for (int num_threads : {1, 4}) {
+        EXPECT_TRUE(build(num_threads, base) == serial) << "stream, " << num_threads << " threads";
+    }
+}
@@ -0,0 +1,131 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "capi/saq_c.h"
+#include "defines.hpp"
+#include "index/ivf.hpp"
+#include "quantization/config.h"
+#include "test_base.hpp"
+
+class CApiTest : public TestBase, public ::testing::Test {
+  protected:
+    static constexpr size_t kTopk = 10;
+    static constexpr size_t kNprobe = 8;
+    const size_t num_query_ = 30;
+    const size_t num_centroids_ = 16;
+
+    void SetUp() override { generateTestData(3000, num_query_, 128, num_centroids_); }
+
+    saq_index *build() {
+        saq_build_params params;
+        saq_build_params_init(&params);
+        params.avg_bits = 4;
+        saq_index *index = nullptr;
+        EXPECT_EQ(saq_build(data_.data(), data_.rows(), data_.cols(), centroids_.data(), num_centroids_, cids_.data(),
+                            &params, &index),
+                  SAQ_OK)
+            << saq_last_error();
+        return index;
+    }
+};
+
+TEST_F(CApiTest, BuildSearchSaveLoad) {
+    saq_index *index = build();
+    ASSERT_NE(index, nullptr);
+    EXPECT_EQ(saq_size(index), size_t(data_.rows()));
+    EXPECT_EQ(saq_dim(index), size_t(data_.cols()));
+    EXPECT_EQ(saq_num_clusters(index), num_centroids_);
+
+    saq_search_params params;
+    saq_search_params_init(&params);
+    params.topk = kTopk;
+    params.nprobe = kNprobe;
+    std::vector<uint32_t> ids(num_query_ * kTopk);
+    std::vector<float> distances(num_query_ * kTopk);
+    ASSERT_EQ(saq_search_batch(index, query_.data(), num_query_, &params, ids.data(), distances.data()), SAQ_OK)
+        << saq_last_error();
+    for (size_t i = 0; i < num_query_; ++i) {
+        std::vector<uint32_t> one(kTopk);
+        std::vector<float> one_dist(kTopk);
+        ASSERT_EQ(saq_search(index, query_.row(i).data(), &params, one.data(), one_dist.data()), SAQ_OK);
+        EXPECT_EQ(std::memcmp(one.data(), &ids[i * kTopk], kTopk * sizeof(uint32_t)), 0) << "query " << i;
+        EXPECT_EQ(std::memcmp(one_dist.data(), &distances[i * kTopk], kTopk * sizeof(float)), 0) << "query " << i;
+        for (size_t j = 0; j < kTopk; ++j) {
+            const float exact = (query_.row(i) - data_.row(ids[i * kTopk + j])).squaredNorm();
+            EXPECT_NEAR(distances[i * kTopk + j], exact, 0.1 * exact) << "query " << i;
+            if (j) {
+                EXPECT_LE(distances[i * kTopk + j - 1], distances[i * kTopk + j]);
+            }
+        }
+    }
+
+    // threads split the batch, the file round trip keeps the answers
+    const std::string path = testing::TempDir() + "ut_c_api.index";
+    ASSERT_EQ(saq_save(index, path.c_str()), SAQ_OK) << saq_last_error();
+    saq_index *loaded = nullptr;
+    ASSERT_EQ(saq_load(path.c_str(), &loaded), SAQ_OK) << saq_last_error();
+    ASSERT_EQ(saq_set_num_threads(loaded, 3), SAQ_OK);
+    std::vector<uint32_t> loaded_ids(num_query_ * kTopk);
+    ASSERT_EQ(saq_search_batch(loaded, query_.data(), num_query_, &params, loaded_ids.data(), nullptr), SAQ_OK);
+    EXPECT_EQ(loaded_ids, ids);
+    saq_free(loaded);
+    saq_free(index);
+    std::remove(path.c_str());
+}
+
+TEST_F(CApiTest, Errors) {
+    saq_index *index = build();
+    ASSERT_NE(index, nullptr);
+    saq_search_params params;
+    saq_search_params_init(&params);
+    std::vector<uint32_t> ids(params.topk);
+
+    params.nprobe = num_centroids_ + 1;
+    EXPECT_EQ(saq_search(index, query_.data(), &params, ids.data(), nullptr), SAQ_ERR_INVALID_ARGUMENT);
+    EXPECT_NE(std::string(saq_last_error()).find("nprobe"), std::string::npos);
+    params.nprobe = 4;
+    params.metric = 7;
+    EXPECT_EQ(saq_search(index, query_.data(), &params, ids.data(), nullptr), SAQ_ERR_INVALID_ARGUMENT);
+    params.metric = SAQ_METRIC_L2;
+    EXPECT_EQ(saq_search(index, query_.data(), &params, ids.data(), nullptr), SAQ_OK);
+    EXPECT_STREQ(saq_last_error(), "");
+
+    saq_index *missing = nullptr;
+    EXPECT_EQ(saq_load((testing::TempDir() + "ut_c_api_missing.index").c_str(), &missing), SAQ_ERR_IO);
+    EXPECT_EQ(missing, nullptr);
+
+    // a damaged file is refused with an error instead of stopping the process
+    const auto damaged = testing::TempDir() + "ut_c_api_damaged.index";
+    ASSERT_EQ(saq_save(index, damaged.c_str()), SAQ_OK);
+    {
+        std::fstream file(damaged, std::ios::binary | std::ios::in | std::ios::out);
+        file.seekp(sizeof(uint64_t));
+        const uint32_t version = 7;
+        file.write(reinterpret_cast<const char *>(&version), sizeof(version));
+    }
+    EXPECT_EQ(saq_load(damaged.c_str(), &missing), SAQ_ERR_IO);
+    EXPECT_NE(std::string(saq_last_error()).find("damaged"), std::string::npos);
+    EXPECT_EQ(missing, nullptr);
+    std::remove(damaged.c_str());
+
+    const auto unwritable = testing::TempDir() + "ut_c_api_missing_dir/out.index";
+    EXPECT_EQ(saq_save(index, unwritable.c_str()), SAQ_ERR_IO);
+    EXPECT_NE(std::string(saq_last_error()).find("cannot write"), std::string::npos);
+
+    saq_build_params build_params;
+    saq_build_params_init(&build_params);
+    std::vector<uint32_t> bad_cids(cids_.data(), cids_.data() + data_.rows());
+    bad_cids[5] = num_centroids_;
+    saq_index *bad = nullptr;
+    EXPECT_EQ(saq_build(data_.data(), data_.rows(), data_.cols(), centroids_.data(), num_centroids_, bad_cids.data(),
+                        &build_params, &bad),
+              SAQ_ERR_INVALID_ARGUMENT);
+    EXPECT_EQ(bad, nullptr);
+    saq_free(index);
+}
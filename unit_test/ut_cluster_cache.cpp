@@ -0,0 +1,72 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "defines.hpp"
+#include "index/cluster_cache.hpp"
+#include "index/index_file.hpp"
+#include "index/ivf.hpp"
+#include "quantization/config.h"
+#include "test_base.hpp"
+
+class ClusterCacheTest : public IVFTestBase<20, 8> {
+  protected:
+    ClusterCacheTest() : IVFTestBase(6400, 50, 64) { search_threads_ = 8; }
+};
+
+TEST_F(ClusterCacheTest, LazyMatchesEager) {
+    QuantizeConfig config;
+    config.avg_bits = 4.0f;
+    const std::string path = testing::TempDir() + "ut_cluster_cache.index";
+    {
+        IVF ivf(data_.rows(), data_.cols(), num_centroids_, config);
+        ivf.construct(data_, centroids_, cids_.data());
+        ivf.save(path.c_str());
+    }
+    IVF eager;
+    eager.load(path.c_str());
+    const auto expected = searchAll(eager);
+
+    // a cache keeping one cluster per shard (16 of 64), then one holding all of them
+    for (size_t cache_mb : {size_t(0), size_t(64)}) {
+        StorageConfig storage;
+        storage.lazy = true;
+        storage.lazy_cache_mb = cache_mb;
+        IVF lazy;
+        lazy.load(path.c_str(), storage);
+        ASSERT_NE(lazy.get_cluster_cache(), nullptr);
+        EXPECT_EQ(lazy.get_cluster_cache()->bytes(), 0u);
+
+        for (int round = 0; round < 2; ++round) {
+            QueryRuntimeMetrics metrics;
+            EXPECT_EQ(searchAll(lazy, &metrics), expected) << "cache " << cache_mb << " MiB, round " << round;
+            EXPECT_EQ(metrics.cluster_hits + metrics.cluster_misses, num_query_ * kNprobe);
+            if (cache_mb && round == 1) {
+                EXPECT_EQ(metrics.cluster_misses, 0u) << "all clusters are cached after the first round";
+            } else {
+                EXPECT_GT(metrics.cluster_misses, 0u);
+            }
+        }
+        auto *cache = lazy.get_cluster_cache();
+        EXPECT_LE(cache->misses(), cache_mb ? num_centroids_ : num_query_ * kNprobe * 2);
+        EXPECT_GT(cache->hits(), 0u);
+    }
+    std::remove(path.c_str());
+}
+
+TEST_F(ClusterCacheTest, MissingCluster) {
+    const std::string path = testing::TempDir() + "ut_cluster_cache_missing.index";
+    {
+        IndexFileHeader header;
+        header.magic = kIndexFileMagic;
+        header.version = kIndexFileVersion;
+        IndexFileWriter writer(path.c_str(), header, 1);
+        writer.add(IndexSection::Cluster, 0, [](std::ostream &os) { os.put(0); });
+        writer.finish();
+    }
+    ClusterCache cache(path.c_str(), {}, QuantizeConfig{}, {1, 1}, 1 << 20);
+    EXPECT_DEATH(cache.get(1), "Missing section of cluster 1");
+    std::remove(path.c_str());
+}
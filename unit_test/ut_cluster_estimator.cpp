@@ -1,4 +1,8 @@
+#include <cstdio>
+#include <fstream>
+#include <iterator>
 #include <memory>
+#include <sstream>
 #include <vector>
 
 #include <fmt/core.h>
@@ -111,6 +115,33 @@ class CluEstimatorTest : public ::testing::Test, public TestBase {
         quantizer.quantize_cluster(data_, centroid, cluster_ids_, *cluster_);
     }
 
+    // Fast and accurate distances of a cluster quantized with 16-bit factors are within `tol`
+    // (relative) of the ones of cluster_, quantized with float factors
+    void expectNearFullFactors(const SaqCluData &half, float tol) {
+        for (size_t q = 0; q < num_query_; ++q) {
+            SaqCluEstimator<DistType::L2Sqr> est_full(*saq_data_, searcher_config_, query_.row(q));
+            SaqCluEstimator<DistType::L2Sqr> est_half(*saq_data_, searcher_config_, query_.row(q));
+            est_full.prepare(cluster_.get());
+            est_half.prepare(&half);
+            for (size_t b = 0; b < half.num_blocks_; ++b) {
+                alignas(64) float d_full[KFastScanSize], d_half[KFastScanSize];
+                __m512 t[2];
+                est_full.compFastDist(b, t);
+                _mm512_store_ps(d_full, t[0]);
+                _mm512_store_ps(d_full + 16, t[1]);
+                est_half.compFastDist(b, t);
+                _mm512_store_ps(d_half, t[0]);
+                _mm512_store_ps(d_half + 16, t[1]);
+                for (size_t j = b * KFastScanSize; j < std::min(num_data_, (b + 1) * KFastScanSize); ++j) {
+                    const auto k = j % KFastScanSize;
+                    EXPECT_NEAR(d_half[k], d_full[k], tol * d_full[k]);
+                    const float acc_full = est_full.compAccurateDist(j);
+                    EXPECT_NEAR(est_half.compAccurateDist(j), acc_full, tol * acc_full);
+                }
+            }
+        }
+    }
+
     // Generic helper function using template and lambda for distance computation
     template <typename EstimatorFactory, typename DistComputer>
     std::tuple<float, float, float> testAllQueries(const std::string &test_name,
@@ -135,7 +166,7 @@ class CluEstimatorTest : public ::testing::Test, public TestBase {
                 auto [fast_dist, estimated_dist, vars_dist] = compute_distances(estimator, vec_idx);
 
                 // Compute ground truth distance for comparison
-                PID data_id = cluster_->ids()[vec_idx];
+                PID data_id = cluster_->id(vec_idx);
                 float true_dist = (query - data_.row(data_id)).squaredNorm();
 
                 auto relative_error_vars = (true_dist - vars_dist) / (true_dist + 1e-18);
@@ -447,3 +478,142 @@ TEST_F(CluEstimatorTest, SaqCluSingle_GIST) {
     EXPECT_LT(std::abs(fast_err), 0.38);
     EXPECT_LT(std::abs(acc_err), 3.75e-04);
 }
+
+TEST_F(CluEstimatorTest, SaqCluInterleavedLayout) {
+    gen();
+    config_.enable_segmentation = true;
+    config_.seg_eqseg = 4;
+    config_.single.random_rotation = false;
+    quantize();
+    ASSERT_GT(saq_data_->quant_plan.size(), 1u);
+
+    // Same quantization into the interleaved layout
+    SAQuantizer quantizer(saq_data_.get());
+    SaqCluData interleaved(num_data_, saq_data_->quant_plan, config_.use_compact_layout, true);
+    quantizer.quantize_cluster(data_, centroids_.row(0), cluster_ids_, interleaved);
+
+    // Blocks are contiguous: segment i+1 of a block starts right after the codes of segment i
+    for (size_t s = 0; s + 1 < saq_data_->quant_plan.size(); ++s) {
+        const auto &cur = interleaved.get_segment(s);
+        const auto *next_factors = interleaved.get_segment(s + 1).short_factors(0);
+        EXPECT_EQ(cur.short_code(0) + cur.num_dim_padded_ * KFastScanSize / 8, next_factors);
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(next_factors) % 64, 0u);
+    }
+
+    // The file format does not depend on the layout
+    const std::string sep_file = testing::TempDir() + "ut_saq_clu_separate.bin";
+    const std::string itl_file = testing::TempDir() + "ut_saq_clu_interleaved.bin";
+    {
+        std::ofstream out(sep_file, std::ios::binary);
+        cluster_->save(out);
+    }
+    {
+        std::ofstream out(itl_file, std::ios::binary);
+        interleaved.save(out);
+    }
+    std::ifstream sep_in(sep_file, std::ios::binary), itl_in(itl_file, std::ios::binary);
+    std::string sep_bytes((std::istreambuf_iterator<char>(sep_in)), std::istreambuf_iterator<char>());
+    std::string itl_bytes((std::istreambuf_iterator<char>(itl_in)), std::istreambuf_iterator<char>());
+    EXPECT_EQ(sep_bytes, itl_bytes);
+
+    // An interleaved cluster loaded from the separate file gives the same distances
+    SaqCluData loaded(num_data_, saq_data_->quant_plan, config_.use_compact_layout, true);
+    {
+        std::ifstream in(sep_file, std::ios::binary);
+        loaded.load(in);
+    }
+    for (size_t q = 0; q < num_query_; ++q) {
+        SaqCluEstimator<DistType::L2Sqr> est_sep(*saq_data_, searcher_config_, query_.row(q));
+        SaqCluEstimator<DistType::L2Sqr> est_itl(*saq_data_, searcher_config_, query_.row(q));
+        est_sep.prepare(cluster_.get());
+        est_itl.prepare(&loaded);
+        for (size_t b = 0; b < interleaved.num_blocks_; ++b) {
+            __m512 d_sep[2], d_itl[2];
+            est_sep.compFastDist(b, d_sep);
+            est_itl.compFastDist(b, d_itl);
+            for (int h = 0; h < 2; ++h) {
+                EXPECT_EQ(_mm512_cmpneq_ps_mask(d_sep[h], d_itl[h]), 0);
+            }
+            for (size_t j = b * KFastScanSize; j < std::min(num_data_, (b + 1) * KFastScanSize); ++j) {
+                EXPECT_EQ(est_sep.compAccurateDist(j), est_itl.compAccurateDist(j));
+            }
+        }
+    }
+    std::remove(sep_file.c_str());
+    std::remove(itl_file.c_str());
+}
+
+TEST_F(CluEstimatorTest, SaqCluHalfFactors) {
+    gen();
+    config_.enable_segmentation = true;
+    config_.seg_eqseg = 4;
+    config_.single.random_rotation = false;
+    quantize();
+
+    SAQuantizer quantizer(saq_data_.get());
+    for (auto type : {FactorType::Fp16, FactorType::Bf16}) {
+        const float tol = type == FactorType::Fp16 ? 2e-3 : 2e-2;
+        SaqCluData half(num_data_, saq_data_->quant_plan, config_.use_compact_layout, true, nullptr, false, type);
+        quantizer.quantize_cluster(data_, centroids_.row(0), cluster_ids_, half);
+
+        // Saved factors take half the bytes
+        std::ostringstream full_out, half_out;
+        cluster_->save(full_out);
+        half.save(half_out);
+        const size_t num_factors = num_data_ * saq_data_->quant_plan.size() * 2 +
+                                   half.num_blocks_ * KFastScanSize * saq_data_->quant_plan.size() * 2;
+        EXPECT_EQ(full_out.str().size() - half_out.str().size(), num_factors * 2);
+
+        expectNearFullFactors(half, tol);
+    }
+}
+
+// Factors of un-normalized data go past the fp16 range: fp16 refuses them, bf16 keeps them
+TEST_F(CluEstimatorTest, SaqCluHalfFactorsLargeNorm) {
+    gen();
+    data_ *= 1e4f;
+    query_ *= 1e4f;
+    config_.enable_segmentation = true;
+    config_.seg_eqseg = 4;
+    config_.single.random_rotation = false;
+    quantize();
+
+    SAQuantizer quantizer(saq_data_.get());
+    SaqCluData fp16(num_data_, saq_data_->quant_plan, config_.use_compact_layout, true, nullptr, false,
+                    FactorType::Fp16);
+    EXPECT_DEATH(quantizer.quantize_cluster(data_, centroids_.row(0), cluster_ids_, fp16), "fp16 range");
+
+    SaqCluData bf16(num_data_, saq_data_->quant_plan, config_.use_compact_layout, true, nullptr, false,
+                    FactorType::Bf16);
+    quantizer.quantize_cluster(data_, centroids_.row(0), cluster_ids_, bf16);
+    expectNearFullFactors(bf16, 2e-2);
+}
+
+// The bound checked before quantization holds for the factors of the codes of every bit width
+TEST_F(CluEstimatorTest, FactorBoundHolds) {
+    gen();
+    centroids_.row(0).head(num_dim_).setConstant(3.0f);
+    config_.enable_segmentation = true;
+    config_.seg_eqseg = 4;
+    for (float bits : {0.5f, 1.0f, 4.0f, 8.0f}) {
+        config_.avg_bits = bits;
+        quantize();
+        SAQuantizer quantizer(saq_data_.get());
+        for (size_t i = 0; i < num_data_; ++i) {
+            const double bound = quantizer.factor_bound(&data_(i, 0), centroids_.row(0));
+            for (size_t s = 0; s < cluster_->num_segments_; ++s) {
+                const auto &seg = cluster_->get_segment(s);
+                if (seg.num_bits_ == 0) {
+                    continue;
+                }
+                const auto *short_factors = seg.short_factors(i / KFastScanSize);
+                const float ip_cent_oa = utils::decode_factor(
+                    short_factors + (KFastScanSize + i % KFastScanSize) * sizeof(float), FactorType::Fp32);
+                const auto ex_fac = seg.long_factor(i);
+                for (float factor : {seg.factor_o_l2norm(i), ip_cent_oa, ex_fac.rescale, ex_fac.error}) {
+                    EXPECT_LE(std::abs(factor), bound) << bits << " bits, vector " << i << ", segment " << s;
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,69 @@
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "utils/code_helper.hpp"
+
+using namespace saqlib;
+
+namespace {
+constexpr size_t kDims[] = {64, 128, 576};
+
+std::vector<int32_t> random_codes(size_t num_dim, size_t num_bits, uint32_t seed) {
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int32_t> dist(0, (1 << num_bits) - 1);
+    std::vector<int32_t> code(num_dim);
+    for (auto &c : code) {
+        c = dist(gen);
+    }
+    return code;
+}
+
+// the short code packing before the bit plane kernels: MSB first, byte by byte
+std::vector<uint8_t> pack_short_reference(const std::vector<int32_t> &code, int32_t short_bit, bool u64) {
+    std::vector<uint8_t> out(code.size() / 8);
+    for (size_t j = 0; j < out.size(); ++j) {
+        uint8_t byte = 0;
+        for (size_t k = 0; k < 8; ++k) {
+            byte |= (code[j * 8 + k] & short_bit) ? 0x80 >> k : 0;
+        }
+        out[u64 ? j + 7 - 2 * (j % 8) : j] = byte; // every 8 bytes reversed for the uint64 layout
+    }
+    return out;
+}
+} // namespace
+
+TEST(CodeHelperTest, ShortCodesMatchBytewisePacking) {
+    for (size_t num_bits = 1; num_bits <= 9; ++num_bits) {
+        const int32_t short_bit = 1 << (num_bits - 1);
+        for (size_t num_dim : kDims) {
+            const auto code = random_codes(num_dim, num_bits, num_bits * 1000 + num_dim);
+            std::vector<uint8_t> msb(num_dim / 8), u64(num_dim / 8);
+            utils::pack_bit_plane_msb(msb.data(), code.data(), short_bit, num_dim);
+            utils::pack_bit_plane_u64(u64.data(), code.data(), short_bit, num_dim);
+            EXPECT_EQ(msb, pack_short_reference(code, short_bit, false)) << num_bits << " bits, " << num_dim << " dims";
+            EXPECT_EQ(u64, pack_short_reference(code, short_bit, true)) << num_bits << " bits, " << num_dim << " dims";
+        }
+    }
+}
+
+TEST(CodeHelperTest, LongCodesMatchCompactedCode16) {
+    // the long code keeps the low bits of a code one bit wider, compacted_code32 drops the top one itself
+    for (int bits = 1; bits <= 16; ++bits) {
+        auto compact16 = utils::get_compacted_code16_func(bits);
+        auto compact32 = utils::get_compacted_code32_func(bits);
+        for (size_t num_dim : kDims) {
+            const auto code = random_codes(num_dim, bits + 1, bits * 1000 + num_dim);
+            std::vector<uint16_t> low(num_dim);
+            for (size_t j = 0; j < num_dim; ++j) {
+                low[j] = code[j] & ((1 << bits) - 1);
+            }
+            std::vector<uint8_t> expected(num_dim * bits / 8, 0xAA), packed(num_dim * bits / 8, 0x55);
+            compact16(expected.data(), low.data(), num_dim);
+            compact32(packed.data(), code.data(), num_dim);
+            EXPECT_EQ(packed, expected) << bits << " bits, " << num_dim << " dims";
+        }
+    }
+}
@@ -0,0 +1,229 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "defines.hpp"
+#include "index/index_file.hpp"
+#include "index/ivf.hpp"
+#include "quantization/config.h"
+#include "test_base.hpp"
+#include "utils/crc32c.hpp"
+
+class IndexFileTest : public IVFTestBase<10, 16> {
+  protected:
+    std::string path_;
+    std::vector<std::string> files_;
+
+    IndexFileTest() : IVFTestBase(3000, 20, 16) {}
+
+    void SetUp() override {
+        IVFTestBase::SetUp();
+        QuantizeConfig config;
+        config.avg_bits = 4.0f;
+        config.seg_eqseg = 4;
+        IVF ivf(data_.rows(), data_.cols(), num_centroids_, config);
+        ivf.construct(data_, centroids_, cids_.data());
+        path_ = path("v2.index");
+        ivf.save(path_.c_str());
+    }
+
+    void TearDown() override {
+        for (const auto &file : files_) {
+            std::remove(file.c_str());
+        }
+    }
+
+    std::string path(const std::string &name) {
+        files_.push_back(testing::TempDir() + "ut_index_file_" + name);
+        return files_.back();
+    }
+
+    std::vector<std::vector<PID>> searchFile(const std::string &file, size_t num_threads = 0) {
+        IVF ivf;
+        ivf.load(file.c_str(), {}, nullptr, num_threads);
+        return searchAll(ivf);
+    }
+};
+
+TEST_F(IndexFileTest, SectionsMatchTheirChecksums) {
+    IndexFileReader reader(path_.c_str());
+    EXPECT_EQ(reader.sections().size(), num_centroids_ + 3);
+    EXPECT_EQ(reader.verify(), 0u);
+    size_t end = 0;
+    for (const auto &entry : reader.sections()) {
+        EXPECT_EQ(entry.offset % kIndexFileAlign, 0u);
+        EXPECT_GE(entry.offset, end) << "sections overlap";
+        end = entry.offset + entry.bytes;
+        const auto payload = reader.read(entry);
+        EXPECT_EQ(utils::crc32c(payload.data(), payload.size()), entry.crc);
+    }
+
+    // payloads larger than the buffer of the writer, written in pieces of odd sizes
+    const auto file = path("streamed.index");
+    std::vector<char> payload(300001);
+    for (size_t i = 0; i < payload.size(); ++i) {
+        payload[i] = char(i * 7 + i / 251);
+    }
+    std::vector<char> written;
+    {
+        IndexFileHeader header;
+        header.magic = kIndexFileMagic;
+        header.version = kIndexFileVersion;
+        IndexFileWriter writer(file.c_str(), header, 3);
+        writer.add(IndexSection::Cluster, 0, [&](std::ostream &os) {
+            size_t pos = 0;
+            for (size_t piece = 1; pos < payload.size(); piece = piece * 3 + 1) {
+                const size_t n = std::min(piece, payload.size() - pos);
+                os.write(payload.data() + pos, n);
+                os.put(char(n));
+                written.insert(written.end(), payload.begin() + pos, payload.begin() + pos + n);
+                written.push_back(char(n));
+                pos += n;
+            }
+        });
+        writer.add(IndexSection::Cluster, 1, [&](std::ostream &) {});
+        writer.add(IndexSection::Cluster, 2, [&](std::ostream &os) { os.write(payload.data(), 5); });
+        writer.finish();
+    }
+    IndexFileReader streamed(file.c_str());
+    ASSERT_EQ(streamed.sections().size(), 3u);
+    EXPECT_EQ(streamed.read(IndexSection::Cluster, 0), written);
+    EXPECT_EQ(streamed.read(IndexSection::Cluster, 1).size(), 0u);
+    EXPECT_EQ(streamed.read(IndexSection::Cluster, 2), std::vector<char>(payload.begin(), payload.begin() + 5));
+    EXPECT_EQ(streamed.find(IndexSection::Cluster, 2)->offset % kIndexFileAlign, 0u);
+}
+
+TEST_F(IndexFileTest, RejectsCorruptedSection) {
+    const uint64_t offset = IndexFileReader(path_.c_str()).find(IndexSection::Cluster, 3)->offset;
+    {
+        std::fstream file(path_, std::ios::binary | std::ios::in | std::ios::out);
+        file.seekg(offset + 100);
+        char c = 0;
+        file.read(&c, 1);
+        c ^= 0x10;
+        file.seekp(offset + 100);
+        file.write(&c, 1);
+    }
+    EXPECT_EQ(IndexFileReader(path_.c_str()).verify(), 1u);
+    EXPECT_FALSE(IVF::verify(path_.c_str()));
+    EXPECT_DEATH(searchFile(path_), "Corrupted section \\(type 4, index 3\\)");
+
+    // the other clusters are still readable
+    std::vector<PID> clusters;
+    for (PID cid = 0; cid < num_centroids_; ++cid) {
+        if (cid != 3) {
+            clusters.push_back(cid);
+        }
+    }
+    IVF ivf;
+    ivf.load(path_.c_str(), {}, &clusters);
+    EXPECT_EQ(ivf.memory_report().cluster_sizes[3], 0u);
+}
+
+TEST_F(IndexFileTest, RejectsBadHeader) {
+    const auto header = IndexFileReader(path_.c_str()).header();
+    const auto last = IndexFileReader(path_.c_str()).sections().back();
+    auto patched = [&](const std::string &name, size_t offset, const void *data, size_t bytes) {
+        const auto file = path(name);
+        std::filesystem::copy_file(path_, file);
+        std::fstream out(file, std::ios::binary | std::ios::in | std::ios::out);
+        out.seekp(offset);
+        out.write(static_cast<const char *>(data), bytes);
+        return file;
+    };
+    auto expect_rejected = [&](const std::string &file, const std::string &reason) {
+        EXPECT_NE(IndexFileReader::check(file.c_str()).find(reason), std::string::npos)
+            << IndexFileReader::check(file.c_str());
+        EXPECT_FALSE(IVF::verify(file.c_str()));
+        EXPECT_DEATH(IndexFileReader(file.c_str()), reason);
+    };
+    EXPECT_EQ(IndexFileReader::check(path_.c_str()), "");
+
+    const uint64_t magic = 0x1234;
+    expect_rejected(patched("magic.index", offsetof(IndexFileHeader, magic), &magic, sizeof(magic)),
+                    "not an index file");
+    const uint32_t version = 3;
+    expect_rejected(patched("version.index", offsetof(IndexFileHeader, version), &version, sizeof(version)),
+                    "format version 3");
+    const uint64_t num_sections = uint64_t(1) << 60;
+    expect_rejected(patched("sections.index", offsetof(IndexFileHeader, num_sections), &num_sections,
+                            sizeof(num_sections)),
+                    "directory of 1152921504606846976 sections beyond the end of the file");
+    const uint64_t num_data = header.num_data + 1;
+    expect_rejected(patched("crc.index", offsetof(IndexFileHeader, num_data), &num_data, sizeof(num_data)),
+                    "corrupted header");
+
+    // a file cut in its last section keeps a valid header
+    const auto truncated = path("truncated.index");
+    std::filesystem::copy_file(path_, truncated);
+    std::filesystem::resize_file(truncated, last.offset + last.bytes - 1);
+    expect_rejected(truncated, "beyond the end of the file");
+    std::filesystem::resize_file(truncated, sizeof(IndexFileHeader) - 1);
+    expect_rejected(truncated, "truncated header");
+}
+
+TEST_F(IndexFileTest, PartialLoad) {
+    const std::vector<PID> clusters = {1, 4, 5, 9, 15};
+    IVF ivf;
+    ivf.load(path_.c_str(), {}, &clusters);
+    const auto sizes = ivf.memory_report().cluster_sizes;
+    ASSERT_EQ(sizes.size(), num_centroids_);
+    for (PID cid = 0; cid < num_centroids_; ++cid) {
+        const bool selected = std::find(clusters.begin(), clusters.end(), cid) != clusters.end();
+        const size_t size = std::count(cids_.data(), cids_.data() + cids_.size(), cid);
+        EXPECT_EQ(sizes[cid], selected ? size : 0u) << "cluster " << cid;
+    }
+    for (const auto &result : searchAll(ivf)) {
+        for (auto id : result) {
+            ASSERT_LT(id, size_t(data_.rows()));
+            EXPECT_NE(std::find(clusters.begin(), clusters.end(), cids_.data()[id]), clusters.end()) << "id " << id;
+        }
+    }
+    EXPECT_DEATH(ivf.save(path("partial.index").c_str()), "subset of the clusters");
+}
+
+TEST_F(IndexFileTest, ParallelLoad) {
+    const auto expected = searchFile(path_, 1);
+    EXPECT_EQ(searchFile(path_, 4), expected);
+    EXPECT_EQ(searchFile(path_, 0), expected);
+}
+
+TEST_F(IndexFileTest, LoadsVersion1) {
+    // version 1: header without directory, then the payloads of v2 back to back
+    const auto legacy = path("v1.index");
+    {
+        IndexFileReader reader(path_.c_str());
+        const auto &header = reader.header();
+        std::ofstream out(legacy, std::ios::binary);
+        const uint32_t version = 1, flags = 0;
+        out.write(reinterpret_cast<const char *>(&header.magic), sizeof(uint64_t));
+        out.write(reinterpret_cast<const char *>(&version), sizeof(uint32_t));
+        out.write(reinterpret_cast<const char *>(&flags), sizeof(uint32_t));
+        out.write(reinterpret_cast<const char *>(&header.num_data), sizeof(uint64_t));
+        out.write(reinterpret_cast<const char *>(&header.num_dim), sizeof(uint64_t));
+        out.write(reinterpret_cast<const char *>(&header.num_cen), sizeof(uint64_t));
+        auto append = [&](IndexSection type, uint64_t index) {
+            const auto payload = reader.read(type, index);
+            out.write(payload.data(), payload.size());
+        };
+        append(IndexSection::Centroids, 0);
+        append(IndexSection::QuantData, 0);
+        append(IndexSection::ClusterSizes, 0);
+        for (size_t cid = 0; cid < num_centroids_; ++cid) {
+            append(IndexSection::Cluster, cid);
+        }
+    }
+    EXPECT_EQ(searchFile(legacy), searchFile(path_));
+    EXPECT_FALSE(IVF::verify(legacy.c_str())) << "version 1 has no checksums";
+
+    const std::vector<PID> clusters = {0};
+    IVF ivf;
+    EXPECT_DEATH(ivf.load(legacy.c_str(), {}, &clusters), "needs an index file of version 2");
+}
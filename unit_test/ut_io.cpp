@@ -0,0 +1,117 @@
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "defines.hpp"
+#include "utils/IO.hpp"
+
+using namespace saqlib;
+
+class IOTest : public ::testing::Test {
+  protected:
+    const size_t rows_ = 37;
+    const size_t cols_ = 20;
+    FloatRowMat data_;
+    std::vector<std::string> files_;
+
+    void SetUp() override { data_ = FloatRowMat::Random(rows_, cols_); }
+
+    void TearDown() override {
+        for (const auto &file : files_) {
+            std::remove(file.c_str());
+        }
+    }
+
+    std::string path(const std::string &name) {
+        files_.push_back(testing::TempDir() + "ut_io_" + name);
+        return files_.back();
+    }
+
+    // rows back to back after a header of (rows, cols)
+    std::string write_fbin(const std::string &name, const FloatRowMat &mat) {
+        const auto file = path(name);
+        std::ofstream out(file, std::ios::binary);
+        const uint32_t header[2] = {uint32_t(mat.rows()), uint32_t(mat.cols())};
+        out.write(reinterpret_cast<const char *>(header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(mat.data()), mat.size() * sizeof(float));
+        return file;
+    }
+
+    std::string write_fvecs(const std::string &name, const FloatRowMat &mat) {
+        const auto file = path(name);
+        utils::save_vecs<float, FloatRowMat>(file.c_str(), mat);
+        return file;
+    }
+
+    void expect_view(const utils::VecsView<float> &view, bool contiguous) {
+        ASSERT_EQ(view.rows(), rows_);
+        ASSERT_EQ(view.cols(), cols_);
+        EXPECT_EQ(view.contiguous(), contiguous);
+        EXPECT_EQ(FloatRowMat(view.mat()), data_);
+        for (size_t i = 0; i < rows_; ++i) {
+            EXPECT_EQ(view.row(i)[cols_ - 1], data_(i, cols_ - 1)) << "row " << i;
+        }
+    }
+};
+
+TEST_F(IOTest, FvecsAndFbinViews) {
+    expect_view(utils::VecsView<float>(write_fvecs("view.fvecs", data_).c_str()), false);
+    expect_view(utils::VecsView<float>(write_fbin("view.fbin", data_).c_str()), true);
+
+    // an empty .fvecs file is an empty view
+    const auto empty = path("empty.fvecs");
+    std::ofstream(empty, std::ios::binary).close();
+    utils::VecsView<float> view(empty.c_str());
+    EXPECT_EQ(view.rows(), 0u);
+    FloatRowMat copy;
+    view.copy_to(copy, 64);
+    EXPECT_EQ(copy.rows(), 0);
+}
+
+TEST_F(IOTest, CopyToPaddedMatrix) {
+    for (const auto &file : {write_fvecs("copy.fvecs", data_), write_fbin("copy.fbin", data_)}) {
+        utils::VecsView<float> view(file.c_str());
+        FloatRowMat padded = FloatRowMat::Constant(3, 3, 7.0f);
+        view.copy_to(padded, 32, 3);
+        ASSERT_EQ(padded.rows(), Eigen::Index(rows_)) << file;
+        ASSERT_EQ(padded.cols(), 32) << file;
+        EXPECT_EQ(FloatRowMat(padded.leftCols(cols_)), data_) << file;
+        EXPECT_TRUE(padded.rightCols(32 - cols_).isZero(0)) << file;
+
+        // fewer columns than the file keeps them all
+        FloatRowMat same;
+        view.copy_to(same, cols_ - 5, 1);
+        EXPECT_EQ(same, data_) << file;
+    }
+}
+
+TEST_F(IOTest, RejectsBadFiles) {
+    const auto fvecs = write_fvecs("bad.fvecs", data_);
+    const auto fbin = write_fbin("bad.fbin", data_);
+    const auto fvecs_size = std::filesystem::file_size(fvecs);
+
+    std::filesystem::resize_file(fvecs, fvecs_size - 3);
+    EXPECT_DEATH(utils::VecsView<float>(fvecs.c_str()), "not a multiple of the row size");
+
+    // the last row claims one more dimension, with the same size
+    std::filesystem::resize_file(fvecs, fvecs_size);
+    {
+        std::fstream out(fvecs, std::ios::binary | std::ios::in | std::ios::out);
+        const uint32_t dim = cols_ + 1;
+        out.seekp((rows_ - 1) * (cols_ + 1) * sizeof(float));
+        out.write(reinterpret_cast<const char *>(&dim), sizeof(dim));
+    }
+    EXPECT_DEATH(utils::VecsView<float>(fvecs.c_str()), "rows of different dimensions");
+
+    std::filesystem::resize_file(fbin, std::filesystem::file_size(fbin) - sizeof(float));
+    EXPECT_DEATH(utils::VecsView<float>(fbin.c_str()), "truncated");
+    std::filesystem::resize_file(fbin, sizeof(uint32_t));
+    EXPECT_DEATH(utils::VecsView<float>(fbin.c_str()), "missing header");
+
+    EXPECT_DEATH(utils::VecsView<double>(fvecs.c_str()), "4-byte elements");
+}
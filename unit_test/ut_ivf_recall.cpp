@@ -150,6 +150,21 @@ TEST_F(RecallTest, SAQ_GIST_AllBits) {
     testDatasetQuantTypeRecall("gist", config, expected_recalls);
 }
 
+// 16-bit factors are expected to keep the recall of float factors
+TEST_F(RecallTest, SAQ_GIST_Fp16Factors) {
+    QuantizeConfig config;
+    config.factor_type = FactorType::Fp16;
+    std::map<int, float> expected_recalls = {{1, 0.88347}, {4, 0.95118}, {8, 0.95421}};
+    testDatasetQuantTypeRecall("gist", config, expected_recalls);
+}
+
+TEST_F(RecallTest, SAQ_GIST_Bf16Factors) {
+    QuantizeConfig config;
+    config.factor_type = FactorType::Bf16;
+    std::map<int, float> expected_recalls = {{1, 0.88347}, {4, 0.95118}, {8, 0.95421}};
+    testDatasetQuantTypeRecall("gist", config, expected_recalls);
+}
+
 TEST_F(RecallTest, CAQ_GIST_AllBits) {
     QuantizeConfig config;
     config.enable_segmentation = false;
@@ -0,0 +1,46 @@
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "utils/pool.hpp"
+
+using namespace saqlib;
+
+TEST(LatencyHistogramTest, PercentilesWithinPrecision) {
+    std::mt19937_64 gen(3);
+    std::lognormal_distribution<double> dist(12, 2); // ~160us median, spanning ns to s
+    std::vector<uint64_t> values(100000);
+    utils::LatencyHistogram hist, first, second;
+    for (size_t i = 0; i < values.size(); ++i) {
+        values[i] = dist(gen);
+        hist.insert(values[i]);
+        (i % 2 ? first : second).insert(values[i]);
+    }
+    first.merge(second);
+    std::sort(values.begin(), values.end());
+
+    EXPECT_EQ(hist.count(), values.size());
+    EXPECT_EQ(hist.min(), values.front());
+    EXPECT_EQ(hist.max(), values.back());
+    for (double q : {0.0, 0.5, 0.9, 0.99, 0.999, 1.0}) {
+        const uint64_t exact = values[std::max<size_t>(1, std::ceil(q * values.size())) - 1];
+        const uint64_t p = hist.percentile(q);
+        EXPECT_GE(p, exact) << "q " << q;
+        EXPECT_LE(p, exact + exact / 1000 + 1) << "q " << q;
+        EXPECT_EQ(first.percentile(q), p) << "q " << q;
+    }
+}
+
+TEST(LatencyHistogramTest, SmallValuesAreExact) {
+    utils::LatencyHistogram hist;
+    EXPECT_EQ(hist.percentile(0.99), 0u);
+    for (uint64_t v = 1; v <= 100; ++v) {
+        hist.insert(v);
+    }
+    EXPECT_EQ(hist.percentile(0.5), 50u);
+    EXPECT_EQ(hist.percentile(0.99), 99u);
+    EXPECT_DOUBLE_EQ(hist.avg(), 50.5);
+}
@@ -0,0 +1,102 @@
+#include <cstddef>
+#include <map>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "defines.hpp"
+#include "index/ivf.hpp"
+#include "index/memory_report.hpp"
+#include "quantization/config.h"
+#include "test_base.hpp"
+#include "utils/tools.hpp"
+
+class MemoryReportTest : public TestBase, public ::testing::Test {
+  protected:
+    const size_t num_centroids_ = 16;
+
+    void SetUp() override { generateTestData(3000, 1, 128, num_centroids_); }
+
+    // the sections of the clusters are the sums over the segments, and match the layout
+    void testReport(const QuantizeConfig &config) {
+        IVF ivf(data_.rows(), data_.cols(), num_centroids_, config);
+        ivf.construct(data_, centroids_, cids_.data());
+        const auto report = ivf.memory_report();
+
+        std::map<std::string, size_t> sections;
+        size_t total = 0;
+        for (const auto &s : report.sections) {
+            EXPECT_LE(s.padding, s.bytes) << s.name;
+            EXPECT_TRUE(sections.emplace(s.name, s.bytes).second) << "duplicate section " << s.name;
+            total += s.bytes;
+        }
+        EXPECT_EQ(report.total(), total);
+        EXPECT_NE(report.toString().find(fmt::format("{:.2f} MiB", total / 1048576.0)), std::string::npos);
+
+        ASSERT_EQ(report.cluster_sizes.size(), num_centroids_);
+        size_t num_vec = 0, num_vec_align = 0, compact_long_codes = 0;
+        for (size_t size : report.cluster_sizes) {
+            num_vec += size;
+            num_vec_align += utils::rd_up_to_multiple_of(size, KFastScanSize);
+        }
+        EXPECT_EQ(num_vec, size_t(data_.rows()));
+        EXPECT_EQ(report.padding_vectors, num_vec_align - num_vec);
+
+        const size_t factor_bytes = utils::factor_bytes(config.factor_type);
+        const size_t align = SaqCluData::kLongCodeAlignBytes;
+        SegmentMemory sum, expected;
+        for (const auto &seg : report.segments) {
+            sum.merge(seg.memory);
+            const size_t ex_bytes = seg.num_bits ? seg.num_dim * (seg.num_bits - 1) / 8 : 0;
+            expected.short_factors += num_vec_align * 2 * factor_bytes;
+            expected.short_codes += seg.num_bits ? num_vec_align * seg.num_dim / 8 : 0;
+            expected.long_factors += num_vec * 2 * factor_bytes;
+            expected.centroid += num_centroids_ * seg.num_dim * sizeof(float);
+            if (config.use_compact_layout) {
+                for (size_t size : report.cluster_sizes) {
+                    compact_long_codes += utils::rd_up_to_multiple_of(ex_bytes * size, align);
+                }
+            } else {
+                expected.long_codes += utils::rd_up_to_multiple_of(ex_bytes, align) * num_vec;
+            }
+            EXPECT_EQ(seg.memory.long_codes - seg.memory.long_codes_padding, ex_bytes * num_vec);
+        }
+        expected.long_codes += compact_long_codes;
+        EXPECT_EQ(sum.short_factors, expected.short_factors);
+        EXPECT_EQ(sum.short_codes, expected.short_codes);
+        EXPECT_EQ(sum.long_codes, expected.long_codes);
+        EXPECT_EQ(sum.long_factors, expected.long_factors);
+        EXPECT_EQ(sum.centroid, expected.centroid);
+        EXPECT_EQ(sum.short_factors_padding, report.padding_vectors * 2 * factor_bytes * report.segments.size());
+
+        EXPECT_EQ(sections["short factors"], sum.short_factors);
+        EXPECT_EQ(sections["short codes"], sum.short_codes);
+        EXPECT_EQ(sections["long codes"], sum.long_codes);
+        EXPECT_EQ(sections["long factors"], sum.long_factors);
+        EXPECT_EQ(sections["cluster centroids"], sum.centroid);
+        EXPECT_GT(sections["ids"], 0u);
+        EXPECT_GE(sections["centroids"], num_centroids_ * data_.cols() * sizeof(float));
+    }
+};
+
+TEST_F(MemoryReportTest, SingleSegment) {
+    QuantizeConfig config;
+    config.avg_bits = 4.0f;
+    config.enable_segmentation = false;
+    testReport(config);
+}
+
+TEST_F(MemoryReportTest, Segments) {
+    QuantizeConfig config;
+    config.avg_bits = 4.0f;
+    config.seg_eqseg = 4;
+    testReport(config);
+}
+
+TEST_F(MemoryReportTest, SegmentsCompactLayout) {
+    QuantizeConfig config;
+    config.avg_bits = 4.0f;
+    config.seg_eqseg = 4;
+    config.use_compact_layout = true;
+    testReport(config);
+}
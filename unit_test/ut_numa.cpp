@@ -0,0 +1,108 @@
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "defines.hpp"
+#include "index/ivf.hpp"
+#include "quantization/config.h"
+#include "test_base.hpp"
+#include "utils/numa.hpp"
+
+class NumaTest : public IVFTestBase<20, 16> {
+  protected:
+    std::string sysfs_;
+
+    NumaTest() : IVFTestBase(6000, 40, 32) {}
+
+    void SetUp() override {
+        IVFTestBase::SetUp();
+
+        // node 0 holds a CPU this host does not have, so the calling thread runs on node 1;
+        // node 2 only has memory
+        const unsigned num_cpus = std::max(1u, std::thread::hardware_concurrency());
+        sysfs_ = testing::TempDir() + "ut_numa_sysfs";
+        const std::vector<std::string> cpulists = {std::to_string(num_cpus), fmt::format("0-{}", num_cpus - 1), ""};
+        for (size_t n = 0; n < cpulists.size(); ++n) {
+            const auto dir = fmt::format("{}/node{}", sysfs_, n);
+            std::filesystem::create_directories(dir);
+            std::ofstream(dir + "/cpulist") << cpulists[n] << '\n';
+        }
+    }
+
+    void TearDown() override { std::filesystem::remove_all(sysfs_); }
+};
+
+TEST_F(NumaTest, LoadsTopology) {
+    const auto topo = utils::NumaTopology::load(sysfs_);
+    ASSERT_EQ(topo.num_nodes(), 2u) << "the memory-only node is skipped";
+    EXPECT_EQ(topo.node_ids, (std::vector<int>{0, 1}));
+    EXPECT_EQ(topo.node_of_cpu(0), 1);
+    EXPECT_EQ(topo.current_node(), 1);
+    EXPECT_EQ(topo.interleaved_cpus().size(), topo.node_cpus[0].size() + topo.node_cpus[1].size());
+
+    const auto none = utils::NumaTopology::load(sysfs_ + "/missing");
+    ASSERT_EQ(none.num_nodes(), 1u);
+    EXPECT_EQ(none.node_ids, std::vector<int>{-1});
+    EXPECT_EQ(none.current_node(), 0);
+}
+
+TEST_F(NumaTest, PlacementsMatchDefault) {
+    QuantizeConfig config;
+    config.avg_bits = 4.0f;
+    config.seg_eqseg = 4;
+    const std::string path = testing::TempDir() + "ut_numa.index";
+    {
+        IVF ivf(data_.rows(), data_.cols(), num_centroids_, config);
+        ivf.construct(data_, centroids_, cids_.data());
+        ivf.save(path.c_str());
+    }
+    IVF plain;
+    plain.load(path.c_str());
+    std::vector<std::vector<float>> expected_dist;
+    const auto expected = searchAll(plain, nullptr, &expected_dist);
+
+    const auto topo = utils::NumaTopology::load(sysfs_);
+    for (auto mode : {NumaMode::Replicate, NumaMode::Partition}) {
+        StorageConfig storage;
+        storage.numa = mode;
+        IVF ivf;
+        ivf.set_topology(topo);
+        ivf.load(path.c_str(), storage);
+        std::vector<std::vector<float>> dist;
+        const auto results = searchAll(ivf, nullptr, &dist);
+        if (mode == NumaMode::Replicate) {
+            // the calling thread runs on node 1, so it reads the copy
+            EXPECT_NE(ivf.memory_report().toString().find("NUMA replicas (1)"), std::string::npos);
+            EXPECT_EQ(results, expected);
+        } else {
+            // the nodes prune against the k-th distance of their own results, so they keep the
+            // neighbors of the default scan or closer ones, with the same distances
+            size_t same = 0;
+            for (size_t i = 0; i < num_query_; ++i) {
+                for (size_t j = 0; j < kTopk; ++j) {
+                    EXPECT_LE(dist[i][j], expected_dist[i][j]) << "query " << i << " rank " << j;
+                    auto it = std::find(expected[i].begin(), expected[i].end(), results[i][j]);
+                    if (it != expected[i].end()) {
+                        EXPECT_EQ(dist[i][j], expected_dist[i][it - expected[i].begin()]) << "query " << i;
+                        ++same;
+                    }
+                }
+            }
+            EXPECT_GE(same, num_query_ * kTopk * 9 / 10);
+        }
+
+        std::vector<PID> batch(num_query_ * kTopk);
+        ivf.search_batch<DistType::L2Sqr>(query_, kTopk, kNprobe, searcher_cfg_, batch.data());
+        for (size_t i = 0; i < num_query_; ++i) {
+            EXPECT_TRUE(std::equal(results[i].begin(), results[i].end(), batch.begin() + i * kTopk))
+                << "mode " << int(mode) << " query " << i;
+        }
+    }
+    std::remove(path.c_str());
+}
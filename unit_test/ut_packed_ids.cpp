@@ -0,0 +1,46 @@
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "quantization/packed_ids.hpp"
+
+using namespace saqlib;
+
+TEST(PackedIdsTest, RoundTrip) {
+    std::mt19937 gen(5);
+    for (int t = 0; t < 100; ++t) {
+        const size_t num = gen() % 300;
+        std::vector<PID> ids(num);
+        if (t % 4 == 0) {
+            std::fill(ids.begin(), ids.end(), 7); // zero-width blocks
+        } else if (t % 4 == 1) {
+            for (auto &id : ids) {
+                id = gen(); // full 32-bit deltas
+            }
+        } else {
+            const uint32_t span = 1u << (gen() % 20);
+            for (auto &id : ids) {
+                id = 123456 + gen() % span;
+            }
+            std::sort(ids.begin(), ids.end());
+        }
+
+        std::vector<uint8_t> buf(PackedIds::encoded_bytes(ids.data(), num));
+        PackedIds::encode(ids.data(), num, buf.data());
+        const size_t num_blocks = utils::div_rd_up(num, KFastScanSize);
+        for (size_t i = 0; i < num; ++i) {
+            ASSERT_EQ(PackedIds::get(buf.data(), num_blocks, i), ids[i]) << "case " << t << " idx " << i;
+        }
+    }
+}
+
+TEST(PackedIdsTest, SortedIdsAreSmaller) {
+    std::vector<PID> ids(4096);
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ids[i] = 1000000 + i * 50; // typical spacing of ids within one IVF cluster
+    }
+    // 8 bytes header and 11 bits per id for every block of 32 ids
+    EXPECT_LT(PackedIds::encoded_bytes(ids.data(), ids.size()), ids.size() * sizeof(PID) / 2);
+}
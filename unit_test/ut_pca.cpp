@@ -0,0 +1,122 @@
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "defines.hpp"
+#include "index/ivf.hpp"
+#include "quantization/config.h"
+#include "test_base.hpp"
+#include "utils/pca.hpp"
+
+class PCATest : public ::testing::Test, public TestBase {
+  protected:
+    FloatRowMat correlated(size_t num, size_t dim, int seed) {
+        std::mt19937 gen(seed);
+        std::normal_distribution<float> dist(0, 1);
+        FloatRowMat base(num, dim);
+        for (size_t i = 0; i < num; ++i) {
+            for (size_t j = 0; j < dim; ++j) {
+                base(i, j) = dist(gen) * (1.0f + j);
+            }
+        }
+        // mix dimensions and add an offset so PCA has something to undo
+        utils::Rotator rot(dim);
+        rot.orthogonalize();
+        FloatRowMat out = base * rot.get_P();
+        out.rowwise() += FloatVec::LinSpaced(dim, -5, 5);
+        return out;
+    }
+};
+
+TEST_F(PCATest, StreamingMatchesBatch) {
+    constexpr size_t kDim = 64;
+    auto data = correlated(5000, kDim, 7);
+
+    utils::PCABuilder batch(kDim);
+    batch.add(data);
+    auto pca_batch = batch.build();
+
+    utils::PCABuilder stream(kDim);
+    stream.add_all(data, 333);
+    auto pca_stream = stream.build();
+    EXPECT_EQ(stream.num_added(), 5000u);
+
+    EXPECT_LT((pca_batch->mean - pca_stream->mean).cwiseAbs().maxCoeff(), 1e-4);
+    for (size_t i = 0; i < kDim; ++i) {
+        EXPECT_NEAR(batch.variance()[i], stream.variance()[i], 1e-3 * batch.variance()[0]);
+    }
+
+    // P is orthonormal, components are sorted by decreasing variance
+    FloatRowMat I = pca_stream->P * pca_stream->P.transpose();
+    EXPECT_LT((I - FloatRowMat::Identity(kDim, kDim)).cwiseAbs().maxCoeff(), 1e-4);
+    for (size_t i = 1; i < kDim; ++i) {
+        EXPECT_GE(stream.variance()[i - 1], stream.variance()[i]);
+    }
+
+    // Transformed data is centered and its per-dimension variance equals the eigenvalues
+    FloatRowMat t = data;
+    pca_stream->transform_inplace(t, 1000);
+    FloatVec mean = t.colwise().mean();
+    FloatVec vars = t.array().square().colwise().mean();
+    EXPECT_LT(mean.cwiseAbs().maxCoeff(), 1e-3);
+    for (size_t i = 0; i < kDim; ++i) {
+        EXPECT_NEAR(vars[i], stream.variance()[i], 1e-3 * stream.variance()[0]);
+    }
+
+    // Single-vector transform agrees with the block transform
+    Eigen::RowVectorXf q = data.row(3), tq;
+    pca_stream->transform(q, tq);
+    EXPECT_LT((tq - t.row(3)).cwiseAbs().maxCoeff(), 1e-3);
+}
+
+TEST_F(PCATest, BatchTransformMatchesSingle) {
+    constexpr size_t kDim = 64;
+    auto data = correlated(2000, kDim, 3);
+    utils::PCABuilder builder(kDim);
+    builder.add(data);
+    auto pca = builder.build();
+
+    for (bool center : {true, false}) {
+        FloatRowMat t;
+        pca->transform(data.topRows(100), t, center);
+        ASSERT_EQ(t.rows(), 100);
+        for (size_t i = 0; i < 100; ++i) {
+            Eigen::RowVectorXf q = data.row(i), tq;
+            pca->transform(q, tq, center);
+            EXPECT_LT((tq - t.row(i)).cwiseAbs().maxCoeff(), 1e-3) << "row " << i << ", center " << center;
+        }
+    }
+}
+
+TEST_F(PCATest, IvfAppliesPcaToRawQueries) {
+    constexpr size_t kTopk = 10;
+    const size_t num_query = 20, num_centroids = 16;
+    generateTestData(3000, num_query, 128, num_centroids);
+    utils::PCABuilder builder(data_.cols());
+    builder.add(data_);
+    auto pca = builder.build();
+    FloatRowMat mapped = data_, mapped_centroids = centroids_;
+    pca->transform_inplace(mapped);
+    pca->transform_inplace(mapped_centroids);
+    FloatRowMat mapped_queries;
+    pca->transform(query_, mapped_queries);
+
+    QuantizeConfig config;
+    config.avg_bits = 4.0f;
+    IVF ivf(mapped.rows(), mapped.cols(), num_centroids, config);
+    ivf.construct(mapped, mapped_centroids, cids_.data());
+    ivf.set_pca(std::move(pca));
+
+    SearcherConfig raw, index_space;
+    index_space.apply_pca = false;
+    std::vector<PID> expected(num_query * kTopk), ids(num_query * kTopk);
+    ivf.search_batch<DistType::L2Sqr>(mapped_queries, kTopk, num_centroids, index_space, expected.data());
+    ivf.search_batch<DistType::L2Sqr>(query_, kTopk, num_centroids, raw, ids.data());
+    EXPECT_EQ(ids, expected);
+    for (size_t i = 0; i < num_query; ++i) {
+        std::vector<PID> single(kTopk), mapped_single(kTopk);
+        ivf.search<DistType::L2Sqr>(query_.row(i), kTopk, num_centroids, raw, single.data());
+        ivf.search<DistType::L2Sqr>(mapped_queries.row(i), kTopk, num_centroids, index_space, mapped_single.data());
+        EXPECT_EQ(single, mapped_single) << "query " << i;
+    }
+}
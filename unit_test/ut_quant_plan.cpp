@@ -0,0 +1,265 @@
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "defines.hpp"
+#include "quantization/config.h"
+#include "quantization/saq_data.hpp"
+#include "quantization/scan_cost_model.hpp"
+#include "test_base.hpp"
+
+namespace {
+// exposes the planners of SaqDataMaker
+class PlanMaker : public SaqDataMaker {
+  public:
+    using SaqDataMaker::dynamic_programming;
+    using SaqDataMaker::estimate_plan;
+    using SaqDataMaker::lagrangian_plan;
+    using SaqDataMaker::latency_aware_plan;
+    using SaqDataMaker::PlanEstimate;
+    using SaqDataMaker::QuantPlanT;
+    using SaqDataMaker::SaqDataMaker;
+    using SaqDataMaker::segment_costs;
+
+    // the DP as it was before its layers were rolled: a dense (segments, blocks, bits) table
+    QuantPlanT reference_dp(const FloatVec &data_variance, float avg_bits) {
+        const auto num_bit_factors = kNumShortFactors * sizeof(float) * 8;
+        const size_t tot_bits = avg_bits * num_dim_padded_ + num_bit_factors;
+        const size_t max_num_segs =
+            avg_bits < 2 ? num_dim_padded_ / kDimPaddingSize : num_dim_padded_ / kDimPaddingSize / 2;
+        constexpr auto valid_lmt = std::numeric_limits<double>::max();
+        auto f = std::vector<std::vector<std::vector<std::pair<double, size_t>>>>(
+            max_num_segs + 1, std::vector<std::vector<std::pair<double, size_t>>>(
+                                  num_dim_padded_ / kDimPaddingSize + 1,
+                                  std::vector<std::pair<double, size_t>>(tot_bits + 1, {valid_lmt, 0})));
+        const size_t i_end = num_dim_padded_ / kDimPaddingSize;
+        size_t ans_ns = 0;
+        size_t ans_i = i_end;
+        size_t ans_b = tot_bits;
+        f[0][0][0] = {0, 0};
+        for (size_t ns = 0; ns <= max_num_segs; ns++) {
+            for (size_t i = 0; i <= i_end; i++) {
+                for (size_t used_bits = 0; used_bits <= tot_bits; ++used_bits)
+                    if (f[ns][i][used_bits].first < valid_lmt) {
+                        if (i == i_end) {
+                            if (f[ns][i][used_bits].first * (1.01) < f[ans_ns][ans_i][ans_b].first) {
+                                ans_ns = ns;
+                                ans_i = i;
+                                ans_b = used_bits;
+                            }
+                            continue;
+                        }
+                        if (ns == max_num_segs) {
+                            continue;
+                        }
+
+                        double var_sum = 0;
+                        for (size_t j = 1; (i + j) * kDimPaddingSize <= num_dim_padded_; j++) {
+                            var_sum += data_variance.segment((i + j - 1) * kDimPaddingSize, kDimPaddingSize).sum();
+
+                            for (size_t b = 1; b <= kMaxQuantBit; ++b) {
+                                auto B_new = used_bits + b * j * kDimPaddingSize + num_bit_factors;
+                                if (B_new > tot_bits)
+                                    break;
+                                auto v = var_sum / (1 << b);
+                                auto &f_to = f[ns + 1][i + j][B_new];
+                                if (f_to.first > f[ns][i][used_bits].first + v) {
+                                    f_to.first = f[ns][i][used_bits].first + v;
+                                    f_to.second = (i << 4) + b;
+                                }
+                            }
+                        }
+                        auto err0 = var_sum;
+                        if (f[ns][i][used_bits].first + err0 < f[1 + ns][i_end][used_bits].first) {
+                            f[1 + ns][i_end][used_bits].first = f[ns][i][used_bits].first + err0;
+                            f[1 + ns][i_end][used_bits].second = (i << 4) + 0;
+                        }
+                    }
+            }
+        }
+
+        QuantPlanT quant_plan;
+        size_t ns = ans_ns;
+        size_t i = ans_i;
+        size_t B = ans_b;
+        while (i > 0) {
+            auto &f_cur = f[ns][i][B];
+            auto pev_i = (f_cur.second >> 4);
+            auto curr_bits = f_cur.second & 0xf;
+            auto curr_dim_len = (i - pev_i) * kDimPaddingSize;
+            quant_plan.emplace_back(curr_dim_len, curr_bits);
+
+            ns--;
+            i = pev_i;
+            if (curr_bits)
+                B -= curr_bits * curr_dim_len + num_bit_factors;
+        }
+        std::reverse(quant_plan.begin(), quant_plan.end());
+        return quant_plan;
+    }
+};
+
+// variances decaying like a PCA spectrum, optionally with a tail of zero variance
+FloatVec pca_like_variance(size_t dim, bool zero_tail, int seed) {
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<float> noise(0.8f, 1.2f);
+    FloatVec vars = FloatVec::Zero(utils::rd_up_to_multiple_of(dim, kDimPaddingSize));
+    const size_t nonzero = zero_tail ? dim * 3 / 4 : dim;
+    for (size_t d = 0; d < nonzero; ++d) {
+        vars[d] = 100.0f * std::exp(-4.0f * d / dim) * noise(gen);
+    }
+    return vars;
+}
+
+// a model of made-up kernel costs, so plans do not depend on the host
+ScanCostModel fixed_cost_model() {
+    ScanCostModel model;
+    model.fast = {20, 0.05};
+    model.lut = {50, 0.2};
+    for (size_t e = 0; e < model.ip.size(); ++e) {
+        model.ip[e] = {5, 0.01 * (e + 1)};
+    }
+    return model;
+}
+
+std::vector<float> block_variances(const FloatVec &vars) {
+    std::vector<float> blk_vars(vars.cols() / kDimPaddingSize);
+    for (size_t k = 0; k < blk_vars.size(); ++k) {
+        blk_vars[k] = vars.segment(k * kDimPaddingSize, kDimPaddingSize).sum();
+    }
+    return blk_vars;
+}
+} // namespace
+
+TEST(QuantPlanTest, DynamicProgrammingMatchesReference) {
+    for (size_t dim : {128, 960, 1536}) {
+        for (bool zero_tail : {false, true}) {
+            const auto vars = pca_like_variance(dim, zero_tail, int(dim));
+            for (float avg_bits : {0.5f, 1.0f, 1.5f, 2.0f, 3.3f, 4.0f, 6.5f, 9.0f}) {
+                QuantizeConfig config;
+                config.avg_bits = avg_bits;
+                PlanMaker maker(config, dim);
+                const auto plan = maker.dynamic_programming(vars, avg_bits);
+                EXPECT_EQ(plan, maker.reference_dp(vars, avg_bits))
+                    << "dim " << dim << ", " << avg_bits << " bits" << (zero_tail ? ", zero tail" : "");
+
+                size_t covered = 0;
+                for (auto [len, bits] : plan) {
+                    covered += len;
+                }
+                EXPECT_EQ(covered, size_t(vars.cols()));
+            }
+        }
+    }
+}
+
+TEST(QuantPlanTest, CostModelRoundTrip) {
+    const auto model = fixed_cost_model();
+    std::stringstream ss;
+    model.save(ss);
+    const auto loaded = ScanCostModel::load(ss);
+    EXPECT_EQ(loaded.toString(), model.toString());
+    for (size_t dim : {64, 640}) {
+        EXPECT_DOUBLE_EQ(loaded.segment_cost(dim, 4, 256, 0.1), model.segment_cost(dim, 4, 256, 0.1));
+    }
+
+    std::stringstream bad("fast 1 2\nlut 3\n");
+    EXPECT_DEATH(ScanCostModel::load(bad), "Bad scan cost model, expected lut");
+}
+
+TEST(QuantPlanTest, LagrangianTradeoff) {
+    constexpr size_t kDim = 960;
+    constexpr float kBits = 4.0f;
+    const auto vars = pca_like_variance(kDim, false, 5);
+    PlanMaker maker(QuantizeConfig{}, kDim);
+    const auto blk_vars = block_variances(vars);
+    const auto seg_cost = maker.segment_costs(fixed_cost_model());
+    const size_t tot_units = size_t(kBits * kDim + 128) / kDimPaddingSize;
+    double tot_var = 0;
+    for (auto v : blk_vars) {
+        tot_var += v;
+    }
+
+    // a larger weight of the cost never buys a costlier plan, nor a more accurate one
+    auto prev = maker.lagrangian_plan(blk_vars, seg_cost, tot_units, 0);
+    for (double lambda = tot_var * 1e-6; lambda < tot_var * 1e3; lambda *= 4) {
+        const auto cur = maker.lagrangian_plan(blk_vars, seg_cost, tot_units, lambda);
+        EXPECT_LE(cur.cost, prev.cost * (1 + 1e-9)) << "lambda " << lambda;
+        EXPECT_GE(cur.error, prev.error * (1 - 1e-9)) << "lambda " << lambda;
+        const auto est = PlanMaker::estimate_plan(cur.plan, blk_vars, seg_cost);
+        EXPECT_DOUBLE_EQ(est.cost, cur.cost);
+        EXPECT_DOUBLE_EQ(est.error, cur.error);
+        prev = cur;
+    }
+}
+
+TEST(QuantPlanTest, LatencyAwarePlanMeetsBudget) {
+    constexpr size_t kDim = 960;
+    constexpr float kBits = 4.0f;
+    const auto vars = pca_like_variance(kDim, true, 9);
+    const auto model = fixed_cost_model();
+    const auto blk_vars = block_variances(vars);
+    double tot_var = 0;
+    for (auto v : blk_vars) {
+        tot_var += v;
+    }
+
+    QuantizeConfig config;
+    config.avg_bits = kBits;
+    PlanMaker error_maker(config, kDim);
+    const auto seg_cost = error_maker.segment_costs(model);
+    const auto dp = PlanMaker::estimate_plan(error_maker.dynamic_programming(vars, kBits), blk_vars, seg_cost);
+    const auto cheapest = error_maker.lagrangian_plan(blk_vars, seg_cost, size_t(kBits * kDim + 128) / 64, 1e12 * tot_var);
+    ASSERT_LT(cheapest.cost, dp.cost);
+
+    for (double frac : {0.25, 0.5, 0.75}) {
+        config.planner.mode = PlannerMode::Latency;
+        config.planner.budget = cheapest.cost + frac * (dp.cost - cheapest.cost);
+        PlanMaker maker(config, kDim);
+        const auto plan = PlanMaker::estimate_plan(maker.latency_aware_plan(vars, kBits, model), blk_vars, seg_cost);
+        EXPECT_LE(plan.cost, config.planner.budget) << "budget " << config.planner.budget;
+        EXPECT_GE(plan.error, dp.error * (1 - 1e-9));
+    }
+    for (double frac : {1.5, 3.0}) {
+        config.planner.mode = PlannerMode::ErrorBound;
+        config.planner.budget = frac * dp.error / tot_var;
+        PlanMaker maker(config, kDim);
+        const auto plan = PlanMaker::estimate_plan(maker.latency_aware_plan(vars, kBits, model), blk_vars, seg_cost);
+        EXPECT_LE(plan.error, config.planner.budget * tot_var) << "budget " << config.planner.budget;
+        EXPECT_LE(plan.cost, dp.cost);
+    }
+
+    // a latency budget the min error plan meets changes nothing
+    config.planner.mode = PlannerMode::Latency;
+    config.planner.budget = dp.cost * 2;
+    PlanMaker loose(config, kDim);
+    EXPECT_EQ(loose.latency_aware_plan(vars, kBits, model), dp.plan);
+}
+
+TEST(QuantPlanTest, SavedCostModelReproducesPlan) {
+    constexpr size_t kDim = 960;
+    const auto vars = pca_like_variance(kDim, false, 11);
+    const auto model = fixed_cost_model();
+    const std::string file = testing::TempDir() + "ut_quant_plan_cost.txt";
+    model.save(file.c_str());
+
+    QuantizeConfig config;
+    config.avg_bits = 4.0f;
+    config.planner.mode = PlannerMode::Latency;
+    config.planner.budget = 10;
+    config.planner.cost_model = file;
+    PlanMaker maker(config, kDim);
+    maker.set_variance(vars);
+    PlanMaker expected(config, kDim);
+    EXPECT_EQ(maker.get_data()->quant_plan, expected.latency_aware_plan(vars, 4.0f, model));
+    std::remove(file.c_str());
+}
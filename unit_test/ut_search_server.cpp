@@ -0,0 +1,168 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "defines.hpp"
+#include "index/ivf.hpp"
+#include "quantization/config.h"
+#include "server/protocol.hpp"
+#include "server/search_server.hpp"
+#include "test_base.hpp"
+
+class SearchServerTest : public IVFTestBase<10, 8> {
+  protected:
+    std::string index_files_[2];
+    std::string socket_;
+    server::ServerConfig cfg_;
+
+    SearchServerTest() : IVFTestBase(4000, 40, 32) {}
+
+    void SetUp() override {
+        IVFTestBase::SetUp();
+        // two indexes of the same data, at 4 and 2 bits
+        for (int i = 0; i < 2; ++i) {
+            QuantizeConfig config;
+            config.avg_bits = i ? 2.0f : 4.0f;
+            IVF ivf(data_.rows(), data_.cols(), num_centroids_, config);
+            ivf.construct(data_, centroids_, cids_.data());
+            index_files_[i] = testing::TempDir() + "ut_search_server_" + std::to_string(i) + ".index";
+            ivf.save(index_files_[i].c_str());
+        }
+        socket_ = testing::TempDir() + "ut_search_server.sock";
+        cfg_.unix_path = socket_;
+        cfg_.num_threads = 1; // one search_batch() per request
+        cfg_.searcher_cfg = searcher_cfg_;
+    }
+
+    void TearDown() override {
+        for (const auto &file : index_files_) {
+            std::remove(file.c_str());
+        }
+    }
+
+    std::vector<PID> expected(const std::string &index_file) {
+        IVF ivf;
+        ivf.load(index_file.c_str());
+        std::vector<PID> ids(num_query_ * kTopk);
+        ivf.search_batch(query_, kTopk, kNprobe, cfg_.searcher_cfg, ids.data());
+        return ids;
+    }
+};
+
+TEST_F(SearchServerTest, BatchSearchAndErrors) {
+    server::SearchServer srv(index_files_[0], cfg_);
+    srv.start();
+    server::SearchClient client(socket_, 0);
+
+    server::InfoReply info;
+    ASSERT_TRUE(client.info(info)) << client.error();
+    EXPECT_EQ(info.num_data, size_t(data_.rows()));
+    EXPECT_EQ(info.dim, size_t(data_.cols()));
+    EXPECT_EQ(info.num_clusters, num_centroids_);
+
+    std::vector<PID> ids(num_query_ * kTopk);
+    ASSERT_TRUE(client.search(query_.data(), num_query_, query_.cols(), kTopk, kNprobe, ids.data())) << client.error();
+    EXPECT_EQ(ids, expected(index_files_[0]));
+    EXPECT_EQ(client.index_version(), 1u);
+
+    // rejected requests leave the connection usable
+    EXPECT_FALSE(client.search(query_.data(), 1, query_.cols() - 1, kTopk, kNprobe, ids.data()));
+    EXPECT_FALSE(client.error().empty());
+    EXPECT_FALSE(client.search(query_.data(), 1, query_.cols(), kTopk, num_centroids_ + 1, ids.data()));
+    EXPECT_FALSE(client.reload(testing::TempDir() + "ut_search_server_missing.index"));
+    EXPECT_TRUE(client.search(query_.data(), 1, query_.cols(), kTopk, kNprobe, ids.data())) << client.error();
+    EXPECT_EQ(srv.version(), 1u);
+}
+
+TEST_F(SearchServerTest, RejectsBeforeReadingPayload) {
+    cfg_.max_queries = 8;
+    server::SearchServer srv(index_files_[0], cfg_);
+    srv.start();
+    server::SearchClient client(socket_, 0);
+    std::vector<PID> ids(num_query_ * kTopk);
+    EXPECT_FALSE(client.search(query_.data(), num_query_, query_.cols(), kTopk, kNprobe, ids.data()));
+    EXPECT_NE(client.error().find("queries"), std::string::npos) << client.error();
+    ASSERT_TRUE(client.search(query_.data(), 8, query_.cols(), kTopk, kNprobe, ids.data())) << client.error();
+    const auto all = expected(index_files_[0]);
+    EXPECT_TRUE(std::equal(ids.begin(), ids.begin() + 8 * kTopk, all.begin()));
+
+    // a payload size that does not match the header is dropped, and the stream stays in sync
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, socket_.c_str(), socket_.size());
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT_EQ(::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)), 0);
+    server::RequestHeader req;
+    req.op = uint16_t(server::Op::Search);
+    req.num_queries = 2;
+    req.dim = query_.cols();
+    req.topk = kTopk;
+    req.nprobe = kNprobe;
+    req.payload_bytes = query_.cols() * sizeof(float) + 12;
+    std::vector<char> payload(req.payload_bytes, 1);
+    ASSERT_TRUE(server::write_full(fd, &req, sizeof(req)) && server::write_full(fd, payload.data(), payload.size()));
+    server::ResponseHeader resp;
+    ASSERT_TRUE(server::read_full(fd, &resp, sizeof(resp)));
+    EXPECT_EQ(resp.status, uint16_t(server::Status::BadRequest));
+    std::string message(resp.payload_bytes, '\0');
+    ASSERT_TRUE(server::read_full(fd, message.data(), message.size()));
+    EXPECT_NE(message.find("payload size"), std::string::npos) << message;
+
+    req = server::RequestHeader();
+    req.op = uint16_t(server::Op::Info);
+    ASSERT_TRUE(server::write_full(fd, &req, sizeof(req)));
+    ASSERT_TRUE(server::read_full(fd, &resp, sizeof(resp)));
+    EXPECT_EQ(resp.status, uint16_t(server::Status::Ok));
+    EXPECT_EQ(resp.payload_bytes, sizeof(server::InfoReply));
+    ::close(fd);
+}
+
+TEST_F(SearchServerTest, HotReloadKeepsServing) {
+    server::SearchServer srv(index_files_[0], cfg_);
+    srv.start();
+    const auto before = expected(index_files_[0]);
+    const auto after = expected(index_files_[1]);
+
+    // a client searching through the swap gets every answer from one index or the other
+    std::atomic<bool> done{false};
+    std::atomic<size_t> num_requests{0}, num_failures{0};
+    std::thread searcher([&] {
+        server::SearchClient client(socket_, 0);
+        std::vector<PID> ids(num_query_ * kTopk);
+        while (!done.load()) {
+            const bool ok = client.search(query_.data(), num_query_, query_.cols(), kTopk, kNprobe, ids.data());
+            const auto &ref = client.index_version() == 1 ? before : after;
+            num_failures += !ok || ids != ref;
+            ++num_requests;
+        }
+    });
+    while (num_requests.load() < 3) {
+        std::this_thread::yield();
+    }
+    server::SearchClient admin(socket_, 0);
+    ASSERT_TRUE(admin.reload(index_files_[1])) << admin.error();
+    EXPECT_EQ(admin.index_version(), 2u);
+    const size_t swapped_at = num_requests.load();
+    while (num_requests.load() < swapped_at + 3) {
+        std::this_thread::yield();
+    }
+    done = true;
+    searcher.join();
+    EXPECT_EQ(num_failures.load(), 0u);
+    EXPECT_EQ(srv.version(), 2u);
+    EXPECT_EQ(srv.filename(), index_files_[1]);
+
+    std::vector<PID> ids(num_query_ * kTopk);
+    server::SearchClient client(socket_, 0);
+    ASSERT_TRUE(client.search(query_.data(), num_query_, query_.cols(), kTopk, kNprobe, ids.data()));
+    EXPECT_EQ(ids, after);
+}
@@ -0,0 +1,128 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "defines.hpp"
+#include "index/index_file.hpp"
+#include "index/ivf.hpp"
+#include "index/sharded_ivf.hpp"
+#include "quantization/config.h"
+#include "test_base.hpp"
+
+class ShardedIVFTest : public IVFTestBase<20, 16> {
+  protected:
+    QuantizeConfig config_;
+
+    ShardedIVFTest() : IVFTestBase(4000, 20, 16) { config_.avg_bits = 4.0f; }
+
+    std::vector<std::vector<PID>> searchAll(ShardedIVF &index, size_t nprobe) {
+        std::vector<std::vector<PID>> results(num_query_, std::vector<PID>(kTopk));
+        for (size_t i = 0; i < num_query_; ++i) {
+            index.search<DistType::L2Sqr>(query_.row(i), kTopk, nprobe, searcher_cfg_, results[i].data());
+        }
+        return results;
+    }
+
+    // Same vectors in one IVF, quantized with the data of the shards
+    double overlapWithSingle(const ShardedIVF &index, const std::vector<std::vector<PID>> &results, size_t nprobe) {
+        IVF single(data_.rows(), data_.cols(), num_centroids_, config_);
+        single.set_saq_data(index.shared_saq_data());
+        single.construct(data_, centroids_, cids_.data());
+        size_t same = 0;
+        for (size_t i = 0; i < num_query_; ++i) {
+            std::vector<PID> expected(kTopk);
+            single.search<DistType::L2Sqr>(query_.row(i), kTopk, nprobe, searcher_cfg_, expected.data());
+            for (auto id : results[i]) {
+                same += std::count(expected.begin(), expected.end(), id);
+            }
+        }
+        return double(same) / (num_query_ * kTopk);
+    }
+
+    void testMode(ShardMode mode, size_t num_shards) {
+        ShardedIVF index(data_.rows(), data_.cols(), num_centroids_, config_, num_shards, mode);
+        index.construct(data_, centroids_, cids_.data());
+        ASSERT_EQ(index.num_shards(), num_shards);
+        size_t total = 0;
+        for (size_t s = 0; s < num_shards; ++s) {
+            total += index.shard_info(s).num_data;
+            EXPECT_EQ(index.shard(s)->get_saq_data(), index.get_saq_data());
+        }
+        EXPECT_EQ(total, num_data_);
+
+        for (size_t nprobe : {size_t(4), num_centroids_}) {
+            const auto results = searchAll(index, nprobe);
+            EXPECT_GE(overlapWithSingle(index, results, nprobe), 0.98) << "nprobe " << nprobe;
+        }
+
+        // round trip, and reload of one shard
+        const std::string file = testing::TempDir() + "ut_sharded_ivf.index";
+        const auto expected = searchAll(index, num_centroids_);
+        index.save(file.c_str());
+        ShardedIVF loaded;
+        loaded.load(file.c_str());
+        EXPECT_EQ(loaded.mode(), mode);
+        EXPECT_EQ(searchAll(loaded, num_centroids_), expected);
+        loaded.load_shard(num_shards - 1);
+        EXPECT_EQ(searchAll(loaded, num_centroids_), expected);
+
+        // shards scanned in turn into one pool, ties at the k-th distance may go either way
+        loaded.set_search_threads(0);
+        EXPECT_GE(overlapWithSingle(loaded, searchAll(loaded, num_centroids_), num_centroids_), 0.98);
+
+        std::remove(file.c_str());
+        for (size_t s = 0; s < num_shards; ++s) {
+            std::remove(ShardedIVF::shard_filename(file, s).c_str());
+        }
+    }
+};
+
+TEST_F(ShardedIVFTest, ClusterShards) { testMode(ShardMode::Cluster, 3); }
+
+TEST_F(ShardedIVFTest, IdShards) { testMode(ShardMode::Id, 3); }
+
+TEST_F(ShardedIVFTest, RejectsBadShardTable) {
+    ShardedIVF index(data_.rows(), data_.cols(), num_centroids_, config_, 2, ShardMode::Cluster);
+    index.prepare(data_, centroids_, cids_.data());
+    const std::string file = testing::TempDir() + "ut_sharded_ivf_manifest.index";
+    const std::string bad = testing::TempDir() + "ut_sharded_ivf_bad.index";
+    index.save_manifest(file.c_str());
+
+    // the manifest with its shard table replaced by `table`
+    IndexFileReader reader(file.c_str());
+    const auto table = reader.read(IndexSection::Shards);
+    auto load_with = [&](const std::vector<char> &table) {
+        IndexFileWriter writer(bad.c_str(), reader.header(), 3);
+        for (auto type : {IndexSection::Centroids, IndexSection::QuantData}) {
+            const auto payload = reader.read(type);
+            writer.add(type, 0, [&](std::ostream &os) { os.write(payload.data(), payload.size()); });
+        }
+        writer.add(IndexSection::Shards, 0, [&](std::ostream &os) { os.write(table.data(), table.size()); });
+        writer.finish();
+        ShardedIVF loaded;
+        loaded.load_manifest(bad.c_str());
+    };
+    auto patched = [&](size_t offset, uint64_t value, size_t bytes) {
+        auto copy = table;
+        std::memcpy(copy.data() + offset, &value, bytes);
+        return copy;
+    };
+    load_with(table);
+
+    EXPECT_DEATH(load_with(std::vector<char>(table.begin(), table.begin() + 8)), "truncated shard table");
+    EXPECT_DEATH(load_with(patched(8, uint64_t(1) << 60, sizeof(uint64_t))), "for 1152921504606846976 shards");
+    EXPECT_DEATH(load_with(patched(0, 5, sizeof(uint32_t))), "unknown shard mode 5");
+    const size_t end_of_last = 16 + sizeof(ShardedIVF::ShardInfo) + offsetof(ShardedIVF::ShardInfo, end);
+    EXPECT_DEATH(load_with(patched(end_of_last, num_centroids_ + 1, sizeof(uint64_t))),
+                 "shard 1 covers \\[.*, 17\\), beyond the 16 clusters");
+
+    std::remove(file.c_str());
+    std::remove(bad.c_str());
+}
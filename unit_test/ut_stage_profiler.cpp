@@ -0,0 +1,91 @@
+#include <algorithm>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "defines.hpp"
+#include "index/ivf.hpp"
+#include "quantization/config.h"
+#include "test_base.hpp"
+#include "utils/stage_profiler.hpp"
+
+class StageProfilerTest : public IVFTestBase<10, 8> {
+  protected:
+    StageProfilerTest() : IVFTestBase(4000, 50, 16) {}
+
+    // the profiled search returns the same ids as the plain one, and its counts add up
+    utils::SearchProfile checkProfiled(const QuantizeConfig &config) {
+        IVF ivf(data_.rows(), data_.cols(), num_centroids_, config);
+        ivf.construct(data_, centroids_, cids_.data());
+
+        utils::SearchProfile profile;
+        std::vector<PID> plain(kTopk), profiled(kTopk);
+        for (size_t i = 0; i < num_query_; ++i) {
+            ivf.search<DistType::L2Sqr>(query_.row(i), kTopk, kNprobe, searcher_cfg_, plain.data());
+            ivf.search<DistType::L2Sqr, utils::CycleProfiler>(query_.row(i), kTopk, kNprobe, searcher_cfg_,
+                                                             profiled.data(), nullptr, &profile);
+            EXPECT_EQ(plain, profiled) << "query " << i;
+        }
+
+        EXPECT_EQ(profile.num_queries, num_query_);
+        EXPECT_EQ(profile.num_clusters, num_query_ * kNprobe);
+        EXPECT_GT(profile.num_vectors, 0u);
+        EXPECT_GT(profile.total_cycles, 0u);
+        uint64_t stage_cycles = 0;
+        for (auto c : profile.cycles) {
+            stage_cycles += c;
+        }
+        EXPECT_LE(stage_cycles, profile.total_cycles);
+        EXPECT_GT(profile.cycles[static_cast<size_t>(utils::SearchStage::Fast)], 0u);
+        EXPECT_GT(profile.cycles[static_cast<size_t>(utils::SearchStage::Accurate)], 0u);
+
+        EXPECT_FALSE(profile.segments.empty());
+        EXPECT_LE(profile.segments[0].fast_kept, profile.segments[0].fast_in);
+        EXPECT_GE(profile.inserted, num_query_ * kTopk);
+        return profile;
+    }
+};
+
+TEST_F(StageProfilerTest, SingleSegment) {
+    QuantizeConfig config;
+    config.avg_bits = 4.0f;
+    config.enable_segmentation = false;
+    const auto profile = checkProfiled(config);
+
+    ASSERT_EQ(profile.segments.size(), 1u);
+    EXPECT_EQ(profile.segments[0].fast_in, profile.num_vectors);
+    EXPECT_EQ(profile.segments[0].acc_in, profile.segments[0].fast_kept);
+}
+
+// Clusters of 8 full blocks: the last block is scanned and counted like the others
+TEST_F(StageProfilerTest, SingleSegmentFullLastBlock) {
+    generateTestData(num_centroids_ * 8 * KFastScanSize, num_query_, 128, num_centroids_);
+    QuantizeConfig config;
+    config.avg_bits = 4.0f;
+    config.enable_segmentation = false;
+    const auto profile = checkProfiled(config);
+    EXPECT_EQ(profile.segments[0].fast_in, profile.num_vectors);
+
+    // the last vector of cluster 0 finds itself
+    IVF ivf(data_.rows(), data_.cols(), num_centroids_, config);
+    ivf.construct(data_, centroids_, cids_.data());
+    const PID last = data_.rows() - num_centroids_;
+    std::vector<PID> results(kTopk);
+    ivf.search<DistType::L2Sqr>(data_.row(last), kTopk, num_centroids_, searcher_cfg_, results.data());
+    EXPECT_NE(std::find(results.begin(), results.end(), last), results.end());
+}
+
+TEST_F(StageProfilerTest, Segments) {
+    QuantizeConfig config;
+    config.avg_bits = 4.0f;
+    config.seg_eqseg = 4;
+    const auto profile = checkProfiled(config);
+
+    ASSERT_GT(profile.segments.size(), 1u);
+    EXPECT_LE(profile.vars_kept, profile.num_vectors + profile.num_clusters * KFastScanSize);
+    for (size_t i = 1; i < profile.segments.size(); ++i) {
+        // a segment only sees what the previous ones kept
+        EXPECT_LE(profile.segments[i].fast_in, profile.segments[i - 1].fast_kept);
+        EXPECT_LE(profile.segments[i].acc_in, profile.segments[i - 1].acc_in);
+    }
+}
@@ -0,0 +1,82 @@
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "defines.hpp"
+#include "index/ivf.hpp"
+#include "quantization/config.h"
+#include "test_base.hpp"
+
+class TieredStorageTest : public IVFTestBase<20, 8> {
+  protected:
+    TieredStorageTest() : IVFTestBase(12800, 50, 64) { search_threads_ = 8; }
+
+    // tiered search returns the ids of the in-memory search of the same file and layout
+    void testTiered(const QuantizeConfig &config, bool interleaved) {
+        const std::string path = testing::TempDir() + "ut_tiered_storage.index";
+        {
+            IVF ivf(data_.rows(), data_.cols(), num_centroids_, config);
+            ivf.construct(data_, centroids_, cids_.data());
+            ivf.save(path.c_str());
+        }
+        StorageConfig storage;
+        storage.interleaved_layout = interleaved;
+        IVF in_memory;
+        in_memory.load(path.c_str(), storage);
+        const auto expected = searchAll(in_memory);
+
+        // the smallest cache (one block per shard) is far below the long data of the file
+        const size_t file_blocks = std::filesystem::file_size(path) / 4096 + 1;
+        for (size_t cache_mb : {size_t(0), size_t(64)}) {
+            storage.tiered = true;
+            storage.tier_cache_mb = cache_mb;
+            storage.tier_io_threads = cache_mb ? 2 : 0;
+            IVF tiered;
+            tiered.load(path.c_str(), storage);
+
+            QueryRuntimeMetrics metrics;
+            for (int round = 0; round < 2; ++round) {
+                EXPECT_EQ(searchAll(tiered, &metrics), expected) << "cache " << cache_mb << " MiB, round " << round;
+            }
+            EXPECT_GT(metrics.long_block_hits, 0u);
+            if (cache_mb) {
+                EXPECT_LE(metrics.long_block_misses, file_blocks);
+            } else {
+                EXPECT_GT(metrics.long_block_misses, file_blocks) << "blocks are evicted and read again";
+            }
+        }
+        std::remove(path.c_str());
+    }
+};
+
+TEST_F(TieredStorageTest, SingleSegment) {
+    QuantizeConfig config;
+    config.avg_bits = 4.0f;
+    config.enable_segmentation = false;
+    testTiered(config, false);
+}
+
+TEST_F(TieredStorageTest, Segments) {
+    QuantizeConfig config;
+    config.avg_bits = 4.0f;
+    config.seg_eqseg = 4;
+    testTiered(config, false);
+}
+
+TEST_F(TieredStorageTest, SegmentsCompactLayout) {
+    QuantizeConfig config;
+    config.avg_bits = 4.0f;
+    config.seg_eqseg = 4;
+    config.use_compact_layout = true;
+    testTiered(config, false);
+}
+
+TEST_F(TieredStorageTest, SegmentsInterleavedLayout) {
+    QuantizeConfig config;
+    config.avg_bits = 4.0f;
+    config.seg_eqseg = 4;
+    testTiered(config, true);
+}
@@ -0,0 +1,150 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "defines.hpp"
+#include "index/ivf.hpp"
+#include "index/vector_store.hpp"
+#include "quantization/config.h"
+#include "test_base.hpp"
+#include "utils/IO.hpp"
+#include "utils/pool.hpp"
+
+class VectorStoreTest : public TestBase, public ::testing::Test {
+  protected:
+    static constexpr size_t kTopk = 10;
+    const size_t num_query_ = 30;
+    const size_t num_centroids_ = 16;
+    std::string base_file_;
+
+    void SetUp() override {
+        generateTestData(4000, num_query_, 128, num_centroids_);
+        base_file_ = testing::TempDir() + "ut_vector_store_base.fvecs";
+        utils::save_vecs<float, FloatRowMat>(base_file_.c_str(), data_);
+    }
+
+    void TearDown() override { std::remove(base_file_.c_str()); }
+
+    float exact(size_t qi, PID id, DistType dist_type) {
+        return dist_type == DistType::IP ? query_.row(qi).dot(data_.row(id))
+                                         : (query_.row(qi) - data_.row(id)).squaredNorm();
+    }
+};
+
+TEST_F(VectorStoreTest, Distances) {
+    const std::string f16_file = testing::TempDir() + "ut_vector_store.f16.store";
+    const std::string i8_file = testing::TempDir() + "ut_vector_store.i8.store";
+    {
+        utils::VectorStream stream(base_file_.c_str(), 1000);
+        VectorStore::write(f16_file.c_str(), stream, StoreType::Fp16);
+        VectorStore::write(i8_file.c_str(), stream, StoreType::Int8);
+    }
+    // small integers are exact in fp16, int8 rounds them to its scale
+    const std::vector<std::pair<std::string, float>> stores = {{base_file_, 1e-5f}, {f16_file, 1e-5f}, {i8_file, 0.05f}};
+    for (const auto &[file, tolerance] : stores) {
+        VectorStore store(file.c_str());
+        ASSERT_EQ(store.rows(), size_t(data_.rows())) << file;
+        ASSERT_EQ(store.dim(), size_t(data_.cols())) << file;
+        for (auto dist_type : {DistType::L2Sqr, DistType::IP}) {
+            for (size_t qi = 0; qi < num_query_; ++qi) {
+                for (PID id = 0; id < data_.rows(); id += 97) {
+                    const float expected = exact(qi, id, dist_type);
+                    EXPECT_NEAR(store.distance(query_.row(qi).data(), id, dist_type), expected,
+                                tolerance * (std::abs(expected) + query_.row(qi).squaredNorm()))
+                        << file << " query " << qi << " id " << id;
+                }
+            }
+        }
+    }
+    std::remove(f16_file.c_str());
+    std::remove(i8_file.c_str());
+}
+
+TEST_F(VectorStoreTest, RefusesFp16OutOfRange) {
+    const std::string large_file = testing::TempDir() + "ut_vector_store_large.fvecs";
+    const std::string f16_file = testing::TempDir() + "ut_vector_store_large.f16.store";
+    FloatRowMat large = data_;
+    large(3999, 5) = 70000.0f; // in the last chunk
+    utils::save_vecs<float, FloatRowMat>(large_file.c_str(), large);
+    EXPECT_DEATH(
+        {
+            utils::VectorStream stream(large_file.c_str(), 1000); // its reader thread would not survive the fork
+            VectorStore::write(f16_file.c_str(), stream, StoreType::Fp16);
+        },
+        "reach 70000, out of the fp16 range, use an fp32 or int8 store");
+    EXPECT_FALSE(utils::file_exists(f16_file.c_str()));
+    std::remove(large_file.c_str());
+}
+
+TEST_F(VectorStoreTest, RerankIsExact) {
+    QuantizeConfig config;
+    config.avg_bits = 2.0f;
+    IVF ivf(data_.rows(), data_.cols(), num_centroids_, config);
+    ivf.construct(data_, centroids_, cids_.data());
+    VectorStore store(base_file_.c_str());
+    SearcherConfig searcher_cfg;
+    searcher_cfg.searcher_vars_bound_m = 4.0;
+    searcher_cfg.dist_type = DistType::L2Sqr;
+
+    size_t hits = 0, rerank_hits = 0;
+    for (size_t qi = 0; qi < num_query_; ++qi) {
+        utils::ResultPool gt(kTopk);
+        for (PID id = 0; id < data_.rows(); ++id) {
+            gt.insert(id, exact(qi, id, DistType::L2Sqr));
+        }
+        const float gt_distk = gt.distk();
+
+        std::vector<PID> ids(kTopk), rerank_ids(kTopk);
+        std::vector<float> distances(kTopk);
+        QueryRuntimeMetrics metrics;
+        ivf.search(query_.row(qi), kTopk, num_centroids_, searcher_cfg, ids.data());
+        ivf.search_rerank(query_.row(qi), kTopk, num_centroids_, searcher_cfg, store, 4.0f, rerank_ids.data(),
+                          distances.data(), &metrics);
+        EXPECT_EQ(metrics.rerank_cnt, kTopk * 4);
+        for (size_t j = 0; j < kTopk; ++j) {
+            EXPECT_FLOAT_EQ(distances[j], exact(qi, rerank_ids[j], DistType::L2Sqr));
+            if (j) {
+                EXPECT_LE(distances[j - 1], distances[j]);
+            }
+            hits += exact(qi, ids[j], DistType::L2Sqr) <= gt_distk;
+            rerank_hits += distances[j] <= gt_distk;
+        }
+    }
+    EXPECT_GT(rerank_hits, hits) << "re-ranking 4x candidates improves the recall of 2-bit codes";
+}
+
+TEST_F(VectorStoreTest, EmptySlots) {
+    QuantizeConfig config;
+    config.avg_bits = 4.0f;
+    IVF ivf(data_.rows(), data_.cols(), num_centroids_, config);
+    ivf.construct(data_, centroids_, cids_.data());
+    VectorStore store(base_file_.c_str());
+    SearcherConfig searcher_cfg;
+    searcher_cfg.dist_type = DistType::L2Sqr;
+
+    // one probed cluster holds fewer vectors than topk: every path leaves the same empty slots
+    const size_t topk = data_.rows();
+    std::vector<PID> ids(topk), batch_ids(topk), rerank_ids(topk);
+    std::vector<float> distances(topk), batch_distances(topk), rerank_distances(topk);
+    ivf.search(query_.row(0), topk, 1, searcher_cfg, ids.data(), nullptr, nullptr, distances.data());
+    ivf.search_batch(query_.topRows(1), topk, 1, searcher_cfg, batch_ids.data(), batch_distances.data());
+    ivf.search_rerank(query_.row(0), topk, 1, searcher_cfg, store, 1.0f, rerank_ids.data(), rerank_distances.data());
+    EXPECT_EQ(batch_ids, ids);
+    EXPECT_EQ(batch_distances, distances);
+
+    const size_t found = std::find(ids.begin(), ids.end(), kInvalidPID) - ids.begin();
+    ASSERT_GT(found, 0u);
+    ASSERT_LT(found, topk);
+    for (size_t j = found; j < topk; ++j) {
+        EXPECT_EQ(ids[j], kInvalidPID);
+        EXPECT_EQ(rerank_ids[j], kInvalidPID);
+        EXPECT_EQ(distances[j], std::numeric_limits<float>::max());
+        EXPECT_EQ(rerank_distances[j], std::numeric_limits<float>::max());
+    }
+    EXPECT_NE(rerank_ids[found - 1], kInvalidPID);
+}
@@ -0,0 +1,129 @@
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "defines.hpp"
+#include "index/ivf.hpp"
+#include "quantization/config.h"
+#include "quantization/saq_data.hpp"
+#include "test_base.hpp"
+#include "utils/IO.hpp"
+
+class VectorStreamTest : public TestBase, public ::testing::Test {
+  protected:
+    static constexpr size_t kTopk = 20;
+    const size_t num_query_ = 20;
+    const size_t num_centroids_ = 16;
+
+    void SetUp() override { generateTestData(3000, num_query_, 128, num_centroids_); }
+
+    std::string tempFile(const char *name) { return testing::TempDir() + "ut_vector_stream_" + name; }
+
+    // `mat` as elements of type T, with a dimension before each row (.vecs) or a header (.bin)
+    template <typename T>
+    void writeFile(const std::string &path, const FloatRowMat &mat, bool vecs) {
+        std::ofstream os(path, std::ios::binary);
+        const uint32_t rows = mat.rows(), cols = mat.cols();
+        if (!vecs) {
+            os.write(reinterpret_cast<const char *>(&rows), sizeof(rows));
+            os.write(reinterpret_cast<const char *>(&cols), sizeof(cols));
+        }
+        for (uint32_t i = 0; i < rows; ++i) {
+            if (vecs) {
+                os.write(reinterpret_cast<const char *>(&cols), sizeof(cols));
+            }
+            for (uint32_t j = 0; j < cols; ++j) {
+                const T v = static_cast<T>(mat(i, j));
+                os.write(reinterpret_cast<const char *>(&v), sizeof(T));
+            }
+        }
+    }
+
+    std::vector<std::vector<PID>> searchAll(IVF &ivf) {
+        SearcherConfig searcher_cfg;
+        searcher_cfg.searcher_vars_bound_m = 4.0;
+        searcher_cfg.dist_type = DistType::L2Sqr;
+        std::vector<std::vector<PID>> results(num_query_, std::vector<PID>(kTopk));
+        for (size_t i = 0; i < num_query_; ++i) {
+            ivf.search<DistType::L2Sqr>(query_.row(i), kTopk, 8, searcher_cfg, results[i].data());
+        }
+        return results;
+    }
+};
+
+TEST_F(VectorStreamTest, ReadsAllFormats) {
+    // small non-negative integers, exact in both uint8 and float
+    FloatRowMat mat(257, 20);
+    for (Eigen::Index i = 0; i < mat.rows(); ++i) {
+        for (Eigen::Index j = 0; j < mat.cols(); ++j) {
+            mat(i, j) = (i * 31 + j * 7) % 256;
+        }
+    }
+    const std::vector<std::string> paths = {tempFile("a.fvecs"), tempFile("a.fbin"), tempFile("a.bvecs"),
+                                            tempFile("a.u8bin")};
+    writeFile<float>(paths[0], mat, true);
+    writeFile<float>(paths[1], mat, false);
+    writeFile<uint8_t>(paths[2], mat, true);
+    writeFile<uint8_t>(paths[3], mat, false);
+
+    for (const auto &path : paths) {
+        for (size_t padded_cols : {size_t(0), size_t(32)}) {
+            utils::VectorStream stream(path.c_str(), 64, padded_cols);
+            ASSERT_EQ(stream.rows(), 257u) << path;
+            ASSERT_EQ(stream.cols(), 20u) << path;
+            for (int pass = 0; pass < 2; ++pass) {
+                stream.reset();
+                size_t rows = 0, first = 0;
+                while (auto *chunk = stream.next(&first)) {
+                    EXPECT_EQ(first, rows) << path;
+                    ASSERT_EQ(size_t(chunk->cols()), padded_cols ? padded_cols : 20u);
+                    EXPECT_EQ(chunk->leftCols(20), mat.middleRows(first, chunk->rows())) << path;
+                    EXPECT_TRUE((chunk->rightCols(chunk->cols() - 20).array() == 0).all()) << path;
+                    rows += chunk->rows();
+                }
+                EXPECT_EQ(rows, 257u) << path << ", pass " << pass;
+            }
+        }
+        std::remove(path.c_str());
+    }
+}
+
+TEST_F(VectorStreamTest, StreamConstructMatchesInMemory) {
+    QuantizeConfig config;
+    config.avg_bits = 4.0f;
+    SaqDataMaker maker(config, data_.cols());
+    maker.compute_variance(data_);
+    std::shared_ptr<SaqData> saq_data = maker.return_data();
+
+    IVF expected_ivf(data_.rows(), data_.cols(), num_centroids_, config);
+    expected_ivf.set_saq_data(saq_data);
+    expected_ivf.construct(data_, centroids_, cids_.data());
+    const auto expected = searchAll(expected_ivf);
+
+    const std::string path = tempFile("base.fvecs");
+    utils::save_vecs<float, FloatRowMat>(path.c_str(), data_);
+    // chunks not aligned to blocks, and one chunk for everything
+    for (size_t chunk_rows : {size_t(333), size_t(1000), size_t(4096)}) {
+        utils::VectorStream stream(path.c_str(), chunk_rows);
+        IVF ivf(data_.rows(), data_.cols(), num_centroids_, config);
+        ivf.set_saq_data(saq_data);
+        ivf.construct(stream, centroids_, cids_.data());
+        EXPECT_EQ(searchAll(ivf), expected) << "chunk rows " << chunk_rows;
+    }
+
+    // the variance pass of the stream
+    utils::VectorStream stream(path.c_str(), 500);
+    IVF ivf(data_.rows(), data_.cols(), num_centroids_, config);
+    ivf.construct(stream, centroids_, cids_.data());
+    const FloatVec &vars = ivf.get_saq_data()->data_variance;
+    ASSERT_EQ(vars.cols(), saq_data->data_variance.cols());
+    for (Eigen::Index j = 0; j < vars.cols(); ++j) {
+        EXPECT_NEAR(vars[j], saq_data->data_variance[j], 1e-3 * (1 + saq_data->data_variance[j]));
+    }
+    std::remove(path.c_str());
+}